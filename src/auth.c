@@ -3,44 +3,168 @@
 #include "membuf.h"
 #include "datachunk.h"
 #include "md5calc.h"
+#include "sha256calc.h"
 #include "fmconfig.h"
 #include "fmlog.h"
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
 #include <time.h>
 #include <stdio.h>
+#include <sys/random.h>
 
 
 const char FM_REALM[] = "File Manager";
 
 
-char *auth_getAuthResponseHeader(void)
+/* Nonces given to clients are not stored. The nonce consists of the serial
+ * number (16 hex digits), the issue time (monotonic clock, in seconds;
+ * 8 hex digits) and the first NONCE_MAC_LEN bytes of HMAC-SHA256 of the two
+ * (hex-encoded). The request counts used with a nonce are recorded in the
+ * table when the nonce is used for the first time, i.e. by authorized
+ * request. The entry at index serial % NONCE_TABLE_SIZE belongs to the
+ * nonce with the highest serial used so far; nonces with lower serial are
+ * rejected as stale.
+ */
+enum {
+    NONCE_TABLE_SIZE = 1024,
+    NONCE_MAC_LEN = 8,
+    NONCE_LEN = 16 + 8 + 2 * NONCE_MAC_LEN,
+    NC_WINDOW = 64              /* number of bits in ncSeen */
+};
+
+typedef struct {
+    unsigned long long serial;  /* 0 when unused */
+    unsigned long maxNc;        /* the highest request count used */
+    uint64_t ncSeen;            /* bit i set: maxNc - i was used */
+} NonceEnt;
+
+static NonceEnt gNonces[NONCE_TABLE_SIZE];
+static unsigned long long gLastNonceSerial;
+static Sha256HmacKey gNonceKey;
+static bool gIsNonceKeySet;
+
+
+static time_t getTimeSecs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/* Stores in mac the hex-encoded mac of serial and issue time, i.e.
+ * 2 * NONCE_MAC_LEN digits and terminating '\0'.
+ */
+static void getNonceMac(char *mac, const char *serialAndTime)
+{
+    unsigned char key[32], digest[SHA256_DIGEST_LEN];
+    unsigned i;
+
+    if( ! gIsNonceKeySet ) {
+        if( getrandom(key, sizeof(key), 0) != sizeof(key) )
+            log_fatal("auth: unable to generate nonce key");
+        sha256_hmacInitKey(&gNonceKey, key, sizeof(key));
+        memset(key, 0, sizeof(key));
+        gIsNonceKeySet = true;
+    }
+    sha256_hmacWithKey(digest, &gNonceKey, serialAndTime, 16 + 8);
+    for(i = 0; i < NONCE_MAC_LEN; ++i)
+        sprintf(mac + 2 * i, "%02x", digest[i]);
+}
+
+/* Parses hex number of len digits.
+ */
+static bool parseHex(const char *s, unsigned len, unsigned long long *res)
+{
+    unsigned i;
+
+    *res = 0;
+    for(i = 0; i < len; ++i) {
+        if( ! isxdigit((unsigned char)s[i]) )
+            return false;
+        *res = *res << 4 | (isdigit((unsigned char)s[i]) ? s[i] - '0' :
+                (tolower((unsigned char)s[i]) - 'a' + 10));
+    }
+    return len > 0;
+}
+
+/* Checks whether the nonce was given by the server, has not expired
+ * and the nonce count was not used yet. When so, marks the nonce count
+ * as used.
+ */
+static bool useNonce(const DataChunk *dchNonce, const DataChunk *dchNc)
+{
+    unsigned long long serial, issueTime, nc;
+    unsigned lifetime = config_getNonceLifetime();
+    unsigned i, diff = 0;
+    char mac[2 * NONCE_MAC_LEN + 1];
+    NonceEnt *ne;
+
+    if( dchNonce->len != NONCE_LEN ||
+            ! parseHex(dchNonce->data, 16, &serial) ||
+            ! parseHex(dchNonce->data + 16, 8, &issueTime) ||
+            dchNc->len > 8 || ! parseHex(dchNc->data, dchNc->len, &nc) ||
+            nc == 0 )
+        return false;
+    getNonceMac(mac, dchNonce->data);
+    /* constant-time comparison */
+    for(i = 0; i < 2 * NONCE_MAC_LEN; ++i)
+        diff |= mac[i] ^ dchNonce->data[16 + 8 + i];
+    if( diff != 0 || serial == 0 || serial > gLastNonceSerial )
+        return false;
+    if( lifetime != 0 && getTimeSecs() - issueTime >= lifetime )
+        return false;
+    ne = gNonces + serial % NONCE_TABLE_SIZE;
+    if( ne->serial > serial )
+        return false;   /* replaced by newer one */
+    if( ne->serial < serial ) {
+        /* first use */
+        ne->serial = serial;
+        ne->maxNc = 0;
+        ne->ncSeen = 0;
+    }
+    if( nc > ne->maxNc ) {
+        ne->ncSeen = nc - ne->maxNc >= NC_WINDOW ? 0 :
+            ne->ncSeen << (nc - ne->maxNc);
+        ne->ncSeen |= 1;
+        ne->maxNc = nc;
+    }else{
+        /* requests sent at once may arrive in different order */
+        if( ne->maxNc - nc >= NC_WINDOW ||
+                ne->ncSeen & (uint64_t)1 << (ne->maxNc - nc) )
+            return false;
+        ne->ncSeen |= (uint64_t)1 << (ne->maxNc - nc);
+    }
+    return true;
+}
+
+char *auth_getAuthResponseHeader(bool isStale)
 {
-    static unsigned long long nextNonce;
     MemBuf *authHeader = mb_new();
-    char nonce[40];
+    char nonce[NONCE_LEN + 1];
 
     /* According to RFC2617, the nonce value is "uniquely generated
      * each time a 401 response is made". */
-    if( nextNonce == 0 ) {
-        nextNonce = time(NULL) * 1000ULL;
-    }else{
-        ++nextNonce;
-    }
-    sprintf(nonce, "%llx", nextNonce);
+    sprintf(nonce, "%016llx%08llx", ++gLastNonceSerial,
+            (unsigned long long)getTimeSecs() & 0xffffffff);
+    getNonceMac(nonce + 16 + 8, nonce);
     mb_appendStrL(authHeader, "Digest realm=\"", FM_REALM, "\", "
-            "nonce=\"", nonce, "\", " "qop=\"auth\"", NULL);
+            "nonce=\"", nonce, "\", " "qop=\"auth\"",
+            isStale ? ", stale=true" : "", NULL);
     log_debug("auth: resp nonce=%s", nonce);
     return mb_unbox_free(authHeader);
 }
 
 bool auth_isClientAuthorized(const char *authorization,
-        const char *requestMethod)
+        const char *requestMethod, bool *isStale, char **userNameBuf)
 {
     bool res = false;
     DataChunk dchLine, dchName, dchValue;
     DataChunk dchUsername, dchNonce, dchUri;
     DataChunk dchResponse, dchNc, dchCNonce;
-    MemBuf *response, *a;
+    MemBuf *response;
+    unsigned a2Offset;
     char md5sum[40];
 
     /* Authorization header example:
@@ -48,6 +172,7 @@ bool auth_isClientAuthorized(const char *authorization,
      *   response="72dd44377dacd9ce557e0048b5ad5335", qop=auth, nc=00000001,
      *   cnonce="53a7a7e25e8587ea"
      */
+    *isStale = false;
     dch_initWithStr(&dchLine, authorization);
     if( ! dch_extractTillWS(&dchLine, &dchName) ||
             !dch_equalsStrIgnoreCase(&dchName, "Digest") )
@@ -83,8 +208,11 @@ bool auth_isClientAuthorized(const char *authorization,
      * response-qop is "qop" value from "WWW-Authenticate" response header
      * (here: "auth")
      */
+    if( ! config_getDigestAuthCredential(dchUsername.data, dchUsername.len,
+                md5sum) )
+        return false;
     response = mb_new();
-    mb_resize(response, 32);    /* a place for MD5 of A1 */
+    mb_appendData(response, md5sum, 32);
     mb_appendStr(response, ":");
     mb_appendChunk(response, &dchNonce);
     mb_appendStr(response, ":");
@@ -92,18 +220,19 @@ bool auth_isClientAuthorized(const char *authorization,
     mb_appendStr(response, ":");
     mb_appendChunk(response, &dchCNonce);
     mb_appendStr(response, ":auth:");
-    a = mb_new();
-    mb_appendStrL(a, requestMethod, ":", NULL);
-    mb_appendChunk(a, &dchUri);
-    md5_calculate(md5sum, mb_data(a), mb_dataLen(a));
-    mb_free(a);
-    mb_appendStr(response, md5sum);
-    if( config_getDigestAuthCredential(dchUsername.data, dchUsername.len,
-                md5sum) )
-    {
-        mb_setData(response, 0, md5sum, 32);
-        md5_calculate(md5sum, mb_data(response), mb_dataLen(response));
-        res = dch_equalsStr(&dchResponse, md5sum);
+    a2Offset = mb_dataLen(response);
+    mb_appendStrL(response, requestMethod, ":", NULL);
+    mb_appendChunk(response, &dchUri);
+    md5_calculate(md5sum, mb_data(response) + a2Offset,
+            mb_dataLen(response) - a2Offset);
+    mb_setStrEnd(response, a2Offset, md5sum);
+    md5_calculate(md5sum, mb_data(response), mb_dataLen(response));
+    if( dch_equalsStr(&dchResponse, md5sum) ) {
+        /* the client knows password; check the nonce is still valid */
+        res = useNonce(&dchNonce, &dchNc);
+        *isStale = !res;
+        if( res )
+            *userNameBuf = dch_dupToStr(&dchUsername);
     }
     mb_free(response);
     return res;
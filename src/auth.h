@@ -8,18 +8,25 @@ extern const char FM_REALM[];
 
 
 /* Returns WWW-Authenticate header value to add to "401 Unauthorized"
- * response message
+ * response message. A new nonce is issued; the server keeps track of the
+ * nonces it gave. When isStale is true, the header tells the client that
+ * its credentials were correct but the nonce has expired, so the client
+ * may repeat the request with the new nonce without asking user.
  */
-char *auth_getAuthResponseHeader(void);
+char *auth_getAuthResponseHeader(bool isStale);
 
 
 /* Parameters:
  *      authorization   - "Authorization" header field value.
  *      requestMethod   - request method, i.e. "GET", "POST", etc.
+ *      isStale         - set to true when the credentials are correct, but
+ *                        the nonce is unknown, has expired or the nonce
+ *                        count ("nc") was already used
+ *      userNameBuf     - set to the user name (malloc'ed) when authorized
  * Returns true when the client authorization has passed, false otherwise.
  */
 bool auth_isClientAuthorized(const char *authorization,
-        const char *requestMethod);
+        const char *requestMethod, bool *isStale, char **userNameBuf);
 
 
 #endif /* AUTH_H */
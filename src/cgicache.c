@@ -0,0 +1,409 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdbool.h>
+#include "cgicache.h"
+#include "cgicommon.h"
+#include "membuf.h"
+#include "fmconfig.h"
+#include "fmlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+
+/* Number of hash table buckets; must be a power of two.
+ */
+enum { CGI_CACHE_BUCKETS = 256 };
+
+/* Bodies larger than this are stored in temporary files.
+ */
+enum { CGI_CACHE_MEM_BODY_MAX = 65536 };
+
+typedef struct CacheEntry {
+    char *key;                  /* request path, '\0', query */
+    unsigned keyLen;
+    DataHeader *cgiHeader;
+    MemBuf *body;               /* NULL when body is in file */
+    int bodyFd;                 /* -1 when body is in memory */
+    unsigned long long bodyLen;
+    unsigned long long size;    /* counted against the cache size limit */
+    time_t storeTime;           /* the times are of monotonic clock */
+    time_t freshUntil;
+    time_t staleUntil;          /* end of stale-while-revalidate period */
+    bool isRefreshing;          /* some request is running the script */
+    struct CacheEntry *bucketNext;
+    struct CacheEntry *lruPrev, *lruNext;
+} CacheEntry;
+
+struct CgiCacheFill {
+    char *key;
+    unsigned keyLen;
+    DataHeader *cgiHeader;      /* NULL until started */
+    MemBuf *body;
+    int bodyFd;
+    unsigned long long bodyLen;
+    unsigned maxAge;
+    unsigned staleAge;
+    bool isAbandoned;
+    bool isCommitted;
+};
+
+static CacheEntry *gBuckets[CGI_CACHE_BUCKETS];
+
+/* The most and the least recently used entry.
+ */
+static CacheEntry *gLruHead, *gLruTail;
+static unsigned long long gTotalSize;
+
+
+static time_t getTimeSecs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static unsigned getHash(const char *key, unsigned keyLen)
+{
+    unsigned hash = 2166136261u;
+
+    while( keyLen-- > 0 )
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    return hash & (CGI_CACHE_BUCKETS - 1);
+}
+
+static CacheEntry *findEntry(const char *key, unsigned keyLen)
+{
+    CacheEntry *ent;
+
+    for(ent = gBuckets[getHash(key, keyLen)]; ent != NULL;
+            ent = ent->bucketNext)
+    {
+        if( ent->keyLen == keyLen && ! memcmp(ent->key, key, keyLen) )
+            return ent;
+    }
+    return NULL;
+}
+
+static void lruUnlink(CacheEntry *ent)
+{
+    if( ent->lruPrev != NULL )
+        ent->lruPrev->lruNext = ent->lruNext;
+    else
+        gLruHead = ent->lruNext;
+    if( ent->lruNext != NULL )
+        ent->lruNext->lruPrev = ent->lruPrev;
+    else
+        gLruTail = ent->lruPrev;
+}
+
+static void lruPushFront(CacheEntry *ent)
+{
+    ent->lruPrev = NULL;
+    ent->lruNext = gLruHead;
+    if( gLruHead != NULL )
+        gLruHead->lruPrev = ent;
+    else
+        gLruTail = ent;
+    gLruHead = ent;
+}
+
+static void dropEntry(CacheEntry *ent)
+{
+    CacheEntry **entLoc = gBuckets + getHash(ent->key, ent->keyLen);
+
+    while( *entLoc != ent )
+        entLoc = &(*entLoc)->bucketNext;
+    *entLoc = ent->bucketNext;
+    lruUnlink(ent);
+    gTotalSize -= ent->size;
+    free(ent->key);
+    datahdr_free(ent->cgiHeader);
+    mb_free(ent->body);
+    if( ent->bodyFd >= 0 )
+        close(ent->bodyFd);
+    free(ent);
+}
+
+/* Returns true when the request has a body.
+ */
+static bool hasRequestBody(const RequestHeader *rhdr)
+{
+    const char *contentLength = reqhdr_getHeaderVal(rhdr, "Content-Length");
+
+    return (contentLength != NULL && strcmp(contentLength, "0")) ||
+        reqhdr_isChunkedTransferEncoding(rhdr);
+}
+
+static RespBuf *newResponse(const CacheEntry *ent, bool onlyHead, time_t now)
+{
+    RespBuf *resp;
+    char buf[40];
+    int fd = -1;
+
+    if( ent->bodyFd >= 0 && ! onlyHead ) {
+        /* open separately, so the file offset is not shared */
+        sprintf(buf, "/proc/self/fd/%d", ent->bodyFd);
+        if( (fd = open(buf, O_RDONLY | O_CLOEXEC)) < 0 ) {
+            log_error("CGI cache: open %s", buf);
+            return NULL;
+        }
+    }
+    resp = cgicmn_newResponse(ent->cgiHeader, onlyHead);
+    sprintf(buf, "%lld", (long long)(now - ent->storeTime));
+    resp_appendHeader(resp, "Age", buf);
+    if( fd >= 0 )
+        resp_enqFileOfSize(resp, fd, ent->bodyLen);
+    else if( ent->body != NULL )
+        resp_appendData(resp, mb_data(ent->body), ent->bodyLen);
+    return resp;
+}
+
+RespBuf *cgicache_getResponse(const RequestHeader *rhdr,
+        const char *scriptName, CgiCacheFill **fill)
+{
+    const char *method = reqhdr_getMethod(rhdr);
+    const char *query = reqhdr_getQuery(rhdr);
+    bool onlyHead = ! strcmp(method, "HEAD");
+    MemBuf *key;
+    CacheEntry *ent;
+    RespBuf *resp = NULL;
+    time_t now;
+
+    *fill = NULL;
+    if( (! onlyHead && strcmp(method, "GET")) ||
+            ! config_isCGICached(scriptName) || hasRequestBody(rhdr) )
+        return NULL;
+    key = mb_newWithStr(reqhdr_getPath(rhdr));
+    mb_appendData(key, "", 1);
+    if( query != NULL )
+        mb_appendStr(key, query);
+    if( (ent = findEntry(mb_data(key), mb_dataLen(key))) != NULL ) {
+        now = getTimeSecs();
+        if( now < ent->freshUntil || (now < ent->staleUntil &&
+                    (ent->isRefreshing || onlyHead)) )
+        {
+            if( (resp = newResponse(ent, onlyHead, now)) != NULL ) {
+                lruUnlink(ent);
+                lruPushFront(ent);
+            }else
+                dropEntry(ent);
+        }else if( now < ent->staleUntil ) {
+            /* this request refreshes the entry; meanwhile the others
+             * receive the stale one */
+            ent->isRefreshing = true;
+        }else
+            dropEntry(ent);
+    }
+    if( resp == NULL && ! onlyHead ) {
+        *fill = calloc(1, sizeof(CgiCacheFill));
+        (*fill)->keyLen = mb_dataLen(key);
+        (*fill)->key = mb_unbox_free(key);
+        (*fill)->bodyFd = -1;
+    }else
+        mb_free(key);
+    return resp;
+}
+
+/* Parses unsigned number at str. Returns 0 when not a number.
+ */
+static unsigned parseSeconds(const char *str)
+{
+    unsigned long val = strtoul(str, NULL, 10);
+
+    return val > 0x7fffffff ? 0x7fffffff : val;
+}
+
+/* Retrieves the fresh period and stale-while-revalidate period of the
+ * response. Returns false when the response shall not be stored.
+ */
+static bool getFreshness(const DataHeader *cgiHeader, unsigned *maxAge,
+        unsigned *staleAge)
+{
+    const char *cacheControl, *expires, *tok;
+    unsigned tokLen;
+    bool hasMaxAge = false, isSharedMaxAge = false;
+    struct tm tm;
+    time_t expTime, now;
+
+    *maxAge = *staleAge = 0;
+    cacheControl = datahdr_getHeaderVal(cgiHeader, "Cache-Control");
+    for(tok = cacheControl; tok != NULL && *tok; tok += tokLen) {
+        tok += strspn(tok, " \t,");
+        tokLen = strcspn(tok, ",");
+        if( ! strncasecmp(tok, "no-store", 8) ||
+                ! strncasecmp(tok, "no-cache", 8) ||
+                ! strncasecmp(tok, "private", 7) )
+            return false;
+        if( ! strncasecmp(tok, "s-maxage=", 9) ) {
+            *maxAge = parseSeconds(tok + 9);
+            hasMaxAge = isSharedMaxAge = true;
+        }else if( ! strncasecmp(tok, "max-age=", 8) ) {
+            if( ! isSharedMaxAge )
+                *maxAge = parseSeconds(tok + 8);
+            hasMaxAge = true;
+        }else if( ! strncasecmp(tok, "stale-while-revalidate=", 23) )
+            *staleAge = parseSeconds(tok + 23);
+    }
+    /* max-age takes precedence over Expires */
+    if( ! hasMaxAge && (expires = datahdr_getHeaderVal(cgiHeader, "Expires")) != NULL )
+    {
+        memset(&tm, 0, sizeof(tm));
+        if( strptime(expires, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL &&
+                (expTime = timegm(&tm)) > (now = time(NULL)) )
+            *maxAge = expTime - now;
+    }
+    return *maxAge > 0;
+}
+
+bool cgicache_fillStart(CgiCacheFill *fill, const DataHeader *cgiHeader)
+{
+    const char *status = datahdr_getHeaderVal(cgiHeader, "Status");
+
+    if( (status != NULL && strncmp(status, "200", 3)) ||
+            datahdr_getHeaderVal(cgiHeader, "Set-Cookie") != NULL ||
+            datahdr_getHeaderVal(cgiHeader, "Vary") != NULL ||
+            ! getFreshness(cgiHeader, &fill->maxAge, &fill->staleAge) )
+        return false;
+    fill->cgiHeader = datahdr_dup(cgiHeader);
+    fill->body = mb_new();
+    return true;
+}
+
+static void abandonFill(CgiCacheFill *fill)
+{
+    fill->isAbandoned = true;
+    mb_free(fill->body);
+    fill->body = NULL;
+    if( fill->bodyFd >= 0 ) {
+        close(fill->bodyFd);
+        fill->bodyFd = -1;
+    }
+}
+
+/* Writes data to the body file. Returns false on error.
+ */
+static bool writeBodyFile(int fd, const char *data, unsigned len)
+{
+    int wr;
+
+    while( len > 0 ) {
+        if( (wr = write(fd, data, len)) < 0 ) {
+            log_error("CGI cache: write");
+            return false;
+        }
+        data += wr;
+        len -= wr;
+    }
+    return true;
+}
+
+void cgicache_fillAppend(CgiCacheFill *fill, const char *data, unsigned len)
+{
+    if( fill->isAbandoned )
+        return;
+    if( fill->bodyLen + len > config_getCGICacheSize() / 4 ) {
+        log_debug("CGI cache: response too large to store");
+        abandonFill(fill);
+        return;
+    }
+    if( fill->body != NULL && fill->bodyLen + len > CGI_CACHE_MEM_BODY_MAX ) {
+        if( (fill->bodyFd = cgicmn_openTempFile()) < 0 ||
+                ! writeBodyFile(fill->bodyFd, mb_data(fill->body),
+                    fill->bodyLen) )
+        {
+            abandonFill(fill);
+            return;
+        }
+        mb_free(fill->body);
+        fill->body = NULL;
+    }
+    if( fill->body != NULL )
+        mb_appendData(fill->body, data, len);
+    else if( ! writeBodyFile(fill->bodyFd, data, len) ) {
+        abandonFill(fill);
+        return;
+    }
+    fill->bodyLen += len;
+}
+
+/* Returns approximate size of memory taken by the header.
+ */
+static unsigned getHeaderSize(const DataHeader *cgiHeader)
+{
+    const char *name, *value;
+    unsigned i, size = 0;
+
+    for(i = 0; datahdr_getHeaderLineAt(cgiHeader, i, &name, &value); ++i)
+        size += strlen(name) + strlen(value) + 2 + sizeof(char*);
+    return size;
+}
+
+void cgicache_fillCommit(CgiCacheFill *fill)
+{
+    unsigned long long maxSize = config_getCGICacheSize();
+    CacheEntry *ent, **bucket;
+
+    if( fill->isAbandoned || fill->cgiHeader == NULL )
+        return;
+    if( (ent = findEntry(fill->key, fill->keyLen)) != NULL )
+        dropEntry(ent);
+    ent = malloc(sizeof(CacheEntry));
+    ent->key = fill->key;
+    ent->keyLen = fill->keyLen;
+    ent->cgiHeader = fill->cgiHeader;
+    ent->body = fill->body;
+    ent->bodyFd = fill->bodyFd;
+    ent->bodyLen = fill->bodyLen;
+    ent->size = sizeof(CacheEntry) + ent->keyLen +
+        getHeaderSize(ent->cgiHeader) + ent->bodyLen;
+    ent->storeTime = getTimeSecs();
+    ent->freshUntil = ent->storeTime + fill->maxAge;
+    ent->staleUntil = ent->freshUntil + fill->staleAge;
+    ent->isRefreshing = false;
+    fill->key = NULL;
+    fill->cgiHeader = NULL;
+    fill->body = NULL;
+    fill->bodyFd = -1;
+    fill->isCommitted = true;
+    while( gLruTail != NULL && gTotalSize + ent->size > maxSize )
+        dropEntry(gLruTail);
+    bucket = gBuckets + getHash(ent->key, ent->keyLen);
+    ent->bucketNext = *bucket;
+    *bucket = ent;
+    lruPushFront(ent);
+    gTotalSize += ent->size;
+    log_debug("CGI cache: stored %llu bytes for %u s, total %llu",
+            ent->bodyLen, fill->maxAge, gTotalSize);
+}
+
+void cgicache_fillFree(CgiCacheFill *fill)
+{
+    CacheEntry *ent;
+
+    if( fill == NULL )
+        return;
+    if( ! fill->isCommitted &&
+            (ent = findEntry(fill->key, fill->keyLen)) != NULL )
+        ent->isRefreshing = false;  /* let another request refresh */
+    free(fill->key);
+    if( fill->cgiHeader != NULL )
+        datahdr_free(fill->cgiHeader);
+    mb_free(fill->body);
+    if( fill->bodyFd >= 0 )
+        close(fill->bodyFd);
+    free(fill);
+}
+
+void cgicache_clear(void)
+{
+    while( gLruHead != NULL )
+        dropEntry(gLruHead);
+}
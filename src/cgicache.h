@@ -0,0 +1,64 @@
+#ifndef CGICACHE_H
+#define CGICACHE_H
+
+#include "requestheader.h"
+#include "dataheader.h"
+#include "respbuf.h"
+
+
+/* Cache of CGI responses, for the scripts matching "cgicache" option.
+ * Responses to GET requests are stored when the script allows it by
+ * Cache-Control or Expires header field. Entries are looked up by the
+ * request path and query; HEAD requests are served from the GET entries.
+ * Small bodies are kept in memory, larger ones in temporary files.
+ * The total size is limited by "cgicachesize" option; the least recently
+ * used entries are dropped when the limit is reached.
+ *
+ * An expired entry may be still served for the stale-while-revalidate
+ * period given by the script, while one of the requests runs the script
+ * to refresh the entry.
+ */
+
+
+/* A CGI response being stored in the cache.
+ */
+typedef struct CgiCacheFill CgiCacheFill;
+
+
+/* Returns cached response to the request for CGI script at scriptName URL
+ * path. When the response is not cached, returns NULL and, if the response
+ * may be stored, sets fill to a new CgiCacheFill; otherwise fill is set
+ * to NULL.
+ */
+RespBuf *cgicache_getResponse(const RequestHeader*, const char *scriptName,
+        CgiCacheFill **fill);
+
+
+/* Starts storing the response with the CGI response header. Returns false
+ * when the response cannot be stored; the fill should be freed then.
+ */
+bool cgicache_fillStart(CgiCacheFill*, const DataHeader *cgiHeader);
+
+
+/* Appends piece of the response body. The fill is abandoned (the function
+ * becomes no-op) when the body size exceeds the entry size limit.
+ */
+void cgicache_fillAppend(CgiCacheFill*, const char *data, unsigned len);
+
+
+/* Stores the response, complete now, in the cache.
+ */
+void cgicache_fillCommit(CgiCacheFill*);
+
+
+/* Ends use of the fill. When not committed, the response is not stored.
+ */
+void cgicache_fillFree(CgiCacheFill*);
+
+
+/* Drops all entries.
+ */
+void cgicache_clear(void);
+
+
+#endif /* CGICACHE_H */
@@ -0,0 +1,157 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdbool.h>
+#include "cgicommon.h"
+#include "fmconfig.h"
+#include "session.h"
+#include "membuf.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+
+
+static void putHeader(const char *headerName, const char *headerValue,
+        CgiParamConsumer consumer, void *consumerData)
+{
+    static const char *omitHeaders[] = {
+        "Content-Length", "Content-Type", "Authorization", "Connection",
+        "Transfer-Encoding", NULL
+    };
+    int i, len;
+    char *nameBuf;
+
+    for(i = 0; omitHeaders[i]; ++i) {
+        if( !strcasecmp(headerName, omitHeaders[i]) )
+            return;
+    }
+    len = strlen(headerName);
+    nameBuf = malloc(len + 6);
+    strcpy(nameBuf, "HTTP_");
+    for(i = 0; headerName[i]; ++i) {
+        if( headerName[i] == '-' )
+            nameBuf[i+5] = '_';
+        else
+            nameBuf[i+5] = toupper(headerName[i]);
+    }
+    nameBuf[i+5] = '\0';
+    consumer(consumerData, nameBuf, headerValue);
+    free(nameBuf);
+}
+
+void cgicmn_collectParams(const RequestHeader *hdr, const char *peerAddr,
+        const char *scriptName, const char *pathInfo,
+        const char *scriptFileName, CgiParamConsumer consumer,
+        void *consumerData)
+{
+    const char *headerName, *headerVal;
+    char *pathTranslated, *cookie;
+    unsigned i;
+
+    if( pathInfo != NULL ) {
+        consumer(consumerData, "PATH_INFO", pathInfo);
+        if( (pathTranslated = config_getSysPathForUrlPath(pathInfo)) != NULL )
+        {
+            consumer(consumerData, "PATH_TRANSLATED", pathTranslated);
+            free(pathTranslated);
+        }
+    }
+    if( (headerVal = reqhdr_getQuery(hdr)) != NULL )
+        consumer(consumerData, "QUERY_STRING", headerVal);
+    if( peerAddr != NULL ) {
+        consumer(consumerData, "REMOTE_ADDR", peerAddr);
+        consumer(consumerData, "REMOTE_HOST", peerAddr);
+    }
+    consumer(consumerData, "REQUEST_METHOD", reqhdr_getMethod(hdr));
+    if( scriptName != NULL )
+        consumer(consumerData, "SCRIPT_NAME", scriptName);
+    if( scriptFileName != NULL )
+        consumer(consumerData, "SCRIPT_FILENAME", scriptFileName);
+    for(i = 0; reqhdr_getHeaderAt(hdr, i, &headerName, &headerVal); ++i) {
+        if( ! strcasecmp(headerName, "Content-Type") ) {
+            consumer(consumerData, "CONTENT_TYPE", headerVal);
+        }else if( ! strcasecmp(headerName, "Content-Length") ) {
+            consumer(consumerData, "CONTENT_LENGTH", headerVal);
+        }else if( ! strcasecmp(headerName, "Cookie") &&
+                config_getSessionLifetime() != 0 )
+        {
+            /* don't reveal the session token, like Authorization */
+            if( (cookie = session_stripCookie(headerVal)) != NULL ) {
+                putHeader(headerName, cookie, consumer, consumerData);
+                free(cookie);
+            }
+        }else
+            putHeader(headerName, headerVal, consumer, consumerData);
+    }
+}
+
+void cgicmn_collectServerParams(CgiParamConsumer consumer, void *consumerData)
+{
+    static char hostname[HOST_NAME_MAX+1], portnum[8];
+
+    if( portnum[0] == '\0' ) {
+        if( gethostname(hostname, sizeof(hostname)) != 0 )
+            hostname[0] = '\0';
+        sprintf(portnum, "%u", config_getListenPort());
+    }
+    consumer(consumerData, "GATEWAY_INTERFACE", "1.1");
+    if( hostname[0] )
+        consumer(consumerData, "SERVER_NAME", hostname);
+    consumer(consumerData, "SERVER_PORT", portnum);
+    consumer(consumerData, "SERVER_PROTOCOL", "HTTP/1.1");
+    consumer(consumerData, "SERVER_SOFTWARE", "filemanager-httpd");
+}
+
+RespBuf *cgicmn_newResponse(const DataHeader *cgiHeader, bool onlyHead)
+{
+    RespBuf *resp;
+    const char *headerName, *headerVal;
+    unsigned i;
+
+    headerVal = datahdr_getHeaderVal(cgiHeader, "Status");
+    if( headerVal == NULL )
+        headerVal = resp_cmnStatus(HTTP_200_OK);
+    resp = resp_new(headerVal, onlyHead);
+    headerVal = datahdr_getHeaderVal(cgiHeader, "Content-Type");
+    resp_appendHeader(resp, "Content-Type",
+            headerVal ? headerVal : "text/plain");
+    for(i = 0; datahdr_getHeaderLineAt(cgiHeader, i, &headerName,
+                &headerVal); ++i)
+    {
+        if( strcasecmp(headerName, "Status") &&
+                strcasecmp(headerName, "Content-Type") &&
+                strncasecmp(headerName, "X-CGI-", 6) )
+        {
+            resp_appendHeader(resp, headerName, headerVal);
+        }
+    }
+    return resp;
+}
+
+int cgicmn_openTempFile(void)
+{
+    const char *tmpDir = getenv("TMPDIR");
+    MemBuf *tmpName;
+    int fd;
+
+    if( tmpDir == NULL || tmpDir[0] == '\0' )
+        tmpDir = "/tmp";
+#ifdef O_TMPFILE
+    if( (fd = open(tmpDir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) >= 0 )
+        return fd;
+#endif
+    tmpName = mb_newWithStr(tmpDir);
+    mb_ensureEndsWithSlash(tmpName);
+    mb_appendStr(tmpName, "fmgrXXXXXX");
+    if( (fd = mb_mkstemp(tmpName)) >= 0 ) {
+        unlink(mb_data(tmpName));
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    mb_free(tmpName);
+    return fd;
+}
@@ -0,0 +1,50 @@
+#ifndef CGICOMMON_H
+#define CGICOMMON_H
+
+#include "requestheader.h"
+#include "dataheader.h"
+#include "respbuf.h"
+
+
+/* Helpers common for CGI and FastCGI.
+ */
+
+
+/* Receives CGI meta-variable name and value.
+ */
+typedef void (*CgiParamConsumer)(void *consumerData, const char *name,
+        const char *value);
+
+
+/* Passes to consumer the CGI meta-variables (RFC 3875) which are the same
+ * for all requests: GATEWAY_INTERFACE and SERVER_*.
+ */
+void cgicmn_collectServerParams(CgiParamConsumer, void *consumerData);
+
+
+/* Passes to consumer the request-specific CGI meta-variables.
+ * CONTENT_LENGTH is passed only when the request has Content-Length header.
+ * Parameters:
+ *      peerAddr        - $REMOTE_ADDR value; may be NULL
+ *      scriptName      - $SCRIPT_NAME value; may be NULL
+ *      pathInfo        - $PATH_INFO value; may be NULL
+ *      scriptFileName  - $SCRIPT_FILENAME value, i.e. the script path in
+ *                        file system; may be NULL
+ */
+void cgicmn_collectParams(const RequestHeader*, const char *peerAddr,
+        const char *scriptName, const char *pathInfo,
+        const char *scriptFileName, CgiParamConsumer, void *consumerData);
+
+
+/* Creates response with status and header fields taken from the CGI
+ * response header.
+ */
+RespBuf *cgicmn_newResponse(const DataHeader *cgiHeader, bool onlyHead);
+
+
+/* Creates an anonymous temporary file in $TMPDIR (/tmp by default).
+ * Returns the file descriptor, -1 on error.
+ */
+int cgicmn_openTempFile(void);
+
+#endif /* CGICOMMON_H */
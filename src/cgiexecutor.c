@@ -1,213 +1,383 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdbool.h>
 #include "cgiexecutor.h"
 #include "dataheader.h"
+#include "cgicommon.h"
+#include "cgiprocess.h"
+#include "membuf.h"
+#include "fmconfig.h"
 #include "fmlog.h"
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
-#include <limits.h>
 #include <libgen.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
 
 
+/* Size up to which request body of unknown length is spooled in memory.
+ * Larger body is moved to a temporary file.
+ */
+enum { SPOOL_MEM_MAX = 1 << 20 };
+
 struct CgiExecutor {
     bool onlyHead;
+    bool isSpooled;         /* request body is spooled */
+    bool isBodyComplete;
     int inFd, outFd;
+    CgiProcess *proc;       /* NULL when start failed */
+    char *exePath;          /* set until the CGI is started */
+    char **envp;
+    MemBuf *envStrings;
+    int spoolFd;            /* spooled request body; -1 when not spooling */
+    unsigned long long spoolLen;
+    bool isSpoolOnDisk;
+    const char *errMesg;    /* reason of CGI start failure */
+    CgiCacheFill *cacheFill;
     DataHeader *cgiHeader;  /* header of data received from CGI */
 };
 
-static void fatalErrorResp(const char *message, const char *status)
+/* Environment of CGI process being built: "name=value" strings, stored
+ * one after another in one buffer.
+ */
+typedef struct {
+    MemBuf *strings;
+    unsigned count;
+} CgiEnv;
+
+/* The variables which are the same for all requests.
+ */
+static char **gServerEnv;
+static unsigned gServerEnvCount;
+
+/* CGI parameter consumer: appends the parameter to environment.
+ */
+static void putParam(void *pvEnv, const char *name, const char *value)
 {
-    if( status == NULL )
-        status = "500 Internal Server Error";
-    printf("Content-Type: text/html\nStatus: %s\n\n"
-            "<!DOCTYPE html><html><head>\n<title>%s</title>\n</head>\n"
-            "<body><h3>%s</h3>\n%s\n</body></html>",
-            status, status, status, message);
-    exit(1);
+    CgiEnv *env = pvEnv;
+    unsigned nameLen = strlen(name), valueLen = strlen(value);
+    char *str = mb_appendSpace(env->strings, nameLen + valueLen + 2);
+
+    memcpy(str, name, nameLen);
+    str[nameLen] = '=';
+    memcpy(str + nameLen + 1, value, valueLen + 1);
+    ++env->count;
 }
 
-static char *handleNoContentLength(char *ctLenBuf)
+/* Fills envp with pointers to strings of env.
+ */
+static void setEnvPointers(char **envp, const CgiEnv *env)
 {
-    char tmpnamebuf[] = "/tmp/fmgrXXXXXX";
-    char buf[65535];
-    unsigned ctLen = 0;
-    int tmpFd, rd, wr, offs;
-
-    if( (tmpFd = mkstemp(tmpnamebuf)) == -1 )
-        fatalErrorResp("unable to create tempfile", NULL);
-    unlink(tmpnamebuf);
-    while(ctLen <= 1000000 && (rd = read(STDIN_FILENO, buf, sizeof(buf))) > 0)
-    {
-        offs = 0;
-        while( offs < rd ) {
-            if( (wr = write(tmpFd, buf + offs, rd - offs)) < 0 )
-                fatalErrorResp("tempfile write error", NULL);
-            offs += wr;
-        }
-        ctLen += rd;
+    const char *str = mb_data(env->strings);
+    unsigned i;
+
+    for(i = 0; i < env->count; ++i) {
+        envp[i] = (char*)str;
+        str += strlen(str) + 1;
     }
-    if( ctLen > 1000000 )
-        fatalErrorResp("Request body too long", "413 Payload Too Large");
-    if( rd < 0 )
-        fatalErrorResp("stdin read fail", NULL);
-    dup2(tmpFd, 0);
-    sprintf(ctLenBuf, "%u", ctLen);
-    return ctLenBuf;
 }
 
-static void appendEnv(char ***envpLoc, const char *name, const char *value)
+/* Returns environment for the CGI process. The variables are followed
+ * by extraCount NULL pointers. The strings are stored in envStrings.
+ */
+static char **buildEnv(const RequestHeader *hdr, const char *exePath,
+        const char *peerAddr, const char *scriptName, const char *pathInfo,
+        unsigned extraCount, MemBuf *envStrings)
 {
-    int envCount = 0, eqpos;
-    char **envp, *env;
+    CgiEnv env;
+    char **envp;
 
-    envp = *envpLoc;
-    if( envp != NULL ) {
-        while( envp[envCount] )
-            ++envCount;
+    if( gServerEnv == NULL ) {
+        env.strings = mb_new();
+        env.count = 0;
+        cgicmn_collectServerParams(putParam, &env);
+        gServerEnv = malloc(env.count * sizeof(char*));
+        gServerEnvCount = env.count;
+        /* strings are kept for the process lifetime */
+        setEnvPointers(gServerEnv, &env);
+        mb_unbox_free(env.strings);
     }
-    envp = realloc(envp, (envCount+2) * sizeof(char*));
-    eqpos = strlen(name);
-    env = malloc(eqpos + strlen(value) + 2);
-    strcpy(env, name);
-    env[eqpos] = '=';
-    strcpy(env+eqpos+1, value);
-    envp[envCount++] = env;
-    envp[envCount] = NULL;
-    *envpLoc = envp;
+    env.strings = envStrings;
+    env.count = 0;
+    cgicmn_collectParams(hdr, peerAddr, scriptName, pathInfo, exePath,
+            putParam, &env);
+    envp = malloc((gServerEnvCount + env.count + extraCount + 1) *
+            sizeof(char*));
+    memcpy(envp, gServerEnv, gServerEnvCount * sizeof(char*));
+    setEnvPointers(envp + gServerEnvCount, &env);
+    memset(envp + gServerEnvCount + env.count, 0,
+            (extraCount + 1) * sizeof(char*));
+    return envp;
 }
 
-static void putHeader(char ***envpLoc, const char *headerName,
-        const char *headerValue)
+/* Starts the CGI process in its own process group.
+ * Returns the process ID, -1 on failure.
+ */
+static pid_t spawnCgi(const char *exePath, char **envp, int stdinFd,
+        int stdoutFd)
 {
-    static const char *omitHeaders[] = {
-        "Content-Length", "Content-Type", "Authorization", "Connection",
-        "Transfer-Encoding", NULL
-    };
-    int i, len;
-    char *nameBuf;
-
-    for(i = 0; omitHeaders[i]; ++i) {
-        if( !strcasecmp(headerName, omitHeaders[i]) )
-            return;
+    char *argv[2], *dir;
+    sigset_t sigMask;
+    pid_t pid;
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+    posix_spawn_file_actions_t fileActions;
+    posix_spawnattr_t attr;
+    sigset_t sigDefault;
+    int res;
+#endif
+
+    if( (argv[0] = strrchr(exePath, '/')) == NULL )
+        argv[0] = (char*)exePath;
+    else
+        ++argv[0];
+    argv[1] = NULL;
+    dir = strdup(exePath);
+    /* the server blocks SIGCHLD */
+    sigemptyset(&sigMask);
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+    posix_spawn_file_actions_init(&fileActions);
+    posix_spawn_file_actions_adddup2(&fileActions, stdinFd, 0);
+    posix_spawn_file_actions_adddup2(&fileActions, stdoutFd, 1);
+    posix_spawn_file_actions_addchdir_np(&fileActions, dirname(dir));
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigDefault);
+    sigaddset(&sigDefault, SIGPIPE);
+    sigaddset(&sigDefault, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &sigDefault);
+    posix_spawnattr_setsigmask(&attr, &sigMask);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+            POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+    res = posix_spawn(&pid, exePath, &fileActions, &attr, argv, envp);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fileActions);
+    if( res != 0 ) {
+        errno = res;
+        log_error("unable to execute CGI %s", exePath);
+        pid = -1;
     }
-    len = strlen(headerName);
-    nameBuf = malloc(len + 6);
-    strcpy(nameBuf, "HTTP_");
-    for(i = 0; headerName[i]; ++i) {
-        if( headerName[i] == '-' )
-            nameBuf[i+5] = '_';
-        else
-            nameBuf[i+5] = toupper(headerName[i]);
+#else
+    switch( pid = fork() ) {
+    case -1:
+        log_error("fork");
+        break;
+    case 0:
+        dup2(stdinFd, 0);
+        dup2(stdoutFd, 1);
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &sigMask, NULL);
+        setpgid(0, 0);
+        if( chdir(dirname(dir)) == 0 )
+            execve(exePath, argv, envp);
+        _exit(127);
+    default:
+        break;
     }
-    nameBuf[i+5] = '\0';
-    appendEnv(envpLoc, nameBuf, headerValue);
-    free(nameBuf);
+#endif
+    free(dir);
+    return pid;
 }
 
-static void runCgi(const RequestHeader *hdr, const char *exePath,
-        const char *peerAddr, const char *scriptName, const char *pathInfo)
+/* Releases data needed to start the CGI.
+ */
+static void freeStartData(CgiExecutor *cgiexe)
 {
-    const char *arg0, *headerName, *headerVal, *contentLength = NULL;
-    char hostname[HOST_NAME_MAX], portnum[8];
-    char ctLenBuf[10];
-    char **argv, **envp = NULL;
-    unsigned i;
+    free(cgiexe->exePath);
+    cgiexe->exePath = NULL;
+    free(cgiexe->envp);
+    cgiexe->envp = NULL;
+    mb_free(cgiexe->envStrings);
+    cgiexe->envStrings = NULL;
+}
 
-    argv = malloc(2 * sizeof(char*));
-    if( (arg0 = strrchr(exePath, '/')) == NULL )
-        arg0 = exePath;
-    else
-        ++arg0;
-    argv[0] = strdup(arg0);
-    argv[1] = NULL;
-    appendEnv(&envp, "GATEWAY_INTERFACE", "1.1");
-    if( pathInfo != NULL ) {
-        appendEnv(&envp, "PATH_INFO", pathInfo);
-        if( (headerVal = config_getSysPathForUrlPath(pathInfo)) != NULL )
-            appendEnv(&envp, "PATH_TRANSLATED", headerVal);
+/* Starts the CGI process with the given standard input, using the
+ * acquired slot.
+ */
+static void startCgi(CgiExecutor *cgiexe, int stdinFd)
+{
+    int fdFromCgi[2];
+    pid_t pid;
+
+    if( pipe2(fdFromCgi, O_CLOEXEC) != 0 )
+        log_fatal("pipe");
+    pid = spawnCgi(cgiexe->exePath, cgiexe->envp, stdinFd, fdFromCgi[1]);
+    if( pid > 0 ) {
+        cgiproc_setStarted(cgiexe->proc, pid);
+        cgiexe->outFd = fdFromCgi[0];
+        drs_setNonBlockingCloExecFlags(cgiexe->outFd);
+    }else{
+        close(fdFromCgi[0]);
+        cgiproc_free(cgiexe->proc);
+        cgiexe->proc = NULL;
+        cgiexe->errMesg = "unable to execute CGI";
+    }
+    close(fdFromCgi[1]);
+    freeStartData(cgiexe);
+}
+
+/* Replaces the in-memory spool with a temporary file.
+ */
+static bool moveSpoolToDisk(CgiExecutor *cgiexe)
+{
+    off_t offset = 0;
+    int fd;
+
+    if( (fd = cgicmn_openTempFile()) < 0 )
+        return false;
+    while( offset < cgiexe->spoolLen ) {
+        if( sendfile(fd, cgiexe->spoolFd, &offset,
+                    cgiexe->spoolLen - offset) <= 0 )
+        {
+            close(fd);
+            return false;
+        }
     }
-    if( (headerVal = reqhdr_getQuery(hdr)) != NULL )
-        appendEnv(&envp, "QUERY_STRING", headerVal);
-    if( peerAddr != NULL ) {
-        appendEnv(&envp, "REMOTE_ADDR", peerAddr);
-        appendEnv(&envp, "REMOTE_HOST", peerAddr);
+    close(cgiexe->spoolFd);
+    cgiexe->spoolFd = fd;
+    cgiexe->isSpoolOnDisk = true;
+    return true;
+}
+
+static void spoolFailed(CgiExecutor *cgiexe)
+{
+    log_error("CGI request body spool");
+    if( cgiexe->spoolFd >= 0 ) {
+        close(cgiexe->spoolFd);
+        cgiexe->spoolFd = -1;
     }
-    appendEnv(&envp, "REQUEST_METHOD", reqhdr_getMethod(hdr));
-    if( scriptName != NULL )
-        appendEnv(&envp, "SCRIPT_NAME", scriptName);
-    for(i = 0; reqhdr_getHeaderAt(hdr, i, &headerName, &headerVal); ++i) {
-        if( ! strcasecmp(headerName, "Content-Type") ) {
-            appendEnv(&envp, "CONTENT_TYPE", headerVal);
-        }else if( ! strcasecmp(headerName, "Content-Length") ) {
-            contentLength = headerVal;
+    cgiexe->errMesg = "unable to store request body";
+}
+
+/* Starts the CGI process when a slot is available. The spooled body must
+ * be complete. Returns false when the request has to wait for a slot.
+ */
+static bool tryStart(CgiExecutor *cgiexe)
+{
+    char ctLenEnv[40], **envEnd;
+    int fdToCgi[2];
+
+    if( ! cgiproc_acquire(cgiexe->proc) )
+        return false;
+    if( cgiexe->isSpooled ) {
+        if( cgiexe->spoolFd >= 0 && lseek(cgiexe->spoolFd, 0, SEEK_SET) == 0 )
+        {
+            sprintf(ctLenEnv, "CONTENT_LENGTH=%llu", cgiexe->spoolLen);
+            for(envEnd = cgiexe->envp; *envEnd != NULL; ++envEnd)
+                ;
+            *envEnd = ctLenEnv;
+            startCgi(cgiexe, cgiexe->spoolFd);
+        }else{
+            if( cgiexe->spoolFd >= 0 )
+                spoolFailed(cgiexe);
+            cgiproc_free(cgiexe->proc);
+            cgiexe->proc = NULL;
+            freeStartData(cgiexe);
+        }
+        if( cgiexe->spoolFd >= 0 ) {
+            close(cgiexe->spoolFd);
+            cgiexe->spoolFd = -1;
+        }
+    }else{
+        if( pipe2(fdToCgi, O_CLOEXEC) != 0 )
+            log_fatal("pipe");
+        startCgi(cgiexe, fdToCgi[0]);
+        close(fdToCgi[0]);
+        if( cgiexe->outFd >= 0 && ! cgiexe->isBodyComplete ) {
+            cgiexe->inFd = fdToCgi[1];
+            drs_setNonBlockingCloExecFlags(cgiexe->inFd);
         }else
-            putHeader(&envp, headerName, headerVal);
+            close(fdToCgi[1]);
     }
-    if( gethostname(hostname, sizeof(hostname)) == 0 )
-        appendEnv(&envp, "SERVER_NAME", hostname);
-    sprintf(portnum, "%u", config_getListenPort());
-    appendEnv(&envp, "SERVER_PORT", portnum);
-    appendEnv(&envp, "SERVER_PROTOCOL", "HTTP/1.1");
-    appendEnv(&envp, "SERVER_SOFTWARE", "filemanager-httpd");
-    if( contentLength == NULL && reqhdr_isChunkedTransferEncoding(hdr) )
-        contentLength = handleNoContentLength(ctLenBuf);
-    if( contentLength != NULL )
-        appendEnv(&envp, "CONTENT_LENGTH", contentLength);
-    chdir( dirname( strdup(exePath)) );
-    execve(exePath, argv, envp);
-    fatalErrorResp("unable to execute CGI", NULL);
+    return true;
 }
 
 CgiExecutor *cgiexe_new(const RequestHeader *hdr, const char *exePath,
-        const char *peerAddr, const char *scriptName, const char *pathInfo)
+        const char *peerAddr, const char *scriptName, const char *pathInfo,
+        CgiCacheFill *cacheFill)
 {
     CgiExecutor *cgiexe = malloc(sizeof(CgiExecutor));
-    int fdToCgi[2], fdFromCgi[2];
     const char *query = reqhdr_getQuery(hdr);
 
     log_debug("executing %s, SCRIPT_NAME=%s, PATH_INFO=%s, QUERY_STRING=%s",
             exePath, scriptName == NULL ? "" : scriptName,
             pathInfo == NULL ? "" : pathInfo, query == NULL ? "" : query);
-    if( pipe(fdToCgi) != 0 )
-        log_fatal("pipe");
-    if( pipe(fdFromCgi) != 0 )
-        log_fatal("pipe");
-    switch( fork() ) {
-    case -1:
-        log_fatal("fork");
-    case 0:
-        dup2(fdToCgi[0], 0);
-        close(fdToCgi[0]);
-        close(fdToCgi[1]);
-        dup2(fdFromCgi[1], 1);
-        close(fdFromCgi[0]);
-        close(fdFromCgi[1]);
-        runCgi(hdr, exePath, peerAddr, scriptName, pathInfo);
-        /* does not return */
-    default:
-        break;
-    }
-    cgiexe->inFd = fdToCgi[1];
-    close(fdToCgi[0]);
-    drs_setNonBlockingCloExecFlags(cgiexe->inFd);
-    cgiexe->outFd = fdFromCgi[0];
-    close(fdFromCgi[1]);
-    drs_setNonBlockingCloExecFlags(cgiexe->outFd);
+    /* when request body length is unknown, CONTENT_LENGTH is set after
+     * the body is received */
+    cgiexe->isSpooled = reqhdr_getHeaderVal(hdr, "Content-Length") == NULL &&
+            reqhdr_isChunkedTransferEncoding(hdr) &&
+            ! config_isCGIStreamingBody(scriptName);
+    cgiexe->isBodyComplete = false;
     cgiexe->onlyHead = !strcmp(reqhdr_getMethod(hdr), "HEAD");
+    cgiexe->inFd = cgiexe->outFd = -1;
+    cgiexe->proc = cgiproc_new(scriptName);
+    cgiexe->exePath = strdup(exePath);
+    cgiexe->envStrings = mb_new();
+    cgiexe->envp = buildEnv(hdr, exePath, peerAddr, scriptName, pathInfo,
+            cgiexe->isSpooled, cgiexe->envStrings);
+    cgiexe->spoolFd = -1;
+    cgiexe->spoolLen = 0;
+    cgiexe->isSpoolOnDisk = false;
+    cgiexe->errMesg = NULL;
+    cgiexe->cacheFill = cacheFill;
     cgiexe->cgiHeader = datahdr_new();
+    if( cgiexe->isSpooled ) {
+#ifdef HAVE_MEMFD_CREATE
+        cgiexe->spoolFd = memfd_create("cgi-body", MFD_CLOEXEC);
+#endif
+        if( cgiexe->spoolFd < 0 ) {
+            if( (cgiexe->spoolFd = cgicmn_openTempFile()) >= 0 )
+                cgiexe->isSpoolOnDisk = true;
+            else
+                spoolFailed(cgiexe);
+        }
+    }else
+        tryStart(cgiexe);
     return cgiexe;
 }
 
+/* Appends a piece of request body to the spool.
+ */
+static void spoolData(CgiExecutor *cgiexe, const char *data, unsigned len)
+{
+    unsigned wrtot = 0;
+    int wr;
+
+    while( cgiexe->spoolFd >= 0 && wrtot < len ) {
+        if( (wr = write(cgiexe->spoolFd, data + wrtot, len - wrtot)) < 0 ) {
+            spoolFailed(cgiexe);
+        }else{
+            wrtot += wr;
+            cgiexe->spoolLen += wr;
+        }
+    }
+    if( cgiexe->spoolFd >= 0 && ! cgiexe->isSpoolOnDisk &&
+            cgiexe->spoolLen > SPOOL_MEM_MAX && ! moveSpoolToDisk(cgiexe) )
+        spoolFailed(cgiexe);
+}
+
 unsigned cgiexe_processData(CgiExecutor *cgiexe, const char *data,
         unsigned len, DataProcessingResult *dpr)
 {
     int wr;
     unsigned wrtot = 0;
 
+    if( cgiexe->isSpooled ) {
+        spoolData(cgiexe, data, len);
+        return len;
+    }
+    if( cgiexe->exePath != NULL && ! tryStart(cgiexe) ) {
+        /* wait for a slot */
+        dpr_setReqState(dpr, DPR_AWAIT_READ, cgiproc_getEventFd());
+        return 0;
+    }
     while( cgiexe->inFd >= 0 && wrtot < len ) {
         if( (wr = write(cgiexe->inFd, data + wrtot, len - wrtot)) < 0 ) {
             if( errno == EWOULDBLOCK ) {
@@ -227,41 +397,105 @@ unsigned cgiexe_processData(CgiExecutor *cgiexe, const char *data,
 
 void cgiexe_requestReadCompleted(CgiExecutor *cgiexe)
 {
-    close(cgiexe->inFd);
-    cgiexe->inFd = -1;
+    cgiexe->isBodyComplete = true;
+    if( cgiexe->inFd != -1 ) {
+        close(cgiexe->inFd);
+        cgiexe->inFd = -1;
+    }
+}
+
+/* Response body read from CGI and stored in cache.
+ */
+typedef struct {
+    int fd;
+    CgiCacheFill *cacheFill;
+} CachedBody;
+
+static bool produceCachedBody(RespBuf *resp, void *pvBody, int *awaitFd)
+{
+    CachedBody *body = pvBody;
+    char buf[65536];
+    int rd;
+
+    if( (rd = read(body->fd, buf, sizeof(buf))) > 0 ) {
+        resp_appendData(resp, buf, rd);
+        cgicache_fillAppend(body->cacheFill, buf, rd);
+    }else if( rd == 0 ) {
+        cgicache_fillCommit(body->cacheFill);
+        return false;
+    }else if( errno == EWOULDBLOCK ) {
+        *awaitFd = body->fd;
+    }else{
+        log_error("CGI read");
+        return false;
+    }
+    return true;
+}
+
+static void freeCachedBody(void *pvBody)
+{
+    CachedBody *body = pvBody;
+
+    close(body->fd);
+    cgicache_fillFree(body->cacheFill);
+    free(body);
 }
 
 RespBuf *cgiexe_getResponse(CgiExecutor *cgiexe, DataProcessingResult *dpr)
 {
     RespBuf *resp = NULL;
     char buf[4096];
-    int i, offset = -1, rd;
-    const char *headerName, *headerVal;
+    int offset = -1, rd;
 
+    if( cgiexe->exePath != NULL ) {     /* not started yet */
+        if( cgiexe->isSpooled && ! cgiexe->isBodyComplete )
+            return NULL;
+        if( ! tryStart(cgiexe) ) {
+            dpr_setRespState(dpr, DPR_AWAIT_READ, cgiproc_getEventFd());
+            return NULL;
+        }
+    }
+    if( cgiexe->outFd == -1 ) {     /* CGI start failed */
+        resp = resp_new(resp_cmnStatus(HTTP_500), cgiexe->onlyHead);
+        resp_appendHeader(resp, "Content-Type", "text/html");
+        resp_appendStr(resp, "<!DOCTYPE html><html><head>\n"
+                "<title>Internal Server Error</title>\n</head>\n"
+                "<body><h3>Internal Server Error</h3>\n");
+        resp_appendStr(resp, cgiexe->errMesg);
+        resp_appendStr(resp, "\n</body></html>");
+        return resp;
+    }
     while( offset < 0 && (rd = read(cgiexe->outFd, buf, sizeof(buf))) > 0 ) {
         offset = datahdr_appendData(cgiexe->cgiHeader, buf, rd, "CGI response");
     }
     if( offset >= 0 ) {
-        headerVal = datahdr_getHeaderVal(cgiexe->cgiHeader, "Status");
-        if( headerVal == NULL )
-            headerVal = resp_cmnStatus(HTTP_200_OK);
-        resp = resp_new(headerVal, cgiexe->onlyHead);
-        headerVal = datahdr_getHeaderVal(cgiexe->cgiHeader, "Content-Type");
-        resp_appendHeader(resp, "Content-Type",
-                headerVal ? headerVal : "text/plain");
-        for(i = 0; datahdr_getHeaderLineAt(cgiexe->cgiHeader, i,
-                    &headerName, &headerVal); ++i)
-        {
-            if( strcasecmp(headerName, "Status") &&
-                    strcasecmp(headerName, "Content-Type") &&
-                    strncasecmp(headerName, "X-CGI-", 6) )
-            {
-                resp_appendHeader(resp, headerName, headerVal);
-            }
-        }
+        resp = cgicmn_newResponse(cgiexe->cgiHeader, cgiexe->onlyHead);
         resp_appendData(resp, buf + offset, rd - offset);
-        resp_enqFile(resp, cgiexe->outFd);
+        if( cgiexe->cacheFill != NULL &&
+                cgicache_fillStart(cgiexe->cacheFill, cgiexe->cgiHeader) )
+        {
+            CachedBody *body = malloc(sizeof(CachedBody));
+
+            cgicache_fillAppend(cgiexe->cacheFill, buf + offset, rd - offset);
+            body->fd = cgiexe->outFd;
+            body->cacheFill = cgiexe->cacheFill;
+            cgiexe->cacheFill = NULL;
+            resp_setBodyProducer(resp, produceCachedBody, body,
+                    freeCachedBody);
+        }else
+            resp_enqFile(resp, cgiexe->outFd);
+        cgiexe->outFd = -1;
+    }else if( rd == 0 && cgiexe->proc != NULL &&
+            cgiproc_isTimedOut(cgiexe->proc) )
+    {
+        close(cgiexe->outFd);
         cgiexe->outFd = -1;
+        resp = resp_new("504 Gateway Timeout", cgiexe->onlyHead);
+        resp_appendHeader(resp, "Content-Type", "text/html");
+        resp_appendStr(resp, "<!DOCTYPE html><html><head>\n"
+                "<title>Gateway Timeout</title>\n</head>\n"
+                "<body><h3>Gateway Timeout</h3>\n"
+                "CGI script exceeded time limit\n</body></html>");
     }else if( rd == 0 ) { /* incomplete header in CGI response */
         close(cgiexe->outFd);
         cgiexe->outFd = -1;
@@ -288,6 +522,13 @@ void cgiexe_free(CgiExecutor *cgiexe)
             close(cgiexe->inFd);
         if( cgiexe->outFd != -1 )
             close(cgiexe->outFd);
+        if( cgiexe->spoolFd != -1 )
+            close(cgiexe->spoolFd);
+        free(cgiexe->exePath);
+        free(cgiexe->envp);
+        mb_free(cgiexe->envStrings);
+        cgiproc_free(cgiexe->proc);
+        cgicache_fillFree(cgiexe->cacheFill);
         datahdr_free(cgiexe->cgiHeader);
         free(cgiexe);
     }
@@ -4,6 +4,7 @@
 #include "requestheader.h"
 #include "respbuf.h"
 #include "dataprocessingresult.h"
+#include "cgicache.h"
 
 
 typedef struct CgiExecutor CgiExecutor;
@@ -15,9 +16,12 @@ typedef struct CgiExecutor CgiExecutor;
  *      peerAddr    - CGI $REMOTE_ADDR value
  *      scriptName  - CGI $SCRIPT_NAME value
  *      pathInfo    - CGI $PATH_INFO value
+ *      cacheFill   - stores the response in cache; may be NULL. The
+ *                    executor takes ownership of the fill
  */
 CgiExecutor *cgiexe_new(const RequestHeader*, const char *exePath,
-        const char *peerAddr, const char *scriptName, const char *pathInfo);
+        const char *peerAddr, const char *scriptName, const char *pathInfo,
+        CgiCacheFill *cacheFill);
 
 
 /* Processes the data chunk arrived.
@@ -0,0 +1,376 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdbool.h>
+#include "cgiprocess.h"
+#include "fmconfig.h"
+#include "fmlog.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+
+enum CgiProcessState {
+    CPS_QUEUED,
+    CPS_ACQUIRED,   /* slot acquired; the process is not started yet */
+    CPS_RUNNING,
+    CPS_EXITED
+};
+
+typedef struct CgiGroup {
+    char *name;
+    unsigned maxProcs;      /* as configured at the last slot creation */
+    unsigned slotCount;     /* acquired slots, including running processes */
+    CgiProcess *queueHead, *queueTail;
+    unsigned queueLen;
+    /* statistics */
+    unsigned long long startCount;
+    unsigned long long waitCount;       /* slots which have been queued */
+    unsigned long long waitTotalMs;
+    unsigned long long waitMaxMs;
+    unsigned queueLenMax;
+    unsigned long long timeoutCount;
+    struct CgiGroup *next;
+} CgiGroup;
+
+struct CgiProcess {
+    CgiGroup *group;
+    enum CgiProcessState state;
+    bool isOwned;           /* not freed by cgiproc_free() yet */
+    bool isWaitCounted;
+    bool isTimedOut;
+    unsigned long long createTime;
+    pid_t pid;
+    unsigned long long deadline;    /* 0 when no time limit */
+    CgiProcess *prev, *next;        /* in group queue or running list */
+};
+
+static int gEpollFd = -1, gSignalFd, gTimerFd, gKickFd;
+static CgiGroup *gGroups;
+static CgiProcess *gRunning;
+
+/* Returns monotonic clock time in milliseconds.
+ */
+static unsigned long long getTimeMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void addToEpoll(int fd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if( epoll_ctl(gEpollFd, EPOLL_CTL_ADD, fd, &ev) != 0 )
+        log_fatal("cgiproc: epoll_ctl");
+}
+
+static void init(void)
+{
+    sigset_t mask;
+
+    /* SIGCHLD is received through signalfd */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    if( (gEpollFd = epoll_create1(EPOLL_CLOEXEC)) < 0 )
+        log_fatal("cgiproc: epoll_create1");
+    if( (gSignalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 )
+        log_fatal("cgiproc: signalfd");
+    if( (gTimerFd = timerfd_create(CLOCK_MONOTONIC,
+                    TFD_NONBLOCK | TFD_CLOEXEC)) < 0 )
+        log_fatal("cgiproc: timerfd_create");
+    if( (gKickFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 )
+        log_fatal("cgiproc: eventfd");
+    addToEpoll(gSignalFd);
+    addToEpoll(gTimerFd);
+    addToEpoll(gKickFd);
+}
+
+int cgiproc_getEventFd(void)
+{
+    if( gEpollFd < 0 )
+        init();
+    return gEpollFd;
+}
+
+/* Wakes up the queued slots when some of them may be acquired.
+ */
+static void kickQueue(const CgiGroup *group)
+{
+    uint64_t val = 1;
+
+    if( group->queueHead != NULL &&
+            (group->maxProcs == 0 || group->slotCount < group->maxProcs) &&
+            write(gKickFd, &val, sizeof(val)) < 0 )
+        log_error("cgiproc: eventfd write");
+}
+
+static void listRemove(CgiProcess **head, CgiProcess **tail, CgiProcess *proc)
+{
+    if( proc->prev != NULL )
+        proc->prev->next = proc->next;
+    else
+        *head = proc->next;
+    if( proc->next != NULL )
+        proc->next->prev = proc->prev;
+    else if( tail != NULL )
+        *tail = proc->prev;
+    proc->prev = proc->next = NULL;
+}
+
+/* Releases the slot of exited process.
+ */
+static void processExited(CgiProcess *proc)
+{
+    listRemove(&gRunning, NULL, proc);
+    proc->state = CPS_EXITED;
+    --proc->group->slotCount;
+    if( ! proc->isOwned )
+        free(proc);
+}
+
+static void reapChildren(void)
+{
+    CgiProcess *proc;
+    pid_t pid;
+    int status;
+
+    while( (pid = waitpid(-1, &status, WNOHANG)) > 0 ) {
+        for(proc = gRunning; proc != NULL && proc->pid != pid;
+                proc = proc->next)
+            ;
+        if( proc != NULL ) {
+            if( WIFSIGNALED(status) && ! proc->isTimedOut )
+                log_warn("CGI process %d killed by signal %d", pid,
+                        WTERMSIG(status));
+            processExited(proc);
+        }else
+            log_debug("reaped child process %d", pid);
+    }
+}
+
+/* Kills the processes which exceeded time limit. Sets the timer to the
+ * nearest deadline of remaining processes.
+ */
+static void killExpired(void)
+{
+    struct itimerspec its;
+    unsigned long long now = getTimeMs(), nearest = 0;
+    CgiProcess *proc;
+
+    for(proc = gRunning; proc != NULL; proc = proc->next) {
+        if( proc->deadline == 0 || proc->isTimedOut )
+            continue;
+        if( proc->deadline <= now ) {
+            log_warn("CGI process %d exceeded time limit; killing", proc->pid);
+            /* the process leads its own process group */
+            kill(-proc->pid, SIGKILL);
+            proc->isTimedOut = true;
+            ++proc->group->timeoutCount;
+        }else if( nearest == 0 || proc->deadline < nearest )
+            nearest = proc->deadline;
+    }
+    memset(&its, 0, sizeof(its));
+    if( nearest != 0 ) {
+        its.it_value.tv_sec = (nearest - now) / 1000;
+        its.it_value.tv_nsec = (nearest - now) % 1000 * 1000000;
+    }
+    timerfd_settime(gTimerFd, 0, &its, NULL);
+}
+
+/* Consumes the expiration count of timerfd or the value of eventfd.
+ */
+static void drainCounter(int fd)
+{
+    uint64_t val;
+
+    if( read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN )
+        log_error("cgiproc: read");
+}
+
+void cgiproc_processEvents(void)
+{
+    struct signalfd_siginfo si;
+
+    while( read(gSignalFd, &si, sizeof(si)) > 0 )
+        ;
+    drainCounter(gTimerFd);
+    drainCounter(gKickFd);
+    reapChildren();
+    killExpired();
+}
+
+static CgiGroup *getGroup(const char *name)
+{
+    CgiGroup *group;
+
+    for(group = gGroups; group != NULL; group = group->next) {
+        if( ! strcmp(group->name, name) )
+            return group;
+    }
+    group = calloc(1, sizeof(CgiGroup));
+    group->name = strdup(name);
+    group->next = gGroups;
+    gGroups = group;
+    return group;
+}
+
+CgiProcess *cgiproc_new(const char *urlPath)
+{
+    CgiProcess *proc = calloc(1, sizeof(CgiProcess));
+    const char *groupName;
+    unsigned maxProcs;
+    CgiGroup *group;
+
+    cgiproc_getEventFd();
+    maxProcs = config_getCGILimit(urlPath, &groupName);
+    group = getGroup(groupName);
+    if( maxProcs != group->maxProcs ) {
+        group->maxProcs = maxProcs;
+        kickQueue(group);   /* the limit might have been raised */
+    }
+    proc->group = group;
+    proc->state = CPS_QUEUED;
+    proc->isOwned = true;
+    proc->createTime = getTimeMs();
+    proc->pid = -1;
+    proc->prev = group->queueTail;
+    if( group->queueTail != NULL )
+        group->queueTail->next = proc;
+    else
+        group->queueHead = proc;
+    group->queueTail = proc;
+    ++group->queueLen;
+    return proc;
+}
+
+bool cgiproc_acquire(CgiProcess *proc)
+{
+    CgiGroup *group = proc->group;
+    const CgiProcess *qp;
+    unsigned queuePos = 0, waitMs;
+
+    if( proc->state != CPS_QUEUED )
+        return true;
+    for(qp = group->queueHead; qp != proc; qp = qp->next)
+        ++queuePos;
+    if( group->maxProcs != 0 && group->slotCount + queuePos >= group->maxProcs )
+    {
+        if( ! proc->isWaitCounted ) {
+            proc->isWaitCounted = true;
+            ++group->waitCount;
+            if( group->queueLen > group->queueLenMax )
+                group->queueLenMax = group->queueLen;
+            log_debug("CGI group \"%s\": limit %u reached, %u queued",
+                    group->name, group->maxProcs, group->queueLen);
+        }
+        return false;
+    }
+    listRemove(&group->queueHead, &group->queueTail, proc);
+    --group->queueLen;
+    proc->state = CPS_ACQUIRED;
+    ++group->slotCount;
+    if( proc->isWaitCounted ) {
+        waitMs = getTimeMs() - proc->createTime;
+        group->waitTotalMs += waitMs;
+        if( waitMs > group->waitMaxMs )
+            group->waitMaxMs = waitMs;
+    }
+    return true;
+}
+
+void cgiproc_setStarted(CgiProcess *proc, pid_t pid)
+{
+    struct rlimit rlim;
+    unsigned timeout, cpuLimit;
+
+    proc->state = CPS_RUNNING;
+    proc->pid = pid;
+    ++proc->group->startCount;
+    if( (cpuLimit = config_getCGICpuLimit()) != 0 ) {
+        /* SIGXCPU at the soft limit, SIGKILL a second later */
+        rlim.rlim_cur = cpuLimit;
+        rlim.rlim_max = cpuLimit + 1;
+        if( prlimit(pid, RLIMIT_CPU, &rlim, NULL) != 0 )
+            log_error("CGI prlimit");
+    }
+    proc->next = gRunning;
+    if( gRunning != NULL )
+        gRunning->prev = proc;
+    gRunning = proc;
+    if( (timeout = config_getCGITimeout()) != 0 ) {
+        proc->deadline = getTimeMs() + timeout * 1000ULL;
+        killExpired();
+    }
+}
+
+bool cgiproc_isTimedOut(const CgiProcess *proc)
+{
+    return proc->isTimedOut;
+}
+
+void cgiproc_free(CgiProcess *proc)
+{
+    CgiGroup *group;
+
+    if( proc == NULL )
+        return;
+    group = proc->group;
+    switch( proc->state ) {
+    case CPS_QUEUED:
+        listRemove(&group->queueHead, &group->queueTail, proc);
+        --group->queueLen;
+        kickQueue(group);
+        free(proc);
+        break;
+    case CPS_ACQUIRED:
+        --group->slotCount;
+        kickQueue(group);
+        free(proc);
+        break;
+    case CPS_RUNNING:
+        proc->isOwned = false;  /* freed when exits */
+        break;
+    case CPS_EXITED:
+        free(proc);
+        break;
+    }
+}
+
+void cgiproc_forgetChildren(void)
+{
+    while( gRunning != NULL )
+        processExited(gRunning);
+}
+
+void cgiproc_logStats(void)
+{
+    const CgiGroup *group;
+
+    for(group = gGroups; group != NULL; group = group->next) {
+        log_info("CGI group \"%s\": limit %u, running %u, queued %u "
+                "(max %u), started %llu, waited %llu (avg %llu ms, "
+                "max %llu ms), timed out %llu",
+                group->name, group->maxProcs, group->slotCount,
+                group->queueLen, group->queueLenMax, group->startCount,
+                group->waitCount, group->waitCount ?
+                group->waitTotalMs / group->waitCount : 0,
+                group->waitMaxMs, group->timeoutCount);
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef CGIPROCESS_H
+#define CGIPROCESS_H
+
+#include <sys/types.h>
+
+
+/* A slot for CGI process run. CGI scripts are grouped according to
+ * "cgilimit" configuration option; the number of processes running at once
+ * in a group is limited. When the limit is reached, the slots wait in a
+ * FIFO queue.
+ */
+typedef struct CgiProcess CgiProcess;
+
+
+/* Returns file descriptor which becomes ready for read when a CGI process
+ * exits, exceeds its time limit or a queued slot may be available.
+ * The main loop shall always await it and invoke cgiproc_processEvents()
+ * when ready, before the connections are processed. Requests waiting for
+ * a slot should await the descriptor too.
+ */
+int cgiproc_getEventFd(void);
+
+
+/* Reaps the exited child processes and kills the CGI processes which
+ * exceeded the wall-clock time limit.
+ */
+void cgiproc_processEvents(void);
+
+
+/* Creates a slot for CGI script at the URL path. The slot is queued.
+ */
+CgiProcess *cgiproc_new(const char *urlPath);
+
+
+/* Returns true when the slot may be used to start the process: the slot
+ * is at the front of the queue and the group limit is not reached.
+ * Returns false when the process should wait; the caller shall await
+ * cgiproc_getEventFd() and retry.
+ */
+bool cgiproc_acquire(CgiProcess*);
+
+
+/* Registers the process started using the acquired slot. Sets the resource
+ * limits of the process and starts its wall-clock timer.
+ */
+void cgiproc_setStarted(CgiProcess*, pid_t);
+
+
+/* Returns true when the process was killed due to time limit.
+ */
+bool cgiproc_isTimedOut(const CgiProcess*);
+
+
+/* Ends use of the slot. A process still running keeps the slot until it
+ * exits or is killed on time limit.
+ */
+void cgiproc_free(CgiProcess*);
+
+
+/* Forgets the running processes, which are not children of the process
+ * anymore. Invoked in forked process.
+ */
+void cgiproc_forgetChildren(void);
+
+
+/* Writes statistics of CGI groups to log.
+ */
+void cgiproc_logStats(void);
+
+#endif /* CGIPROCESS_H */
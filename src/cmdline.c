@@ -7,6 +7,7 @@
 static const char *gConfigLoc = SYSCONFDIR "/filemanager-httpd.d";
 unsigned gLogLevel;
 bool gIsInetdMode;
+bool gIsConfigCheck;
 
 static void usage(void)
 {
@@ -29,6 +30,9 @@ static void usage(void)
     "\n"
     "\t-i             - inetd mode (socket passed as standard input)\n"
     "\n"
+    "\t-t             - check that all configuration files are readable\n"
+    "\t                 and exit; exit status is non-zero when not\n"
+    "\n"
     );
 }
 
@@ -36,7 +40,7 @@ bool cmdline_parse(int argc, char *argv[])
 {
     int opt;
 
-    while( (opt = getopt(argc, argv, "c:dhip:")) != -1 ) {
+    while( (opt = getopt(argc, argv, "c:dhip:t")) != -1 ) {
         switch( opt ) {
         case 'c':
             gConfigLoc = optarg;
@@ -47,6 +51,9 @@ bool cmdline_parse(int argc, char *argv[])
         case 'i':
             gIsInetdMode = true;
             break;
+        case 't':
+            gIsConfigCheck = true;
+            break;
         case 'p':
             puts(config_getCredentialsEncoded(optarg));
             return false;
@@ -74,3 +81,8 @@ bool cmdline_isInetdMode(void)
     return gIsInetdMode;
 }
 
+bool cmdline_isConfigCheck(void)
+{
+    return gIsConfigCheck;
+}
+
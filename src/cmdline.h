@@ -11,4 +11,6 @@ unsigned cmdline_getLogLevel(void);
 
 bool cmdline_isInetdMode(void);
 
+bool cmdline_isConfigCheck(void);
+
 #endif /* CMDLINE_H */
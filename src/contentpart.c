@@ -1,3 +1,6 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdbool.h>
 #include "contentpart.h"
 #include "dataheader.h"
@@ -8,12 +11,14 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
 
 
 struct ContentPart {
     DataHeader *header;
-    char *destDir;
-    MemBuf *filePathName;   /* body output full path - if body store is file */
+    int destDirFd;          /* output files location; -1 when discarded */
+    MemBuf *filePathName;   /* body output file name, relative to destDir -
+                             * if body store is file */
     char *name;             /* Content-Disposition "name" value */
     char *fileName;         /* Content-Disposition "filename" value */
     int fileDesc;           /* body output - used when "filename" is set */
@@ -22,12 +27,44 @@ struct ContentPart {
 };
 
 
-ContentPart *cpart_new(const char *destDir)
+/* Creates a file with random name in dirFd directory. The file name is
+ * stored in fileName.
+ */
+static int openTmpFileAt(int dirFd, MemBuf *fileName)
+{
+    static const char chars[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    static unsigned long long seq;
+    unsigned long long rnd;
+    char name[] = "fmgrXXXXXX";
+    unsigned i, attempt;
+    int fd = -1;
+
+    if( seq == 0 )
+        seq = (unsigned long long)time(NULL) << 20 ^ getpid();
+    for(attempt = 0; fd == -1 && attempt < 100; ++attempt) {
+        seq = seq * 6364136223846793005ULL + 1442695040888963407ULL;
+        rnd = seq >> 16;
+        for(i = 4; name[i]; ++i) {
+            name[i] = chars[rnd % (sizeof(chars) - 1)];
+            rnd /= sizeof(chars) - 1;
+        }
+        fd = openat(dirFd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                S_IRUSR | S_IWUSR);
+        if( fd == -1 && errno != EEXIST )
+            break;
+    }
+    if( fd != -1 )
+        mb_setStrEnd(fileName, 0, name);
+    return fd;
+}
+
+ContentPart *cpart_new(int destDirFd)
 {
     ContentPart *cpart = malloc(sizeof(ContentPart));
 
     cpart->header = datahdr_new();
-    cpart->destDir = destDir ? strdup(destDir) : NULL;
+    cpart->destDirFd = destDirFd;
     cpart->filePathName = NULL;
     cpart->name = NULL;
     cpart->fileName = NULL;
@@ -37,9 +74,10 @@ ContentPart *cpart_new(const char *destDir)
     return cpart;
 }
 
-void cpart_appendData(ContentPart *cpart, const char *data, unsigned len)
+unsigned cpart_appendData(ContentPart *cpart, const char *data, unsigned len)
 {
-    int offset = 0, wr, pathNameLen;
+    int offset = 0, wr;
+    unsigned memLen = 0;
     const char *contentDisp;
     DataChunk dchContentDisp, dchName, dchValue;
 
@@ -47,6 +85,7 @@ void cpart_appendData(ContentPart *cpart, const char *data, unsigned len)
             datahdr_appendData(cpart->header, data, len, "form data")) >= 0)
     {
         /* complete header received */
+        memLen = offset;
         contentDisp = datahdr_getHeaderVal(cpart->header,
                 "Content-Disposition");
         /* Content-Disposition: form-data; name="file"; filename="Test.xml" */
@@ -69,20 +108,21 @@ void cpart_appendData(ContentPart *cpart, const char *data, unsigned len)
             log_debug("no Content-Disposition in part");
         }
         if( cpart->fileName != NULL ) {
-            if( cpart->destDir != NULL ) {
+            if( strchr(cpart->fileName, '/') != NULL ||
+                    ! strcmp(cpart->fileName, ".") ||
+                    ! strcmp(cpart->fileName, "..") )
+            {
+                cpart->sysErrNo = EINVAL;
+            }else if( cpart->destDirFd != -1 ) {
                 mb_free(cpart->filePathName);
-                cpart->filePathName = mb_newWithStr(cpart->destDir);
-                mb_ensureEndsWithSlash(cpart->filePathName);
-                pathNameLen = mb_dataLen(cpart->filePathName);
-                mb_appendStr(cpart->filePathName, cpart->fileName);
-                cpart->fileDesc = open(mb_data(cpart->filePathName),
-                        O_RDWR | O_CREAT | O_EXCL,
+                cpart->filePathName = mb_newWithStr(cpart->fileName);
+                cpart->fileDesc = openat(cpart->destDirFd, cpart->fileName,
+                        O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
                         S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
                 if( cpart->fileDesc == -1 ) {
                     if( errno == EEXIST ) {
-                        mb_setStrEnd(cpart->filePathName, pathNameLen,
-                                "fmgrXXXXXX");
-                        cpart->fileDesc = mb_mkstemp(cpart->filePathName);
+                        cpart->fileDesc = openTmpFileAt(cpart->destDirFd,
+                                cpart->filePathName);
                         if( cpart->fileDesc == -1 )
                             cpart->sysErrNo = errno;
                     }else
@@ -102,7 +142,8 @@ void cpart_appendData(ContentPart *cpart, const char *data, unsigned len)
                     cpart->sysErrNo = errno;
                     close(cpart->fileDesc);
                     cpart->fileDesc = -1;
-                    if( unlink(mb_data(cpart->filePathName)) != 0 )
+                    if( unlinkat(cpart->destDirFd,
+                                mb_data(cpart->filePathName), 0) != 0 )
                         log_error("remove %s fail",
                                 mb_data(cpart->filePathName));
                 }
@@ -110,8 +151,11 @@ void cpart_appendData(ContentPart *cpart, const char *data, unsigned len)
             }
         }else{
             mb_appendData(cpart->body, data + offset, len - offset);
+            memLen += len - offset;
         }
-    }
+    }else
+        memLen = len;   /* header is not complete yet */
+    return memLen;
 }
 
 const char *cpart_getName(const ContentPart *cpart)
@@ -143,20 +187,17 @@ bool cpart_finishUpload(ContentPart *cpart, const char *targetName,
         bool replaceIfExists, int *sysErrNo)
 {
     bool res = cpart->fileDesc != -1;
-    MemBuf *targetPathName = NULL;
+    const char *fileName;
 
     if( res ) {
+        fileName = mb_data(cpart->filePathName);
         if( targetName == NULL )
             targetName = cpart->fileName;
-        if( targetName[0] != '/' ) {
-            targetPathName = mb_newWithStr(cpart->destDir);
-            mb_ensureEndsWithSlash(targetPathName);
-            mb_appendStr(targetPathName, targetName);
-            targetName = mb_data(targetPathName);
-        }
-        if( strcmp(mb_data(cpart->filePathName), targetName) ) {
+        if( strcmp(fileName, targetName) ) {
             if( replaceIfExists ) {
-                if( rename(mb_data(cpart->filePathName), targetName) == 0 ) {
+                if( renameat(cpart->destDirFd, fileName,
+                            cpart->destDirFd, targetName) == 0 )
+                {
                     log_debug("replaced %s", targetName);
                 }else{
                     res = false;
@@ -166,10 +207,12 @@ bool cpart_finishUpload(ContentPart *cpart, const char *targetName,
                             strerror(cpart->sysErrNo));
                 }
             }else{
-                if( link(mb_data(cpart->filePathName), targetName) == 0 ) {
-                    unlink(mb_data(cpart->filePathName));
+                if( linkat(cpart->destDirFd, fileName,
+                            cpart->destDirFd, targetName, 0) == 0 )
+                {
+                    unlinkat(cpart->destDirFd, fileName, 0);
                     log_debug("added %s (renamed from: %s)",
-                            mb_data(cpart->filePathName), targetName);
+                            fileName, targetName);
                 }else{
                     res = false;
                     cpart->sysErrNo = errno;
@@ -184,7 +227,6 @@ bool cpart_finishUpload(ContentPart *cpart, const char *targetName,
             close(cpart->fileDesc);
             cpart->fileDesc = -1;
         }
-        mb_free(targetPathName);
     }
     if( ! res )
         *sysErrNo = cpart->sysErrNo;
@@ -196,12 +238,12 @@ void cpart_free(ContentPart *cpart)
     if( cpart != NULL ) {
         if( cpart->fileDesc != -1 ) {
             close(cpart->fileDesc);
-            if( unlink(mb_data(cpart->filePathName)) != 0 )
+            if( unlinkat(cpart->destDirFd, mb_data(cpart->filePathName), 0)
+                    != 0 )
                 log_error("remove %s fail", mb_data(cpart->filePathName));
         }
         datahdr_free(cpart->header);
         mb_free(cpart->filePathName);
-        free(cpart->destDir);
         free(cpart->name);
         free(cpart->fileName);
         mb_free(cpart->body);
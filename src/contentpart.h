@@ -12,21 +12,24 @@ typedef struct ContentPart ContentPart;
 /* Creates a new ContentPart object.
  * If the content part contains Content-Disposition header field with
  * "filename" parameter, the content part body will be stored in file
- * under name specified by the "filename" parameter value. The destDir
- * parameter specifies the file location.
- * If the destDir parameter is NULL and "filename" parameter is set,
+ * under name specified by the "filename" parameter value. The destDirFd
+ * parameter is a descriptor of the file location directory; it is not
+ * closed by the ContentPart. The "filename" containing a slash is rejected.
+ * If the destDirFd parameter is -1 and "filename" parameter is set,
  * the body is discarded.
  *
  * If the "filename" parameter is not set, the body is stored in memory,
- * regardless of whether the destDir is NULL or not.
+ * regardless of whether the destDirFd is -1 or not.
  */
-ContentPart *cpart_new(const char *destDir);
+ContentPart *cpart_new(int destDirFd);
 
 
 /* The ContentPart contents build helper.
  * Adds the data arrived as a part of ContentPart.
+ * Returns the number of bytes stored in memory: the part header and the
+ * body when it is not stored in file.
  */
-void cpart_appendData(ContentPart*, const char *data, unsigned len);
+unsigned cpart_appendData(ContentPart*, const char *data, unsigned len);
 
 
 /* Returns value of "name" parameter from Content-Type header field.
@@ -43,16 +46,16 @@ bool cpart_nameEquals(const ContentPart*, const char *name);
 /* Returns value of "filename" parameter from Content-Type header field.
  * Returns NULL when the parameter is not set.
  * When not NULL, the part content is stored in a file, in directory
- * provided as destDir at ContentPart object creation.
- * If the destDir already contains a file with this name, a random name is
+ * provided as destDirFd at ContentPart object creation.
+ * If the directory already contains a file with this name, a random name is
  * chosen for output file. Otherwise the output is stored in file
  * with this name.
  */
 const char *cpart_getFileName(const ContentPart*);
 
 
-/* Returns ouptut file full path name. Returns NULL when body is stored in
- * memory or is discarded.
+/* Returns ouptut file name, relative to destination directory. Returns NULL
+ * when body is stored in memory or is discarded.
  */
 const char *cpart_getFilePathName(const ContentPart*);
 
@@ -68,8 +71,8 @@ const char *cpart_getDataStr(const ContentPart*);
  * permanent (i.e. causes that file will be not deleted at object
  * destruction) and returns true.
  *
- * The targetName may be relative or absolute. Relative name is related to
- * destDir. The targetName may be NULL. In this case the file is stored
+ * The targetName is relative to destination directory. The targetName
+ * may be NULL. In this case the file is stored
  * with name returned by cpart_getFileName(). If a file with the target name
  * already exists, the result depends on replaceIfExists parameter value.
  * If false, the function fails with sysErrNo set to EEXIST.
@@ -1,90 +1,253 @@
 #include <stdbool.h>
 #include "contenttype.h"
+#include "datachunk.h"
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 
+/* Maximum length of file name extension recognized.
+ */
+enum { EXT_MAXLEN = 32 };
+
+/* Built-in content types. The table is a perfect hash: every extension is
+ * placed at index equal to its hash value, as computed in getBuiltinType().
+ * The BUILTIN_HASH_MULT constant was chosen so that no two extensions
+ * collide; on table change a new multiplier may be needed.
+ */
+enum {
+    BUILTIN_TABLE_BITS = 8,
+    BUILTIN_HASH_MULT = 195893u
+};
+
+static const struct mime_type { const char *ext, *mime; }
+    gBuiltinTypes[1 << BUILTIN_TABLE_BITS] = {
+        [120] = { "7z",     "application/x-7z-compressed" },
+        [  7] = { "aac",    "audio/x-hx-aac-adts" },
+        [108] = { "apng",   "image/apng" },
+        [178] = { "avi",    "video/x-msvideo" },
+        [ 68] = { "avif",   "image/avif" },
+        [ 46] = { "bmp",    "image/bmp" },
+        [188] = { "bz2",    "application/x-bzip2" },
+        [  0] = { "c",      "text/x-c" },
+        [181] = { "conf",   "text/plain" },
+        [227] = { "css",    "text/css" },
+        [  4] = { "csv",    "text/csv" },
+        [ 99] = { "deb",    "application/x-debian-package" },
+        [151] = { "doc",    "application/msword" },
+        [209] = { "epub",   "application/epub+zip" },
+        [165] = { "flac",   "audio/flac" },
+        [190] = { "flv",    "video/x-flv" },
+        [ 48] = { "gif",    "image/gif" },
+        [253] = { "gz",     "application/gzip" },
+        [177] = { "heic",   "image/heic" },
+        [113] = { "htm",    "text/html; charset=utf-8" },
+        [ 49] = { "html",   "text/html; charset=utf-8" },
+        [ 80] = { "ico",    "image/vnd.microsoft.icon" },
+        [228] = { "jar",    "application/jar" },
+        [111] = { "java",   "text/plain" },
+        [134] = { "jpe",    "image/jpeg" },
+        [158] = { "jpeg",   "image/jpeg" },
+        [ 18] = { "jpg",    "image/jpeg" },
+        [241] = { "js",     "text/javascript" },
+        [ 81] = { "json",   "application/json" },
+        [207] = { "jsp",    "text/html; charset=utf-8" },
+        [117] = { "m3u",    "audio/x-mpegurl" },
+        [118] = { "m4a",    "audio/mp4" },
+        [ 77] = { "md",     "text/markdown; charset=utf-8" },
+        [130] = { "mid",    "audio/midi" },
+        [255] = { "midi",   "audio/midi" },
+        [ 13] = { "mjs",    "text/javascript" },
+        [176] = { "mkv",    "video/x-matroska" },
+        [160] = { "mov",    "video/quicktime" },
+        [104] = { "mp2",    "audio/mpeg" },
+        [162] = { "mp3",    "audio/mpeg" },
+        [219] = { "mp4",    "video/mp4" },
+        [ 29] = { "mpe",    "video/mpeg" },
+        [234] = { "mpeg",   "video/mpeg" },
+        [145] = { "mpg",    "video/mpeg" },
+        [ 19] = { "oga",    "audio/ogg" },
+        [135] = { "ogg",    "video/ogg" },
+        [ 73] = { "opus",   "audio/ogg" },
+        [ 65] = { "otf",    "font/otf" },
+        [ 62] = { "pdf",    "application/pdf" },
+        [ 57] = { "png",    "image/png" },
+        [ 23] = { "ppt",    "application/vnd.ms-powerpoint" },
+        [230] = { "ps",     "application/postscript" },
+        [157] = { "qt",     "video/quicktime" },
+        [146] = { "ra",     "audio/x-realaudio" },
+        [169] = { "ram",    "audio/x-pn-realaudio" },
+        [242] = { "rtf",    "text/rtf" },
+        [ 83] = { "sh",     "text/plain; charset=utf-8" },
+        [195] = { "sql",    "application/sql" },
+        [183] = { "svg",    "image/svg+xml" },
+        [136] = { "svgz",   "image/svg+xml" },
+        [235] = { "tar",    "application/x-tar" },
+        [156] = { "tif",    "image/tiff" },
+        [229] = { "tiff",   "image/tiff" },
+        [ 91] = { "tsv",    "text/tab-separated-values; charset=utf-8" },
+        [ 21] = { "ttf",    "font/ttf" },
+        [144] = { "txt",    "text/plain; charset=utf-8" },
+        [223] = { "wasm",   "application/wasm" },
+        [173] = { "wav",    "audio/x-wav" },
+        [216] = { "webm",   "video/webm" },
+        [194] = { "webp",   "image/webp" },
+        [  8] = { "wma",    "audio/x-ms-wma" },
+        [ 55] = { "wmv",    "video/x-ms-wmv" },
+        [171] = { "wmx",    "video/x-ms-wmx" },
+        [ 66] = { "woff",   "font/woff" },
+        [114] = { "woff2",  "font/woff2" },
+        [ 96] = { "xls",    "application/vnd.ms-excel" },
+        [ 52] = { "xml",    "text/xml; charset=utf-8" },
+        [ 39] = { "xpm",    "image/x-xpmi" },
+        [205] = { "xsl",    "text/xml; charset=utf-8" },
+        [103] = { "xz",     "application/x-xz" },
+        [ 85] = { "zip",    "application/zip" },
+        [226] = { "zst",    "application/zstd" },
+    };
+
+/* Content types loaded from mime.types file and set in configuration.
+ * Open addressing hash table; the size is a power of two.
+ */
+typedef struct {
+    char *ext;                  /* lower case; NULL when unused */
+    char *mime;
+} ContentTypeEnt;
+
+static ContentTypeEnt *gTypes;
+static unsigned gTypesSize, gTypesCount;
+
+
+/* FNV-1a hash of lower case ext.
+ */
+static unsigned extHash(const char *ext)
+{
+    unsigned hash = 2166136261u;
+
+    while( *ext )
+        hash = (hash ^ (unsigned char)tolower(*ext++)) * 16777619u;
+    return hash;
+}
+
+static const char *getBuiltinType(const char *ext)
+{
+    const struct mime_type *mt = gBuiltinTypes +
+        (extHash(ext) * BUILTIN_HASH_MULT >> (32 - BUILTIN_TABLE_BITS));
+
+    return mt->ext != NULL && !strcasecmp(ext, mt->ext) ? mt->mime : NULL;
+}
+
+static ContentTypeEnt *findType(const char *ext)
+{
+    unsigned idx;
+
+    if( gTypesSize == 0 )
+        return NULL;
+    idx = extHash(ext) & (gTypesSize - 1);
+    while( gTypes[idx].ext != NULL && strcasecmp(gTypes[idx].ext, ext) )
+        idx = (idx + 1) & (gTypesSize - 1);
+    return gTypes + idx;
+}
+
+static void addType(const char *mimeType, const DataChunk *ext,
+        bool isOverride)
+{
+    ContentTypeEnt *ent, *oldTypes;
+    unsigned i, oldSize;
+    char extBuf[EXT_MAXLEN+1];
+
+    if( ext->len == 0 || ext->len > EXT_MAXLEN )
+        return;
+    for(i = 0; i < ext->len; ++i)
+        extBuf[i] = tolower(ext->data[i]);
+    extBuf[i] = '\0';
+    if( 2 * (gTypesCount + 1) > gTypesSize ) {
+        oldTypes = gTypes;
+        oldSize = gTypesSize;
+        gTypesSize = gTypesSize ? 2 * gTypesSize : 256;
+        gTypes = calloc(gTypesSize, sizeof(ContentTypeEnt));
+        for(i = 0; i < oldSize; ++i) {
+            if( oldTypes[i].ext != NULL )
+                *findType(oldTypes[i].ext) = oldTypes[i];
+        }
+        free(oldTypes);
+    }
+    ent = findType(extBuf);
+    if( ent->ext == NULL ) {
+        ent->ext = strdup(extBuf);
+        ent->mime = strdup(mimeType);
+        ++gTypesCount;
+    }else if( isOverride ) {
+        free(ent->mime);
+        ent->mime = strdup(mimeType);
+    }
+}
+
+void cttype_setType(const char *mimeType, const DataChunk *ext)
+{
+    addType(mimeType, ext, true);
+}
+
+bool cttype_loadMimeTypes(const char *fileName)
+{
+    FILE *fp;
+    char buf[1024], ext[EXT_MAXLEN+1], *mimeType;
+    const char *builtin;
+    DataChunk dchLine, dchMime, dchExt;
+
+    if( (fp = fopen(fileName, "r")) == NULL )
+        return false;
+    while( fgets(buf, sizeof(buf), fp) != NULL ) {
+        dch_initWithStr(&dchLine, buf);
+        dch_trimWS(&dchLine);
+        if( dchLine.len == 0 || *dchLine.data == '#' ||
+                ! dch_extractTillWS(&dchLine, &dchMime) )
+            continue;
+        mimeType = dch_dupToStr(&dchMime);
+        while( dch_extractTillWS(&dchLine, &dchExt) ) {
+            /* built-in types having parameters, like charset, are kept */
+            if( dchExt.len <= EXT_MAXLEN ) {
+                memcpy(ext, dchExt.data, dchExt.len);
+                ext[dchExt.len] = '\0';
+                if( (builtin = getBuiltinType(ext)) != NULL &&
+                        strchr(builtin, ';') != NULL )
+                    continue;
+            }
+            addType(mimeType, &dchExt, false);
+        }
+        free(mimeType);
+    }
+    fclose(fp);
+    return true;
+}
+
+void cttype_clear(void)
+{
+    unsigned i;
+
+    for(i = 0; i < gTypesSize; ++i) {
+        free(gTypes[i].ext);
+        free(gTypes[i].mime);
+    }
+    free(gTypes);
+    gTypes = NULL;
+    gTypesSize = gTypesCount = 0;
+}
+
 const char *cttype_getContentTypeByFileExt(const char *fname)
 {
-    static struct mime_type { const char *ext, *mime; } mime_types[] = {
-        { "aac",     "audio/x-hx-aac-adts" },
-        { "avi",     "video/x-msvideo" },
-        { "bmp",     "image/bmp" },
-        { "bz2",     "application/x-bzip2" },
-        { "c",       "text/x-c" },
-        { "conf",    "text/plain" },
-        { "css",     "text/css" },
-        { "csv",     "text/csv" },
-        { "deb",     "application/x-debian-package" },
-        { "doc",     "application/msword" },
-        { "flv",     "video/x-flv" },
-        { "gif",     "image/gif" },
-        { "gz",      "application/gzip" },
-        { "htm",     "text/html; charset=utf-8" },
-        { "html",    "text/html; charset=utf-8" },
-        { "java",    "text/plain" },
-        { "jar",     "application/jar" },
-        { "jpe",     "image/jpeg" },
-        { "jpeg",    "image/jpeg" },
-        { "jpg",     "image/jpeg" },
-        { "js",      "text/javascript" },
-        { "json",    "application/json" },
-        { "jsp",     "text/html; charset=utf-8" },
-        { "m3u",     "audio/x-mpegurl" },
-        { "mid",     "audio/midi" },
-        { "midi",    "audio/midi" },
-        { "mjs",     "text/javascript" },
-        { "mov",     "video/quicktime" },
-        { "mp2",     "audio/mpeg" },
-        { "mp3",     "audio/mpeg" },
-        { "mp4",     "video/mp4" },
-        { "mpe",     "video/mpeg" },
-        { "mpeg",    "video/mpeg" },
-        { "mpg",     "video/mpeg" },
-        { "ogg",     "video/ogg" },
-        { "pdf",     "application/pdf" },
-        { "png",     "image/png" },
-        { "ppt",     "application/vnd.ms-powerpoint" },
-        { "ps",      "application/postscript" },
-        { "qt",      "video/quicktime" },
-        { "ra",      "audio/x-realaudio" },
-        { "ram",     "audio/x-pn-realaudio" },
-        { "rtf",     "text/rtf" },
-        { "sh",      "text/plain; charset=utf-8" },
-        { "sql",     "application/sql" },
-        { "svg",     "image/svg+xml" },
-        { "svgz",    "image/svg+xml" },
-        { "tar",     "application/x-tar" },
-        { "tif",     "image/tiff" },
-        { "tiff",    "image/tiff" },
-        { "tsv",     "text/tab-separated-values; charset=utf-8" },
-        { "txt",     "text/plain; charset=utf-8" },
-        { "wasm",    "application/wasm" },
-        { "wav",     "audio/x-wav" },
-        { "wma",     "audio/x-ms-wma" },
-        { "wmv",     "video/x-ms-wmv" },
-        { "wmx",     "video/x-ms-wmx" },
-        { "xls",     "application/vnd.ms-excel" },
-        { "xml",     "text/xml; charset=utf-8" },
-        { "xpm",     "image/x-xpmi" },
-        { "xsl",     "text/xml; charset=utf-8" },
-        { "zip",     "application/zip" }
-    };
     const char *ext, *res = NULL;
-    int i;
+    const ContentTypeEnt *ent;
 
     if( (ext = strrchr(fname, '/')) == NULL )
         ext = fname;
     if( (ext = strrchr(ext, '.')) == NULL || ext == fname || ext[-1] == '/' )
         ext = ".txt";
     ++ext;
-    for(i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]) &&
-            res == NULL; ++i)
-    {
-        if( !strcasecmp(ext, mime_types[i].ext) )
-            res = mime_types[i].mime;
-    }
-    if( res == NULL )
+    if( (ent = findType(ext)) != NULL && ent->ext != NULL )
+        res = ent->mime;
+    else if( (res = getBuiltinType(ext)) == NULL )
         res = "application/octet-stream";
     return res;
 }
-
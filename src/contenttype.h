@@ -1,8 +1,33 @@
 #ifndef CONTENTTYPE_H
 #define CONTENTTYPE_H
 
+#include "datachunk.h"
+
+
+/* Loads content types from file in mime.types format: each line contains
+ * MIME type followed by file name extensions.
+ * Types already set by cttype_setType() are not changed. Also built-in types
+ * having parameters (e.g. charset) are preferred over the loaded ones.
+ * Returns false when the file cannot be read.
+ */
+bool cttype_loadMimeTypes(const char *fileName);
+
+
+/* Sets MIME type for the file name extension, overriding types loaded
+ * from mime.types file and the built-in ones.
+ */
+void cttype_setType(const char *mimeType, const DataChunk *ext);
+
+
+/* Removes all types set by cttype_setType() and loaded by
+ * cttype_loadMimeTypes().
+ */
+void cttype_clear(void);
+
 
 /* Returns possible MIME media type in file based on the file extension.
+ * The extension is looked up in types set by cttype_setType(), loaded
+ * by cttype_loadMimeTypes(), then in the built-in types.
  */
 const char *cttype_getContentTypeByFileExt(const char *fileName);
 
@@ -24,6 +24,24 @@ DataHeader *datahdr_new(void)
     return hdr;
 }
 
+DataHeader *datahdr_dup(const DataHeader *hdr)
+{
+    DataHeader *dup = malloc(sizeof(DataHeader));
+    unsigned i, lineLen;
+
+    dup->lines = malloc((hdr->lineCount + 1) * sizeof(char*));
+    for(i = 0; i < hdr->lineCount; ++i) {
+        /* the line contains name and value separated by '\0' */
+        lineLen = strlen(hdr->lines[i]) + 1;
+        lineLen += strlen(hdr->lines[i] + lineLen) + 1;
+        dup->lines[i] = malloc(lineLen);
+        memcpy(dup->lines[i], hdr->lines[i], lineLen);
+    }
+    dup->lines[hdr->lineCount] = strdup("");
+    dup->lineCount = hdr->lineCount;
+    return dup;
+}
+
 bool datahdr_getHeaderLineAt(const DataHeader *hdr, unsigned idx,
         const char **nameBuf, const char **valueBuf)
 {
@@ -22,6 +22,11 @@ int datahdr_appendData(DataHeader*, const char *data, unsigned len,
         const char *debugMsgLoc);
 
 
+/* Returns a copy of complete header.
+ */
+DataHeader *datahdr_dup(const DataHeader*);
+
+
 /* If the idx exceeds the size of header array, returns false.
  * Otherwise stores in nameBuf and valueBuf the header name and value
  * and returns true.
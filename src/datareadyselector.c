@@ -4,12 +4,16 @@
 #include <sys/select.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <errno.h>
 
 
 struct DataReadySelector {
     fd_set readFds;
     fd_set writeFds;
     int numFds;
+    fd_set readyReadFds;    /* result of the last pselect() */
+    fd_set readyWriteFds;
+    int numReadyFds;
 };
 
 
@@ -20,6 +24,9 @@ DataReadySelector *drs_new(void)
     FD_ZERO(&drs->readFds);
     FD_ZERO(&drs->writeFds);
     drs->numFds = 0;
+    FD_ZERO(&drs->readyReadFds);
+    FD_ZERO(&drs->readyWriteFds);
+    drs->numReadyFds = 0;
     return drs;
 }
 
@@ -37,15 +44,34 @@ void drs_setWriteFd(DataReadySelector *drs, int fd)
         drs->numFds = fd + 1;
 }
 
-void drs_select(DataReadySelector *drs)
+void drs_select(DataReadySelector *drs, const sigset_t *sigMask)
 {
-    if( select(drs->numFds, &drs->readFds, &drs->writeFds, NULL, NULL) < 0 )
+    if( pselect(drs->numFds, &drs->readFds, &drs->writeFds, NULL, NULL,
+                sigMask) >= 0 )
+    {
+        drs->readyReadFds = drs->readFds;
+        drs->readyWriteFds = drs->writeFds;
+        drs->numReadyFds = drs->numFds;
+    }else if( errno == EINTR ) {
+        /* interrupted by signal; nothing is ready */
+        drs->numReadyFds = 0;
+    }else
         log_fatal("select");
     FD_ZERO(&drs->readFds);
     FD_ZERO(&drs->writeFds);
     drs->numFds = 0;
 }
 
+bool drs_isReadReady(const DataReadySelector *drs, int fd)
+{
+    return fd < drs->numReadyFds && FD_ISSET(fd, &drs->readyReadFds);
+}
+
+bool drs_isWriteReady(const DataReadySelector *drs, int fd)
+{
+    return fd < drs->numReadyFds && FD_ISSET(fd, &drs->readyWriteFds);
+}
+
 void drs_free(DataReadySelector *drs)
 {
     free(drs);
@@ -1,6 +1,8 @@
 #ifndef DATAREADYSELECTOR_H
 #define DATAREADYSELECTOR_H
 
+#include <signal.h>
+
 
 typedef struct DataReadySelector DataReadySelector;
 
@@ -14,10 +16,18 @@ void drs_setReadFd(DataReadySelector*, int fd);
 void drs_setWriteFd(DataReadySelector*, int fd);
 
 
-/* Invokes select() with file descriptors set since previous call
- * of the drs_select
+/* Invokes pselect() with file descriptors set since previous call
+ * of the drs_select. The sigMask is the signal mask set while waiting.
+ * When interrupted by a signal, no file descriptor is reported ready.
+ */
+void drs_select(DataReadySelector*, const sigset_t *sigMask);
+
+
+/* Return true when the file descriptor was reported ready for read
+ * (write, respectively) by the last drs_select() call.
  */
-void drs_select(DataReadySelector*);
+bool drs_isReadReady(const DataReadySelector*, int fd);
+bool drs_isWriteReady(const DataReadySelector*, int fd);
 
 
 void drs_free(DataReadySelector*);
@@ -0,0 +1,446 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdbool.h>
+#include "fcgiclient.h"
+#include "cgicommon.h"
+#include "dataheader.h"
+#include "membuf.h"
+#include "fmlog.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
+
+/* FastCGI protocol constants; see FastCGI Specification.
+ */
+enum {
+    FCGI_VERSION_1      = 1,
+
+    /* record types */
+    FCGI_BEGIN_REQUEST  = 1,
+    FCGI_END_REQUEST    = 3,
+    FCGI_PARAMS         = 4,
+    FCGI_STDIN          = 5,
+    FCGI_STDOUT         = 6,
+    FCGI_STDERR         = 7,
+
+    FCGI_RESPONDER      = 1,    /* role */
+    FCGI_KEEP_CONN      = 1,    /* flag */
+
+    FCGI_HEADER_LEN     = 8,
+    FCGI_CONTENT_MAX    = 65535,
+    FCGI_RECORD_MAX     = FCGI_HEADER_LEN + FCGI_CONTENT_MAX + 255,
+
+    /* only one request at a time is sent over connection */
+    FCGI_REQUEST_ID     = 1
+};
+
+/* Maximum number of idle connections kept open to an application.
+ */
+enum { IDLE_CONN_MAX = 8 };
+
+/* Size of response body piece passed at once to response sender.
+ */
+enum { BODY_PIECE_SIZE = 65536 };
+
+/* FastCGI application, with its idle connections.
+ */
+typedef struct FcgiApp {
+    char *address;                  /* as specified in configuration */
+    struct sockaddr_storage sockAddr;
+    socklen_t sockAddrLen;          /* 0 when address is not resolved */
+    int idleFds[IDLE_CONN_MAX];
+    unsigned idleCount;
+    struct FcgiApp *next;
+} FcgiApp;
+
+static FcgiApp *gApps;
+
+struct FcgiRequest {
+    FcgiApp *app;
+    int fd;                 /* connection; -1 when failed */
+    bool onlyHead;
+    MemBuf *out;            /* records to send */
+    unsigned outOffset;     /* index of first unsent byte in out */
+    char *inBuf;            /* received data, FCGI_RECORD_MAX bytes */
+    unsigned inLen;
+    unsigned inOffset;      /* index of first unprocessed byte in inBuf */
+    DataHeader *respHeader;
+    bool isEnded;           /* FCGI_END_REQUEST received */
+};
+
+static bool resolveAddress(FcgiApp *app)
+{
+    struct sockaddr_un *sun;
+    struct addrinfo hints, *ai;
+    char *host, *port;
+    int res;
+
+    if( app->address[0] == '/' ) {
+        sun = (struct sockaddr_un*)&app->sockAddr;
+        if( strlen(app->address) >= sizeof(sun->sun_path) ) {
+            log_warn("FastCGI socket path too long: %s", app->address);
+            return false;
+        }
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, app->address);
+        app->sockAddrLen = sizeof(struct sockaddr_un);
+        return true;
+    }
+    host = strdup(app->address);
+    if( (port = strrchr(host, ':')) == NULL ) {
+        log_warn("FastCGI address %s: missing port", app->address);
+        free(host);
+        return false;
+    }
+    *port++ = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if( (res = getaddrinfo(host, port, &hints, &ai)) == 0 ) {
+        memcpy(&app->sockAddr, ai->ai_addr, ai->ai_addrlen);
+        app->sockAddrLen = ai->ai_addrlen;
+        freeaddrinfo(ai);
+    }else
+        log_warn("FastCGI address %s: %s", app->address, gai_strerror(res));
+    free(host);
+    return res == 0;
+}
+
+static FcgiApp *getApp(const char *address)
+{
+    FcgiApp *app;
+
+    for(app = gApps; app != NULL; app = app->next) {
+        if( ! strcmp(app->address, address) )
+            return app;
+    }
+    app = calloc(1, sizeof(FcgiApp));
+    app->address = strdup(address);
+    app->next = gApps;
+    gApps = app;
+    return app;
+}
+
+/* Returns connection to the application: idle one or a new one, possibly
+ * not connected yet. Returns -1 on failure.
+ */
+static int connectApp(FcgiApp *app)
+{
+    int fd;
+    char c;
+
+    while( app->idleCount > 0 ) {
+        fd = app->idleFds[--app->idleCount];
+        /* the application might have closed the idle connection */
+        if( recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+                errno == EWOULDBLOCK )
+            return fd;
+        close(fd);
+    }
+    if( app->sockAddrLen == 0 && ! resolveAddress(app) )
+        return -1;
+    fd = socket(app->sockAddr.ss_family,
+            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if( fd < 0 ) {
+        log_error("FastCGI socket");
+        return -1;
+    }
+    if( connect(fd, (struct sockaddr*)&app->sockAddr, app->sockAddrLen) != 0
+            && errno != EINPROGRESS )
+    {
+        log_error("FastCGI connect %s", app->address);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void appendRecord(MemBuf *mb, unsigned type, const char *content,
+        unsigned contentLen)
+{
+    unsigned char *rec = (unsigned char*)mb_appendSpace(mb,
+            FCGI_HEADER_LEN + contentLen);
+
+    rec[0] = FCGI_VERSION_1;
+    rec[1] = type;
+    rec[2] = FCGI_REQUEST_ID >> 8;
+    rec[3] = FCGI_REQUEST_ID & 0xff;
+    rec[4] = contentLen >> 8;
+    rec[5] = contentLen & 0xff;
+    rec[6] = 0;     /* padding length */
+    rec[7] = 0;
+    memcpy(rec + FCGI_HEADER_LEN, content, contentLen);
+}
+
+static void appendParamLength(MemBuf *mb, unsigned len)
+{
+    unsigned char *buf;
+
+    if( len < 128 ) {
+        buf = (unsigned char*)mb_appendSpace(mb, 1);
+        buf[0] = len;
+    }else{
+        buf = (unsigned char*)mb_appendSpace(mb, 4);
+        buf[0] = len >> 24 | 0x80;
+        buf[1] = len >> 16;
+        buf[2] = len >> 8;
+        buf[3] = len;
+    }
+}
+
+/* CGI parameter consumer: appends the parameter as name-value pair.
+ */
+static void putParam(void *pvParams, const char *name, const char *value)
+{
+    MemBuf *params = pvParams;
+    unsigned nameLen = strlen(name), valueLen = strlen(value);
+
+    appendParamLength(params, nameLen);
+    appendParamLength(params, valueLen);
+    mb_appendData(params, name, nameLen);
+    mb_appendData(params, value, valueLen);
+}
+
+static void closeConnection(FcgiRequest *req)
+{
+    close(req->fd);
+    req->fd = -1;
+}
+
+/* Sends pending records. Returns false when some data remains to send.
+ * On error the connection is closed.
+ */
+static bool flushOutput(FcgiRequest *req)
+{
+    unsigned outLen = mb_dataLen(req->out);
+    int wr;
+
+    while( req->fd >= 0 && req->outOffset < outLen ) {
+        if( (wr = send(req->fd, mb_data(req->out) + req->outOffset,
+                        outLen - req->outOffset, MSG_NOSIGNAL)) < 0 )
+        {
+            if( errno == EWOULDBLOCK )
+                return false;
+            log_error("FastCGI %s: send", req->app->address);
+            closeConnection(req);
+        }else
+            req->outOffset += wr;
+    }
+    mb_resize(req->out, 0);
+    req->outOffset = 0;
+    return true;
+}
+
+FcgiRequest *fcgi_new(const RequestHeader *hdr, const char *appAddress,
+        const char *peerAddr, const char *scriptName, const char *pathInfo,
+        const char *scriptFileName)
+{
+    FcgiRequest *req = malloc(sizeof(FcgiRequest));
+    static const char beginRequestBody[8] = {
+        FCGI_RESPONDER >> 8, FCGI_RESPONDER & 0xff, FCGI_KEEP_CONN
+    };
+    MemBuf *params;
+    unsigned offset, len;
+
+    log_debug("FastCGI %s, SCRIPT_NAME=%s, PATH_INFO=%s", appAddress,
+            scriptName, pathInfo == NULL ? "" : pathInfo);
+    req->app = getApp(appAddress);
+    req->fd = connectApp(req->app);
+    req->onlyHead = !strcmp(reqhdr_getMethod(hdr), "HEAD");
+    req->out = mb_new();
+    req->outOffset = 0;
+    req->inBuf = malloc(FCGI_RECORD_MAX);
+    req->inLen = 0;
+    req->inOffset = 0;
+    req->respHeader = datahdr_new();
+    req->isEnded = false;
+    if( req->fd >= 0 ) {
+        appendRecord(req->out, FCGI_BEGIN_REQUEST, beginRequestBody,
+                sizeof(beginRequestBody));
+        params = mb_new();
+        cgicmn_collectServerParams(putParam, params);
+        cgicmn_collectParams(hdr, peerAddr, scriptName, pathInfo,
+                scriptFileName, putParam, params);
+        for(offset = 0; offset < mb_dataLen(params); offset += len) {
+            len = mb_dataLen(params) - offset;
+            if( len > FCGI_CONTENT_MAX )
+                len = FCGI_CONTENT_MAX;
+            appendRecord(req->out, FCGI_PARAMS, mb_data(params) + offset,
+                    len);
+        }
+        mb_free(params);
+        appendRecord(req->out, FCGI_PARAMS, NULL, 0);
+        flushOutput(req);
+    }
+    return req;
+}
+
+unsigned fcgi_processData(FcgiRequest *req, const char *data, unsigned len,
+        DataProcessingResult *dpr)
+{
+    unsigned processed = 0, recLen;
+
+    while( processed < len ) {
+        /* at most one record is kept unsent */
+        if( ! flushOutput(req) ) {
+            dpr_setReqState(dpr, DPR_AWAIT_WRITE, req->fd);
+            return processed;
+        }
+        if( req->fd < 0 )   /* body is discarded */
+            return len;
+        recLen = len - processed;
+        if( recLen > FCGI_CONTENT_MAX )
+            recLen = FCGI_CONTENT_MAX;
+        appendRecord(req->out, FCGI_STDIN, data + processed, recLen);
+        processed += recLen;
+    }
+    flushOutput(req);
+    return len;
+}
+
+void fcgi_requestReadCompleted(FcgiRequest *req)
+{
+    if( req->fd >= 0 ) {
+        appendRecord(req->out, FCGI_STDIN, NULL, 0);
+        flushOutput(req);
+    }
+}
+
+/* Returns contents of next FCGI_STDOUT record received. Other records
+ * are processed on the way. Returns NULL when no more data is available:
+ * the request has ended, the connection failed or the data did not
+ * arrive yet. The returned data is valid until next call.
+ */
+static const char *getStdout(FcgiRequest *req, unsigned *len)
+{
+    const unsigned char *rec;
+    unsigned avail, contentLen, recLen;
+    int rd;
+
+    while( true ) {
+        rec = (const unsigned char*)req->inBuf + req->inOffset;
+        avail = req->inLen - req->inOffset;
+        if( avail >= FCGI_HEADER_LEN ) {
+            contentLen = rec[4] << 8 | rec[5];
+            recLen = FCGI_HEADER_LEN + contentLen + rec[6];
+            if( avail >= recLen ) {
+                req->inOffset += recLen;
+                switch( rec[1] ) {
+                case FCGI_STDOUT:
+                    if( contentLen > 0 ) {
+                        *len = contentLen;
+                        return (const char*)rec + FCGI_HEADER_LEN;
+                    }
+                    break;
+                case FCGI_STDERR:
+                    log_warn("FastCGI %s: %.*s", req->app->address,
+                            contentLen, rec + FCGI_HEADER_LEN);
+                    break;
+                case FCGI_END_REQUEST:
+                    req->isEnded = true;
+                    return NULL;
+                default:
+                    break;
+                }
+                continue;
+            }
+        }
+        if( req->isEnded || req->fd < 0 )
+            return NULL;
+        memmove(req->inBuf, rec, avail);
+        req->inOffset = 0;
+        req->inLen = avail;
+        if( (rd = read(req->fd, req->inBuf + req->inLen,
+                        FCGI_RECORD_MAX - req->inLen)) > 0 )
+        {
+            req->inLen += rd;
+        }else{
+            if( rd == 0 || errno != EWOULDBLOCK ) {
+                log_error("FastCGI %s: connection closed", req->app->address);
+                closeConnection(req);
+            }
+            return NULL;
+        }
+    }
+}
+
+/* Response body producer: passes the application output.
+ */
+static bool produceBody(RespBuf *resp, void *pvReq, int *awaitFd)
+{
+    FcgiRequest *req = pvReq;
+    const char *data;
+    unsigned len, total = 0;
+
+    while( total < BODY_PIECE_SIZE && (data = getStdout(req, &len)) != NULL ) {
+        resp_appendData(resp, data, len);
+        total += len;
+    }
+    if( total == 0 ) {
+        if( req->isEnded || req->fd < 0 )
+            return false;
+        *awaitFd = req->fd;
+    }
+    return true;
+}
+
+RespBuf *fcgi_getResponse(FcgiRequest *req, DataProcessingResult *dpr)
+{
+    RespBuf *resp;
+    const char *data;
+    unsigned len;
+    int offset = -1;
+
+    if( ! flushOutput(req) ) {
+        dpr_setRespState(dpr, DPR_AWAIT_WRITE, req->fd);
+        return NULL;
+    }
+    while( offset < 0 && (data = getStdout(req, &len)) != NULL ) {
+        offset = datahdr_appendData(req->respHeader, data, len,
+                "FastCGI response");
+    }
+    if( offset >= 0 ) {
+        resp = cgicmn_newResponse(req->respHeader, req->onlyHead);
+        resp_appendData(resp, data + offset, len - offset);
+        if( ! req->onlyHead )
+            resp_setBodyProducer(resp, produceBody, req, NULL);
+    }else if( req->isEnded || req->fd < 0 ) {
+        resp = resp_new("502 Bad Gateway", req->onlyHead);
+        resp_appendHeader(resp, "Content-Type", "text/html");
+        resp_appendStr(resp, "<!DOCTYPE html><html><head>\n"
+                "<title>Bad Gateway</title>\n</head>\n"
+                "<body><h3>Bad Gateway</h3>\n"
+                "No valid response from FastCGI application\n"
+                "</body></html>");
+    }else{
+        dpr_setRespState(dpr, DPR_AWAIT_READ, req->fd);
+        resp = NULL;
+    }
+    return resp;
+}
+
+void fcgi_free(FcgiRequest *req)
+{
+    FcgiApp *app;
+
+    if( req != NULL ) {
+        app = req->app;
+        if( req->fd >= 0 ) {
+            if( req->isEnded && req->inOffset == req->inLen &&
+                    mb_dataLen(req->out) == 0 && app->idleCount < IDLE_CONN_MAX )
+                app->idleFds[app->idleCount++] = req->fd;
+            else
+                close(req->fd);
+        }
+        mb_free(req->out);
+        free(req->inBuf);
+        datahdr_free(req->respHeader);
+        free(req);
+    }
+}
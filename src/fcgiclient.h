@@ -0,0 +1,56 @@
+#ifndef FCGICLIENT_H
+#define FCGICLIENT_H
+
+#include "requestheader.h"
+#include "respbuf.h"
+#include "dataprocessingresult.h"
+
+
+/* A request to FastCGI application.
+ */
+typedef struct FcgiRequest FcgiRequest;
+
+
+/* Starts a request to FastCGI application. Connection to the application
+ * is taken from the pool of idle ones or a new one is opened.
+ * Parameters:
+ *      appAddress      - application socket address: Unix domain socket
+ *                        path or host:port
+ *      peerAddr        - $REMOTE_ADDR value
+ *      scriptName      - $SCRIPT_NAME value
+ *      pathInfo        - $PATH_INFO value
+ *      scriptFileName  - $SCRIPT_FILENAME value; may be NULL
+ */
+FcgiRequest *fcgi_new(const RequestHeader*, const char *appAddress,
+        const char *peerAddr, const char *scriptName, const char *pathInfo,
+        const char *scriptFileName);
+
+
+/* Passes a piece of request body to the application.
+ * Returns number of bytes processed. If less than len, the
+ * DataProcessingResult is set with file descriptor needed to wait
+ * for I/O ready for processing more data.
+ */
+unsigned fcgi_processData(FcgiRequest*, const char *data, unsigned len,
+        DataProcessingResult*);
+
+
+/* Signals the application end of request body.
+ */
+void fcgi_requestReadCompleted(FcgiRequest*);
+
+
+/* Returns response if available. If not yet, sets appropriate fd in
+ * DataProcessingResult and returns NULL.
+ * The response body is received from the application while the response
+ * is being sent. The FcgiRequest shall not be freed before the response.
+ */
+RespBuf *fcgi_getResponse(FcgiRequest*, DataProcessingResult*);
+
+
+/* Ends use of FcgiRequest. When the request has been completed,
+ * the connection is kept open for reuse.
+ */
+void fcgi_free(FcgiRequest*);
+
+#endif /* FCGICLIENT_H */
@@ -1,3 +1,6 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdbool.h>
 #include "filemanager.h"
 #include "fmconfig.h"
@@ -5,7 +8,9 @@
 #include "folder.h"
 #include "auth.h"
 #include "fmlog.h"
+#include "fmassets.h"
 #include "multipartdata.h"
+#include "pathcache.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,164 +24,13 @@
 
 struct FileManager {
     char *sysPath;
+    int dirFd;              /* descriptor of sysPath; -1 if sysPath is NULL */
+    struct stat dirStat;    /* sysPath status */
+    char *urlPath;
     MultipartData *body;
     char *opErrorMsg;
 };
 
-static char *format_path(const char *rootdir, const char *subdir)
-{
-    char *res;
-    int rootdir_len, subdir_len;
-
-    rootdir_len = strlen(rootdir);
-    subdir_len = strlen(subdir);
-    res = malloc( rootdir_len + subdir_len + 2 );
-    memcpy(res, rootdir, rootdir_len);
-    if( res[rootdir_len-1] != '/' )
-        res[rootdir_len++] = '/';
-    if( subdir[0] == '/' ) {
-        ++subdir;
-        --subdir_len;
-    }
-    memcpy(res + rootdir_len, subdir, subdir_len + 1);
-    return res;
-}
-
-static const char response_header[] =
-    "<script>\n"
-    "function showOptions(th) {\n"
-    "    th.parentNode.nextElementSibling.style.display = \"table-row\";\n"
-    "    th.firstElementChild.innerHTML = \"&minus;\";\n"
-    "    th.onclick = function() { hideOptions(th); };\n"
-    "}\n"
-    "function hideOptions(th) {\n"
-    "    th.parentNode.nextElementSibling.style.display = \"none\";\n"
-    "    th.firstElementChild.textContent = \"+\";\n"
-    "    th.onclick = function() { showOptions(th); };\n"
-    "}\n"
-    "function showHideHidden(th) {\n"
-    "    var rows = document.getElementsByTagName('tr');\n"
-    "    for(var i = 0; i < rows.length; ++i) {\n"
-    "        var row = rows.item(i);\n"
-    "        if( row.getAttribute('class') == 'rhidden' ) {\n"
-    "            row.style.display = th.checked ? 'table-row' : 'none';\n"
-    "        }\n"
-    "    }\n"
-    "}\n"
-    "function checkRename(th) {\n"
-    "    var res = false;\n"
-    "    var fname = th.form.elements.namedItem('new_name').value;\n"
-    "    if( fname === '' ) {\n"
-    "        alert('please specify the file name');\n"
-    "    }else if( fname.indexOf('/') >= 0 ) {\n"
-    "        alert('slash in name disallowed');\n"
-    "    }else\n"
-    "        res = true;\n"
-    "    return res;\n"
-    "}\n"
-    "function confirmUpload(th) {\n"
-    "    var fname = th.form.elements.namedItem('file').value;\n"
-    "    var repl = th.form.elements.namedItem('new_cont').value;\n"
-    "    if( repl == '' ) {\n"
-    "        alert('please choose a file');\n"
-    "        return false;\n"
-    "    }\n"
-    "    repl = repl.replace(/.*[\\/\\\\]/, '');\n"
-    "    repl = repl == fname ? '' : ' using \"' + repl + '\"';\n"
-    "    return confirm('replace \"' + fname+ '\"' + repl + ' ?');\n"
-    "}\n"
-    "function confirmDel(th) {\n"
-    "    var fname = th.form.elements.namedItem('file').value;\n"
-    "    var recu = th.form.elements.namedItem('del_recursive');\n"
-    "    recu = recu != null && recu.checked ? ' recursively' : '';\n"
-    "    return confirm('delete' + recu + ' \"' + fname + '\" ?');\n"
-    "}\n"
-    "function checkCreateDir(th) {\n"
-    "    var res = false;\n"
-    "    var dname = th.form.elements.namedItem('new_dir').value;\n"
-    "    if( dname === '' ) {\n"
-    "        alert('please specify the directory name');\n"
-    "    }else if( dname.indexOf('/') >= 0 ) {\n"
-    "        alert('slash in name disallowed');\n"
-    "    }else\n"
-    "        res = true;\n"
-    "    return res;\n"
-    "}\n"
-    "function checkAddFile(th) {\n"
-    "    if( th.form.elements.namedItem('file').value == '' ) {\n"
-    "        alert('please choose a file');\n"
-    "        return false;\n"
-    "    }\n"
-    "    return true;\n"
-    "}\n"
-    "</script>\n"
-    "<style>\n"
-    "body { background-color: #F2FAFC; }\n"
-    "div.errormsg {\n"
-    "   font-size: large;\n"
-    "   text-align: center;\n"
-    "   background-color: gold;\n"
-    "   padding: 2px;\n"
-    "   margin-top: 4px;\n"
-    "}\n"
-    "span.plusdir {\n"
-    "    font-family: monospace;\n"
-    "    font-weight: bold;\n"
-    "    background-color: #D31D41;\n"
-    "    color: white;\n"
-    "    padding: 0px 3px;\n"
-    "    cursor: default;\n"
-    "}\n"
-    "span.plusgray {\n"
-    "    font-family: monospace;\n"
-    "    font-weight: bold;\n"
-    "    background-color: #d8d8d8;\n"
-    "    color: white;\n"
-    "    padding: 0px 3px;\n"
-    "    cursor: default;\n"
-    "}\n"
-    "span.pluscgi {\n"
-    "    font-family: monospace;\n"
-    "    font-weight: bold;\n"
-    "    background-color: #E3B81F;\n"
-    "    color: white;\n"
-    "    padding: 0px 3px;\n"
-    "    cursor: default;\n"
-    "}\n"
-    "span.plusfile {\n"
-    "    font-family: monospace;\n"
-    "    font-weight: bold;\n"
-    "    background-color: #bbdb1e;\n"
-    "    color: white;\n"
-    "    padding: 0px 3px;\n"
-    "    cursor: default;\n"
-    "}\n"
-    "tbody.folder > tr > td {\n"
-    "    border-color: #ded4f2;\n"
-    "    border-width: 1px;\n"
-    "    border-bottom-style: solid;\n"
-    "}\n"
-    "table.fattr {\n"
-    "    border-collapse: collapse;\n"
-    "}\n"
-    "table.fattr td {\n"
-    "    background: #e0f0f9;\n"
-    "    padding: 3px 6px;\n"
-    "}\n"
-    "table.fattr input[type='submit'] {\n"
-    "    width: 100%;\n"
-    "}\n"
-    "table.fattr input[name='new_name'] {\n"
-    "    width: 20em;\n"
-    "}\n"
-    "table.diracns td {\n"
-    "    padding: 2px 4px;\n"
-    "}\n"
-    "table.diracns input {\n"
-    "    width: 100%;\n"
-    "}\n"
-    "</style>\n";
-
 static const char response_login_button[] =
     "<form style='display: inline' method=\"POST\" "
     "enctype=\"multipart/form-data\">\n"
@@ -268,80 +122,82 @@ static MemBuf *add_new_file(ContentPart *partFile)
     return res;
 }
 
-static MemBuf *rename_file(const char *sysPath, const char *oldName,
+/* Returns true when name is a single path component, i.e. a name of entry
+ * within the folder.
+ */
+static bool isEntryName(const char *name)
+{
+    return name[0] != '\0' && strchr(name, '/') == NULL &&
+        strcmp(name, ".") && strcmp(name, "..");
+}
+
+static MemBuf *rename_file(int dirFd, const char *oldName,
         const char *newDir, const char *newName)
 {
-    char *oldpath, *newUrlPath, *newSysPath;
+    int newDirFd;
     MemBuf *res = NULL;
 
-    if( oldName == NULL || oldName[0] == '\0' || newDir == NULL || 
+    if( oldName == NULL || ! isEntryName(oldName) || newDir == NULL ||
             newDir[0] != '/' || newName == NULL || newName[0] == '\0' ) {
         res = fmtError(0, "rename: bad parameters", NULL);
-    }else if( strchr(newName, '/') != NULL ) {
+    }else if( ! isEntryName(newName) ) {
         res = fmtError(0, "rename: slash in name disallowed", NULL);
     }else{
-        oldpath = format_path(sysPath, oldName);
-        newUrlPath = format_path(newDir, newName);
-        newSysPath = config_getSysPathForUrlPath(newUrlPath);
-        log_debug("rename_file: %s -> %s", oldpath, newSysPath);
-        if( rename(oldpath, newSysPath) != 0 ) {
+        log_debug("rename_file: %s -> %s%s%s", oldName, newDir,
+                newDir[strlen(newDir)-1] == '/' ? "" : "/", newName);
+        newDirFd = config_openUrlPath(newDir, O_PATH | O_DIRECTORY);
+        if( newDirFd < 0 || renameat(dirFd, oldName, newDirFd, newName) != 0 )
             res = fmtError(errno, oldName, " rename failed", NULL);
-        }
-        free(oldpath);
-        free(newSysPath);
-        free(newUrlPath);
+        if( newDirFd >= 0 )
+            close(newDirFd);
     }
     return res;
 }
 
-static MemBuf *create_newdir(const char *sysPath, const char *newDir)
+static MemBuf *create_newdir(int dirFd, const char *newDir)
 {
-    char *path;
     MemBuf *res = NULL;
 
     if( newDir == NULL || newDir[0] == '\0' ) {
         res = fmtError(0, "create dir: bad parameters", NULL);
-    }else if( strchr(newDir, '/') != NULL ) {
+    }else if( ! isEntryName(newDir) ) {
         res = fmtError(0, "create dir: slash in name disallowed", NULL);
     }else{
-        path = format_path(sysPath, newDir);
-        log_debug("create dir: %s", path);
-        if( mkdir(path, S_IRWXU|S_IRWXG|S_IRWXO) != 0 ) {
+        log_debug("create dir: %s", newDir);
+        if( mkdirat(dirFd, newDir, S_IRWXU|S_IRWXG|S_IRWXO) != 0 ) {
             res = fmtError(errno, "unable to create directory \"", newDir,
                     "\"", NULL);
         }
-        free(path);
     }
     return res;
 }
 
-static int del_recursive(const char *path, int *sysErrNo)
+static int del_recursive(int dirFd, const char *name, int *sysErrNo)
 {
-    int res = 0, dirNameLen;
+    int res = 0, fd;
     DIR *d;
     struct dirent *dp;
 
-    log_debug("del_recursive: removing %s", path);
-    if( unlink(path) != 0 ) {
+    log_debug("del_recursive: removing %s", name);
+    if( unlinkat(dirFd, name, 0) != 0 ) {
         if( errno == EISDIR ) {
-            if( (d = opendir(path)) != NULL ) {
-                MemBuf *filePathName = mb_newWithStr(path);
-                mb_ensureEndsWithSlash(filePathName);
-                dirNameLen = mb_dataLen(filePathName);
+            fd = openat(dirFd, name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if( fd >= 0 && (d = fdopendir(fd)) != NULL ) {
                 while( res == 0 && (dp = readdir(d)) != NULL ) {
                     if( strcmp(dp->d_name, ".") && strcmp(dp->d_name, "..")) {
-                        mb_setStrEnd(filePathName, dirNameLen, dp->d_name);
-                        res = del_recursive(mb_data(filePathName), sysErrNo);
+                        res = del_recursive(dirfd(d), dp->d_name, sysErrNo);
                     }
                 }
                 closedir(d);
-                mb_free(filePathName);
                 if( res == 0 ) {
-                    res = rmdir(path);
+                    res = unlinkat(dirFd, name, AT_REMOVEDIR);
                     *sysErrNo = errno;
                 }
             }else{
                 *sysErrNo = errno;
+                if( fd >= 0 )
+                    close(fd);
                 res = -1;
             }
         }else{
@@ -352,58 +208,53 @@ static int del_recursive(const char *path, int *sysErrNo)
     return res;
 }
 
-static MemBuf *delete_file(const char *sysPath, const char *fname,
-        bool recursively)
+static MemBuf *delete_file(int dirFd, const char *fname, bool recursively)
 {
-    char *path;
     MemBuf *res = NULL;
     int opRes, sysErrNo;
 
-    if( fname == NULL || fname[0] == '\0' ) {
+    if( fname == NULL || ! isEntryName(fname) ) {
         res = fmtError(0, "delete: bad parameters", NULL);
     }else{
-        path = format_path(sysPath, fname);
         if( recursively ) {
-            log_debug("delete recursively: %s", path);
-            opRes = del_recursive(path, &sysErrNo);
+            log_debug("delete recursively: %s", fname);
+            opRes = del_recursive(dirFd, fname, &sysErrNo);
         }else{
-            log_debug("delete: %s", path);
-            if( (opRes = unlink(path)) != 0 && errno == EISDIR )
-                opRes = rmdir(path);
+            log_debug("delete: %s", fname);
+            if( (opRes = unlinkat(dirFd, fname, 0)) != 0 && errno == EISDIR )
+                opRes = unlinkat(dirFd, fname, AT_REMOVEDIR);
             sysErrNo = errno;
         }
         if( opRes != 0 )
             res = fmtError(sysErrNo, fname, " delete failed", NULL);
-        free(path);
     }
     return res;
 }
 
-static MemBuf *replace_file(const char *sysPath, const char *fname,
-        ContentPart *partFile)
+static MemBuf *replace_file(const char *fname, ContentPart *partFile)
 {
     MemBuf *res = NULL;
     const char *tmpPath = cpart_getFilePathName(partFile);
     int sysErrNo;
 
-    if( fname != NULL && tmpPath != NULL ) {
-        char *filePath = format_path(sysPath, fname);
-        if( ! cpart_finishUpload(partFile, filePath, true, &sysErrNo) )
+    if( fname != NULL && isEntryName(fname) && tmpPath != NULL ) {
+        if( ! cpart_finishUpload(partFile, fname, true, &sysErrNo) )
             res = fmtError(sysErrNo, "unable to store ", fname, NULL);
-        free(filePath);
     }else
         res = fmtError(0, "unable to replace: no file chosen", NULL);
     return res;
 }
 
-static MemBuf *chmod_file(const char *sysPath, const char *fname,
+static MemBuf *chmod_file(const char *urlPath, const char *fname,
         const char *puser, const char *pgroup, const char *pothers)
 {
-    char *path;
     const char *perm[PERM_GROUP_COUNT] = { puser, pgroup, pothers };
-    MemBuf *res = NULL;
+    MemBuf *res = NULL, *path;
+    char procPath[40];
     unsigned i, j, mode = 0;
-    bool isValidParam = fname && puser && pgroup && pothers;
+    bool isValidParam = fname && isEntryName(fname) && puser && pgroup &&
+        pothers;
+    int fd;
 
     if( isValidParam ) {
         for( i = 0; i < PERM_GROUP_COUNT && isValidParam; ++i) {
@@ -416,13 +267,21 @@ static MemBuf *chmod_file(const char *sysPath, const char *fname,
                 isValidParam = false;
         }
         if( isValidParam ) {
-            path = format_path(sysPath, fname);
+            path = mb_newWithStr(urlPath);
+            mb_ensureEndsWithSlash(path);
+            mb_appendStr(path, fname);
             log_debug("change mode to 0%o (%s%s%s) of %s",
-                    mode, puser, pgroup, pothers, path);
-            if( chmod(path, mode) != 0 )
+                    mode, puser, pgroup, pothers, mb_data(path));
+            /* a symbolic link may lead to other place within the share;
+             * the O_PATH descriptor pins the resolved file */
+            if( (fd = config_openUrlPath(mb_data(path), O_PATH)) >= 0 )
+                sprintf(procPath, "/proc/self/fd/%d", fd);
+            if( fd < 0 || chmod(procPath, mode) != 0 )
                 res = fmtError(errno, "change permissions of ", fname,
                         " failed", NULL);
-            free(path);
+            if( fd >= 0 )
+                close(fd);
+            mb_free(path);
         }
     }
     if( ! isValidParam )
@@ -456,28 +315,30 @@ enum PostingResult filemgr_processPost(FileManager *filemgr,
             if( mpdata_containsPartWithName(filemgr->body, "do_add") ) {
                 opErr = add_new_file(file_part);
             }else if(mpdata_containsPartWithName(filemgr->body, "do_rename")) {
-                opErr = rename_file(filemgr->sysPath,
+                opErr = rename_file(filemgr->dirFd,
                         cpart_getDataStr(file_part),
                         cpart_getDataStr(newdir_part), 
                         cpart_getDataStr(newname_part));
             }else if(mpdata_containsPartWithName(filemgr->body, "do_newdir")) {
-                opErr = create_newdir(filemgr->sysPath,
+                opErr = create_newdir(filemgr->dirFd,
                         cpart_getDataStr(newdir_part));
             }else if(mpdata_containsPartWithName(filemgr->body, "do_replace")) {
-                opErr = replace_file(filemgr->sysPath,
-                        cpart_getDataStr(file_part), newcont_part);
+                opErr = replace_file(cpart_getDataStr(file_part),
+                        newcont_part);
             }else if(mpdata_containsPartWithName(filemgr->body, "do_delete")) {
-                opErr = delete_file(filemgr->sysPath,
+                opErr = delete_file(filemgr->dirFd,
                         cpart_getDataStr(file_part),
                         mpdata_getPartByName(filemgr->body,
                             "del_recursive") != NULL);
             }else if(mpdata_containsPartWithName(filemgr->body, "do_perm")) {
-                opErr = chmod_file(filemgr->sysPath,
+                opErr = chmod_file(filemgr->urlPath,
                         cpart_getDataStr(file_part),
                         cpart_getDataStr(puser_part),
                         cpart_getDataStr(pgroup_part),
                         cpart_getDataStr(pothers_part));
             }
+            /* the modification might create a file missing so far */
+            pathcache_clear();
         }
     }else
         opErr = fmtError(0, "unrecognized request", NULL);
@@ -498,190 +359,557 @@ static bool hasHiddenFiles(const Folder *folder)
     return false;
 }
 
-static RespBuf *printFolderContents(const char *urlPath, const Folder *folder,
-        bool isModifiable, bool showLoginButton, const char *opErrorMsg,
-        bool onlyHead)
+/* Templates of folder listing page parts.
+ */
+static const RespTmplSeg tmplListingHead[] = {
+    RESP_TMPL_TEXT("<!DOCTYPE html><html><head><title>"),
+    RESP_TMPL_HOLE(RTS_CHUNK),      /* URL path */
+    RESP_TMPL_HOLE(RTS_RAW),        /* " on " when path is not empty */
+    RESP_TMPL_HOLE(RTS_HOST),
+    RESP_TMPL_TEXT(" - File Manager</title>"
+            "<link rel=\"stylesheet\" href=\""),
+    RESP_TMPL_HOLE(RTS_RAW),        /* style sheet URL path */
+    RESP_TMPL_TEXT("\">\n<script src=\""),
+    RESP_TMPL_HOLE(RTS_RAW),        /* script URL path */
+    RESP_TMPL_TEXT("\"></script>\n"
+            "</head>\n<body>\n"
+            "<table style='width: 100%'><tbody><tr>"
+            "<td style=\"font-size: large; font-weight: bold\">"
+            "<a href=\"/\">"),
+    RESP_TMPL_HOLE(RTS_HOST),
+    RESP_TMPL_TEXT("</a>&emsp;"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplPathElem[] = {
+    RESP_TMPL_TEXT("/<a href=\""),
+    RESP_TMPL_HOLE(RTS_CHUNK),      /* path up to the element */
+    RESP_TMPL_TEXT("/\">"),
+    RESP_TMPL_HOLE(RTS_CHUNK),      /* the element */
+    RESP_TMPL_TEXT("</a>"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplErrorMsg[] = {
+    RESP_TMPL_TEXT("<div class='errormsg'>"),
+    RESP_TMPL_HOLE(RTS_STR),
+    RESP_TMPL_TEXT("</div>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplParentLink[] = {
+    RESP_TMPL_TEXT("<tr>\n<td><span class=\"plusgray\">"),
+    RESP_TMPL_HOLE(RTS_RAW),        /* "+" or "&sdot;" */
+    RESP_TMPL_TEXT("</span></td>\n"
+            "<td><a style=\"white-space: pre\" href=\""),
+    RESP_TMPL_HOLE(RTS_CHUNK),      /* parent path */
+    RESP_TMPL_TEXT("/\"> .. </a></td>\n<td></td>\n</tr>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplEntry[] = {
+    RESP_TMPL_HOLE(RTS_RAW),        /* row begin */
+    RESP_TMPL_HOLE(RTS_RAW),        /* colored square cell begin */
+    RESP_TMPL_HOLE(RTS_RAW),        /* square class */
+    RESP_TMPL_HOLE(RTS_RAW),        /* colored square cell end */
+    RESP_TMPL_TEXT("<td><a href=\""),
+    RESP_TMPL_HOLE(RTS_CHUNK),      /* folder path */
+    RESP_TMPL_TEXT("/"),
+    RESP_TMPL_HOLE(RTS_STR),        /* file name */
+    RESP_TMPL_HOLE(RTS_RAW),        /* "/" for directory */
+    RESP_TMPL_TEXT("\">"),
+    RESP_TMPL_HOLE(RTS_STR),        /* file name */
+    RESP_TMPL_TEXT("</a></td>\n"),
+    RESP_TMPL_HOLE(RTS_RAW),        /* size cell begin */
+    RESP_TMPL_HOLE(RTS_RAW),        /* size */
+    RESP_TMPL_HOLE(RTS_RAW),        /* size cell end */
+    RESP_TMPL_TEXT("</tr>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplEntryMenuBegin[] = {
+    RESP_TMPL_TEXT("<tr style=\"display: none\">\n"
+            "<td></td>\n"
+            "<td colspan=\"2\">\n"
+            "<form method=\"POST\" enctype=\"multipart/form-data\">\n"
+            "<input type=\"hidden\" name=\"file\" value=\""),
+    RESP_TMPL_HOLE(RTS_STR),        /* file name */
+    RESP_TMPL_TEXT("\"/>\n"
+            "<table class='fattr'><tbody>"
+            "<tr><td>new name:</td>\n"
+            "<td colspan='3'><select name='new_dir'>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplOption[] = {
+    RESP_TMPL_TEXT("<option>"),
+    RESP_TMPL_HOLE(RTS_CHUNK),
+    RESP_TMPL_TEXT("</option>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplOptionSelected[] = {
+    RESP_TMPL_TEXT("<option selected>"),
+    RESP_TMPL_HOLE(RTS_CHUNK),
+    RESP_TMPL_TEXT("/</option>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplOptionSubdir[] = {
+    RESP_TMPL_TEXT("<option>"),
+    RESP_TMPL_HOLE(RTS_CHUNK),      /* folder path */
+    RESP_TMPL_TEXT("/"),
+    RESP_TMPL_HOLE(RTS_STR),        /* subdirectory name */
+    RESP_TMPL_TEXT("/</option>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplEntryRename[] = {
+    RESP_TMPL_TEXT("</select> <input name='new_name' value=\""),
+    RESP_TMPL_HOLE(RTS_STR),        /* file name */
+    RESP_TMPL_TEXT("\"/></td>"
+            "<td><input type=\"submit\" name=\"do_rename\" "
+            "value=\"Rename\" onclick='return checkRename(this)'/>"
+            "</td></tr>\n"
+            "<tr><td>permissions:</td>"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplPermGroup[] = {
+    RESP_TMPL_TEXT("<td>"),
+    RESP_TMPL_HOLE(RTS_RAW),        /* group name */
+    RESP_TMPL_TEXT(": <select name='p"),
+    RESP_TMPL_HOLE(RTS_RAW),        /* group name */
+    RESP_TMPL_TEXT("'>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplPermOption[] = {
+    RESP_TMPL_TEXT("<option"),
+    RESP_TMPL_HOLE(RTS_RAW),        /* " selected" or "" */
+    RESP_TMPL_TEXT(">"),
+    RESP_TMPL_HOLE(RTS_RAW),        /* permissions */
+    RESP_TMPL_TEXT("</option>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplListingFooter[] = {
+    RESP_TMPL_TEXT("</tbody></table>"),
+    RESP_TMPL_HOLE(RTS_RAW),        /* footer with folder actions */
+    RESP_TMPL_TEXT("</body></html>\n"),
+    RESP_TMPL_END
+};
+
+/* Size of listing piece generated at once by the listing producer.
+ */
+enum { LISTING_PIECE_SIZE = 32768 };
+
+/* Maximum size of rendered pieces kept for sharing by one listing.
+ */
+enum { LISTING_KEPT_MAX = 4194304 };
+
+/* Folder listing in progress. Concurrent requests for the same folder and
+ * the same listing variant share one listing: the folder is loaded and
+ * sorted once, the entries are rendered once, piece by piece. A rendered
+ * piece is kept until every request sharing the listing has sent it.
+ * A request joining the listing late renders the already released pieces
+ * by itself.
+ */
+typedef struct ListingFlight {
+    Folder *folder;
+    unsigned entryCount;
+    char *urlPath;
+    DataChunk dchUrlPath;           /* urlPath without trailing slashes */
+    bool isModifiable;
+    bool hasHiddenFiles;
+    unsigned configGen;             /* configuration used for rendering */
+    bool hasSysStat;                /* whether sysStat below is valid */
+    struct stat sysStat;            /* folder status at load */
+    MemBuf *entUrlPath;             /* URL path of current entry */
+    unsigned urlPathLen;            /* length of folder part of entUrlPath */
+    const FolderEntry **subdirs;    /* subdirectories - targets for "move" */
+    unsigned subdirCount;
+    MemBuf **pieces;                /* rendered pieces; NULL when released */
+    unsigned *pieceRefs;            /* number of requests yet to send piece */
+    unsigned *pieceEntEnds;         /* index of entry following the piece */
+    unsigned pieceCount;
+    unsigned keptSize;              /* total size of kept pieces */
+    bool isRenderFinished;
+    unsigned consumerCount;
+    struct ListingFlight *next;
+} ListingFlight;
+
+/* Folder listing response state - producer data.
+ */
+typedef struct {
+    ListingFlight *flight;
+    unsigned nextPiece;             /* next piece to send */
+} ListingConsumer;
+
+static ListingFlight *gListingFlights;
+
+static void printFolderEntry(RespBuf *resp, const ListingFlight *listing,
+        const FolderEntry *cur_ent)
 {
-    const FolderEntry *cur_ent, *optent;
-    DataChunk dchUrlPath, dchDirName;
-    RespBuf *resp;
-    unsigned pathElemBeg, pathElemEnd, i, j, urlPathLen;
-    MemBuf *entUrlPath;
+    static const char spc[] = "&thinsp;";
+    const DataChunk *dchUrlPath = &listing->dchUrlPath;
+    DataChunk dchPathElemTo;
+    unsigned pathElemBeg, pathElemEnd, i, j;
     bool isCGI;
+    char buf[80];
+    int len, dest, cpy;
+
+    mb_setStrEnd(listing->entUrlPath, listing->urlPathLen, cur_ent->fileName);
+    isCGI = !cur_ent->isDir && config_isCGI(mb_data(listing->entUrlPath));
+    /* optional entry size */
+    dest = sizeof(buf) - 1;
+    buf[dest] = '\0';
+    if( ! cur_ent->isDir && ! isCGI ) {
+        sprintf(buf, "%llu", (cur_ent->size+1023) / 1024);
+        /* insert thin spaces every three digits */
+        len = strlen(buf);
+        while( len > 0 ) {
+            cpy = sizeof(spc) - 1;
+            dest -= cpy;
+            memcpy(buf+dest, spc, cpy);
+            cpy = len > 3 ? 3 : len;
+            dest -= cpy;
+            len -= cpy;
+            memcpy(buf+dest, buf+len, cpy);
+        }
+    }
+    resp_appendTmpl(resp, tmplEntry,
+            cur_ent->fileName[0] == '.' ?
+            "<tr class='rhidden' style='display: none'>\n" : "<tr>\n",
+            /* colored square */
+            listing->isModifiable ? "<td onclick=\"showOptions(this)\">"
+            "<span class=\"" : "<td><span class=\"",
+            cur_ent->isDir ? "plusdir" : isCGI ? "pluscgi" : "plusfile",
+            listing->isModifiable ? "\">+</span></td>\n" :
+            "\">&sdot;</span></td>\n",
+            /* entry name as link */
+            dchUrlPath, cur_ent->fileName, cur_ent->isDir ? "/" :"",
+            cur_ent->fileName,
+            /* optional entry size */
+            cur_ent->isDir || isCGI ? "<td>" : "<td style=\"text-align: "
+            "right; padding-left: 2em; white-space: nowrap\">",
+            buf + dest, cur_ent->isDir || isCGI ? "</td>\n" : "kB</td>\n");
+
+    /* menu displayed after click red plus */
+    if( listing->isModifiable ) {
+        /* first row - "new name:" */
+        resp_appendTmpl(resp, tmplEntryMenuBegin, cur_ent->fileName);
+        pathElemEnd = 0;
+        while( pathElemEnd < dchUrlPath->len ) {
+            pathElemBeg = dch_endOfSpan(dchUrlPath, pathElemEnd, '/');
+            dch_init(&dchPathElemTo, dchUrlPath->data, pathElemBeg);
+            resp_appendTmpl(resp, tmplOption, &dchPathElemTo);
+            pathElemEnd = dch_endOfCSpan(dchUrlPath, pathElemBeg, '/');
+        }
+        resp_appendTmpl(resp, tmplOptionSelected, dchUrlPath);
+        for(i = 0; i < listing->subdirCount; ++i) {
+            if( listing->subdirs[i] != cur_ent ) {
+                resp_appendTmpl(resp, tmplOptionSubdir,
+                        dchUrlPath, listing->subdirs[i]->fileName);
+            }
+        }
+        resp_appendTmpl(resp, tmplEntryRename, cur_ent->fileName);
+        /* second row - "permissions:" */
+        for(i = 0; i < PERM_GROUP_COUNT; ++i) {
+            resp_appendTmpl(resp, tmplPermGroup,
+                    gFilePerm[i].name, gFilePerm[i].name);
+            for(j = 0; j < PERM_DISP_CNT; ++j) {
+                resp_appendTmpl(resp, tmplPermOption,
+                        (cur_ent->mode & gFilePerm[i].mask) ==
+                        gFilePerm[i].value[j] ? " selected" : "",
+                        gFilePermDisp[j]);
+            }
+            resp_appendStr(resp, "</select></td>\n");
+        }
+        resp_appendStr(resp, "<td><input type=\"submit\" "
+                "name='do_perm' value='Change'/></td></tr>\n");
+        /* 3rd row - "replace with:" */
+        if( ! cur_ent->isDir ) {
+            resp_appendStr(resp, "<tr><td>replace with:</td>\n"
+                    "<td colspan='3'><input type='file' name='new_cont'>"
+                    "</td><td><input type='submit' name='do_replace' "
+                    "value='Upload' onclick='return confirmUpload(this)'/>"
+                    "</td></tr>\n");
+        }
+        /* 4th row - "delete:" */
+        resp_appendStr(resp, "<tr><td>delete:</td>\n<td colspan='3'>");
+        if( cur_ent->isDir ) {
+            resp_appendStr(resp, "<label>"
+                "<input type='checkbox' name='del_recursive'/>"
+                "recursively</label>");
+        }
+        resp_appendStr(resp, "</td>\n"
+                "<td><input type=\"submit\" name=\"do_delete\" "
+                "value=\"Delete\" onclick=\"return confirmDel(this)\"/>"
+                "</td>\n</tr></tbody>\n</table>\n</form>\n</td>\n</tr>\n");
+    }
+}
+
+static bool isSameFolderStat(const struct stat *st1,
+        const struct stat *st2)
+{
+    return st1->st_dev == st2->st_dev && st1->st_ino == st2->st_ino &&
+        st1->st_mtim.tv_sec == st2->st_mtim.tv_sec &&
+        st1->st_mtim.tv_nsec == st2->st_mtim.tv_nsec;
+}
+
+/* Returns listing of the folder in progress, NULL if there is none.
+ */
+static ListingFlight *findListingFlight(const DataChunk *dchUrlPath,
+        bool isModifiable, const struct stat *sysStat)
+{
+    ListingFlight *flight;
+
+    for(flight = gListingFlights; flight; flight = flight->next) {
+        if( flight->isModifiable == isModifiable &&
+                flight->configGen == config_getGeneration() &&
+                flight->dchUrlPath.len == dchUrlPath->len &&
+                !memcmp(flight->dchUrlPath.data, dchUrlPath->data,
+                    dchUrlPath->len) &&
+                flight->hasSysStat == (sysStat != NULL) &&
+                (sysStat == NULL ||
+                 isSameFolderStat(&flight->sysStat, sysStat)) )
+            return flight;
+    }
+    return NULL;
+}
+
+/* Creates a new listing of the folder. Takes ownership of the folder.
+ */
+static ListingFlight *newListingFlight(const char *urlPath, Folder *folder,
+        bool isModifiable, const struct stat *sysStat)
+{
+    ListingFlight *flight = malloc(sizeof(ListingFlight));
+    const FolderEntry *cur_ent;
+    DataChunk dchUrlPath;
 
-    resp = resp_new(resp_cmnStatus(HTTP_200_OK), onlyHead);
-    resp_appendHeader(resp, "Content-Type", "text/html; charset=utf-8");
-    if( onlyHead )
-        return resp;
     dch_initWithStr(&dchUrlPath, urlPath);
     dch_trimTrailing(&dchUrlPath, '/');
-    /* head, title */
-    resp_appendFmt(resp,
-            "<!DOCTYPE html>"
-            "<html><head><title>%C%R%H - File Manager</title>"
-            "%R</head>\n<body>\n", &dchUrlPath, dchUrlPath.len ? " on " : "",
-            response_header);
-    /* host name as link to root */
-    resp_appendFmt(resp, "<table style='width: 100%'><tbody><tr>"
-            "<td style=\"font-size: large; font-weight: bold\">"
-            "<a href=\"/\">%H</a>&emsp;");
+    flight->folder = folder;
+    flight->entryCount = 0;
+    flight->urlPath = strdup(urlPath);
+    dch_init(&flight->dchUrlPath, flight->urlPath, dchUrlPath.len);
+    flight->isModifiable = isModifiable;
+    flight->hasHiddenFiles = hasHiddenFiles(folder);
+    flight->configGen = config_getGeneration();
+    flight->hasSysStat = sysStat != NULL;
+    if( sysStat != NULL )
+        flight->sysStat = *sysStat;
+    flight->entUrlPath = mb_newWithStr(urlPath);
+    mb_ensureEndsWithSlash(flight->entUrlPath);
+    flight->urlPathLen = mb_dataLen(flight->entUrlPath);
+    flight->subdirs = NULL;
+    flight->subdirCount = 0;
+    for(cur_ent = folder_getEntries(folder); cur_ent->fileName; ++cur_ent) {
+        if( isModifiable && cur_ent->isDir ) {
+            flight->subdirs = realloc(flight->subdirs,
+                    (flight->subdirCount+1) * sizeof(FolderEntry*));
+            flight->subdirs[flight->subdirCount++] = cur_ent;
+        }
+        ++flight->entryCount;
+    }
+    flight->pieces = NULL;
+    flight->pieceRefs = NULL;
+    flight->pieceEntEnds = NULL;
+    flight->pieceCount = 0;
+    flight->keptSize = 0;
+    flight->isRenderFinished = false;
+    flight->consumerCount = 0;
+    flight->next = gListingFlights;
+    gListingFlights = flight;
+    return flight;
+}
+
+static void freeListingFlight(ListingFlight *flight)
+{
+    ListingFlight **flightPtr = &gListingFlights;
+    unsigned i;
+
+    while( *flightPtr != flight )
+        flightPtr = &(*flightPtr)->next;
+    *flightPtr = flight->next;
+    for(i = 0; i < flight->pieceCount; ++i)
+        mb_free(flight->pieces[i]);
+    free(flight->pieces);
+    free(flight->pieceRefs);
+    free(flight->pieceEntEnds);
+    free(flight->subdirs);
+    mb_free(flight->entUrlPath);
+    free(flight->urlPath);
+    folder_free(flight->folder);
+    free(flight);
+}
+
+static void releaseListingPiece(ListingFlight *flight, unsigned pieceNum)
+{
+    MemBuf *piece = flight->pieces[pieceNum];
+
+    if( piece != NULL && --flight->pieceRefs[pieceNum] == 0 ) {
+        flight->keptSize -= mb_dataLen(piece);
+        mb_free(piece);
+        flight->pieces[pieceNum] = NULL;
+    }
+}
+
+static void freeListingConsumer(void *pvConsumer)
+{
+    ListingConsumer *consumer = pvConsumer;
+    ListingFlight *flight = consumer->flight;
+    unsigned i;
+
+    for(i = consumer->nextPiece; i < flight->pieceCount; ++i)
+        releaseListingPiece(flight, i);
+    free(consumer);
+    if( --flight->consumerCount == 0 )
+        freeListingFlight(flight);
+}
+
+/* Renders folder entries from entBeg up to entEnd, or up to the piece size
+ * limit when entEnd is not given. The page footer is rendered after
+ * the last entry. Returns index of the entry following the rendered ones.
+ */
+static unsigned renderListingEntries(RespBuf *resp,
+        const ListingFlight *flight, unsigned entBeg, const unsigned *entEnd)
+{
+    const FolderEntry *entries = folder_getEntries(flight->folder);
+    unsigned pieceEnd = resp_bodyLen(resp) + LISTING_PIECE_SIZE;
+    unsigned entIdx = entBeg;
+
+    while( entIdx < flight->entryCount && (entEnd ? entIdx < *entEnd :
+                resp_bodyLen(resp) < pieceEnd) )
+    {
+        printFolderEntry(resp, flight, entries + entIdx);
+        ++entIdx;
+    }
+    if( entIdx == flight->entryCount ) {
+        /* footer */
+        resp_appendTmpl(resp, tmplListingFooter,
+                flight->isModifiable ? response_footer : "");
+    }
+    return entIdx;
+}
+
+/* Renders next piece of folder entries into response body. Keeps the piece
+ * for other requests sharing the listing, unless too much is kept already.
+ */
+static void renderListingPiece(RespBuf *resp, ListingFlight *flight)
+{
+    unsigned pieceBeg = resp_bodyLen(resp), entEnd;
+    MemBuf *piece = NULL;
+
+    entEnd = renderListingEntries(resp, flight, flight->pieceCount ?
+            flight->pieceEntEnds[flight->pieceCount-1] : 0, NULL);
+    flight->pieces = realloc(flight->pieces,
+            (flight->pieceCount+1) * sizeof(MemBuf*));
+    flight->pieceRefs = realloc(flight->pieceRefs,
+            (flight->pieceCount+1) * sizeof(unsigned));
+    flight->pieceEntEnds = realloc(flight->pieceEntEnds,
+            (flight->pieceCount+1) * sizeof(unsigned));
+    if( flight->consumerCount > 1 && flight->keptSize < LISTING_KEPT_MAX ) {
+        piece = mb_new();
+        mb_appendData(piece, resp_bodyData(resp) + pieceBeg,
+                resp_bodyLen(resp) - pieceBeg);
+        flight->keptSize += mb_dataLen(piece);
+    }
+    flight->pieces[flight->pieceCount] = piece;
+    /* all requests sharing the listing will need the piece */
+    flight->pieceRefs[flight->pieceCount] = flight->consumerCount;
+    flight->pieceEntEnds[flight->pieceCount] = entEnd;
+    ++flight->pieceCount;
+    flight->isRenderFinished = entEnd == flight->entryCount;
+}
+
+/* Response body producer: sends next piece of folder entries. Renders the
+ * piece when not rendered yet or already released by other requests.
+ */
+static bool produceFolderEntries(RespBuf *resp, void *pvConsumer,
+        int *awaitFd)
+{
+    ListingConsumer *consumer = pvConsumer;
+    ListingFlight *flight = consumer->flight;
+    unsigned pieceNum = consumer->nextPiece;
+    const MemBuf *piece;
+
+    if( pieceNum == flight->pieceCount ) {
+        renderListingPiece(resp, flight);
+    }else if( (piece = flight->pieces[pieceNum]) != NULL ) {
+        resp_appendData(resp, mb_data(piece), mb_dataLen(piece));
+    }else{
+        renderListingEntries(resp, flight, pieceNum ?
+                flight->pieceEntEnds[pieceNum-1] : 0,
+                flight->pieceEntEnds + pieceNum);
+    }
+    releaseListingPiece(flight, pieceNum);
+    consumer->nextPiece = pieceNum + 1;
+    return consumer->nextPiece < flight->pieceCount ||
+        ! flight->isRenderFinished;
+}
+
+/* Returns the folder listing response.
+ * Only the page head is rendered here; the folder entries are rendered
+ * while the response is being sent.
+ */
+static RespBuf *printFolderContents(ListingFlight *flight,
+        bool showLoginButton, const char *opErrorMsg)
+{
+    const DataChunk *dchUrlPath = &flight->dchUrlPath;
+    DataChunk dchDirName, dchPathElemTo, dchPathElem;
+    RespBuf *resp;
+    unsigned pathElemBeg, pathElemEnd, i;
+    ListingConsumer *consumer;
+
+    resp = resp_new(resp_cmnStatus(HTTP_200_OK), false);
+    resp_appendHeader(resp, "Content-Type", "text/html; charset=utf-8");
+    /* head, title, host name as link to root */
+    resp_appendTmpl(resp, tmplListingHead, dchUrlPath,
+            dchUrlPath->len ? " on " : "", assets_getStyleUrlPath(),
+            assets_getScriptUrlPath());
     /* current path as link list */
-    pathElemBeg = dch_endOfSpan(&dchUrlPath, 0, '/');
-    while( dchUrlPath.len > pathElemBeg ) {
-        pathElemEnd = dch_endOfCSpan(&dchUrlPath, pathElemBeg, '/');
-        resp_appendFmt(resp, "/<a href=\"%D/\">%D</a>",
-                dchUrlPath.data, pathElemEnd, dchUrlPath.data + pathElemBeg,
+    pathElemBeg = dch_endOfSpan(dchUrlPath, 0, '/');
+    while( dchUrlPath->len > pathElemBeg ) {
+        pathElemEnd = dch_endOfCSpan(dchUrlPath, pathElemBeg, '/');
+        dch_init(&dchPathElemTo, dchUrlPath->data, pathElemEnd);
+        dch_init(&dchPathElem, dchUrlPath->data + pathElemBeg,
                 pathElemEnd - pathElemBeg);
-        pathElemBeg = dch_endOfSpan(&dchUrlPath, pathElemEnd, '/');
+        resp_appendTmpl(resp, tmplPathElem, &dchPathElemTo, &dchPathElem);
+        pathElemBeg = dch_endOfSpan(dchUrlPath, pathElemEnd, '/');
     }
     resp_appendStr(resp, "</td><td style='text-align: right'>");
-    if( hasHiddenFiles(folder) )
+    if( flight->hasHiddenFiles )
         resp_appendStr(resp, "<label><input type='checkbox' name='showall' "
                 "onclick='showHideHidden(this)'></input>show hidden files"
                 "</label>");
-    if( showLoginButton )
-        resp_appendFmt(resp, "&emsp;%R", response_login_button);
+    if( showLoginButton ) {
+        resp_appendStr(resp, "&emsp;");
+        resp_appendStr(resp, response_login_button);
+    }
     resp_appendStr(resp, "</td></tr></tbody></table>\n");
     /* error bar */
     if( opErrorMsg != NULL )
-        resp_appendFmt(resp, "<div class='errormsg'>%S</div>\n", opErrorMsg);
+        resp_appendTmpl(resp, tmplErrorMsg, opErrorMsg);
     resp_appendStr(resp, "<table><tbody class='folder'>\n");
     /* link to parent - " .. " */
-    if( dchUrlPath.len ) {
-        dch_dirNameOf(&dchUrlPath, &dchDirName);
-        resp_appendFmt(resp, "<tr>\n"
-                "<td><span class=\"plusgray\">%R</span></td>\n"
-                "<td><a style=\"white-space: pre\" href=\"%D/\"> .. </a></td>\n"
-                "<td></td>\n"
-                "</tr>\n",
-                isModifiable ? "+" : "&sdot;", dchDirName.data,
-                dch_equalsStr(&dchDirName, "/") ? 0 : dchDirName.len);
+    if( dchUrlPath->len ) {
+        dch_dirNameOf(dchUrlPath, &dchDirName);
+        if( dch_equalsStr(&dchDirName, "/") )
+            dchDirName.len = 0;
+        resp_appendTmpl(resp, tmplParentLink,
+                flight->isModifiable ? "+" : "&sdot;", &dchDirName);
     }
-    entUrlPath = mb_newWithStr(urlPath);
-    mb_ensureEndsWithSlash(entUrlPath);
-    urlPathLen = mb_dataLen(entUrlPath);
     /* entry list */
-    for(cur_ent = folder_getEntries(folder); cur_ent->fileName; ++cur_ent) {
-        mb_setStrEnd(entUrlPath, urlPathLen, cur_ent->fileName);
-        isCGI = !cur_ent->isDir && config_isCGI(mb_data(entUrlPath));
-        if( cur_ent->fileName[0] == '.' )
-            resp_appendStr(resp,"<tr class='rhidden' style='display: none'>\n");
-        else
-            resp_appendStr(resp, "<tr>\n");
-        /* colored square */
-        if( isModifiable ) {
-            resp_appendFmt(resp, "<td onclick=\"showOptions(this)\">"
-                    "<span class=\"%R\">+</span></td>\n", cur_ent->isDir ?
-                    "plusdir" : isCGI ? "pluscgi" : "plusfile");
-        }else{
-            resp_appendFmt(resp,
-                    "<td><span class=\"%R\">&sdot;</span></td>\n",
-                    cur_ent->isDir ?
-                    "plusdir" : isCGI ? "pluscgi" : "plusfile");
-        }
-        /* entry name as link */
-        resp_appendFmt(resp, "<td><a href=\"%C/%S%R\">%S</a></td>\n",
-                &dchUrlPath, cur_ent->fileName, cur_ent->isDir ? "/" :"",
-                cur_ent->fileName);
-        /* optional entry size */
-        if( cur_ent->isDir || isCGI )
-            resp_appendStr(resp, "<td></td>\n");
-        else{
-            static const char spc[] = "&thinsp;";
-            char buf[80];
-            int len, dest = sizeof(buf)-1, cpy;
-
-            sprintf(buf, "%llu", (cur_ent->size+1023) / 1024);
-            /* insert thin spaces every three digits */
-            len = strlen(buf);
-            buf[dest] = '\0';
-            while( len > 0 ) {
-                cpy = sizeof(spc) - 1;
-                dest -= cpy;
-                memcpy(buf+dest, spc, cpy);
-                cpy = len > 3 ? 3 : len;
-                dest -= cpy;
-                len -= cpy;
-                memcpy(buf+dest, buf+len, cpy);
-            }
-            resp_appendFmt(resp, "<td style=\"text-align: right; "
-                    "padding-left: 2em; white-space: nowrap\">%RkB</td>\n",
-                    buf + dest);
-        }
-        resp_appendStr(resp, "</tr>\n");
-
-        /* menu displayed after click red plus */
-        if( isModifiable ) {
-            resp_appendFmt(resp,
-                    "<tr style=\"display: none\">\n"
-                    "<td></td>\n"
-                    "<td colspan=\"2\">\n"
-                    "<form method=\"POST\" enctype=\"multipart/form-data\">\n"
-                    "<input type=\"hidden\" name=\"file\" value=\"%S\"/>\n"
-                    "<table class='fattr'><tbody>", cur_ent->fileName);
-            /* first row - "new name:" */
-            resp_appendStr(resp, "<tr><td>new name:</td>\n"
-                    "<td colspan='3'><select name='new_dir'>\n");
-            pathElemEnd = 0;
-            while( pathElemEnd < dchUrlPath.len ) {
-                pathElemBeg = dch_endOfSpan(&dchUrlPath, pathElemEnd, '/');
-                resp_appendFmt(resp, "<option>%D</option>\n",
-                        dchUrlPath.data, pathElemBeg);
-                pathElemEnd = dch_endOfCSpan(&dchUrlPath, pathElemBeg, '/');
-            }
-            resp_appendFmt(resp, "<option selected>%C/</option>\n",
-                    &dchUrlPath);
-            for(optent = folder_getEntries(folder); optent->fileName; ++optent){
-                if( optent != cur_ent && optent->isDir ) {
-                    resp_appendFmt(resp, "<option>%C/%S/</option>\n",
-                            &dchUrlPath, optent->fileName);
-                }
-            }
-            resp_appendFmt(resp,
-                    "</select> <input name='new_name' value=\"%S\"/></td>"
-                    "<td><input type=\"submit\" name=\"do_rename\" "
-                    "value=\"Rename\" onclick='return checkRename(this)'/>"
-                    "</td></tr>\n", cur_ent->fileName);
-            /* second row - "permissions:" */
-            resp_appendStr(resp, "<tr><td>permissions:</td>");
-            for(i = 0; i < PERM_GROUP_COUNT; ++i) {
-                resp_appendFmt(resp, "<td>%R: <select name='p%R'>\n",
-                        gFilePerm[i].name, gFilePerm[i].name);
-                for(j = 0; j < PERM_DISP_CNT; ++j) {
-                    resp_appendFmt(resp, "<option%R>%R</option>\n", 
-                            (cur_ent->mode & gFilePerm[i].mask) ==
-                            gFilePerm[i].value[j] ? " selected" : "",
-                            gFilePermDisp[j]);
-                }
-                resp_appendStr(resp, "</select></td>\n");
-            }
-            resp_appendStr(resp, "<td><input type=\"submit\" "
-                    "name='do_perm' value='Change'/></td></tr>\n");
-            /* 3rd row - "replace with:" */
-            if( ! cur_ent->isDir ) {
-                resp_appendStr(resp, "<tr><td>replace with:</td>\n"
-                        "<td colspan='3'><input type='file' name='new_cont'>"
-                        "</td><td><input type='submit' name='do_replace' "
-                        "value='Upload' onclick='return confirmUpload(this)'/>"
-                        "</td></tr>\n");
-            }
-            /* 4th row - "delete:" */
-            resp_appendStr(resp, "<tr><td>delete:</td>\n<td colspan='3'>");
-            if( cur_ent->isDir ) {
-                resp_appendStr(resp, "<label>"
-                    "<input type='checkbox' name='del_recursive'/>"
-                    "recursively</label>");
-            }
-            resp_appendStr(resp, "</td>\n"
-                    "<td><input type=\"submit\" name=\"do_delete\" "
-                    "value=\"Delete\" onclick=\"return confirmDel(this)\"/>"
-                    "</td>\n</tr></tbody>\n</table>\n</form>\n</td>\n</tr>\n");
-        }
-    }
-    mb_free(entUrlPath);
-    /* footer */
-    resp_appendFmt(resp, "</tbody></table>%R</body></html>\n",
-            isModifiable ? response_footer : "");
+    consumer = malloc(sizeof(ListingConsumer));
+    consumer->flight = flight;
+    consumer->nextPiece = 0;
+    ++flight->consumerCount;
+    for(i = 0; i < flight->pieceCount; ++i)
+        ++flight->pieceRefs[i];
+    resp_setBodyProducer(resp, produceFolderEntries, consumer,
+            freeListingConsumer);
     return resp;
 }
 
@@ -689,27 +917,60 @@ RespBuf *filemgr_printFolderContents(const FileManager *filemgr,
         const RequestHeader *rhdr, int *sysErrNo)
 {
     Folder *folder;
+    ListingFlight *flight;
+    struct stat sysStat;
     const char *queryFile = reqhdr_getPath(rhdr);
     bool isHeadReq = !strcmp(reqhdr_getMethod(rhdr), "HEAD");
+    DataChunk dchUrlPath;
     RespBuf *resp = NULL;
     bool isModifiable = filemgr->sysPath == NULL ? 0 :
         reqhdr_isActionAllowed(rhdr, PA_MODIFY) &&
-            access(filemgr->sysPath, W_OK) == 0;
-
-    if( filemgr->sysPath != NULL )
-        folder = folder_loadDir(filemgr->sysPath, sysErrNo);
-    else if( (folder = config_getSubSharesForPath(queryFile)) == NULL )
-        *sysErrNo = ENOENT;
-    if( *sysErrNo == 0 ) {
-        resp = printFolderContents(queryFile, folder,
-                isModifiable, reqhdr_isWorthPuttingLogOnButton(rhdr),
-                filemgr->opErrorMsg, isHeadReq);
+            faccessat(filemgr->dirFd, ".", W_OK, AT_EACCESS) == 0;
+
+    /* after POST the folder status is changed */
+    if( filemgr->sysPath != NULL ) {
+        if( strcmp(reqhdr_getMethod(rhdr), "POST") )
+            sysStat = filemgr->dirStat;
+        else if( fstat(filemgr->dirFd, &sysStat) != 0 ) {
+            *sysErrNo = errno;
+            return NULL;
+        }
     }
-    folder_free(folder);
-    return resp;
+    dch_initWithStr(&dchUrlPath, queryFile);
+    dch_trimTrailing(&dchUrlPath, '/');
+    /* after POST the listing should reflect the folder modifications,
+     * which are not always visible in the folder status */
+    flight = strcmp(reqhdr_getMethod(rhdr), "POST") ?
+        findListingFlight(&dchUrlPath, isModifiable,
+                filemgr->sysPath != NULL ? &sysStat : NULL) : NULL;
+    if( flight == NULL ) {
+        if( filemgr->sysPath != NULL )
+            folder = folder_loadDirAt(filemgr->dirFd, sysErrNo);
+        else if( (folder = config_getSubSharesForPath(queryFile)) == NULL )
+            *sysErrNo = ENOENT;
+        if( *sysErrNo != 0 || isHeadReq ) {
+            folder_free(folder);
+            folder = NULL;
+        }else
+            flight = newListingFlight(queryFile, folder, isModifiable,
+                    filemgr->sysPath != NULL ? &sysStat : NULL);
+    }
+    if( isHeadReq ) {
+        if( *sysErrNo == 0 ) {
+            resp = resp_new(resp_cmnStatus(HTTP_200_OK), true);
+            resp_appendHeader(resp, "Content-Type",
+                    "text/html; charset=utf-8");
+        }
+        return resp;
+    }
+    if( flight == NULL )
+        return NULL;
+    return printFolderContents(flight, reqhdr_isWorthPuttingLogOnButton(rhdr),
+            filemgr->opErrorMsg);
 }
 
-FileManager *filemgr_new(const char *sysPath, const RequestHeader *rhdr)
+FileManager *filemgr_new(const char *sysPath, int dirFd,
+        const struct stat *dirStat, const RequestHeader *rhdr)
 {
     FileManager *filemgr = malloc(sizeof(FileManager));
     DataChunk dchContentType, dchName, dchValue;
@@ -718,6 +979,10 @@ FileManager *filemgr_new(const char *sysPath, const RequestHeader *rhdr)
     char *boundaryDelimiter = NULL;
 
     filemgr->sysPath = sysPath ? strdup(sysPath) : NULL;
+    filemgr->dirFd = dirFd;
+    if( sysPath != NULL )
+        filemgr->dirStat = *dirStat;
+    filemgr->urlPath = strdup(reqhdr_getPath(rhdr));
     if( contentType != NULL ) {
         dch_initWithStr(&dchContentType, contentType);
         dch_extractTillChrStripWS(&dchContentType, &dchName, ';');
@@ -732,7 +997,7 @@ FileManager *filemgr_new(const char *sysPath, const RequestHeader *rhdr)
     }
     if( boundaryDelimiter != NULL ) {
         filemgr->body = mpdata_new(boundaryDelimiter,
-                reqhdr_isActionAllowed(rhdr, PA_MODIFY) ? sysPath : NULL);
+                reqhdr_isActionAllowed(rhdr, PA_MODIFY) ? dirFd : -1);
         free(boundaryDelimiter);
     }else
         filemgr->body = NULL;
@@ -747,10 +1012,18 @@ void filemgr_consumeBodyBytes(FileManager *filemgr, const char *data,
         mpdata_appendData(filemgr->body, data, len);
 }
 
+bool filemgr_isBodyTooLarge(const FileManager *filemgr)
+{
+    return filemgr->body != NULL && mpdata_isTooLarge(filemgr->body);
+}
+
 void filemgr_free(FileManager *filemgr)
 {
     if( filemgr != NULL ) {
         free(filemgr->sysPath);
+        if( filemgr->dirFd >= 0 )
+            close(filemgr->dirFd);
+        free(filemgr->urlPath);
         mpdata_free(filemgr->body);
         free(filemgr->opErrorMsg);
         free(filemgr);
@@ -3,6 +3,7 @@
 
 #include "requestheader.h"
 #include "respbuf.h"
+#include <sys/stat.h>
 
 
 typedef struct FileManager FileManager;
@@ -13,12 +14,23 @@ enum PostingResult {
 };
 
 
-FileManager *filemgr_new(const char *sysPath, const RequestHeader*);
+/* Creates a file manager of folder sysPath. The dirFd is a descriptor of the
+ * folder, the file manager takes ownership of it; dirStat is the folder
+ * status. For folders containing only sub-shares the sysPath is NULL,
+ * dirFd is -1 and dirStat is not used.
+ */
+FileManager *filemgr_new(const char *sysPath, int dirFd,
+        const struct stat *dirStat, const RequestHeader*);
 
 
 void filemgr_consumeBodyBytes(FileManager*, const char *data, unsigned len);
 
 
+/* Returns true when the request body exceeds the form data limits.
+ */
+bool filemgr_isBodyTooLarge(const FileManager*);
+
+
 /* Processes POST request on folder
  */
 enum PostingResult filemgr_processPost(FileManager*, const RequestHeader*);
@@ -0,0 +1,307 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdbool.h>
+#include "fmassets.h"
+#include "membuf.h"
+#include "md5calc.h"
+#include "fmlog.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(HAVE_ZLIB) && defined(HAVE_ZLIB_H)
+#include <zlib.h>
+#endif
+
+
+#define ASSETS_URL_PREFIX   "/.fm/"
+
+static const char gListingScript[] =
+    "function showOptions(th) {\n"
+    "    th.parentNode.nextElementSibling.style.display = \"table-row\";\n"
+    "    th.firstElementChild.innerHTML = \"&minus;\";\n"
+    "    th.onclick = function() { hideOptions(th); };\n"
+    "}\n"
+    "function hideOptions(th) {\n"
+    "    th.parentNode.nextElementSibling.style.display = \"none\";\n"
+    "    th.firstElementChild.textContent = \"+\";\n"
+    "    th.onclick = function() { showOptions(th); };\n"
+    "}\n"
+    "function showHideHidden(th) {\n"
+    "    var rows = document.getElementsByTagName('tr');\n"
+    "    for(var i = 0; i < rows.length; ++i) {\n"
+    "        var row = rows.item(i);\n"
+    "        if( row.getAttribute('class') == 'rhidden' ) {\n"
+    "            row.style.display = th.checked ? 'table-row' : 'none';\n"
+    "        }\n"
+    "    }\n"
+    "}\n"
+    "function checkRename(th) {\n"
+    "    var res = false;\n"
+    "    var fname = th.form.elements.namedItem('new_name').value;\n"
+    "    if( fname === '' ) {\n"
+    "        alert('please specify the file name');\n"
+    "    }else if( fname.indexOf('/') >= 0 ) {\n"
+    "        alert('slash in name disallowed');\n"
+    "    }else\n"
+    "        res = true;\n"
+    "    return res;\n"
+    "}\n"
+    "function confirmUpload(th) {\n"
+    "    var fname = th.form.elements.namedItem('file').value;\n"
+    "    var repl = th.form.elements.namedItem('new_cont').value;\n"
+    "    if( repl == '' ) {\n"
+    "        alert('please choose a file');\n"
+    "        return false;\n"
+    "    }\n"
+    "    repl = repl.replace(/.*[\\/\\\\]/, '');\n"
+    "    repl = repl == fname ? '' : ' using \"' + repl + '\"';\n"
+    "    return confirm('replace \"' + fname+ '\"' + repl + ' ?');\n"
+    "}\n"
+    "function confirmDel(th) {\n"
+    "    var fname = th.form.elements.namedItem('file').value;\n"
+    "    var recu = th.form.elements.namedItem('del_recursive');\n"
+    "    recu = recu != null && recu.checked ? ' recursively' : '';\n"
+    "    return confirm('delete' + recu + ' \"' + fname + '\" ?');\n"
+    "}\n"
+    "function checkCreateDir(th) {\n"
+    "    var res = false;\n"
+    "    var dname = th.form.elements.namedItem('new_dir').value;\n"
+    "    if( dname === '' ) {\n"
+    "        alert('please specify the directory name');\n"
+    "    }else if( dname.indexOf('/') >= 0 ) {\n"
+    "        alert('slash in name disallowed');\n"
+    "    }else\n"
+    "        res = true;\n"
+    "    return res;\n"
+    "}\n"
+    "function checkAddFile(th) {\n"
+    "    if( th.form.elements.namedItem('file').value == '' ) {\n"
+    "        alert('please choose a file');\n"
+    "        return false;\n"
+    "    }\n"
+    "    return true;\n"
+    "}\n";
+
+static const char gListingStyle[] =
+    "body { background-color: #F2FAFC; }\n"
+    "div.errormsg {\n"
+    "   font-size: large;\n"
+    "   text-align: center;\n"
+    "   background-color: gold;\n"
+    "   padding: 2px;\n"
+    "   margin-top: 4px;\n"
+    "}\n"
+    "span.plusdir {\n"
+    "    font-family: monospace;\n"
+    "    font-weight: bold;\n"
+    "    background-color: #D31D41;\n"
+    "    color: white;\n"
+    "    padding: 0px 3px;\n"
+    "    cursor: default;\n"
+    "}\n"
+    "span.plusgray {\n"
+    "    font-family: monospace;\n"
+    "    font-weight: bold;\n"
+    "    background-color: #d8d8d8;\n"
+    "    color: white;\n"
+    "    padding: 0px 3px;\n"
+    "    cursor: default;\n"
+    "}\n"
+    "span.pluscgi {\n"
+    "    font-family: monospace;\n"
+    "    font-weight: bold;\n"
+    "    background-color: #E3B81F;\n"
+    "    color: white;\n"
+    "    padding: 0px 3px;\n"
+    "    cursor: default;\n"
+    "}\n"
+    "span.plusfile {\n"
+    "    font-family: monospace;\n"
+    "    font-weight: bold;\n"
+    "    background-color: #bbdb1e;\n"
+    "    color: white;\n"
+    "    padding: 0px 3px;\n"
+    "    cursor: default;\n"
+    "}\n"
+    "tbody.folder > tr > td {\n"
+    "    border-color: #ded4f2;\n"
+    "    border-width: 1px;\n"
+    "    border-bottom-style: solid;\n"
+    "}\n"
+    "table.fattr {\n"
+    "    border-collapse: collapse;\n"
+    "}\n"
+    "table.fattr td {\n"
+    "    background: #e0f0f9;\n"
+    "    padding: 3px 6px;\n"
+    "}\n"
+    "table.fattr input[type='submit'] {\n"
+    "    width: 100%;\n"
+    "}\n"
+    "table.fattr input[name='new_name'] {\n"
+    "    width: 20em;\n"
+    "}\n"
+    "table.diracns td {\n"
+    "    padding: 2px 4px;\n"
+    "}\n"
+    "table.diracns input {\n"
+    "    width: 100%;\n"
+    "}\n";
+
+typedef struct {
+    const char *contents;
+    unsigned len;
+    const char *urlPathExt;
+    const char *contentType;
+    char *urlPath;          /* versioned URL path */
+    char *etag;
+    MemBuf *gzipped;        /* gzip-compressed contents; NULL when
+                             * compression is not available */
+} Asset;
+
+static Asset gAssets[] = {
+    { gListingScript, sizeof(gListingScript) - 1, "js", "text/javascript" },
+    { gListingStyle,  sizeof(gListingStyle) - 1,  "css", "text/css" }
+};
+
+enum {
+    ASSET_SCRIPT,
+    ASSET_STYLE,
+    ASSET_COUNT
+};
+
+
+static MemBuf *gzipData(const char *data, unsigned len)
+{
+    MemBuf *res = NULL;
+#if defined(HAVE_ZLIB) && defined(HAVE_ZLIB_H)
+    z_stream zs;
+
+    memset(&zs, 0, sizeof(zs));
+    /* windowBits + 16 - gzip format */
+    if( deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                Z_DEFAULT_STRATEGY) == Z_OK )
+    {
+        res = mb_new();
+        mb_resize(res, deflateBound(&zs, len));
+        zs.next_in = (Bytef*)data;
+        zs.avail_in = len;
+        zs.next_out = (Bytef*)mb_data(res);
+        zs.avail_out = mb_dataLen(res);
+        if( deflate(&zs, Z_FINISH) == Z_STREAM_END ) {
+            mb_resize(res, zs.total_out);
+        }else{
+            log_warn("unable to compress built-in asset");
+            mb_free(res);
+            res = NULL;
+        }
+        deflateEnd(&zs);
+    }
+#endif
+    return res;
+}
+
+static void initAssets(void)
+{
+    static bool isInitialized;
+    char md5sum[40];
+    Asset *asset;
+    MemBuf *mb;
+
+    if( isInitialized )
+        return;
+    for(asset = gAssets; asset < gAssets + ASSET_COUNT; ++asset) {
+        md5_calculate(md5sum, asset->contents, asset->len);
+        md5sum[16] = '\0';
+        mb = mb_newWithStr(ASSETS_URL_PREFIX "static-");
+        mb_appendStrL(mb, md5sum, ".", asset->urlPathExt, NULL);
+        asset->urlPath = mb_unbox_free(mb);
+        mb = mb_newWithStr("\"");
+        mb_appendStrL(mb, md5sum, "\"", NULL);
+        asset->etag = mb_unbox_free(mb);
+        asset->gzipped = gzipData(asset->contents, asset->len);
+    }
+    isInitialized = true;
+}
+
+const char *assets_getScriptUrlPath(void)
+{
+    initAssets();
+    return gAssets[ASSET_SCRIPT].urlPath;
+}
+
+const char *assets_getStyleUrlPath(void)
+{
+    initAssets();
+    return gAssets[ASSET_STYLE].urlPath;
+}
+
+/* Returns true when "Accept-Encoding" header contains gzip
+ * (and it is not refused with q=0).
+ */
+static bool isGzipAccepted(const RequestHeader *rhdr)
+{
+    const char *acceptEnc = reqhdr_getHeaderVal(rhdr, "Accept-Encoding");
+    DataChunk dchList, dchCoding, dchName, dchValue;
+    char *qvalue;
+    bool res = false;
+
+    dch_initWithStr(&dchList, acceptEnc);
+    while( ! res && dchList.len > 0 ) {
+        dch_extractTillChrStripWS(&dchList, &dchCoding, ',');
+        dch_trimWS(&dchCoding);
+        if( dch_startsWithStrIgnoreCase(&dchCoding, "gzip") ) {
+            res = true;
+            if( dch_shiftAfterChr(&dchCoding, ';') ) {
+                while( dch_extractParam(&dchCoding, &dchName, &dchValue, ';') )
+                {
+                    if( dch_equalsStrIgnoreCase(&dchName, "q") ) {
+                        qvalue = dch_dupToStr(&dchValue);
+                        res = strtod(qvalue, NULL) > 0;
+                        free(qvalue);
+                    }
+                }
+            }
+        }
+    }
+    return res;
+}
+
+RespBuf *assets_getResponse(const RequestHeader *rhdr)
+{
+    const char *urlPath = reqhdr_getPath(rhdr), *ifNoneMatch;
+    const Asset *asset;
+    RespBuf *resp;
+    bool onlyHead;
+
+    if( strncmp(urlPath, ASSETS_URL_PREFIX, sizeof(ASSETS_URL_PREFIX) - 1) )
+        return NULL;
+    initAssets();
+    for(asset = gAssets; asset < gAssets + ASSET_COUNT &&
+            strcmp(urlPath, asset->urlPath); ++asset)
+        ;
+    if( asset == gAssets + ASSET_COUNT )
+        return NULL;
+    ifNoneMatch = reqhdr_getHeaderVal(rhdr, "If-None-Match");
+    if( ifNoneMatch != NULL && (strstr(ifNoneMatch, asset->etag) != NULL ||
+                !strcmp(ifNoneMatch, "*")) )
+    {
+        resp = resp_new("304 Not Modified", true);
+    }else{
+        onlyHead = !strcmp(reqhdr_getMethod(rhdr), "HEAD");
+        resp = resp_new(resp_cmnStatus(HTTP_200_OK), onlyHead);
+        resp_appendHeader(resp, "Content-Type", asset->contentType);
+        if( asset->gzipped != NULL && isGzipAccepted(rhdr) ) {
+            resp_appendHeader(resp, "Content-Encoding", "gzip");
+            if( ! onlyHead )
+                resp_appendData(resp, mb_data(asset->gzipped),
+                        mb_dataLen(asset->gzipped));
+        }else if( ! onlyHead )
+            resp_appendData(resp, asset->contents, asset->len);
+    }
+    resp_appendHeader(resp, "ETag", asset->etag);
+    resp_appendHeader(resp, "Cache-Control",
+            "public, max-age=31536000, immutable");
+    resp_appendHeader(resp, "Vary", "Accept-Encoding");
+    return resp;
+}
@@ -0,0 +1,31 @@
+#ifndef FMASSETS_H
+#define FMASSETS_H
+
+#include "requestheader.h"
+#include "respbuf.h"
+
+
+/* Built-in static assets of folder listing page: the script and the
+ * style sheet. The assets are served under versioned URL paths, i.e. the
+ * path changes whenever the asset contents changes, so clients are allowed
+ * to cache them forever.
+ */
+
+
+/* Returns URL path of the listing page script.
+ */
+const char *assets_getScriptUrlPath(void);
+
+
+/* Returns URL path of the listing page style sheet.
+ */
+const char *assets_getStyleUrlPath(void);
+
+
+/* Returns response containing the built-in asset when the request
+ * path refers to one. Returns NULL otherwise.
+ */
+RespBuf *assets_getResponse(const RequestHeader*);
+
+
+#endif /* FMASSETS_H */
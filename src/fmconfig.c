@@ -1,3 +1,6 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdbool.h>
 #include "fmconfig.h"
 #include "cmdline.h"
@@ -5,15 +8,25 @@
 #include "membuf.h"
 #include "md5calc.h"
 #include "auth.h"
+#include "contenttype.h"
+#include "pathcache.h"
+#include "cgicache.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fnmatch.h>
+#include <alloca.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <pwd.h>
+#include <fcntl.h>
+#ifdef HAVE_LINUX_OPENAT2_H
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#endif
+#include <time.h>
 
 
 enum DirectoryOps {
@@ -24,47 +37,315 @@ enum DirectoryOps {
 };
 
 typedef struct {
-    const char *urlpath;
-    const char *syspath;
+    char *urlpath;
+    char *syspath;
+    int rootFd;         /* O_PATH descriptor of syspath; -1 if not open */
+    bool isDir;         /* whether syspath is a directory */
 } Share;
 
-static unsigned gListenPort;
-static const char *gSwitchUser = "www-data";
+/* Kinds of compiled CGI script patterns.
+ */
+enum CgiPatternKind {
+    CPK_LITERAL,            /* no wildcards */
+    CPK_SUFFIX,             /* '*' followed by literal */
+    CPK_GLOB                /* other; matched using fnmatch() */
+};
+
+/* CGI script pattern compiled for matching. Because of FNM_PATHNAME flag,
+ * a slash in the matched path may be matched only by a slash in pattern.
+ * Hence a pattern not starting with slash, containing N slashes, may match
+ * only the path part following the N+1st slash from the end.
+ */
+typedef struct {
+    enum CgiPatternKind kind;
+    const char *patt;
+    const char *literal;    /* CPK_LITERAL, CPK_SUFFIX: the literal;
+                             * CPK_GLOB: the pattern */
+    unsigned literalLen;    /* CPK_GLOB: length of literal prefix */
+    bool isAnchored;        /* whether the pattern starts with slash */
+    unsigned slashCount;
+} CgiPattern;
+
+/* URL path patterns compiled for matching.
+ */
+typedef struct {
+    char **patterns;            /* as specified in configuration */
+    unsigned patternCount;
+
+    /* patterns other than file extensions - "*.ext"
+     */
+    CgiPattern *compiled;
+    unsigned compiledCount;
+
+    /* File extensions, specified as "*.ext" patterns, sorted.
+     */
+    const char **extensions;
+    unsigned extensionCount;
+
+    /* Maximum slash count of not anchored patterns.
+     */
+    unsigned maxSlashCount;
+} PatternSet;
+
+/* Handler of URL paths matching the patterns: FastCGI application
+ * specified by "fastcgi" option or Lua script specified by "luahandler".
+ */
+typedef struct {
+    PatternSet patterns;
+    char *location;         /* application address or script path */
+} ScriptApp;
 
-/* patterns specified as "index" option in configuration file.
+/* User credentials, specified by "credentials" option, with HA1 value of
+ * Digest authorization computed at configuration load.
  */
-static const char **gIndexPatterns;
-static unsigned gIndexPatternCount;
+typedef struct {
+    char *userName;         /* NULL when the hash table entry is unused */
+    unsigned userNameLen;
+    char ha1[33];
+} UserCredential;
 
-/* CGI script patterns
+/* Group of CGI scripts with common limit of running processes, specified
+ * by "cgilimit" option.
  */
-static const char **gCgiPatterns;
-static unsigned gCgiPatternCount;
+typedef struct {
+    PatternSet patterns;
+    char *name;             /* the patterns, as specified */
+    unsigned maxProcs;
+} CgiLimitGroup;
 
-/* List of shares, terminated with one with urlpath set to NULL
+/* Node of share tree. The tree reflects URL paths of shares; each node
+ * corresponds to one path segment. The root node corresponds to the empty
+ * URL path.
  */
-static Share *gShares;
+typedef struct ShareNode {
+    char *name;                     /* path segment */
+    unsigned nameLen;
+    Share *share;                   /* share with this URL path, if any */
+    struct ShareNode **children;    /* sorted by name */
+    unsigned childCount;
+} ShareNode;
 
+/* MIME type set by "type" option.
+ */
+typedef struct {
+    char *mimeType;
+    char *ext;
+} TypeOption;
 
-/* Available operations.
+/* Parsed configuration along with the structures derived from it.
+ * A snapshot is not changed after parse, except that share roots are opened
+ * lazily. Configuration reload creates a new snapshot; the old one is freed
+ * when the last request using it ends.
  */
-static enum DirectoryOps gAvailOps = DO_ALL;
+struct ConfigSnapshot {
+    unsigned refCount;
+    unsigned generation;
+    unsigned listenPort;
+    char *switchUser;
+
+    /* patterns specified as "index" option in configuration file.
+     */
+    char **indexPatterns;
+    unsigned indexPatternCount;
+
+    /* CGI script patterns
+     */
+    PatternSet cgiPatterns;
+
+    /* CGI scripts receiving chunked request body as it arrives
+     */
+    PatternSet cgiStreamPatterns;
+
+    /* CGI scripts which responses may be cached
+     */
+    PatternSet cgiCachePatterns;
+    unsigned cgiCacheSize;      /* in kilobytes */
+
+    ScriptApp *fastCgiApps;
+    unsigned fastCgiAppCount;
+
+    ScriptApp *luaHandlers;
+    unsigned luaHandlerCount;
+    unsigned luaMaxInstructions;
+    unsigned luaMaxMemory;      /* in kilobytes */
+
+    CgiLimitGroup *cgiLimits;
+    unsigned cgiLimitCount;
+    unsigned cgiDefaultLimit;   /* for scripts not in any group */
+    unsigned cgiTimeout;
+    unsigned cgiCpuLimit;
+
+    Share *shares;
+    unsigned shareCount;
+    ShareNode *shareRoot;
+
+    /* Available operations.
+     */
+    enum DirectoryOps availOps;
+
+    /* Operations which may be performed by guest.
+     */
+    enum DirectoryOps guestOps;
+
+    /* "credentials" option values, as specified; NULL-terminated, NULL
+     * when there are none. Used while the configuration is loaded only.
+     */
+    char **credentials;
+
+    /* Open addressing hash table of credentials, keyed by user name;
+     * the size is a power of two.
+     */
+    UserCredential *userCreds;
+    unsigned userCredSize;
+
+    /* Time in seconds after which Digest authorization nonce expires.
+     */
+    unsigned nonceLifetime;
+
+    /* Lifetime in seconds of login session token; 0 - sessions disabled.
+     */
+    unsigned sessionLifetime;
+
+    /* Limits of request header: request line length, total size of header
+     * field lines and number of header fields; 0 - no limit.
+     */
+    unsigned maxRequestLine;
+    unsigned maxHeaderSize;
+    unsigned maxHeaderCount;
+
+    /* Limits of form data posted to file manager: total size of data kept
+     * in memory and number of parts; 0 - no limit.
+     */
+    unsigned maxFormSize;
+    unsigned maxFormParts;
+
+    /* Maximum number of open client connections.
+     */
+    unsigned maxClients;
+
+    /* Time in seconds to finish open connections when shutting down.
+     */
+    unsigned drainTimeout;
+
+    /* Whether folder entries are sorted in natural order.
+     */
+    bool isNaturalSortOrder;
+
+    /* File with MIME types of file name extensions. Empty when none.
+     */
+    char *mimeTypesFile;
+    bool isMimeTypesFileSet;
+
+    TypeOption *types;
+    unsigned typeCount;
+};
+
+/* The most recently loaded configuration.
+ */
+static ConfigSnapshot *gLatestConfig;
+
+/* Configuration in use: the latest one or the one selected by config_use().
+ */
+static ConfigSnapshot *gConfig;
+
+
+static void freeStrings(char ***strs, unsigned *count)
+{
+    unsigned i;
+
+    for(i = 0; i < *count; ++i)
+        free((*strs)[i]);
+    free(*strs);
+    *strs = NULL;
+    *count = 0;
+}
+
+static void addPattern(PatternSet *ps, const DataChunk *dchPatt)
+{
+    ps->patterns = realloc(ps->patterns,
+            (ps->patternCount+1) * sizeof(char*));
+    ps->patterns[ps->patternCount++] = dch_dupToStr(dchPatt);
+}
 
+static void freePatterns(PatternSet *ps)
+{
+    freeStrings(&ps->patterns, &ps->patternCount);
+    free(ps->compiled);
+    free(ps->extensions);
+    memset(ps, 0, sizeof(PatternSet));
+}
 
-/* Operations which may be performed by guest.
+/* Adds patterns from option value. Empty value clears the set.
  */
-static enum DirectoryOps gGuestOps = DO_ALL;
+static void parsePatterns(PatternSet *ps, DataChunk *dchValue)
+{
+    DataChunk dchPatt;
+    unsigned countPre = ps->patternCount;
+
+    while( dch_extractTillWS(dchValue, &dchPatt) )
+        addPattern(ps, &dchPatt);
+    if( ps->patternCount == countPre )
+        freePatterns(ps);
+}
+
+static void freeCgiLimits(ConfigSnapshot *cfg)
+{
+    unsigned i;
+
+    for(i = 0; i < cfg->cgiLimitCount; ++i) {
+        freePatterns(&cfg->cgiLimits[i].patterns);
+        free(cfg->cgiLimits[i].name);
+    }
+    free(cfg->cgiLimits);
+    cfg->cgiLimits = NULL;
+    cfg->cgiLimitCount = 0;
+}
 
-static const char **gCredentials;
+static void freeScriptApps(ScriptApp **apps, unsigned *appCount)
+{
+    unsigned i;
 
+    for(i = 0; i < *appCount; ++i) {
+        freePatterns(&(*apps)[i].patterns);
+        free((*apps)[i].location);
+    }
+    free(*apps);
+    *apps = NULL;
+    *appCount = 0;
+}
 
-/* Maximum number of open client connections.
+/* Parses value of option specifying patterns followed by location of
+ * the handler. Empty value clears the list.
  */
-static unsigned gMaxClients = 10;
+static void parseScriptApp(ScriptApp **apps, unsigned *appCount,
+        DataChunk *dchValue, const char *optName, const char *configFName,
+        int lineNo)
+{
+    DataChunk dchPatt;
+    ScriptApp app;
 
+    memset(&app, 0, sizeof(app));
+    while( dch_extractTillWS(dchValue, &dchPatt) )
+        addPattern(&app.patterns, &dchPatt);
+    if( app.patterns.patternCount >= 2 ) {
+        /* the last word is the handler location */
+        app.location = app.patterns.patterns[--app.patterns.patternCount];
+        *apps = realloc(*apps, (*appCount+1) * sizeof(ScriptApp));
+        (*apps)[(*appCount)++] = app;
+    }else{
+        if( app.patterns.patternCount == 1 )
+            fprintf(stderr, "%s:%d warning: %s option needs pattern and "
+                    "location; ignored\n", configFName, lineNo, optName);
+        freePatterns(&app.patterns);
+        freeScriptApps(apps, appCount);
+    }
+}
 
-static void parseFile(const char *configFName, int *shareCount,
-        int *credentialCount)
+/* Parses the configuration file into cfg. Returns false when the file
+ * cannot be read.
+ */
+static bool parseFile(ConfigSnapshot *cfg, const char *configFName,
+        unsigned *credentialCount)
 {
     FILE *fp;
     char buf[1024];
@@ -80,79 +361,187 @@ static void parseFile(const char *configFName, int *shareCount,
                 continue;
             if( dch_extractTillChrStripWS(&dchValue, &dchName, '=') ) {
                 if( dch_startsWithStr(&dchName, "/") ) {
-                    gShares = realloc(gShares,
-                            (*shareCount+1) * sizeof(Share));
+                    cfg->shares = realloc(cfg->shares,
+                            (cfg->shareCount+1) * sizeof(Share));
                     dch_trimTrailing(&dchName, '/');
-                    gShares[*shareCount].urlpath = dch_dupToStr(&dchName);
+                    cfg->shares[cfg->shareCount].urlpath =
+                        dch_dupToStr(&dchName);
                     dch_trimTrailing(&dchValue, '/');
-                    gShares[*shareCount].syspath = dch_dupToStr(&dchValue);
-                    ++*shareCount;
+                    cfg->shares[cfg->shareCount].syspath =
+                        dch_dupToStr(&dchValue);
+                    cfg->shares[cfg->shareCount].rootFd = -1;
+                    ++cfg->shareCount;
                 }else if( dch_equalsStr(&dchName, "index") ) {
-                    int countPre = gIndexPatternCount;
+                    int countPre = cfg->indexPatternCount;
                     while( dch_extractTillWS(&dchValue, &dchPatt) ) {
-                        gIndexPatterns = realloc(gIndexPatterns,
-                            (gIndexPatternCount+1) * sizeof(const char*));
-                        gIndexPatterns[gIndexPatternCount++] =
+                        cfg->indexPatterns = realloc(cfg->indexPatterns,
+                            (cfg->indexPatternCount+1) * sizeof(char*));
+                        cfg->indexPatterns[cfg->indexPatternCount++] =
                             dch_dupToStr(&dchPatt);
                     }
-                    if( gIndexPatternCount == countPre ) {
-                        free(gIndexPatterns);
-                        gIndexPatterns = NULL;
-                        gIndexPatternCount = 0;
-                    }
+                    if( cfg->indexPatternCount == countPre )
+                        freeStrings(&cfg->indexPatterns,
+                                &cfg->indexPatternCount);
                 }else if( dch_equalsStr(&dchName, "cgi") ) {
-                    int countPre = gCgiPatternCount;
-                    while( dch_extractTillWS(&dchValue, &dchPatt) ) {
-                        gCgiPatterns = realloc(gCgiPatterns,
-                            (gCgiPatternCount+1) * sizeof(const char*));
-                        gCgiPatterns[gCgiPatternCount++] =
-                            dch_dupToStr(&dchPatt);
-                    }
-                    if( gCgiPatternCount == countPre ) {
-                        free(gCgiPatterns);
-                        gCgiPatterns = NULL;
-                        gCgiPatternCount = 0;
+                    parsePatterns(&cfg->cgiPatterns, &dchValue);
+                }else if( dch_equalsStr(&dchName, "cgistream") ) {
+                    parsePatterns(&cfg->cgiStreamPatterns, &dchValue);
+                }else if( dch_equalsStr(&dchName, "cgicache") ) {
+                    parsePatterns(&cfg->cgiCachePatterns, &dchValue);
+                }else if( dch_equalsStr(&dchName, "cgicachesize") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->cgiCacheSize) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "cgicachesize value\n", configFName, lineNo);
+                }else if( dch_equalsStr(&dchName, "fastcgi") ) {
+                    parseScriptApp(&cfg->fastCgiApps, &cfg->fastCgiAppCount,
+                            &dchValue, "fastcgi", configFName, lineNo);
+                }else if( dch_equalsStr(&dchName, "luahandler") ) {
+#ifdef HAVE_LUA
+                    parseScriptApp(&cfg->luaHandlers, &cfg->luaHandlerCount,
+                            &dchValue, "luahandler", configFName, lineNo);
+#else
+                    fprintf(stderr, "%s:%d warning: built without Lua; "
+                            "luahandler ignored\n", configFName, lineNo);
+#endif
+                }else if( dch_equalsStr(&dchName, "luamaxinstructions") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->luaMaxInstructions) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "luamaxinstructions value\n", configFName,
+                                lineNo);
+                }else if( dch_equalsStr(&dchName, "luamaxmemory") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->luaMaxMemory) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "luamaxmemory value\n", configFName, lineNo);
+                }else if( dch_equalsStr(&dchName, "cgilimit") ) {
+                    CgiLimitGroup group;
+                    memset(&group, 0, sizeof(group));
+                    if( ! dch_extractTillWS(&dchValue, &dchPatt) ) {
+                        freeCgiLimits(cfg);
+                    }else if( ! dch_toUInt(&dchPatt, 0, &group.maxProcs) ) {
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "cgilimit value\n", configFName, lineNo);
+                    }else{
+                        dch_trimWS(&dchValue);
+                        group.name = dch_dupToStr(&dchValue);
+                        parsePatterns(&group.patterns, &dchValue);
+                        if( group.patterns.patternCount == 0 ) {
+                            cfg->cgiDefaultLimit = group.maxProcs;
+                            free(group.name);
+                        }else{
+                            cfg->cgiLimits = realloc(cfg->cgiLimits,
+                                (cfg->cgiLimitCount+1) * sizeof(CgiLimitGroup));
+                            cfg->cgiLimits[cfg->cgiLimitCount++] = group;
+                        }
                     }
+                }else if( dch_equalsStr(&dchName, "cgitimeout") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->cgiTimeout) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "cgitimeout value\n", configFName, lineNo);
+                }else if( dch_equalsStr(&dchName, "cgicpulimit") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->cgiCpuLimit) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "cgicpulimit value\n", configFName, lineNo);
                 }else if( dch_equalsStr(&dchName, "port") ) {
-                    if( ! dch_toUInt(&dchValue, 0, &gListenPort) )
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->listenPort) )
                         fprintf(stderr, "%s:%d warning: unrecognized port",
                                 configFName, lineNo);
                 }else if( dch_equalsStr(&dchName, "user") ) {
-                    gSwitchUser = dch_dupToStr(&dchValue);
+                    free(cfg->switchUser);
+                    cfg->switchUser = dch_dupToStr(&dchValue);
                 }else if( dch_equalsStr(&dchName, "dirops") ) {
                     if( dch_equalsStr(&dchValue, "all") ) {
-                        gAvailOps = DO_ALL;
+                        cfg->availOps = DO_ALL;
                     }else if( dch_equalsStr(&dchValue, "listing") ) {
-                        gAvailOps = DO_LISTING;
+                        cfg->availOps = DO_LISTING;
                     }else{
                         if( ! dch_equalsStr(&dchValue, "none") )
                             fprintf(stderr, "%s:%d warning: bad dirops value; "
                                     "assuming \"none\"\n", configFName, lineNo);
-                        gAvailOps = DO_NONE;
+                        cfg->availOps = DO_NONE;
                     }
                 }else if( dch_equalsStr(&dchName, "guestops") ) {
                     if( dch_equalsStr(&dchValue, "all") ) {
-                        gGuestOps = DO_ALL;
+                        cfg->guestOps = DO_ALL;
                     }else if( dch_equalsStr(&dchValue, "listing") ) {
-                        gGuestOps = DO_LISTING;
+                        cfg->guestOps = DO_LISTING;
                     }else if( dch_equalsStr(&dchValue, "file") ) {
-                        gGuestOps = DO_FILE;
+                        cfg->guestOps = DO_FILE;
                     }else{
                         if( ! dch_equalsStr(&dchValue, "none") )
                             fprintf(stderr, "%s:%d warning: bad guestops "
                                     "value; assuming \"none\"\n",
                                     configFName, lineNo);
-                        gGuestOps = DO_NONE;
+                        cfg->guestOps = DO_NONE;
                     }
                 }else if( dch_equalsStr(&dchName, "credentials") ) {
-                    gCredentials = realloc(gCredentials,
-                            (*credentialCount+1) * sizeof(char*));
-                    gCredentials[*credentialCount] = dch_dupToStr(&dchValue);
+                    cfg->credentials = realloc(cfg->credentials,
+                            (*credentialCount+2) * sizeof(char*));
+                    cfg->credentials[*credentialCount] =
+                        dch_dupToStr(&dchValue);
+                    cfg->credentials[*credentialCount+1] = NULL;
                     ++*credentialCount;
+                }else if( dch_equalsStr(&dchName, "noncelifetime") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->nonceLifetime) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "noncelifetime value\n", configFName, lineNo);
+                }else if( dch_equalsStr(&dchName, "sessionlifetime") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->sessionLifetime) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "sessionlifetime value\n", configFName, lineNo);
+                }else if( dch_equalsStr(&dchName, "maxrequestline") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->maxRequestLine) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "maxrequestline value\n", configFName, lineNo);
+                }else if( dch_equalsStr(&dchName, "maxheadersize") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->maxHeaderSize) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "maxheadersize value\n", configFName, lineNo);
+                }else if( dch_equalsStr(&dchName, "maxheadercount") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->maxHeaderCount) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "maxheadercount value\n", configFName, lineNo);
+                }else if( dch_equalsStr(&dchName, "maxformsize") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->maxFormSize) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "maxformsize value\n", configFName, lineNo);
+                }else if( dch_equalsStr(&dchName, "maxformparts") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->maxFormParts) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "maxformparts value\n", configFName, lineNo);
                 }else if( dch_equalsStr(&dchName, "maxclients") ) {
-                    if( ! dch_toUInt(&dchValue, 0, &gMaxClients) )
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->maxClients) )
                         fprintf(stderr, "%s:%d warning: unrecognized "
                                 "maxclients value", configFName, lineNo);
+                }else if( dch_equalsStr(&dchName, "draintimeout") ) {
+                    if( ! dch_toUInt(&dchValue, 0, &cfg->drainTimeout) )
+                        fprintf(stderr, "%s:%d warning: unrecognized "
+                                "draintimeout value\n", configFName, lineNo);
+                }else if( dch_equalsStr(&dchName, "sortorder") ) {
+                    if( dch_equalsStr(&dchValue, "natural") ) {
+                        cfg->isNaturalSortOrder = true;
+                    }else{
+                        if( ! dch_equalsStr(&dchValue, "collate") )
+                            fprintf(stderr, "%s:%d warning: bad sortorder "
+                                    "value; assuming \"collate\"\n",
+                                    configFName, lineNo);
+                        cfg->isNaturalSortOrder = false;
+                    }
+                }else if( dch_equalsStr(&dchName, "mimetypes") ) {
+                    free(cfg->mimeTypesFile);
+                    cfg->mimeTypesFile = dch_dupToStr(&dchValue);
+                    cfg->isMimeTypesFileSet = true;
+                }else if( dch_equalsStr(&dchName, "type") ) {
+                    DataChunk dchMime;
+                    TypeOption *type;
+                    if( dch_extractTillWS(&dchValue, &dchMime) ) {
+                        while( dch_extractTillWS(&dchValue, &dchPatt) ) {
+                            cfg->types = realloc(cfg->types,
+                                (cfg->typeCount+1) * sizeof(TypeOption));
+                            type = cfg->types + cfg->typeCount++;
+                            type->mimeType = dch_dupToStr(&dchMime);
+                            type->ext = dch_dupToStr(&dchPatt);
+                        }
+                    }
                 }else{
                     fprintf(stderr, "%s:%d warning: unrecognized option "
                             "\"%.*s\", ignored\n", configFName, lineNo,
@@ -167,55 +556,513 @@ static void parseFile(const char *configFName, int *shareCount,
     }else{
         fprintf(stderr, "WARN: unable to read configuration from %s: %s\n",
                 configFName, strerror(errno));
+        return false;
     }
+    return true;
 }
 
-void config_parse(void)
+static ShareNode *newShareNode(const char *name, unsigned nameLen)
 {
-    int shareCount = 0, credentialCount = 0, sysErrNo, len, dirNameLen;
-    const char *configLoc = cmdline_getConfigLoc();
-    Folder *folder;
-    const FolderEntry *fe;
+    ShareNode *node = malloc(sizeof(ShareNode));
 
-    if( (folder = folder_loadDir(configLoc, &sysErrNo)) != NULL ) {
-        MemBuf *filePathName = mb_newWithStr(configLoc);
-        if( ! mb_endsWithStr(filePathName, "/") )
-            mb_appendStr(filePathName, "/");
-        dirNameLen = mb_dataLen(filePathName);
-        for(fe = folder_getEntries(folder); fe->fileName != NULL; ++fe) {
-            if( fe->isDir )
-                continue;
-            len = strlen(fe->fileName);
-            if( len >= 5 && !strcmp(fe->fileName + len - 5, ".conf") ) {
-                mb_setStrEnd(filePathName, dirNameLen, fe->fileName);
-                parseFile(mb_data(filePathName), &shareCount, &credentialCount);
-            }
+    node->name = malloc(nameLen + 1);
+    memcpy(node->name, name, nameLen);
+    node->name[nameLen] = '\0';
+    node->nameLen = nameLen;
+    node->share = NULL;
+    node->children = NULL;
+    node->childCount = 0;
+    return node;
+}
+
+static int cmpSegment(const char *name1, unsigned len1,
+        const char *name2, unsigned len2)
+{
+    int res = memcmp(name1, name2, len1 < len2 ? len1 : len2);
+
+    return res ? res : len1 < len2 ? -1 : len1 > len2;
+}
+
+/* Returns index of child node having the given name. When not found,
+ * returns index where the child should be inserted and sets *isFound
+ * to false.
+ */
+static unsigned findShareChild(const ShareNode *node, const char *name,
+        unsigned nameLen, bool *isFound)
+{
+    unsigned lo = 0, hi = node->childCount, mid;
+    int cmp;
+
+    while( lo < hi ) {
+        mid = (lo + hi) / 2;
+        cmp = cmpSegment(node->children[mid]->name,
+                node->children[mid]->nameLen, name, nameLen);
+        if( cmp == 0 ) {
+            *isFound = true;
+            return mid;
+        }
+        if( cmp < 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *isFound = false;
+    return lo;
+}
+
+static const ShareNode *getShareChild(const ShareNode *node,
+        const char *name, unsigned nameLen)
+{
+    bool isFound;
+    unsigned idx = findShareChild(node, name, nameLen, &isFound);
+
+    return isFound ? node->children[idx] : NULL;
+}
+
+static void addShareToTree(ShareNode *root, Share *share)
+{
+    ShareNode *node = root;
+    const char *seg = share->urlpath, *segEnd;
+    unsigned idx;
+    bool isFound;
+
+    while( *seg == '/' ) {
+        ++seg;
+        segEnd = seg + strcspn(seg, "/");
+        idx = findShareChild(node, seg, segEnd - seg, &isFound);
+        if( ! isFound ) {
+            node->children = realloc(node->children,
+                    (node->childCount+1) * sizeof(ShareNode*));
+            memmove(node->children + idx + 1, node->children + idx,
+                    (node->childCount - idx) * sizeof(ShareNode*));
+            node->children[idx] = newShareNode(seg, segEnd - seg);
+            ++node->childCount;
+        }
+        node = node->children[idx];
+        seg = segEnd;
+    }
+    /* the first share specified wins, as before */
+    if( node->share == NULL )
+        node->share = share;
+}
+
+/* Returns node corresponding exactly to the URL path, with trailing
+ * slashes ignored.
+ */
+static const ShareNode *getShareNodeForPath(const char *urlPath)
+{
+    const ShareNode *node = gConfig->shareRoot;
+    const char *seg = urlPath, *segEnd;
+    unsigned pathLen = strlen(urlPath);
+
+    while( pathLen > 0 && urlPath[pathLen-1] == '/' )
+        --pathLen;
+    while( node != NULL && seg < urlPath + pathLen ) {
+        ++seg;
+        for(segEnd = seg; segEnd < urlPath + pathLen && *segEnd != '/';
+                ++segEnd)
+            ;
+        node = getShareChild(node, seg, segEnd - seg);
+        seg = segEnd;
+    }
+    return node;
+}
+
+static int cmpCgiExtension(const void *ext1, const void *ext2)
+{
+    return strcmp(*(const char**)ext1, *(const char**)ext2);
+}
+
+/* Compiles the patterns for matching.
+ */
+static void compilePatterns(PatternSet *ps)
+{
+    unsigned i;
+    const char *patt, *wildcard, *slash;
+    CgiPattern *cp;
+
+    for(i = 0; i < ps->patternCount; ++i) {
+        patt = ps->patterns[i];
+        /* wildcard following the first character */
+        wildcard = patt[0] ? strpbrk(patt + 1, "*?[\\") : NULL;
+        if( patt[0] == '*' && patt[1] == '.' && wildcard == NULL &&
+                strpbrk(patt + 2, "/.") == NULL )
+        {
+            ps->extensions = realloc(ps->extensions,
+                    (ps->extensionCount+1) * sizeof(const char*));
+            ps->extensions[ps->extensionCount++] = patt + 2;
+            continue;
+        }
+        ps->compiled = realloc(ps->compiled,
+                (ps->compiledCount+1) * sizeof(CgiPattern));
+        cp = ps->compiled + ps->compiledCount++;
+        cp->patt = patt;
+        cp->isAnchored = patt[0] == '/';
+        cp->slashCount = 0;
+        for(slash = patt; (slash = strchr(slash, '/')) != NULL; ++slash)
+            ++cp->slashCount;
+        if( patt[0] == '*' && wildcard == NULL && cp->slashCount == 0 ) {
+            cp->kind = CPK_SUFFIX;
+            cp->literal = patt + 1;
+        }else if( strpbrk(patt, "*?[\\") == NULL ) {
+            cp->kind = CPK_LITERAL;
+            cp->literal = patt;
+        }else{
+            cp->kind = CPK_GLOB;
+            cp->literal = patt;
+        }
+        cp->literalLen = cp->kind == CPK_GLOB ? strcspn(patt, "*?[\\") :
+            strlen(cp->literal);
+        if( ! cp->isAnchored && cp->slashCount > ps->maxSlashCount )
+            ps->maxSlashCount = cp->slashCount;
+    }
+    if( ps->extensionCount > 0 )
+        qsort(ps->extensions, ps->extensionCount, sizeof(const char*),
+                cmpCgiExtension);
+}
+
+/* Opens the share root. Returns false when the share root does not exist.
+ */
+static bool openShareRoot(Share *share)
+{
+    struct stat st;
+
+    if( share->rootFd == -1 ) {
+        share->rootFd = open(share->syspath[0] ? share->syspath : "/",
+                O_PATH | O_CLOEXEC);
+        if( share->rootFd == -1 )
+            return false;
+        share->isDir = fstat(share->rootFd, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    return true;
+}
+
+static void freeShareNode(ShareNode *node)
+{
+    unsigned i;
+
+    for(i = 0; i < node->childCount; ++i)
+        freeShareNode(node->children[i]);
+    free(node->children);
+    free(node->name);
+    free(node);
+}
+
+/* FNV-1a hash of user name.
+ */
+static unsigned userNameHash(const char *userName, unsigned userNameLen)
+{
+    unsigned hash = 2166136261u;
+
+    while( userNameLen-- )
+        hash = (hash ^ (unsigned char)*userName++) * 16777619u;
+    return hash;
+}
+
+/* Returns the hash table entry for the user name: either the one with
+ * the user credentials or an unused one.
+ */
+static UserCredential *findUserCred(const ConfigSnapshot *cfg,
+        const char *userName, unsigned userNameLen)
+{
+    UserCredential *uc;
+    unsigned idx = userNameHash(userName, userNameLen) & (cfg->userCredSize-1);
+
+    while( (uc = cfg->userCreds + idx)->userName != NULL &&
+            (uc->userNameLen != userNameLen ||
+             memcmp(uc->userName, userName, userNameLen)) )
+        idx = (idx + 1) & (cfg->userCredSize - 1);
+    return uc;
+}
+
+/* Fills the credentials hash table from "credentials" option values.
+ * A value is either user name and password separated by colon, or user name
+ * followed by 32-digit HA1, as returned by config_getCredentialsEncoded().
+ * The option values, containing plain passwords, are freed.
+ */
+static void setupUserCreds(ConfigSnapshot *cfg, unsigned credentialCount)
+{
+    char **cred, *colon;
+    unsigned userNameLen;
+    UserCredential *uc;
+    MemBuf *a1;
+
+    if( cfg->credentials == NULL )
+        return;
+    cfg->userCredSize = 4;
+    while( cfg->userCredSize < 2 * credentialCount )
+        cfg->userCredSize *= 2;
+    cfg->userCreds = calloc(cfg->userCredSize, sizeof(UserCredential));
+    for(cred = cfg->credentials; *cred != NULL; ++cred) {
+        if( (colon = strchr(*cred, ':')) != NULL )
+            userNameLen = colon - *cred;
+        else if( (userNameLen = strlen(*cred)) >= 32 )
+            userNameLen -= 32;
+        else
+            continue;
+        uc = findUserCred(cfg, *cred, userNameLen);
+        if( uc->userName != NULL )  /* the first one applies */
+            continue;
+        uc->userName = malloc(userNameLen + 1);
+        memcpy(uc->userName, *cred, userNameLen);
+        uc->userName[userNameLen] = '\0';
+        uc->userNameLen = userNameLen;
+        if( colon != NULL ) {
+            a1 = mb_new();
+            mb_appendData(a1, *cred, userNameLen + 1);
+            mb_appendStr(a1, FM_REALM);
+            mb_appendStr(a1, colon);
+            md5_calculate(uc->ha1, mb_data(a1), mb_dataLen(a1));
+            mb_fillWithZeros(a1, 0, mb_dataLen(a1));
+            mb_free(a1);
+        }else{
+            memcpy(uc->ha1, *cred + userNameLen, 32);
+            uc->ha1[32] = '\0';
         }
-        mb_free(filePathName);
-    }else
-        parseFile(configLoc, &shareCount, &credentialCount);
-    if( shareCount == 0 ) {
-        gShares = realloc(gShares, (shareCount+1) * sizeof(Share));
-        gShares[shareCount].urlpath = "";
-        gShares[shareCount].syspath = HTMLDIR "/welcome.html";
-        ++shareCount;
     }
-    gShares = realloc(gShares, (shareCount+1) * sizeof(Share));
-    gShares[shareCount].urlpath = NULL;
-    gShares[shareCount].syspath = NULL;
-    if( credentialCount > 0 ) {
-        gCredentials = realloc(gCredentials,
-                (credentialCount+1) * sizeof(char*));
-        gCredentials[credentialCount] = NULL;
+    for(cred = cfg->credentials; *cred != NULL; ++cred) {
+        memset(*cred, 0, strlen(*cred));
+        free(*cred);
     }
-    if( gListenPort == 0 ) {
-        gListenPort = geteuid() == 0 ? 80 : 8000;
+    free(cfg->credentials);
+    cfg->credentials = NULL;
+}
+
+static void freeSnapshot(ConfigSnapshot *cfg)
+{
+    unsigned i;
+    char **cred;
+
+    free(cfg->switchUser);
+    freeStrings(&cfg->indexPatterns, &cfg->indexPatternCount);
+    freePatterns(&cfg->cgiPatterns);
+    freePatterns(&cfg->cgiStreamPatterns);
+    freePatterns(&cfg->cgiCachePatterns);
+    freeScriptApps(&cfg->fastCgiApps, &cfg->fastCgiAppCount);
+    freeScriptApps(&cfg->luaHandlers, &cfg->luaHandlerCount);
+    freeCgiLimits(cfg);
+    for(i = 0; i < cfg->shareCount; ++i) {
+        free(cfg->shares[i].urlpath);
+        free(cfg->shares[i].syspath);
+        if( cfg->shares[i].rootFd != -1 )
+            close(cfg->shares[i].rootFd);
+    }
+    free(cfg->shares);
+    if( cfg->shareRoot != NULL )
+        freeShareNode(cfg->shareRoot);
+    if( cfg->credentials != NULL ) {
+        for(cred = cfg->credentials; *cred != NULL; ++cred)
+            free(*cred);
+        free(cfg->credentials);
     }
+    for(i = 0; i < cfg->userCredSize; ++i)
+        free(cfg->userCreds[i].userName);
+    free(cfg->userCreds);
+    free(cfg->mimeTypesFile);
+    for(i = 0; i < cfg->typeCount; ++i) {
+        free(cfg->types[i].mimeType);
+        free(cfg->types[i].ext);
+    }
+    free(cfg->types);
+    free(cfg);
+}
+
+static int isConfFile(const struct dirent *de)
+{
+    size_t len = strlen(de->d_name);
+
+    return len >= 5 && !strcmp(de->d_name + len - 5, ".conf");
+}
+
+static int compareNames(const struct dirent **de1, const struct dirent **de2)
+{
+    return strcmp((*de1)->d_name, (*de2)->d_name);
+}
+
+/* Parses the ".conf" files of configuration directory, in alphabetical
+ * order. Sets isDir to false when configLoc is not a directory.
+ * Returns false when the directory or some file cannot be read.
+ */
+static bool parseDir(ConfigSnapshot *cfg, const char *configLoc,
+        unsigned *credentialCount, bool *isDir)
+{
+    struct dirent **names;
+    struct stat st;
+    int i, count, dirNameLen;
+    MemBuf *filePathName;
+    bool isRead = true;
+
+    *isDir = true;
+    if( (count = scandir(configLoc, &names, isConfFile, compareNames)) < 0 ) {
+        *isDir = errno != ENOTDIR;
+        if( *isDir )
+            fprintf(stderr, "WARN: unable to read configuration from %s: "
+                    "%s\n", configLoc, strerror(errno));
+        return false;
+    }
+    filePathName = mb_newWithStr(configLoc);
+    if( ! mb_endsWithStr(filePathName, "/") )
+        mb_appendStr(filePathName, "/");
+    dirNameLen = mb_dataLen(filePathName);
+    for(i = 0; i < count; ++i) {
+        mb_setStrEnd(filePathName, dirNameLen, names[i]->d_name);
+        if( stat(mb_data(filePathName), &st) != 0 || ! S_ISDIR(st.st_mode) ) {
+            if( ! parseFile(cfg, mb_data(filePathName), credentialCount) )
+                isRead = false;
+        }
+        free(names[i]);
+    }
+    free(names);
+    mb_free(filePathName);
+    return isRead;
+}
+
+/* Loads configuration from files. Sets isRead to false when the
+ * configuration location or some configuration file cannot be read;
+ * returns NULL then, unless it is the first load.
+ */
+static ConfigSnapshot *loadSnapshot(bool *isRead)
+{
+    ConfigSnapshot *cfg = calloc(1, sizeof(ConfigSnapshot));
+    unsigned credentialCount = 0, i;
+    const char *configLoc = cmdline_getConfigLoc();
+    bool isDir;
+
+    cfg->refCount = 1;
+    cfg->switchUser = strdup("www-data");
+    cfg->availOps = DO_ALL;
+    cfg->guestOps = DO_ALL;
+    cfg->maxClients = 10;
+    cfg->drainTimeout = 30;
+    cfg->nonceLifetime = 3600;
+    cfg->maxRequestLine = 8192;
+    cfg->maxHeaderSize = 65536;
+    cfg->maxHeaderCount = 100;
+    cfg->maxFormSize = 1048576;
+    cfg->maxFormParts = 1000;
+    cfg->cgiDefaultLimit = 16;
+    cfg->cgiTimeout = 300;
+    cfg->cgiCacheSize = 16384;
+    cfg->luaMaxInstructions = 10000000;
+    cfg->luaMaxMemory = 8192;
+    cfg->mimeTypesFile = strdup("/etc/mime.types");
+    *isRead = parseDir(cfg, configLoc, &credentialCount, &isDir);
+    if( ! isDir )
+        *isRead = parseFile(cfg, configLoc, &credentialCount);
+    if( ! *isRead && gLatestConfig != NULL ) {
+        freeSnapshot(cfg);
+        return NULL;
+    }
+    if( cfg->shareCount == 0 ) {
+        cfg->shares = malloc(sizeof(Share));
+        cfg->shares[0].urlpath = strdup("");
+        cfg->shares[0].syspath = strdup(HTMLDIR "/welcome.html");
+        cfg->shares[0].rootFd = -1;
+        cfg->shareCount = 1;
+    }
+    setupUserCreds(cfg, credentialCount);
+    compilePatterns(&cfg->cgiPatterns);
+    compilePatterns(&cfg->cgiStreamPatterns);
+    compilePatterns(&cfg->cgiCachePatterns);
+    for(i = 0; i < cfg->fastCgiAppCount; ++i)
+        compilePatterns(&cfg->fastCgiApps[i].patterns);
+    for(i = 0; i < cfg->luaHandlerCount; ++i)
+        compilePatterns(&cfg->luaHandlers[i].patterns);
+    for(i = 0; i < cfg->cgiLimitCount; ++i)
+        compilePatterns(&cfg->cgiLimits[i].patterns);
+    cfg->shareRoot = newShareNode("", 0);
+    for(i = 0; i < cfg->shareCount; ++i) {
+        addShareToTree(cfg->shareRoot, cfg->shares + i);
+        openShareRoot(cfg->shares + i);
+    }
+    if( cfg->listenPort == 0 ) {
+        cfg->listenPort = geteuid() == 0 ? 80 : 8000;
+    }
+    return cfg;
+}
+
+/* Sets up the content types specified in configuration.
+ */
+static void setContentTypes(const ConfigSnapshot *cfg)
+{
+    DataChunk dchExt;
+    unsigned i;
+
+    cttype_clear();
+    for(i = 0; i < cfg->typeCount; ++i) {
+        dch_initWithStr(&dchExt, cfg->types[i].ext);
+        cttype_setType(cfg->types[i].mimeType, &dchExt);
+    }
+    if( cfg->mimeTypesFile[0] && ! cttype_loadMimeTypes(cfg->mimeTypesFile) &&
+            cfg->isMimeTypesFileSet )
+        fprintf(stderr, "WARN: unable to read MIME types from %s: %s\n",
+                cfg->mimeTypesFile, strerror(errno));
+}
+
+bool config_parse(void)
+{
+    bool isRead;
+
+    gConfig = gLatestConfig = loadSnapshot(&isRead);
+    setContentTypes(gConfig);
+    return isRead;
+}
+
+static void clearIndexFileCache(void);
+
+void config_reload(void)
+{
+    ConfigSnapshot *cfg;
+    bool isRead;
+
+    if( (cfg = loadSnapshot(&isRead)) == NULL ) {
+        fprintf(stderr, "WARN: configuration not reloaded\n");
+        return;
+    }
+    /* the settings below are applied on startup only */
+    if( cfg->listenPort != gLatestConfig->listenPort ||
+            strcmp(cfg->switchUser, gLatestConfig->switchUser) ||
+            cfg->maxClients != gLatestConfig->maxClients )
+        fprintf(stderr, "WARN: port, user and maxclients changes take "
+                "effect after restart\n");
+    cfg->listenPort = gLatestConfig->listenPort;
+    free(cfg->switchUser);
+    cfg->switchUser = strdup(gLatestConfig->switchUser);
+    cfg->maxClients = gLatestConfig->maxClients;
+    cfg->generation = gLatestConfig->generation + 1;
+    config_release(gLatestConfig);
+    gConfig = gLatestConfig = cfg;
+    setContentTypes(cfg);
+    clearIndexFileCache();
+    pathcache_clear();
+    cgicache_clear();
+}
+
+ConfigSnapshot *config_acquire(void)
+{
+    ++gConfig->refCount;
+    return gConfig;
+}
+
+void config_use(ConfigSnapshot *cfg)
+{
+    gConfig = cfg != NULL ? cfg : gLatestConfig;
+}
+
+void config_release(ConfigSnapshot *cfg)
+{
+    if( cfg != NULL && --cfg->refCount == 0 )
+        freeSnapshot(cfg);
+}
+
+unsigned config_getGeneration(void)
+{
+    return gConfig->generation;
 }
 
 unsigned config_getListenPort(void)
 {
-    return gListenPort;
+    return gConfig->listenPort;
 }
 
 bool config_switchToTargetUser(void)
@@ -223,9 +1070,9 @@ bool config_switchToTargetUser(void)
     int res = true;
     struct passwd *pwd;
 
-    if( gSwitchUser[0] && geteuid() == 0 ) {
+    if( gConfig->switchUser[0] && geteuid() == 0 ) {
         res = false;
-        if( (pwd = getpwnam(gSwitchUser)) != NULL ) {
+        if( (pwd = getpwnam(gConfig->switchUser)) != NULL ) {
             if( setgid(pwd->pw_gid) != 0 )
                 fprintf(stderr, "WARN: setgid: %s\n", strerror(errno));
             if( setuid(pwd->pw_uid) == 0 )
@@ -234,36 +1081,48 @@ bool config_switchToTargetUser(void)
                 fprintf(stderr, "setuid: %s\n", strerror(errno));
         }else{
             fprintf(stderr, "No such user \"%s\"; please specify a valid "
-                    "switch user in configuration file\n", gSwitchUser);
+                    "switch user in configuration file\n", gConfig->switchUser);
         }
     }
     return res;
 }
 
-char *config_getSysPathForUrlPath(const char *urlPath)
+/* Returns share corresponding to the URL path, NULL if none.
+ * Sets subPath to the URL path part following the share URL path.
+ */
+static Share *getShareForUrlPath(const char *urlPath, const char **subPath)
 {
-    const Share *cur, *best = NULL;
-    int urlPathLen, bestShLen = -1;
+    const ShareNode *node = gConfig->shareRoot;
+    Share *best = node->share;
+    const char *seg = urlPath, *segEnd;
 
     if( !strcmp(urlPath, "/" ) )
-        urlPath = "";
-    urlPathLen = strlen(urlPath);
-    for(cur = gShares; cur->urlpath; ++cur) {
-        int shLen = strlen(cur->urlpath);
-        if( shLen > urlPathLen || shLen <= bestShLen )
-            continue;
-        if( !strncmp(urlPath, cur->urlpath, shLen) &&
-            (shLen == urlPathLen || urlPath[shLen] == '/') )
-        {
-            best = cur;
-            bestShLen = shLen;
+        urlPath = seg = "";
+    *subPath = urlPath;
+    while( *seg == '/' ) {
+        ++seg;
+        segEnd = seg + strcspn(seg, "/");
+        if( (node = getShareChild(node, seg, segEnd - seg)) == NULL )
+            break;
+        if( node->share != NULL ) {
+            best = node->share;
+            *subPath = segEnd;
         }
+        seg = segEnd;
     }
-    if( best != NULL ) {
-        MemBuf *filePathName = mb_newWithStr(best->syspath);
-        if( urlPathLen > bestShLen ) {
-            mb_appendData(filePathName, urlPath + bestShLen,
-                    urlPathLen - bestShLen);
+    return best;
+}
+
+char *config_getSysPathForUrlPath(const char *urlPath)
+{
+    const Share *share;
+    const char *subPath;
+    MemBuf *filePathName;
+
+    if( (share = getShareForUrlPath(urlPath, &subPath)) != NULL ) {
+        filePathName = mb_newWithStr(share->syspath);
+        if( *subPath ) {
+            mb_appendStr(filePathName, subPath);
         }else if( mb_dataLen(filePathName) == 0 )
             mb_appendStr(filePathName, "/");
         return mb_unbox_free(filePathName);
@@ -271,109 +1130,359 @@ char *config_getSysPathForUrlPath(const char *urlPath)
     return NULL;
 }
 
-Folder *config_getSubSharesForPath(const char *urlPath)
+/* Opens path relative to directory. The path may not leave the directory,
+ * also using symbolic links. When openat2() is not available, the path
+ * is opened using openat(); then only ".." path elements are disallowed.
+ */
+static int openBeneath(int dirFd, const char *path, int flags)
 {
-    Folder *folder = NULL;
-    const Share *cur;
-    int pathLen;
-    DataChunk dchPath, ent;
-    const FolderEntry *fe;
-    struct stat st;
+    const char *dotdot;
+#ifdef HAVE_LINUX_OPENAT2_H
+    struct open_how how;
+    int fd;
 
-    pathLen = strlen(urlPath);
-    while( pathLen > 0 && urlPath[pathLen-1] == '/' )
-        --pathLen;
-    for(cur = gShares; cur->urlpath; ++cur) {
-        if( !strncmp(urlPath, cur->urlpath, pathLen) &&
-                cur->urlpath[pathLen] == '/')
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    fd = syscall(SYS_openat2, dirFd, path, &how, sizeof(how));
+    if( fd >= 0 || errno != ENOSYS ) {
+        /* escape attempt */
+        if( fd < 0 && errno == EXDEV )
+            errno = EACCES;
+        return fd;
+    }
+#endif
+    for(dotdot = path; (dotdot = strstr(dotdot, "..")) != NULL; ++dotdot) {
+        if( (dotdot == path || dotdot[-1] == '/') &&
+                (dotdot[2] == '\0' || dotdot[2] == '/') )
         {
-            dch_initWithStr(&dchPath, cur->urlpath + pathLen + 1);
-            dch_skipLeading(&dchPath, '/');
-            if( dchPath.len > 0 ) {
-                dch_extractTillChr(&dchPath, &ent, '/');
-                if( folder == NULL )
-                    folder = folder_new();
-                /* avoid duplicates */
-                for(fe = folder_getEntries(folder); fe->fileName != NULL &&
-                        !dch_equalsStr(&ent, fe->fileName); ++fe)
-                    ;
-                if( fe->fileName == NULL ) {
-                    if( dchPath.len || stat(cur->syspath, &st) < 0 )
-                        folder_addEntryChunk(folder, &ent, true, 
-                                S_IRWXU|S_IRWXG|S_IRWXO, 0);
-                    else
-                        folder_addEntryChunk(folder, &ent,
-                                S_ISDIR(st.st_mode), st.st_mode, st.st_size);
-                }
-            }
+            errno = EACCES;
+            return -1;
         }
     }
-    if( folder != NULL )
+    return openat(dirFd, path, flags | O_CLOEXEC);
+}
+
+int config_openUrlPath(const char *urlPath, int flags)
+{
+    Share *share;
+    const char *subPath;
+
+    if( (share = getShareForUrlPath(urlPath, &subPath)) == NULL ) {
+        errno = ENOENT;
+        return -1;
+    }
+    if( ! openShareRoot(share) )
+        return -1;
+    while( *subPath == '/' )
+        ++subPath;
+    if( ! share->isDir ) {
+        /* a file shared */
+        if( *subPath ) {
+            errno = ENOTDIR;
+            return -1;
+        }
+        return open(share->syspath, flags | O_CLOEXEC);
+    }
+    return openBeneath(share->rootFd, *subPath ? subPath : ".", flags);
+}
+
+/* Adds to folder the shares and share paths below the node.
+ */
+static void addSubShares(Folder *folder, const ShareNode *node)
+{
+    const ShareNode *child;
+    struct stat st;
+    unsigned i;
+
+    for(i = 0; i < node->childCount; ++i) {
+        child = node->children[i];
+        if( child->nameLen == 0 ) {
+            /* double slash in share path */
+            addSubShares(folder, child);
+        }else if( child->share == NULL ||
+                stat(child->share->syspath, &st) < 0 )
+            folder_addEntry(folder, child->name, true,
+                    S_IRWXU|S_IRWXG|S_IRWXO, 0);
+        else
+            folder_addEntry(folder, child->name, S_ISDIR(st.st_mode),
+                    st.st_mode, st.st_size);
+    }
+}
+
+bool config_hasSubShares(const char *urlPath)
+{
+    const ShareNode *node = getShareNodeForPath(urlPath);
+
+    return node != NULL && node->childCount > 0;
+}
+
+Folder *config_getSubSharesForPath(const char *urlPath)
+{
+    Folder *folder = NULL;
+    const ShareNode *node = getShareNodeForPath(urlPath);
+
+    if( node != NULL && node->childCount > 0 ) {
+        folder = folder_new();
+        addSubShares(folder, node);
         folder_sortEntries(folder);
+    }
     return folder;
 }
 
-char *config_getIndexFile(const char *dir, int *sysErrNo)
+/* Cached index file of a directory.
+ */
+typedef struct {
+    char *dir;                  /* NULL when the slot is unused */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;      /* directory modification time */
+    char *indexFile;            /* NULL when there is no index file */
+} IndexFileCacheEnt;
+
+/* Index file cache size; must be a power of two.
+ */
+enum { INDEX_CACHE_SIZE = 1024 };
+
+static IndexFileCacheEnt gIndexFileCache[INDEX_CACHE_SIZE];
+
+/* Time span after directory modification in which the directory index file
+ * is not cached. Directory modification time has limited resolution, so
+ * a modification made shortly after another one may not change the time.
+ */
+enum { INDEX_CACHE_RACY_SECS = 2 };
+
+static IndexFileCacheEnt *getIndexFileCacheEnt(const char *dir)
 {
-    DIR *d;
+    unsigned hash = 2166136261u;
+
+    while( *dir )
+        hash = (hash ^ (unsigned char)*dir++) * 16777619u;
+    return gIndexFileCache + (hash & (INDEX_CACHE_SIZE - 1));
+}
+
+static void clearIndexFileCache(void)
+{
+    unsigned i;
+
+    for(i = 0; i < INDEX_CACHE_SIZE; ++i) {
+        free(gIndexFileCache[i].dir);
+        free(gIndexFileCache[i].indexFile);
+        gIndexFileCache[i].dir = NULL;
+        gIndexFileCache[i].indexFile = NULL;
+    }
+}
+
+static char *findIndexFile(int dirFd, int *sysErrNo)
+{
+    DIR *d = NULL;
     struct dirent *dp;
     struct stat st;
-    unsigned dirNameLen, matchIdx, bestMatchIdx = gIndexPatternCount;
-    MemBuf *bestIdxFile = NULL;
+    unsigned matchIdx, bestMatchIdx = gConfig->indexPatternCount;
+    char *bestIdxFile = NULL;
+    int fd;
 
-    if( (d = opendir(dir)) != NULL ) {
-        MemBuf *filePathName = mb_newWithStr(dir);
-        if( ! mb_endsWithStr(filePathName, "/") )
-            mb_appendStr(filePathName, "/");
-        dirNameLen = mb_dataLen(filePathName);
+    if( (fd = openat(dirFd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) >= 0 &&
+            (d = fdopendir(fd)) == NULL )
+        close(fd);
+    if( d != NULL ) {
         while( bestMatchIdx > 0 && (dp = readdir(d)) != NULL ) {
             if( ! strcmp(dp->d_name, ".") || ! strcmp(dp->d_name, "..") )
                 continue;
             for( matchIdx = 0; matchIdx < bestMatchIdx; ++matchIdx ) {
-                if( fnmatch(gIndexPatterns[matchIdx], dp->d_name,
+                if( fnmatch(gConfig->indexPatterns[matchIdx], dp->d_name,
                             FNM_PERIOD) == 0 )
                     break;
             }
             if( matchIdx < bestMatchIdx ) {
-                mb_setStrEnd(filePathName, dirNameLen, dp->d_name);
-                if( stat(mb_data(filePathName), &st) == 0 &&
+                if( fstatat(dirfd(d), dp->d_name, &st, 0) == 0 &&
                         ! S_ISDIR(st.st_mode) )
                 {
-                    mb_newIfNull(&bestIdxFile);
-                    mb_setStrEnd(bestIdxFile, 0, mb_data(filePathName));
+                    free(bestIdxFile);
+                    bestIdxFile = strdup(dp->d_name);
                     bestMatchIdx = matchIdx;
                 }
             }
         }
         closedir(d);
-        mb_free(filePathName);
         *sysErrNo = 0;
     }else{
         *sysErrNo = errno;
     }
-    return bestIdxFile ? mb_unbox_free(bestIdxFile) : NULL;
+    return bestIdxFile;
+}
+
+char *config_getIndexFile(const char *dir, int dirFd,
+        const struct stat *dirStat, int *sysErrNo)
+{
+    IndexFileCacheEnt *ent;
+    char *indexFile;
+
+    if( gConfig->indexPatternCount == 0 ) {
+        *sysErrNo = 0;
+        return NULL;
+    }
+    ent = getIndexFileCacheEnt(dir);
+    if( ent->dir != NULL && !strcmp(ent->dir, dir) &&
+            ent->dev == dirStat->st_dev && ent->ino == dirStat->st_ino &&
+            ent->mtime.tv_sec == dirStat->st_mtim.tv_sec &&
+            ent->mtime.tv_nsec == dirStat->st_mtim.tv_nsec )
+    {
+        *sysErrNo = 0;
+        return ent->indexFile ? strdup(ent->indexFile) : NULL;
+    }
+    indexFile = findIndexFile(dirFd, sysErrNo);
+    if( *sysErrNo == 0 &&
+            dirStat->st_mtim.tv_sec + INDEX_CACHE_RACY_SECS < time(NULL) )
+    {
+        free(ent->dir);
+        free(ent->indexFile);
+        ent->dir = strdup(dir);
+        ent->dev = dirStat->st_dev;
+        ent->ino = dirStat->st_ino;
+        ent->mtime = dirStat->st_mtim;
+        ent->indexFile = indexFile ? strdup(indexFile) : NULL;
+    }
+    return indexFile;
+}
+
+static bool isCgiPatternMatch(const CgiPattern *cp, const char *subPath)
+{
+    unsigned subPathLen;
+
+    switch( cp->kind ) {
+    case CPK_LITERAL:
+        return !strcmp(subPath, cp->literal);
+    case CPK_SUFFIX:
+        subPathLen = strlen(subPath);
+        /* leading period is not matched by asterisk */
+        return subPath[0] != '.' && subPathLen >= cp->literalLen &&
+            !memcmp(subPath + subPathLen - cp->literalLen, cp->literal,
+                    cp->literalLen);
+    case CPK_GLOB:
+        break;
+    }
+    return !strncmp(subPath, cp->literal, cp->literalLen) &&
+        fnmatch(cp->patt, subPath, FNM_PATHNAME|FNM_PERIOD) == 0;
+}
+
+static bool isPatternSetMatch(const PatternSet *ps, const char *urlPath)
+{
+    unsigned i, slashCount = 0;
+    const char *fileName, *ext, *subPath;
+    const char **subPaths;
+    const CgiPattern *cp;
+
+    /* path parts following the slashes, starting from the last one */
+    subPaths = alloca((ps->maxSlashCount+1) * sizeof(const char*));
+    for(subPath = urlPath + strlen(urlPath); subPath != urlPath &&
+            slashCount <= ps->maxSlashCount; --subPath)
+    {
+        if( subPath[-1] == '/' )
+            subPaths[slashCount++] = subPath;
+    }
+    if( slashCount == 0 )
+        return false;
+    fileName = subPaths[0];
+    if( ps->extensionCount > 0 && fileName[0] != '.' &&
+            (ext = strrchr(fileName, '.')) != NULL )
+    {
+        ++ext;
+        if( bsearch(&ext, ps->extensions, ps->extensionCount,
+                    sizeof(const char*), cmpCgiExtension) != NULL )
+            return true;
+    }
+    for(i = 0; i < ps->compiledCount; ++i) {
+        cp = ps->compiled + i;
+        if( cp->isAnchored ) {
+            if( isCgiPatternMatch(cp, urlPath) )
+                return true;
+        }else if( cp->slashCount < slashCount ) {
+            if( isCgiPatternMatch(cp, subPaths[cp->slashCount]) )
+                return true;
+        }
+    }
+    return false;
 }
 
 bool config_isCGI(const char *urlPath)
 {
-    unsigned i;
-    const char *cgiPatt, *subPath;
-    bool match = false;
-
-    for( i = 0; i < gCgiPatternCount && !match; ++i) {
-        cgiPatt = gCgiPatterns[i];
-        if( cgiPatt[0] == '/' )
-            match = fnmatch(cgiPatt, urlPath, FNM_PATHNAME|FNM_PERIOD) == 0;
-        else{
-            subPath = urlPath;
-            while( subPath != NULL && ! match ) {
-                ++subPath;
-                match = fnmatch(cgiPatt, subPath, FNM_PATHNAME|FNM_PERIOD) == 0;
-                subPath = strchr(subPath, '/');
+    return isPatternSetMatch(&gConfig->cgiPatterns, urlPath);
+}
+
+bool config_isCGIStreamingBody(const char *urlPath)
+{
+    return isPatternSetMatch(&gConfig->cgiStreamPatterns, urlPath);
+}
+
+bool config_isCGICached(const char *urlPath)
+{
+    return isPatternSetMatch(&gConfig->cgiCachePatterns, urlPath);
+}
+
+unsigned long long config_getCGICacheSize(void)
+{
+    return gConfig->cgiCacheSize * 1024ULL;
+}
+
+/* Searches for the handler of URL path among apps. The URL path or its
+ * part up to some slash shall match a pattern.
+ */
+static bool findScriptApp(const ScriptApp *apps, unsigned appCount,
+        const char *urlPath, const char **location, char **scriptNameBuf,
+        char **pathInfoBuf)
+{
+    const ScriptApp *app;
+    char *scriptName;
+    unsigned len, i;
+
+    if( appCount == 0 )
+        return false;
+    scriptName = strdup(urlPath);
+    len = strlen(scriptName);
+    while( true ) {
+        for(i = 0; i < appCount; ++i) {
+            app = apps + i;
+            if( isPatternSetMatch(&app->patterns, scriptName) ) {
+                *location = app->location;
+                *scriptNameBuf = scriptName;
+                *pathInfoBuf = urlPath[len] ? strdup(urlPath + len) : NULL;
+                return true;
             }
         }
+        /* try the path without last segment */
+        while( len > 0 && scriptName[len-1] != '/' )
+            --len;
+        if( len <= 1 )
+            break;
+        scriptName[--len] = '\0';
     }
-    return match;
+    free(scriptName);
+    return false;
+}
+
+bool config_findFastCGI(const char *urlPath, const char **appAddress,
+        char **scriptNameBuf, char **pathInfoBuf)
+{
+    return findScriptApp(gConfig->fastCgiApps, gConfig->fastCgiAppCount,
+            urlPath, appAddress, scriptNameBuf, pathInfoBuf);
+}
+
+bool config_findLuaHandler(const char *urlPath, const char **scriptPath,
+        char **scriptNameBuf, char **pathInfoBuf)
+{
+    return findScriptApp(gConfig->luaHandlers, gConfig->luaHandlerCount,
+            urlPath, scriptPath, scriptNameBuf, pathInfoBuf);
+}
+
+unsigned config_getLuaMaxInstructions(void)
+{
+    return gConfig->luaMaxInstructions;
+}
+
+unsigned long long config_getLuaMaxMemory(void)
+{
+    return gConfig->luaMaxMemory * 1024ULL;
 }
 
 bool config_findCGI(const char *urlPath, char **cgiExeBuf, char **cgiUrlBuf,
@@ -426,37 +1535,17 @@ bool config_findCGI(const char *urlPath, char **cgiExeBuf, char **cgiUrlBuf,
 bool config_getDigestAuthCredential(const char *userName, int userNameLen,
         char *md5sum)
 {
-    const char **cred, *passwdBeg, *found = NULL;
-    bool res = false;
+    const UserCredential *uc;
 
+    if( gConfig->userCreds == NULL )
+        return false;
     if( userNameLen == -1 )
         userNameLen = strlen(userName);
-    if( gCredentials != NULL ) {
-        for(cred = gCredentials; *cred != NULL; ++cred) {
-            if( ! strncmp(*cred, userName, userNameLen) ) {
-                passwdBeg = *cred + userNameLen;
-                if( *passwdBeg == ':' || (strlen(passwdBeg) == 32 &&
-                        strchr(passwdBeg, ':') == NULL) )
-                {
-                    found = passwdBeg;
-                    break;
-                }
-            }
-        }
-        if( found != NULL ) {
-            if( *found == ':' ) {
-                MemBuf *mb = mb_new();
-                mb_appendData(mb, *cred, userNameLen + 1);
-                mb_appendStr(mb, FM_REALM);
-                mb_appendStr(mb, *cred + userNameLen);
-                md5_calculate(md5sum, mb_data(mb), mb_dataLen(mb));
-                mb_free(mb);
-            }else   /* already encoded */
-                strcpy(md5sum, found);
-            res = true;
-        }
-    }
-    return res;
+    uc = findUserCred(gConfig, userName, userNameLen);
+    if( uc->userName == NULL )
+        return false;
+    memcpy(md5sum, uc->ha1, 33);
+    return true;
 }
 
 const char *config_getCredentialsEncoded(const char *userWithPasswd)
@@ -483,24 +1572,24 @@ bool config_isActionAvailable(enum PrivilegedAction pa)
         return true;
         break;
     case PA_LIST_FOLDER:
-        return gAvailOps != DO_NONE;
+        return gConfig->availOps != DO_NONE;
     default:    /* PA_MODIFY */
         break;
     }
-    return gAvailOps == DO_ALL;
+    return gConfig->availOps == DO_ALL;
 }
 
 bool config_isActionAllowed(enum PrivilegedAction pa, bool isLoggedIn)
 {
     if( ! config_isActionAvailable(pa) )
         return false;
-    if( isLoggedIn || gGuestOps == DO_ALL )
+    if( isLoggedIn || gConfig->guestOps == DO_ALL )
         return true;
     switch( pa ) {
     case PA_SERVE_PAGE:
-        return gGuestOps != DO_NONE;
+        return gConfig->guestOps != DO_NONE;
     case PA_LIST_FOLDER:
-        return gGuestOps == DO_LISTING;
+        return gConfig->guestOps == DO_LISTING;
     default:    /* PA_MODIFY */
         break;
     }
@@ -509,13 +1598,13 @@ bool config_isActionAllowed(enum PrivilegedAction pa, bool isLoggedIn)
 
 bool config_givesLoginMorePrivileges(void)
 {
-    switch( gGuestOps ) {
+    switch( gConfig->guestOps ) {
     case DO_ALL:
         return false;
     case DO_LISTING:
-        return gAvailOps == DO_ALL;
+        return gConfig->availOps == DO_ALL;
     case DO_FILE:
-        return gAvailOps != DO_NONE;
+        return gConfig->availOps != DO_NONE;
     default:    /* DO_NONE */
         break;
     }
@@ -524,6 +1613,74 @@ bool config_givesLoginMorePrivileges(void)
 
 unsigned config_getMaxClients(void)
 {
-    return gMaxClients;
+    return gConfig->maxClients;
+}
+
+unsigned config_getDrainTimeout(void)
+{
+    return gConfig->drainTimeout;
+}
+
+unsigned config_getNonceLifetime(void)
+{
+    return gConfig->nonceLifetime;
+}
+
+unsigned config_getSessionLifetime(void)
+{
+    return gConfig->sessionLifetime;
+}
+
+unsigned config_getMaxRequestLine(void)
+{
+    return gConfig->maxRequestLine;
+}
+
+unsigned config_getMaxHeaderSize(void)
+{
+    return gConfig->maxHeaderSize;
+}
+
+unsigned config_getMaxHeaderCount(void)
+{
+    return gConfig->maxHeaderCount;
+}
+
+unsigned config_getMaxFormSize(void)
+{
+    return gConfig->maxFormSize;
 }
 
+unsigned config_getMaxFormParts(void)
+{
+    return gConfig->maxFormParts;
+}
+
+unsigned config_getCGILimit(const char *urlPath, const char **groupName)
+{
+    unsigned i;
+
+    for(i = 0; i < gConfig->cgiLimitCount; ++i) {
+        if( isPatternSetMatch(&gConfig->cgiLimits[i].patterns, urlPath) ) {
+            *groupName = gConfig->cgiLimits[i].name;
+            return gConfig->cgiLimits[i].maxProcs;
+        }
+    }
+    *groupName = "";
+    return gConfig->cgiDefaultLimit;
+}
+
+unsigned config_getCGITimeout(void)
+{
+    return gConfig->cgiTimeout;
+}
+
+unsigned config_getCGICpuLimit(void)
+{
+    return gConfig->cgiCpuLimit;
+}
+
+bool config_isNaturalSortOrder(void)
+{
+    return gConfig->isNaturalSortOrder;
+}
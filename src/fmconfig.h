@@ -2,6 +2,7 @@
 #define FMCONFIG_H
 
 #include "folder.h"
+#include <sys/stat.h>
 
 
 enum PrivilegedAction {
@@ -10,9 +11,51 @@ enum PrivilegedAction {
     PA_MODIFY,
 };
 
-/* Parses configuration file.
+/* Configuration parsed from files, with structures derived from it.
  */
-void config_parse(void);
+typedef struct ConfigSnapshot ConfigSnapshot;
+
+
+/* Parses configuration file. Returns false when the configuration location
+ * or some configuration file cannot be read; the configuration is set up
+ * from the files read anyway.
+ */
+bool config_parse(void);
+
+
+/* Parses configuration files again and makes the new configuration current.
+ * Requests started earlier keep using the configuration they started with.
+ * Listen port, switch user and maximum number of clients are not changed.
+ * The files are read with privileges of the switch user. When the
+ * configuration location or some configuration file cannot be read, the
+ * configuration is left intact.
+ * Should not be called while a configuration is selected by config_use().
+ */
+void config_reload(void);
+
+
+/* Returns the configuration in use, with incremented reference count.
+ */
+ConfigSnapshot *config_acquire(void);
+
+
+/* Makes the config_* functions use the given configuration. When cfg is
+ * NULL, the current configuration is used.
+ */
+void config_use(ConfigSnapshot *cfg);
+
+
+/* Decrements reference count of the configuration. The configuration is
+ * freed when it is not current and not used anymore.
+ */
+void config_release(ConfigSnapshot*);
+
+
+/* Returns sequence number of the configuration in use. The number is
+ * incremented on every reload.
+ */
+unsigned config_getGeneration(void);
+
 
 unsigned config_getListenPort(void);
 
@@ -29,14 +72,35 @@ bool config_switchToTargetUser(void);
 char *config_getSysPathForUrlPath(const char *urlPath);
 
 
+/* Returns true when some shares have URL path below the given one, i.e.
+ * the URL path is a folder containing shares.
+ */
+bool config_hasSubShares(const char *urlPath);
+
+
+/* Returns folder containing the shares and share paths directly below
+ * the URL path. Returns NULL when there are none.
+ */
 Folder *config_getSubSharesForPath(const char *urlPath);
 
 
-/* Retrieves file to serve for dir. If such file does not exist, returns
- * NULL. NULL is also returned when error occurs. In this case sysErrNo is
- * set to errno. When no error occured, sysErrNo is set to 0.
+/* Opens file or directory at the URL path. The path is resolved beneath
+ * the share root directory: symbolic links leading outside of the share
+ * are not followed. Flags are like for open(2).
+ * Returns the file descriptor; on failure returns -1 and sets errno.
+ */
+int config_openUrlPath(const char *urlPath, int flags);
+
+
+/* Retrieves name of file to serve for dir. If such file does not exist,
+ * returns NULL. NULL is also returned when error occurs. In this case
+ * sysErrNo is set to errno. When no error occured, sysErrNo is set to 0.
+ * The dirFd parameter should be a descriptor of the dir, dirStat should
+ * contain the dir status. The result is cached until the directory
+ * modification time changes.
  */
-char *config_getIndexFile(const char *dir, int *sysErrNo);
+char *config_getIndexFile(const char *dir, int dirFd,
+        const struct stat *dirStat, int *sysErrNo);
 
 
 /* Returns true when the specified path does match some CGI pattern.
@@ -44,6 +108,23 @@ char *config_getIndexFile(const char *dir, int *sysErrNo);
 bool config_isCGI(const char *urlPath);
 
 
+/* Returns true when the CGI script at the URL path accepts chunked request
+ * body as it arrives, without CONTENT_LENGTH.
+ */
+bool config_isCGIStreamingBody(const char *urlPath);
+
+
+/* Returns true when responses of the CGI script at the URL path may be
+ * cached.
+ */
+bool config_isCGICached(const char *urlPath);
+
+
+/* Returns the CGI response cache size limit, in bytes.
+ */
+unsigned long long config_getCGICacheSize(void);
+
+
 /* Searches for CGI executable to handle given URL.
  * Returns true when found. The buffers are filled in this case with:
  *   cgiExeBuf      - CGI executable pathname
@@ -54,6 +135,38 @@ bool config_findCGI(const char *urlPath, char **cgiExeBuf, char **cgiUrlBuf,
         char **cgiSubPathBuf);
 
 
+/* Searches for FastCGI application to handle given URL.
+ * Returns true when found. The URL path or its part up to some slash
+ * shall match a pattern of the application. The output parameters are
+ * set in this case to:
+ *   appAddress     - the application address, as specified in configuration;
+ *                    valid as long as the configuration is in use
+ *   scriptNameBuf  - the matching URL path part
+ *   pathInfoBuf    - the rest of URL path (NULL when empty)
+ */
+bool config_findFastCGI(const char *urlPath, const char **appAddress,
+        char **scriptNameBuf, char **pathInfoBuf);
+
+
+/* Searches for Lua script handling given URL, like config_findFastCGI().
+ * The scriptPath is set to the script file path.
+ */
+bool config_findLuaHandler(const char *urlPath, const char **scriptPath,
+        char **scriptNameBuf, char **pathInfoBuf);
+
+
+/* Returns maximum number of Lua instructions executed by a handler call.
+ * 0 means no limit.
+ */
+unsigned config_getLuaMaxInstructions(void);
+
+
+/* Returns maximum amount of memory in bytes allocated by a Lua handler
+ * call. 0 means no limit.
+ */
+unsigned long long config_getLuaMaxMemory(void);
+
+
 /* Stores in md5sum a MD5 sum of string constructed as concatenation of:
  *      username ":" realm ":" password
  * Returns true on success, false when credentials for the user don't exist.
@@ -62,6 +175,8 @@ bool config_findCGI(const char *urlPath, char **cgiExeBuf, char **cgiUrlBuf,
  *
  * The string is formed per definition of A1 value in Digest authorization.
  * See RFC 2617 (Basic and Digest Access Authentication), section 3.2.2.2
+ * The sums are computed when the configuration is loaded; the lookup is
+ * done in a hash table keyed by user name.
  */
 bool config_getDigestAuthCredential(const char *userName, int userNameLen,
         char *md5sum);
@@ -92,4 +207,75 @@ bool config_givesLoginMorePrivileges(void);
  */
 unsigned config_getMaxClients(void);
 
+
+/* Returns time in seconds given to open connections to finish when
+ * the server is shutting down or upgrading.
+ */
+unsigned config_getDrainTimeout(void);
+
+
+/* Returns time in seconds after which a nonce given to client for Digest
+ * authorization expires. 0 means the nonces don't expire.
+ */
+unsigned config_getNonceLifetime(void);
+
+
+/* Returns lifetime in seconds of login session token. 0 means that
+ * sessions are disabled.
+ */
+unsigned config_getSessionLifetime(void);
+
+
+/* Returns maximum length of request line, in bytes. 0 means no limit.
+ */
+unsigned config_getMaxRequestLine(void);
+
+
+/* Returns maximum total size of request header field lines including line
+ * terminators (the request line not included), in bytes. 0 means no limit.
+ */
+unsigned config_getMaxHeaderSize(void);
+
+
+/* Returns maximum number of request header fields. 0 means no limit.
+ */
+unsigned config_getMaxHeaderCount(void);
+
+
+/* Returns maximum total size, in bytes, of posted form data which is kept
+ * in memory: part headers and fields other than uploaded files.
+ * 0 means no limit.
+ */
+unsigned config_getMaxFormSize(void);
+
+
+/* Returns maximum number of parts of posted form data. 0 means no limit.
+ */
+unsigned config_getMaxFormParts(void);
+
+
+/* Returns maximum number of CGI processes running at once in the group of
+ * the script at the URL path; 0 means no limit. The group name is stored
+ * in groupName; it is valid as long as the configuration is in use.
+ * Scripts not in any group share the default group, named "".
+ */
+unsigned config_getCGILimit(const char *urlPath, const char **groupName);
+
+
+/* Returns wall-clock time limit of CGI process run, in seconds.
+ * 0 means no limit.
+ */
+unsigned config_getCGITimeout(void);
+
+
+/* Returns CPU time limit of CGI process, in seconds. 0 means no limit.
+ */
+unsigned config_getCGICpuLimit(void);
+
+
+/* Returns true when folder entries should be sorted in natural order,
+ * i.e. with numbers compared by value.
+ */
+bool config_isNaturalSortOrder(void);
+
 #endif /* FMCONFIG_H */
@@ -39,6 +39,17 @@ void log_warn(const char *msg, ...)
     fprintf(stderr, "\n");
 }
 
+void log_info(const char *msg, ...)
+{
+    va_list args;
+
+    va_start(args, msg);
+    vfprintf(stdout, msg, args);
+    va_end(args);
+    printf("\n");
+    fflush(stdout);
+}
+
 void log_fatal(const char *msg, ...)
 {
     int err = errno;
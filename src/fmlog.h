@@ -12,6 +12,11 @@ void log_fatal(const char *msg, ...);
 
 void log_error(const char *msg, ...);
 void log_warn(const char *msg, ...);
+
+/* Prints out message regardless of log level.
+ */
+void log_info(const char *msg, ...);
+
 void log_debug(const char *msg, ...);
 
 
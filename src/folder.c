@@ -1,12 +1,18 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdbool.h>
 #include "folder.h"
 #include "membuf.h"
+#include "fmconfig.h"
 #include <string.h>
+#include <locale.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 
 
 struct Folder {
@@ -41,6 +47,8 @@ void folder_addEntryChunk(Folder *folder, const DataChunk *name, bool isDir,
     fe->isDir = isDir;
     fe->mode = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
     fe->size = size;
+    fe->sortKey = NULL;
+    fe->sortKeyLen = 0;
     fe[1].fileName = NULL;
     ++folder->entryCount;
 }
@@ -54,21 +62,110 @@ void folder_addEntry(Folder *folder, const char *name, bool isDir,
     folder_addEntryChunk(folder, &dch, isDir, mode, size);
 }
 
+/* Returns true when the collation order of the current locale is the same
+ * as byte order of strings, i.e. strxfrm() is identity.
+ */
+static bool isByteOrderCollation(void)
+{
+    const char *collate = setlocale(LC_COLLATE, NULL);
+
+    return collate == NULL || !strcmp(collate, "C") ||
+        !strcmp(collate, "POSIX");
+}
+
+/* Builds sort key for natural order: every run of digits is replaced with
+ * '0' character (which sorts digits between '/' and ':' as usual), followed
+ * by number of significant digits and then the digits. This way numbers
+ * are compared by value using plain memcmp() on the keys.
+ */
+static char *naturalSortKey(const char *fileName, unsigned *keyLen)
+{
+    const char *cur = fileName, *digBeg;
+    unsigned digCount;
+    char count;
+    MemBuf *key = mb_new();
+
+    while( *cur ) {
+        digBeg = cur;
+        while( *cur && (*cur < '0' || *cur > '9') )
+            ++cur;
+        if( cur != digBeg )
+            mb_appendData(key, digBeg, cur - digBeg);
+        if( *cur ) {
+            while( *cur == '0' )
+                ++cur;
+            digBeg = cur;
+            while( *cur >= '0' && *cur <= '9' )
+                ++cur;
+            /* file names are no longer than 255 bytes */
+            digCount = cur - digBeg;
+            count = digCount < 255 ? digCount : 255;
+            mb_appendData(key, "0", 1);
+            mb_appendData(key, &count, 1);
+            mb_appendData(key, digBeg, digCount);
+        }
+    }
+    *keyLen = mb_dataLen(key);
+    return mb_unbox_free(key);
+}
+
+static char *collateSortKey(const char *fileName, unsigned *keyLen)
+{
+    size_t len = strxfrm(NULL, fileName, 0);
+    char *key = malloc(len + 1);
+
+    strxfrm(key, fileName, len + 1);
+    *keyLen = len;
+    return key;
+}
+
 static int folderEntCompare(const void *pvEnt1, const void *pvEnt2)
 {
     const FolderEntry *ent1 = pvEnt1;
     const FolderEntry *ent2 = pvEnt2;
+    int res;
 
     if( ent1 ->isDir != ent2->isDir )
         return ent2->isDir - ent1->isDir;
-    return strcoll(ent1->fileName, ent2->fileName);
+    res = memcmp(ent1->sortKey, ent2->sortKey,
+            ent1->sortKeyLen < ent2->sortKeyLen ?
+            ent1->sortKeyLen : ent2->sortKeyLen);
+    if( res == 0 ) {
+        res = ent1->sortKeyLen == ent2->sortKeyLen ? 0 :
+            ent1->sortKeyLen < ent2->sortKeyLen ? -1 : 1;
+        if( res == 0 && ent1->sortKey != ent1->fileName )
+            res = strcmp(ent1->fileName, ent2->fileName);
+    }
+    return res;
 }
 
 void folder_sortEntries(Folder *folder)
 {
+    FolderEntry *fe;
+    bool isNatural, isByteOrder;
+
     if( folder->entryCount > 1 ) {
+        /* Keys are computed once per entry, not on every comparison.
+         * For "C" locale the file name itself is the key. */
+        isNatural = config_isNaturalSortOrder();
+        isByteOrder = isByteOrderCollation();
+        for(fe = folder->entries; fe->fileName; ++fe) {
+            if( isNatural )
+                fe->sortKey = naturalSortKey(fe->fileName, &fe->sortKeyLen);
+            else if( isByteOrder ) {
+                fe->sortKey = fe->fileName;
+                fe->sortKeyLen = strlen(fe->fileName);
+            }else
+                fe->sortKey = collateSortKey(fe->fileName, &fe->sortKeyLen);
+        }
         qsort(folder->entries, folder->entryCount, sizeof(FolderEntry),
                 folderEntCompare);
+        for(fe = folder->entries; fe->fileName; ++fe) {
+            if( fe->sortKey != fe->fileName )
+                free((char*)fe->sortKey);
+            fe->sortKey = NULL;
+            fe->sortKeyLen = 0;
+        }
     }
 }
 
@@ -89,34 +186,45 @@ void folder_free(Folder *folder)
     }
 }
 
-Folder *folder_loadDir(const char *dir, int *sysErrNo)
+Folder *folder_loadDirAt(int dirFd, int *sysErrNo)
 {
-    DIR *d;
+    DIR *d = NULL;
     struct dirent *dp;
     struct stat st;
-    unsigned dirNameLen;
     Folder *folder = NULL;
+    int fd;
 
     *sysErrNo = 0;
-    if( (d = opendir(dir)) != NULL ) {
-        MemBuf *filePathName = mb_newWithStr(dir);
-        mb_ensureEndsWithSlash(filePathName);
-        dirNameLen = mb_dataLen(filePathName);
+    if( (fd = openat(dirFd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) >= 0 &&
+            (d = fdopendir(fd)) == NULL )
+        close(fd);
+    if( d != NULL ) {
         folder = folder_new();
         while( (dp = readdir(d)) != NULL ) {
             if( !strcmp(dp->d_name, ".") || ! strcmp(dp->d_name, ".."))
                 continue;
-            mb_setStrEnd(filePathName, dirNameLen, dp->d_name);
-            if( stat(mb_data(filePathName), &st) == 0 ) {
+            if( fstatat(dirfd(d), dp->d_name, &st, 0) == 0 ) {
                 folder_addEntry(folder, dp->d_name, S_ISDIR(st.st_mode),
                         st.st_mode, st.st_size);
             }
         }
         folder_sortEntries(folder);
         closedir(d);
-        mb_free(filePathName);
     }else{
         *sysErrNo = errno;
     }
     return folder;
 }
+
+Folder *folder_loadDir(const char *dir, int *sysErrNo)
+{
+    Folder *folder = NULL;
+    int fd;
+
+    if( (fd = open(dir, O_PATH|O_DIRECTORY|O_CLOEXEC)) >= 0 ) {
+        folder = folder_loadDirAt(fd, sysErrNo);
+        close(fd);
+    }else
+        *sysErrNo = errno;
+    return folder;
+}
@@ -8,6 +8,9 @@ typedef struct {
     bool isDir;
     unsigned mode;              /* rwx permissions, like st_mode */
     unsigned long long size;
+    const char *sortKey;        /* collation key; used internally during
+                                 * folder_sortEntries() only */
+    unsigned sortKeyLen;
 } FolderEntry;
 
 typedef struct Folder Folder;
@@ -28,6 +31,8 @@ void folder_addEntryChunk(Folder*, const DataChunk *name, bool isDir,
 
 /* Sorts entries in directory listing. Entries are sorted as follows:
  * folders first, sorted alphabetically, then files, sorted alphabetically.
+ * When natural sort order is set in configuration, numbers within names
+ * are compared by their value, i.e. "file2" goes before "file10".
  */
 void folder_sortEntries(Folder*);
 
@@ -48,4 +53,10 @@ void folder_free(Folder*);
 Folder *folder_loadDir(const char *dir, int *sysErrNo);
 
 
+/* Loads contents of the directory specified by descriptor into folder.
+ * The descriptor remains open.
+ */
+Folder *folder_loadDirAt(int dirFd, int *sysErrNo);
+
+
 #endif /* FOLDER_H */
@@ -0,0 +1,615 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdbool.h>
+#include "luahandler.h"
+#include "membuf.h"
+#include "fmconfig.h"
+#include "fmlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#ifdef HAVE_LUA
+#ifdef HAVE_LUA_H
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#else
+#include <lua5.4/lua.h>
+#include <lua5.4/lauxlib.h>
+#include <lua5.4/lualib.h>
+#endif
+#endif
+
+
+#ifdef HAVE_LUA
+
+/* Size of response body piece after which the handler is suspended.
+ */
+enum { BODY_PIECE_SIZE = 65536 };
+
+/* Number of instructions between instruction limit checks.
+ */
+enum { INSTR_CHECK_STEP = 1000 };
+
+/* Name of the response object metatable in registry.
+ */
+#define RESPONSE_MT "filemanager.response"
+
+/* Limits of a handler call or a script load. Memory allocated and freed
+ * while the code runs is accounted to it.
+ */
+typedef struct {
+    unsigned long long instrCount;
+    unsigned long long instrMax;    /* 0 when unlimited */
+    long long memUsed;
+    unsigned long long memMax;      /* 0 when unlimited */
+} RunLimits;
+
+/* A loaded script. The script is kept loaded as long as it is current,
+ * i.e. the file did not change, or used by some request.
+ */
+typedef struct LuaScript {
+    char *path;
+    lua_State *L;
+    struct stat fileStat;
+    int handlerRef;             /* the handle() function in registry */
+    RunLimits *limits;          /* of the running code; NULL when none */
+    unsigned refCount;          /* number of requests using the script */
+    bool isCurrent;
+    struct LuaScript *next;
+} LuaScript;
+
+struct LuaRequest {
+    LuaScript *script;          /* NULL when the script failed to load */
+    lua_State *co;              /* the handler; NULL when finished */
+    int coRef;                  /* keeps the handler thread in registry */
+    LuaRequest **respObj;       /* the response userdata */
+    RunLimits limits;
+    bool onlyHead;
+    MemBuf *body;
+    bool isBodyTooLarge;
+    bool isBodyComplete;
+    bool isHeaderSent;
+    bool isFailed;              /* the handler raised error */
+    char *status;
+    char **headers;             /* names and values, alternately */
+    unsigned headerCount;
+    MemBuf *out;                /* response body piece */
+};
+
+static LuaScript *gScripts;
+
+
+static void *allocMem(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    LuaScript *script = ud;
+    RunLimits *limits = script->limits;
+    void *newPtr;
+
+    if( ptr == NULL )
+        osize = 0;  /* osize is object type then */
+    if( nsize == 0 ) {
+        free(ptr);
+        if( limits != NULL )
+            limits->memUsed -= osize;
+        return NULL;
+    }
+    if( limits != NULL && nsize > osize && limits->memMax != 0 &&
+            limits->memUsed + (long long)(nsize - osize) >
+            (long long)limits->memMax )
+        return NULL;
+    if( (newPtr = realloc(ptr, nsize)) != NULL && limits != NULL )
+        limits->memUsed += (long long)nsize - (long long)osize;
+    return newPtr;
+}
+
+/* The instruction count hook. Invoked for the handler thread and the
+ * coroutines created by the script.
+ */
+static void countInstructions(lua_State *L, lua_Debug *ar)
+{
+    LuaScript *script;
+    RunLimits *limits;
+
+    lua_getallocf(L, (void**)&script);
+    if( (limits = script->limits) == NULL )
+        return;
+    limits->instrCount += INSTR_CHECK_STEP;
+    if( limits->instrMax != 0 && limits->instrCount > limits->instrMax ) {
+        /* fail at each instruction, so the code can't continue after
+         * catching the error by pcall() */
+        lua_sethook(L, countInstructions, LUA_MASKCOUNT, 1);
+        luaL_error(L, "instruction limit exceeded");
+    }
+}
+
+/* Sets the limits of memory allocation and executed instructions for
+ * the Lua thread run.
+ */
+static void setLimits(LuaScript *script, lua_State *L, RunLimits *limits)
+{
+    script->limits = limits;
+    if( limits->instrMax != 0 )
+        lua_sethook(L, countInstructions, LUA_MASKCOUNT, INSTR_CHECK_STEP);
+}
+
+static const char *getStatusReason(int code)
+{
+    switch( code ) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    }
+    return "";
+}
+
+static LuaRequest *checkResponse(lua_State *L)
+{
+    LuaRequest **respObj = luaL_checkudata(L, 1, RESPONSE_MT);
+
+    if( *respObj == NULL )
+        luaL_error(L, "response is finished");
+    return *respObj;
+}
+
+static void checkHeaderNotSent(lua_State *L, const LuaRequest *req)
+{
+    if( req->isHeaderSent )
+        luaL_error(L, "response header is already sent");
+}
+
+/* resp:status(code [, reason])
+ */
+static int setStatus(lua_State *L)
+{
+    LuaRequest *req = checkResponse(L);
+    lua_Integer code = luaL_checkinteger(L, 2);
+    const char *reason;
+
+    luaL_argcheck(L, code >= 100 && code <= 999, 2, "invalid status code");
+    reason = luaL_optstring(L, 3, getStatusReason(code));
+    luaL_argcheck(L, strpbrk(reason, "\r\n") == NULL, 3, "invalid reason");
+    checkHeaderNotSent(L, req);
+    free(req->status);
+    req->status = malloc(strlen(reason) + 8);
+    sprintf(req->status, "%d %s", (int)code, reason);
+    return 0;
+}
+
+/* resp:header(name, value)
+ */
+static int addHeader(lua_State *L)
+{
+    LuaRequest *req = checkResponse(L);
+    const char *name = luaL_checkstring(L, 2);
+    const char *value = luaL_checkstring(L, 3);
+
+    luaL_argcheck(L, name[0] && strpbrk(name, ": \t\r\n") == NULL, 2,
+            "invalid header name");
+    luaL_argcheck(L, strcasecmp(name, "Content-Length") &&
+            strcasecmp(name, "Transfer-Encoding"), 2,
+            "header is set by server");
+    luaL_argcheck(L, strpbrk(value, "\r\n") == NULL, 3,
+            "invalid header value");
+    checkHeaderNotSent(L, req);
+    req->headers = realloc(req->headers,
+            (req->headerCount + 1) * 2 * sizeof(char*));
+    req->headers[2 * req->headerCount] = strdup(name);
+    req->headers[2 * req->headerCount + 1] = strdup(value);
+    ++req->headerCount;
+    return 0;
+}
+
+/* resp:write(str, ...)
+ */
+static int writeBody(lua_State *L)
+{
+    LuaRequest *req = checkResponse(L);
+    const char *data;
+    size_t len;
+    int i, top = lua_gettop(L);
+
+    for(i = 2; i <= top; ++i) {
+        data = luaL_checklstring(L, i, &len);
+        if( ! req->onlyHead )
+            mb_appendData(req->out, data, len);
+    }
+    if( mb_dataLen(req->out) < BODY_PIECE_SIZE )
+        return 0;
+    /* The handler can't be suspended from a coroutine created by the
+     * script, nor across a C function like table.sort(); the data is kept
+     * until the next write which can suspend it. */
+    if( L == req->co && lua_isyieldable(L) )
+        return lua_yield(L, 0);
+    if( req->limits.memMax != 0 && mb_dataLen(req->out) > req->limits.memMax )
+        luaL_error(L, "too much data written where the handler can't yield");
+    return 0;
+}
+
+static const luaL_Reg gResponseMethods[] = {
+    { "status", setStatus },
+    { "header", addHeader },
+    { "write",  writeBody },
+    { NULL, NULL }
+};
+
+/* Opens the standard libraries, except the ones doing I/O which would
+ * block the server.
+ */
+static void openLibs(lua_State *L)
+{
+    static const luaL_Reg libs[] = {
+        { LUA_GNAME, luaopen_base },
+        { LUA_COLIBNAME, luaopen_coroutine },
+        { LUA_TABLIBNAME, luaopen_table },
+        { LUA_STRLIBNAME, luaopen_string },
+        { LUA_UTF8LIBNAME, luaopen_utf8 },
+        { LUA_MATHLIBNAME, luaopen_math },
+        { LUA_OSLIBNAME, luaopen_os },
+        { NULL, NULL }
+    };
+    static const char *const removed[] = {
+        "dofile", "loadfile", "os.execute", "os.exit", "os.remove",
+        "os.rename", "os.tmpname", "os.setlocale", NULL
+    };
+    const luaL_Reg *lib;
+    const char *const *name;
+
+    for(lib = libs; lib->func != NULL; ++lib) {
+        luaL_requiref(L, lib->name, lib->func, 1);
+        lua_pop(L, 1);
+    }
+    for(name = removed; *name != NULL; ++name) {
+        if( ! strncmp(*name, "os.", 3) ) {
+            lua_getglobal(L, LUA_OSLIBNAME);
+            lua_pushnil(L);
+            lua_setfield(L, -2, *name + 3);
+            lua_pop(L, 1);
+        }else{
+            lua_pushnil(L);
+            lua_setglobal(L, *name);
+        }
+    }
+}
+
+static void releaseScript(LuaScript *script)
+{
+    if( --script->refCount == 0 && ! script->isCurrent ) {
+        lua_close(script->L);
+        free(script->path);
+        free(script);
+    }
+}
+
+/* Loads the script file. Returns NULL on error.
+ */
+static LuaScript *loadScript(const char *path, const struct stat *st)
+{
+    LuaScript *script = calloc(1, sizeof(LuaScript));
+    RunLimits limits = { 0, config_getLuaMaxInstructions(), 0,
+        config_getLuaMaxMemory() };
+    lua_State *L;
+
+    if( (L = lua_newstate(allocMem, script)) == NULL ) {
+        free(script);
+        return NULL;
+    }
+    openLibs(L);
+    luaL_newmetatable(L, RESPONSE_MT);
+    luaL_newlib(L, gResponseMethods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    setLimits(script, L, &limits);
+    if( luaL_loadfile(L, path) != LUA_OK || lua_pcall(L, 0, 0, 0) != LUA_OK ) {
+        log_warn("Lua script %s: %s", path, lua_tostring(L, -1));
+    }else if( lua_getglobal(L, "handle") != LUA_TFUNCTION ) {
+        log_warn("Lua script %s: missing handle function", path);
+    }else{
+        lua_sethook(L, NULL, 0, 0);
+        script->limits = NULL;
+        script->handlerRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        script->path = strdup(path);
+        script->L = L;
+        script->fileStat = *st;
+        script->isCurrent = true;
+        return script;
+    }
+    lua_close(L);
+    free(script);
+    return NULL;
+}
+
+/* Returns the script loaded from the file; loads the script when not
+ * loaded yet or the file has changed.
+ */
+static LuaScript *getScript(const char *path)
+{
+    LuaScript *script, **scriptLoc;
+    struct stat st;
+
+    if( stat(path, &st) != 0 ) {
+        log_error("Lua script %s", path);
+        return NULL;
+    }
+    for(scriptLoc = &gScripts; (script = *scriptLoc) != NULL;
+            scriptLoc = &script->next)
+    {
+        if( ! strcmp(script->path, path) ) {
+            if( script->fileStat.st_ino == st.st_ino &&
+                    script->fileStat.st_size == st.st_size &&
+                    script->fileStat.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+                    script->fileStat.st_mtim.tv_nsec == st.st_mtim.tv_nsec )
+                return script;
+            /* the file has changed */
+            *scriptLoc = script->next;
+            script->isCurrent = false;
+            ++script->refCount;
+            releaseScript(script);
+            break;
+        }
+    }
+    if( (script = loadScript(path, &st)) != NULL ) {
+        script->next = gScripts;
+        gScripts = script;
+    }
+    return script;
+}
+
+static void setStrField(lua_State *L, const char *name, const char *value)
+{
+    if( value != NULL ) {
+        lua_pushstring(L, value);
+        lua_setfield(L, -2, name);
+    }
+}
+
+/* Pushes the req table on the stack.
+ */
+static void pushRequestTable(lua_State *L, const RequestHeader *rhdr,
+        const char *peerAddr, const char *scriptName, const char *pathInfo)
+{
+    const char *name, *value;
+    char *lowerName;
+    unsigned i, j;
+
+    lua_createtable(L, 0, 9);
+    setStrField(L, "method", reqhdr_getMethod(rhdr));
+    setStrField(L, "path", reqhdr_getPath(rhdr));
+    setStrField(L, "query", reqhdr_getQuery(rhdr));
+    setStrField(L, "version", reqhdr_getVersion(rhdr));
+    setStrField(L, "remote_addr", peerAddr);
+    setStrField(L, "script_name", scriptName);
+    setStrField(L, "path_info", pathInfo);
+    lua_newtable(L);
+    for(i = 0; reqhdr_getHeaderAt(rhdr, i, &name, &value); ++i) {
+        lowerName = strdup(name);
+        for(j = 0; lowerName[j]; ++j)
+            lowerName[j] = tolower((unsigned char)lowerName[j]);
+        setStrField(L, lowerName, value);
+        free(lowerName);
+    }
+    lua_setfield(L, -2, "headers");
+}
+
+LuaRequest *luahdlr_new(const RequestHeader *rhdr, const char *scriptPath,
+        const char *peerAddr, const char *scriptName, const char *pathInfo)
+{
+    LuaRequest *req = calloc(1, sizeof(LuaRequest));
+    LuaScript *script;
+    lua_State *co;
+
+    req->onlyHead = ! strcmp(reqhdr_getMethod(rhdr), "HEAD");
+    req->body = mb_new();
+    req->out = mb_new();
+    req->limits.instrMax = config_getLuaMaxInstructions();
+    req->limits.memMax = config_getLuaMaxMemory();
+    if( (script = getScript(scriptPath)) == NULL ) {
+        req->isFailed = true;
+        return req;
+    }
+    ++script->refCount;
+    req->script = script;
+    /* stack of the handler thread: handle, req, resp */
+    co = lua_newthread(script->L);
+    req->coRef = luaL_ref(script->L, LUA_REGISTRYINDEX);
+    req->co = co;
+    lua_rawgeti(co, LUA_REGISTRYINDEX, script->handlerRef);
+    pushRequestTable(co, rhdr, peerAddr, scriptName, pathInfo);
+    req->respObj = lua_newuserdatauv(co, sizeof(LuaRequest*), 0);
+    *req->respObj = req;
+    luaL_setmetatable(co, RESPONSE_MT);
+    return req;
+}
+
+void luahdlr_processData(LuaRequest *req, const char *data, unsigned len)
+{
+    if( req->isBodyTooLarge )
+        return;
+    if( req->limits.memMax != 0 &&
+            mb_dataLen(req->body) + len > req->limits.memMax )
+    {
+        req->isBodyTooLarge = true;
+        mb_resize(req->body, 0);
+    }else
+        mb_appendData(req->body, data, len);
+}
+
+void luahdlr_requestReadCompleted(LuaRequest *req)
+{
+    req->isBodyComplete = true;
+}
+
+/* Releases the handler thread.
+ */
+static void finishHandler(LuaRequest *req)
+{
+    *req->respObj = NULL;
+    req->respObj = NULL;
+    lua_sethook(req->co, NULL, 0, 0);
+    luaL_unref(req->script->L, LUA_REGISTRYINDEX, req->coRef);
+    req->co = NULL;
+}
+
+/* Runs the handler until it is suspended or finished.
+ */
+static void resumeHandler(LuaRequest *req, int argCount)
+{
+    LuaScript *script = req->script;
+    int status, resultCount;
+
+    setLimits(script, req->co, &req->limits);
+    status = lua_resume(req->co, script->L, argCount, &resultCount);
+    script->limits = NULL;
+    if( status == LUA_YIELD ) {
+        lua_pop(req->co, resultCount);
+    }else{
+        if( status != LUA_OK ) {
+            luaL_traceback(script->L, req->co, lua_tostring(req->co, -1), 0);
+            log_warn("Lua script %s: %s", script->path,
+                    lua_tostring(script->L, -1));
+            lua_pop(script->L, 1);
+            req->isFailed = true;
+        }
+        finishHandler(req);
+    }
+}
+
+static bool produceBody(RespBuf *resp, void *pvReq, int *awaitFd)
+{
+    LuaRequest *req = pvReq;
+
+    mb_resize(req->out, 0);
+    while( req->co != NULL && mb_dataLen(req->out) == 0 )
+        resumeHandler(req, 0);
+    resp_appendData(resp, mb_data(req->out), mb_dataLen(req->out));
+    return req->co != NULL;
+}
+
+static RespBuf *newErrorResponse(const char *status, const char *title,
+        const char *mesg, bool onlyHead)
+{
+    RespBuf *resp = resp_new(status, onlyHead);
+
+    resp_appendHeader(resp, "Content-Type", "text/html");
+    resp_appendStr(resp, "<!DOCTYPE html><html><head>\n<title>");
+    resp_appendStr(resp, title);
+    resp_appendStr(resp, "</title>\n</head>\n<body><h3>");
+    resp_appendStr(resp, title);
+    resp_appendStr(resp, "</h3>\n");
+    resp_appendStr(resp, mesg);
+    resp_appendStr(resp, "\n</body></html>");
+    return resp;
+}
+
+RespBuf *luahdlr_getResponse(LuaRequest *req)
+{
+    RespBuf *resp;
+    bool hasContentType = false;
+    unsigned i;
+
+    if( ! req->isBodyComplete )
+        return NULL;
+    if( req->isBodyTooLarge ) {
+        return newErrorResponse("413 Payload Too Large", "Payload Too Large",
+                "Request body is too large", req->onlyHead);
+    }
+    if( req->co != NULL ) {
+        /* set req.body and start */
+        lua_pushlstring(req->co, mb_data(req->body), mb_dataLen(req->body));
+        lua_setfield(req->co, 2, "body");
+        req->limits.memUsed = mb_dataLen(req->body);
+        mb_free(req->body);
+        req->body = NULL;
+        resumeHandler(req, 2);
+    }
+    if( req->isFailed ) {
+        return newErrorResponse(resp_cmnStatus(HTTP_500),
+                "Internal Server Error", "Lua handler failed", req->onlyHead);
+    }
+    req->isHeaderSent = true;
+    resp = resp_new(req->status ? req->status : resp_cmnStatus(HTTP_200_OK),
+            req->onlyHead);
+    for(i = 0; i < req->headerCount; ++i) {
+        resp_appendHeader(resp, req->headers[2*i], req->headers[2*i+1]);
+        if( ! strcasecmp(req->headers[2*i], "Content-Type") )
+            hasContentType = true;
+    }
+    if( ! hasContentType )
+        resp_appendHeader(resp, "Content-Type", "text/plain");
+    resp_appendData(resp, mb_data(req->out), mb_dataLen(req->out));
+    if( req->co != NULL && ! req->onlyHead )
+        resp_setBodyProducer(resp, produceBody, req, NULL);
+    return resp;
+}
+
+void luahdlr_free(LuaRequest *req)
+{
+    unsigned i;
+
+    if( req == NULL )
+        return;
+    if( req->co != NULL )
+        finishHandler(req);
+    if( req->script != NULL ) {
+        lua_gc(req->script->L, LUA_GCSTEP, 0);
+        releaseScript(req->script);
+    }
+    mb_free(req->body);
+    mb_free(req->out);
+    free(req->status);
+    for(i = 0; i < 2 * req->headerCount; ++i)
+        free(req->headers[i]);
+    free(req->headers);
+    free(req);
+}
+
+#else /* ! HAVE_LUA */
+
+/* The "luahandler" option is ignored when Lua is not available, so these
+ * are never invoked.
+ */
+LuaRequest *luahdlr_new(const RequestHeader *rhdr, const char *scriptPath,
+        const char *peerAddr, const char *scriptName, const char *pathInfo)
+{
+    log_fatal("luahdlr_new: built without Lua");
+    return NULL;
+}
+
+void luahdlr_processData(LuaRequest *req, const char *data, unsigned len)
+{
+}
+
+void luahdlr_requestReadCompleted(LuaRequest *req)
+{
+}
+
+RespBuf *luahdlr_getResponse(LuaRequest *req)
+{
+    return NULL;
+}
+
+void luahdlr_free(LuaRequest *req)
+{
+}
+
+#endif /* HAVE_LUA */
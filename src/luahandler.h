@@ -0,0 +1,68 @@
+#ifndef LUAHANDLER_H
+#define LUAHANDLER_H
+
+#include "requestheader.h"
+#include "respbuf.h"
+
+
+/* A request handled by Lua script, specified by "luahandler" option.
+ * The script runs inside the server process. It shall define global
+ * function:
+ *
+ *      function handle(req, resp)
+ *
+ * The req is a table with the request data: method, path, query, version,
+ * remote_addr, script_name, path_info, body and headers; the headers table
+ * is keyed by lowercase header names.
+ * The resp has methods:
+ *      resp:status(code [, reason])    - sets response status
+ *      resp:header(name, value)        - adds response header field
+ *      resp:write(str, ...)            - appends strings to response body
+ * The status and header fields shall be set before the body is written.
+ *
+ * The handler runs as a coroutine: it is suspended when the written data
+ * fill the send buffer and resumed when the client receives the data.
+ * Data written from a coroutine created by the script, or from a function
+ * called by C code like table.sort(), is kept until the handler can be
+ * suspended.
+ * The handler call is limited by the number of Lua instructions executed
+ * and by memory allocated; see "luamaxinstructions" and "luamaxmemory"
+ * options. Scripts are loaded on first use and reloaded when the file
+ * changes.
+ */
+typedef struct LuaRequest LuaRequest;
+
+
+/* Starts handling of the request.
+ * Parameters:
+ *      scriptPath      - the Lua script file path
+ *      peerAddr        - client address; may be NULL
+ *      scriptName      - URL path matching the handler pattern
+ *      pathInfo        - the rest of URL path; may be NULL
+ */
+LuaRequest *luahdlr_new(const RequestHeader*, const char *scriptPath,
+        const char *peerAddr, const char *scriptName, const char *pathInfo);
+
+
+/* Passes a piece of request body to the handler.
+ */
+void luahdlr_processData(LuaRequest*, const char *data, unsigned len);
+
+
+/* Signals the handler end of request body.
+ */
+void luahdlr_requestReadCompleted(LuaRequest*);
+
+
+/* Returns response when the request body is complete; NULL before.
+ * The response body is produced while the response is being sent.
+ * The LuaRequest shall not be freed before the response.
+ */
+RespBuf *luahdlr_getResponse(LuaRequest*);
+
+
+/* Ends use of the LuaRequest.
+ */
+void luahdlr_free(LuaRequest*);
+
+#endif /* LUAHANDLER_H */
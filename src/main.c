@@ -1,5 +1,9 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdbool.h>
 #include "serverconnection.h"
+#include "cgiprocess.h"
 #include "fmconfig.h"
 #include "fmlog.h"
 #include "cmdline.h"
@@ -13,61 +17,285 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/wait.h>
 
 
-static void mainloop(void)
+/* Environment variable passing the listening socket to upgraded binary.
+ */
+#define LISTEN_FD_ENV "FILEMANAGER_HTTPD_LISTEN_FD"
+
+/* Command line, for the binary upgrade.
+ */
+static char **gArgv;
+
+/* Signal mask set while waiting for events. The signals handled by
+ * onSignal are blocked otherwise, so that the flags set by the handler are
+ * checked before each wait.
+ */
+static sigset_t gWaitSigMask;
+
+/* Set by signal handlers.
+ */
+static volatile sig_atomic_t gIsReloadRequested, gIsUpgradeRequested,
+        gIsStopRequested, gIsDrainExpired, gIsStatsRequested;
+
+static void onSignal(int sig)
 {
-    int i, listenfd, acceptfd;
-    unsigned connCount = 0, idleConnCount, busyConnCount, maxConnCount;
+    switch( sig ) {
+    case SIGHUP:
+        gIsReloadRequested = 1;
+        break;
+    case SIGUSR2:
+        gIsUpgradeRequested = 1;
+        break;
+    case SIGTERM:
+        gIsStopRequested = 1;
+        break;
+    case SIGALRM:
+        gIsDrainExpired = 1;
+        break;
+    case SIGUSR1:
+        gIsStatsRequested = 1;
+        break;
+    }
+}
+
+/* Installs the signal handlers. The signals are blocked except while
+ * waiting for events. In inetd mode SIGUSR2, SIGTERM and SIGALRM keep the
+ * default action.
+ */
+static void setupSignals(void)
+{
+    static const int sigs[] = { SIGHUP, SIGUSR1, SIGUSR2, SIGTERM, SIGALRM };
+    sigset_t mask;
+    unsigned i, sigCount;
+
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&mask);
+    sigCount = cmdline_isInetdMode() ? 2 : sizeof(sigs) / sizeof(sigs[0]);
+    for(i = 0; i < sigCount; ++i) {
+        signal(sigs[i], onSignal);
+        sigaddset(&mask, sigs[i]);
+    }
+    sigprocmask(SIG_BLOCK, &mask, &gWaitSigMask);
+    /* SIGCHLD is received by cgiproc through signalfd */
+    sigaddset(&gWaitSigMask, SIGCHLD);
+}
+
+/* Reloads configuration when requested. Invoked between request processing
+ * steps, when no request uses the current configuration.
+ */
+static void reloadConfigIfRequested(void)
+{
+    if( gIsReloadRequested ) {
+        gIsReloadRequested = 0;
+        log_debug("reloading configuration");
+        config_reload();
+    }
+}
+
+/* Waits for data ready on the descriptors set in drs. Processes the CGI
+ * process events before the connections.
+ */
+static void selectAndProcessEvents(DataReadySelector *drs)
+{
+    drs_setReadFd(drs, cgiproc_getEventFd());
+    drs_select(drs, &gWaitSigMask);
+    if( drs_isReadReady(drs, cgiproc_getEventFd()) )
+        cgiproc_processEvents();
+    if( gIsStatsRequested ) {
+        gIsStatsRequested = 0;
+        cgiproc_logStats();
+    }
+}
+
+/* Returns listening socket passed by the server process being upgraded,
+ * -1 if none.
+ */
+static int getInheritedListenFd(void)
+{
+    const char *fdStr = getenv(LISTEN_FD_ENV);
+    int fd = -1, val;
+    socklen_t valLen = sizeof(val);
+
+    if( fdStr != NULL ) {
+        fd = atoi(fdStr);
+        if( getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &valLen) != 0 ||
+                ! val )
+        {
+            log_warn("%s=%s is not a listening socket", LISTEN_FD_ENV, fdStr);
+            fd = -1;
+        }
+        unsetenv(LISTEN_FD_ENV);
+    }
+    return fd;
+}
+
+static int createListenSocket(unsigned backlog)
+{
+    int listenfd, val;
     struct sockaddr_in addr;
-    ServerConnection **connections, **busyConnections;
-    DataReadySelector *drs;
-    bool isConnMaxWarnPrinted = false;
 
-    maxConnCount = config_getMaxClients();
     if( (listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
         log_fatal("socket");
-    i = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
+    val = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
     addr.sin_port = htons(config_getListenPort());
     if( bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 )
         log_fatal("bind");
-    if( listen(listenfd, maxConnCount) < 0 )
+    /* accepted sockets inherit TCP_NODELAY from the listening socket */
+    val = 1;
+    setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+#ifdef TCP_DEFER_ACCEPT
+    /* wake up when the request arrives, not on bare connection */
+    val = 5;
+    setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &val, sizeof(val));
+#endif
+    if( listen(listenfd, backlog) < 0 )
         log_fatal("listen");
+    return listenfd;
+}
+
+/* Runs the new binary with "-t" option, to check that it starts and that
+ * the configuration is completely readable with the current privileges.
+ * The upgraded server would read the configuration the same way.
+ * Returns true when the check passed.
+ */
+static bool checkUpgradeConfig(void)
+{
+    char **argv;
+    unsigned argc;
+    pid_t pid;
+    int status;
+
+    for(argc = 0; gArgv[argc] != NULL; ++argc)
+        ;
+    argv = malloc((argc + 2) * sizeof(char*));
+    memcpy(argv, gArgv, argc * sizeof(char*));
+    argv[argc] = "-t";
+    argv[argc + 1] = NULL;
+    if( (pid = fork()) == 0 ) {
+        sigprocmask(SIG_SETMASK, &gWaitSigMask, NULL);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    free(argv);
+    if( pid < 0 ) {
+        log_error("upgrade: fork");
+        return false;
+    }
+    if( waitpid(pid, &status, 0) != pid || ! WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0 )
+    {
+        log_warn("upgrade: configuration check failed; "
+                "the running server is kept");
+        return false;
+    }
+    return true;
+}
+
+/* Replaces the server with a new binary, started using the same command
+ * line. The process ID is retained: the current process executes the new
+ * binary, passing it the listening socket, while a forked process
+ * finishes the open connections.
+ * Before the upgrade the new binary checks the configuration.
+ * Returns true in the forked process; returns false when the upgrade
+ * failed to start.
+ */
+static bool startUpgrade(int listenfd)
+{
+    char fdStr[16];
+    pid_t pid;
+
+    if( strchr(gArgv[0], '/') != NULL && access(gArgv[0], X_OK) != 0 ) {
+        log_error("upgrade: %s", gArgv[0]);
+        return false;
+    }
+    if( ! checkUpgradeConfig() )
+        return false;
+    if( (pid = fork()) < 0 ) {
+        log_error("upgrade: fork");
+        return false;
+    }
+    if( pid == 0 ) {
+        /* the CGI processes are children of the upgraded server */
+        cgiproc_forgetChildren();
+        return true;
+    }
+    /* other descriptors are closed on exec */
+    if( fcntl(listenfd, F_SETFD, 0) < 0 )
+        log_fatal("upgrade: fcntl");
+    sprintf(fdStr, "%d", listenfd);
+    setenv(LISTEN_FD_ENV, fdStr, 1);
+    sigprocmask(SIG_SETMASK, &gWaitSigMask, NULL);
+    execvp(gArgv[0], gArgv);
+    log_fatal("upgrade: exec %s", gArgv[0]);
+    return false;
+}
+
+static void mainloop(void)
+{
+    int i, listenfd, acceptfd;
+    unsigned connCount = 0, idleConnCount, busyConnCount, maxConnCount;
+    struct sockaddr_in peer;
+    socklen_t peerLen;
+    ServerConnection **connections, **busyConnections;
+    DataReadySelector *drs;
+    bool isConnMaxWarnPrinted = false, isDraining = false;
+
+    maxConnCount = config_getMaxClients();
+    if( (listenfd = getInheritedListenFd()) < 0 )
+        listenfd = createListenSocket(maxConnCount);
     if( ! config_switchToTargetUser() )
         exit(1);
     connections = malloc(maxConnCount * sizeof(ServerConnection*));
     busyConnections = malloc(maxConnCount * sizeof(ServerConnection*));
     drs_setNonBlockingCloExecFlags(listenfd);
     drs = drs_new();
-    while( 1 ) {
-        if( connCount < maxConnCount )
-            drs_setReadFd(drs, listenfd);
-        else if( ! isConnMaxWarnPrinted ) {
-            log_warn("number of clients reached maximum (%u)", maxConnCount);
-            isConnMaxWarnPrinted = true;
+    while( ! isDraining || (connCount > 0 && ! gIsDrainExpired) ) {
+        if( ! isDraining ) {
+            if( connCount < maxConnCount )
+                drs_setReadFd(drs, listenfd);
+            else if( ! isConnMaxWarnPrinted ) {
+                log_warn("number of clients reached maximum (%u)",
+                        maxConnCount);
+                isConnMaxWarnPrinted = true;
+            }
+        }
+        selectAndProcessEvents(drs);
+        reloadConfigIfRequested();
+        if( ! isDraining && (gIsStopRequested ||
+                (gIsUpgradeRequested && startUpgrade(listenfd))) )
+        {
+            /* stop accepting; finish the open connections */
+            close(listenfd);
+            isDraining = true;
+            alarm(config_getDrainTimeout());
+            log_debug("draining %u connections", connCount);
         }
-        drs_select(drs);
-        while( connCount < maxConnCount &&
-                (acceptfd = accept(listenfd, NULL, NULL)) >= 0 )
+        gIsUpgradeRequested = 0;
+        while( ! isDraining && connCount < maxConnCount &&
+                drs_isReadReady(drs, listenfd) &&
+                (peerLen = sizeof(peer), acceptfd = accept4(listenfd,
+                    (struct sockaddr*)&peer, &peerLen,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0 )
         {
-            i = 1;
-            setsockopt(acceptfd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
-            drs_setNonBlockingCloExecFlags(acceptfd);
-            connections[connCount++] = conn_new(acceptfd);
+            connections[connCount++] = conn_new(acceptfd,
+                    peerLen == sizeof(peer) ? &peer : NULL);
         }
         if( connCount > maxConnCount && errno != EWOULDBLOCK )
             log_fatal("accept");
         /* keep connections ordered descending by idle time;
-         * close most idle connection when connection number reached maximum
+         * close most idle connection when connection number reached maximum;
+         * when draining, close all idle connections
          */
         i = 0;
         idleConnCount = busyConnCount = 0;
         while( i < connCount ) {
-            switch( conn_processDataReady(connections[i], drs,
-                    connCount == maxConnCount && i == busyConnCount) )
+            switch( conn_processDataReady(connections[i], drs, isDraining ||
+                    (connCount == maxConnCount && i == busyConnCount)) )
             {
             case CONN_BUSY:
                 busyConnections[busyConnCount++] = connections[i++];
@@ -94,24 +322,40 @@ static void mainloop_inetd(void)
 {
     ServerConnection *connection = NULL;
     DataReadySelector *drs;
+    struct sockaddr_in peer;
+    socklen_t peerLen = sizeof(peer);
 
     if( ! config_switchToTargetUser() )
         exit(1);
     drs_setNonBlockingCloExecFlags(0);
     drs = drs_new();
-    connection = conn_new(0);
-    while( conn_processDataReady(connection, drs, false) != CONN_TO_CLOSE )
-        drs_select(drs);
+    if( getpeername(0, (struct sockaddr*)&peer, &peerLen) != 0 ||
+            peerLen != sizeof(peer) || peer.sin_family != AF_INET )
+        peerLen = 0;
+    connection = conn_new(0, peerLen ? &peer : NULL);
+    while( conn_processDataReady(connection, drs, false) != CONN_TO_CLOSE ) {
+        selectAndProcessEvents(drs);
+        reloadConfigIfRequested();
+    }
     conn_free(connection);
     drs_free(drs);
 }
 
 int main(int argc, char *argv[])
 {
+    bool isConfigRead;
+
     if( cmdline_parse(argc, argv) ) {
-        signal(SIGPIPE, SIG_IGN);
-        signal(SIGCHLD, SIG_IGN);
-        config_parse();
+        setupSignals();
+        gArgv = argv;
+        isConfigRead = config_parse();
+        if( cmdline_isConfigCheck() )
+            return isConfigRead ? 0 : 1;
+        /* the upgrade shall not lose settings from unreadable files */
+        if( ! isConfigRead && getenv(LISTEN_FD_ENV) != NULL ) {
+            log_warn("upgrade: configuration is not completely readable");
+            return 1;
+        }
         if( cmdline_isInetdMode() )
             mainloop_inetd();
         else
@@ -1,72 +1,136 @@
-#include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include "md5calc.h"
 
 
-void md5_calculate(char *result, const char *bytes, unsigned count)
+#define F(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z)  ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z)  ((x) ^ (y) ^ (z))
+#define I(x, y, z)  ((y) ^ ((x) | ~(z)))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+    (a) += f((b), (c), (d)) + (x) + (t); \
+    (a) = ((a) << (s) | (a) >> (32 - (s))) + (b)
+
+
+/* Processes one 64-byte block.
+ */
+static void md5Block(uint32_t *Q, const unsigned char *p)
+{
+    uint32_t A = Q[0], B = Q[1], C = Q[2], D = Q[3], X[16];
+    unsigned i;
+
+    for(i = 0; i < 16; ++i, p += 4)
+        X[i] = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+
+    STEP(F, A, B, C, D, X[ 0], 0xd76aa478,  7);
+    STEP(F, D, A, B, C, X[ 1], 0xe8c7b756, 12);
+    STEP(F, C, D, A, B, X[ 2], 0x242070db, 17);
+    STEP(F, B, C, D, A, X[ 3], 0xc1bdceee, 22);
+    STEP(F, A, B, C, D, X[ 4], 0xf57c0faf,  7);
+    STEP(F, D, A, B, C, X[ 5], 0x4787c62a, 12);
+    STEP(F, C, D, A, B, X[ 6], 0xa8304613, 17);
+    STEP(F, B, C, D, A, X[ 7], 0xfd469501, 22);
+    STEP(F, A, B, C, D, X[ 8], 0x698098d8,  7);
+    STEP(F, D, A, B, C, X[ 9], 0x8b44f7af, 12);
+    STEP(F, C, D, A, B, X[10], 0xffff5bb1, 17);
+    STEP(F, B, C, D, A, X[11], 0x895cd7be, 22);
+    STEP(F, A, B, C, D, X[12], 0x6b901122,  7);
+    STEP(F, D, A, B, C, X[13], 0xfd987193, 12);
+    STEP(F, C, D, A, B, X[14], 0xa679438e, 17);
+    STEP(F, B, C, D, A, X[15], 0x49b40821, 22);
+
+    STEP(G, A, B, C, D, X[ 1], 0xf61e2562,  5);
+    STEP(G, D, A, B, C, X[ 6], 0xc040b340,  9);
+    STEP(G, C, D, A, B, X[11], 0x265e5a51, 14);
+    STEP(G, B, C, D, A, X[ 0], 0xe9b6c7aa, 20);
+    STEP(G, A, B, C, D, X[ 5], 0xd62f105d,  5);
+    STEP(G, D, A, B, C, X[10], 0x02441453,  9);
+    STEP(G, C, D, A, B, X[15], 0xd8a1e681, 14);
+    STEP(G, B, C, D, A, X[ 4], 0xe7d3fbc8, 20);
+    STEP(G, A, B, C, D, X[ 9], 0x21e1cde6,  5);
+    STEP(G, D, A, B, C, X[14], 0xc33707d6,  9);
+    STEP(G, C, D, A, B, X[ 3], 0xf4d50d87, 14);
+    STEP(G, B, C, D, A, X[ 8], 0x455a14ed, 20);
+    STEP(G, A, B, C, D, X[13], 0xa9e3e905,  5);
+    STEP(G, D, A, B, C, X[ 2], 0xfcefa3f8,  9);
+    STEP(G, C, D, A, B, X[ 7], 0x676f02d9, 14);
+    STEP(G, B, C, D, A, X[12], 0x8d2a4c8a, 20);
+
+    STEP(H, A, B, C, D, X[ 5], 0xfffa3942,  4);
+    STEP(H, D, A, B, C, X[ 8], 0x8771f681, 11);
+    STEP(H, C, D, A, B, X[11], 0x6d9d6122, 16);
+    STEP(H, B, C, D, A, X[14], 0xfde5380c, 23);
+    STEP(H, A, B, C, D, X[ 1], 0xa4beea44,  4);
+    STEP(H, D, A, B, C, X[ 4], 0x4bdecfa9, 11);
+    STEP(H, C, D, A, B, X[ 7], 0xf6bb4b60, 16);
+    STEP(H, B, C, D, A, X[10], 0xbebfbc70, 23);
+    STEP(H, A, B, C, D, X[13], 0x289b7ec6,  4);
+    STEP(H, D, A, B, C, X[ 0], 0xeaa127fa, 11);
+    STEP(H, C, D, A, B, X[ 3], 0xd4ef3085, 16);
+    STEP(H, B, C, D, A, X[ 6], 0x04881d05, 23);
+    STEP(H, A, B, C, D, X[ 9], 0xd9d4d039,  4);
+    STEP(H, D, A, B, C, X[12], 0xe6db99e5, 11);
+    STEP(H, C, D, A, B, X[15], 0x1fa27cf8, 16);
+    STEP(H, B, C, D, A, X[ 2], 0xc4ac5665, 23);
+
+    STEP(I, A, B, C, D, X[ 0], 0xf4292244,  6);
+    STEP(I, D, A, B, C, X[ 7], 0x432aff97, 10);
+    STEP(I, C, D, A, B, X[14], 0xab9423a7, 15);
+    STEP(I, B, C, D, A, X[ 5], 0xfc93a039, 21);
+    STEP(I, A, B, C, D, X[12], 0x655b59c3,  6);
+    STEP(I, D, A, B, C, X[ 3], 0x8f0ccc92, 10);
+    STEP(I, C, D, A, B, X[10], 0xffeff47d, 15);
+    STEP(I, B, C, D, A, X[ 1], 0x85845dd1, 21);
+    STEP(I, A, B, C, D, X[ 8], 0x6fa87e4f,  6);
+    STEP(I, D, A, B, C, X[15], 0xfe2ce6e0, 10);
+    STEP(I, C, D, A, B, X[ 6], 0xa3014314, 15);
+    STEP(I, B, C, D, A, X[13], 0x4e0811a1, 21);
+    STEP(I, A, B, C, D, X[ 4], 0xf7537e82,  6);
+    STEP(I, D, A, B, C, X[11], 0xbd3af235, 10);
+    STEP(I, C, D, A, B, X[ 2], 0x2ad7d2bb, 15);
+    STEP(I, B, C, D, A, X[ 9], 0xeb86d391, 21);
+
+    Q[0] += A;
+    Q[1] += B;
+    Q[2] += C;
+    Q[3] += D;
+}
+
+void md5_calculateRaw(unsigned char *digest, const char *bytes,
+        unsigned count)
 {
-    static const uint32_t SIN[64] = {
-        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
-        0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
-        0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
-        0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x2441453,  0xd8a1e681, 0xe7d3fbc8,
-        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
-        0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
-        0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
-        0xd4ef3085, 0x4881d05,  0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
-        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
-        0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
-        0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
-    };
-    static const int Shift[4][4] = {
-        { 7, 12, 17, 22 }, { 5, 9, 14,  20 },
-        { 4, 11, 16, 23 }, { 6, 10, 15, 21 }
-    };
     uint32_t Q[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
-    uint32_t A, B, C, D, X[16];
-    uint64_t bits = 8 * count;
+    unsigned char tail[128];
+    uint64_t bits = 8ULL * count;
+    unsigned i, tailLen;
+
+    for(; count >= 64; bytes += 64, count -= 64)
+        md5Block(Q, (const unsigned char*)bytes);
+    memcpy(tail, bytes, count);
+    tail[count] = 0x80;
+    tailLen = count < 56 ? 64 : 128;
+    memset(tail + count + 1, 0, tailLen - 8 - count - 1);
+    for(i = 0; i < 8; ++i)
+        tail[tailLen - 8 + i] = bits >> 8 * i;
+    md5Block(Q, tail);
+    if( tailLen == 128 )
+        md5Block(Q, tail + 64);
+    for(i = 0; i < 16; ++i)
+        digest[i] = Q[i / 4] >> 8 * (i % 4);
+}
+
+void md5_calculate(char *result, const char *bytes, unsigned count)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char digest[16];
     unsigned i;
 
-    while( bytes || count ) {
-        for(i = 0; i < 16; ++i)
-            X[i] = 0;
-        if( bytes ) {
-            for(i = 0; i < (count > 64 ? 64 : count); ++i)
-                X[i/4] |= (unsigned char)bytes[i] << 8 * (i % 4);
-            if( count >= 64 ) {
-                bytes += 64;
-                count -= 64;
-            }else{
-                X[count/4] |= 0x80 << 8 * (count % 4);
-                ++count;
-                bytes = NULL;
-            }
-        }else
-            count = 0;
-        if( bytes == NULL && count <= 56 ) {
-            X[14] = bits;
-            X[15] = bits >> 32;
-            count = 0;
-        }
-        A = Q[0];
-        B = Q[1];
-        C = Q[2];
-        D = Q[3];
-        for(i = 0; i < 64; ++i) {
-            uint32_t rol = ((i < 16) ? ((B & C) | (~B & D)) + X[i] :
-                (i < 32) ? ((D & B) | (~D & C)) + X[(5 * i + 1) & 0xf] :
-                (i < 48) ? (B ^ C ^ D) + X[(3 * i + 5) & 0xf] :
-                (C ^ (B | ~D)) + X[(7 * i) & 0xf]) + A + SIN[i];
-            A = D; D = C; C = B;
-            B += rol << Shift[i/16][i%4] | rol >> (32-Shift[i/16][i%4]);
-        }
-        Q[0] += A;
-        Q[1] += B;
-        Q[2] += C;
-        Q[3] += D;
+    md5_calculateRaw(digest, bytes, count);
+    for(i = 0; i < 16; ++i) {
+        result[2 * i] = hex[digest[i] >> 4];
+        result[2 * i + 1] = hex[digest[i] & 0xf];
     }
-    for(i = 0; i < 4; ++i)
-        sprintf(result + 8 * i, "%02x%02x%02x%02x", Q[i] & 0xff,
-                Q[i] >> 8 & 0xff, Q[i] >> 16 & 0xff, Q[i] >> 24 & 0xff);
+    result[32] = '\0';
 }
 
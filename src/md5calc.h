@@ -9,4 +9,10 @@
 void md5_calculate(char *result, const char *bytes, unsigned count);
 
 
+/* Calculates MD5 sum of bytes. Stores in digest the 16-byte binary value.
+ */
+void md5_calculateRaw(unsigned char *digest, const char *bytes,
+        unsigned count);
+
+
 #endif /* MD5CALC_H */
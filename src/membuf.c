@@ -9,13 +9,31 @@
 struct MemBuf {
     char *data;
     unsigned dataLen;
+    unsigned dataAlloc;     /* allocated size of data, excluding the extra
+                             * byte for terminating '\0' */
 };
 
+/* Ensures the buffer has room for at least size bytes of data.
+ * The buffer grows geometrically to make repeated appends cheap.
+ */
+static void ensureAlloc(MemBuf *mb, unsigned size)
+{
+    if( size > mb->dataAlloc ) {
+        if( size < 2 * mb->dataAlloc )
+            size = 2 * mb->dataAlloc;
+        if( size < 32 )
+            size = 32;
+        mb->data = realloc(mb->data, size + 1);
+        mb->dataAlloc = size;
+    }
+}
+
 MemBuf *mb_new(void)
 {
     MemBuf *res = malloc(sizeof(MemBuf));
 
     res->dataLen = 0;
+    res->dataAlloc = 0;
     res->data = malloc(1);
     res->data[0] = '\0';
     return res;
@@ -33,6 +51,7 @@ MemBuf *mb_newWithStr(const char *str)
     MemBuf *res = malloc(sizeof(MemBuf));
 
     res->dataLen = len;
+    res->dataAlloc = len;
     res->data = malloc(len+1);
     memcpy(res->data, str, len+1);
     return res;
@@ -40,7 +59,7 @@ MemBuf *mb_newWithStr(const char *str)
 
 void mb_appendData(MemBuf *mb, const char *data, unsigned dataLen)
 {
-    mb->data = realloc(mb->data, mb->dataLen + dataLen + 1);
+    ensureAlloc(mb, mb->dataLen + dataLen);
     memcpy(mb->data + mb->dataLen, data, dataLen);
     mb->dataLen += dataLen;
     mb->data[mb->dataLen] = '\0';
@@ -86,11 +105,27 @@ void mb_ensureEndsWithSlash(MemBuf *mb)
 
 void mb_resize(MemBuf *mb, unsigned newSize)
 {
+    ensureAlloc(mb, newSize);
     mb->dataLen = newSize;
-    mb->data = realloc(mb->data, newSize+1);
     mb->data[newSize] = '\0';
 }
 
+void mb_reserve(MemBuf *mb, unsigned size)
+{
+    ensureAlloc(mb, size);
+}
+
+char *mb_appendSpace(MemBuf *mb, unsigned len)
+{
+    char *res;
+
+    ensureAlloc(mb, mb->dataLen + len);
+    res = mb->data + mb->dataLen;
+    mb->dataLen += len;
+    mb->data[mb->dataLen] = '\0';
+    return res;
+}
+
 const char *mb_data(const MemBuf *mb)
 {
     return mb->data;
@@ -108,11 +143,11 @@ void mb_setData(MemBuf *mb, unsigned offset, const char *data, unsigned len)
 
 void mb_setStrEnd(MemBuf *mb, unsigned offset, const char *str)
 {
-    int len = strlen(str) + 1;
+    int len = strlen(str);
 
+    ensureAlloc(mb, offset + len);
     mb->dataLen = offset + len;
-    mb->data = realloc(mb->data, mb->dataLen);
-    memcpy(mb->data + offset, str, len);
+    memcpy(mb->data + offset, str, len + 1);
 }
 
 int mb_mkstemp(MemBuf *mb)
@@ -63,6 +63,20 @@ void mb_ensureEndsWithSlash(MemBuf*);
 void mb_resize(MemBuf*, unsigned newSize);
 
 
+/* Preallocates memory for buffer contents up to size bytes. Buffer contents
+ * and length are not changed. Useful to avoid reallocations when the final
+ * size is known in advance.
+ */
+void mb_reserve(MemBuf*, unsigned size);
+
+
+/* Extends the buffer by len bytes and returns pointer to the added space.
+ * The added space is uninitialized. The pointer is valid until next
+ * modification of buffer size.
+ */
+char *mb_appendSpace(MemBuf*, unsigned len);
+
+
 /* Returns the buffer contents.
  * Contents length may be obtained using mb_dataLen.
  * The data contains extra byte and end, with value '\0'.
@@ -1,5 +1,7 @@
 #include <stdbool.h>
 #include "multipartdata.h"
+#include "fmconfig.h"
+#include "fmlog.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -16,36 +18,59 @@ enum ParsePosition {
 /* See rfc2045, rfc2046 */
 struct MultipartData {
     MemBuf *boundaryDelimiter;
-    char *destDir;
+    int destDirFd;
     enum ParsePosition parsePos;
     unsigned delimMatchPart; /* when PP_BODY: number of bytes from previous
                               * data matching boundary delimiter;
                               * other parse positions: must be 0 */
     ContentPart **parts;
     unsigned partCount;
+    unsigned long long memSize; /* data size stored in memory by the parts */
+    bool isTooLarge;            /* the data exceeds the configured limits;
+                                 * the rest of data is ignored */
 };
 
-MultipartData *mpdata_new(const char *boundaryDelimiter, const char *destDir)
+MultipartData *mpdata_new(const char *boundaryDelimiter, int destDirFd)
 {
     MultipartData *mpdata = malloc(sizeof(MultipartData));
 
     mpdata->boundaryDelimiter = mb_newWithStr("\r\n--");
     mb_appendStr(mpdata->boundaryDelimiter, boundaryDelimiter);
-    mpdata->destDir = destDir ? strdup(destDir) : NULL;
+    mpdata->destDirFd = destDirFd;
     mpdata->parsePos = PP_BODY;
     mpdata->delimMatchPart = 2; /* body may start with boundary
                                  * without inital CRLF */
     mpdata->parts = NULL;
     mpdata->partCount = 0;      /* starting with preamble */
+    mpdata->memSize = 0;
+    mpdata->isTooLarge = false;
     return mpdata;
 }
 
+/* Appends data to the last part, if any (i.e. except preamble).
+ */
+static void appendToLastPart(MultipartData *mpdata, const char *data,
+        unsigned len)
+{
+    unsigned maxSize = config_getMaxFormSize();
+
+    if( mpdata->partCount > 0 ) {
+        mpdata->memSize += cpart_appendData(
+                mpdata->parts[mpdata->partCount-1], data, len);
+        if( maxSize != 0 && mpdata->memSize > maxSize ) {
+            log_debug("multipart data size exceeds maxformsize");
+            mpdata->isTooLarge = true;
+        }
+    }
+}
+
 void mpdata_appendData(MultipartData *mpdata, const char *data, unsigned len)
 {
     const char *const dataEnd = data + len, *delim, *partEnd;
-    unsigned delimLen;
+    unsigned delimLen, maxParts = config_getMaxFormParts();
 
-    if( mpdata->boundaryDelimiter == NULL ) /* after last part (in epilogue) */
+    /* after last part (in epilogue) or over limits */
+    if( mpdata->boundaryDelimiter == NULL || mpdata->isTooLarge )
         return;
     delim = mb_data(mpdata->boundaryDelimiter);
     delimLen = mb_dataLen(mpdata->boundaryDelimiter);
@@ -58,10 +83,7 @@ void mpdata_appendData(MultipartData *mpdata, const char *data, unsigned len)
              * Fortunately no further part of the boundary string may match
              * the initial portion of the boundary string...
              */
-            if( mpdata->partCount > 0 ) {
-                cpart_appendData(mpdata->parts[mpdata->partCount-1],
-                        delim, mpdata->delimMatchPart);
-            }
+            appendToLastPart(mpdata, delim, mpdata->delimMatchPart);
             mpdata->delimMatchPart = 0;
         }else if( delimRmdrLen > len ) {
             mpdata->delimMatchPart += len;
@@ -79,9 +101,14 @@ void mpdata_appendData(MultipartData *mpdata, const char *data, unsigned len)
                 mpdata->boundaryDelimiter = NULL;
                 return;
             }
+            if( maxParts != 0 && mpdata->partCount >= maxParts ) {
+                log_debug("multipart data exceeds maxformparts");
+                mpdata->isTooLarge = true;
+                return;
+            }
             mpdata->parts = realloc(mpdata->parts,
                     (mpdata->partCount+1) * sizeof(ContentPart*));
-            mpdata->parts[mpdata->partCount] = cpart_new(mpdata->destDir);
+            mpdata->parts[mpdata->partCount] = cpart_new(mpdata->destDirFd);
             ++mpdata->partCount;
         }
         if( mpdata->parsePos != PP_BODY ) {
@@ -102,10 +129,9 @@ void mpdata_appendData(MultipartData *mpdata, const char *data, unsigned len)
         }
         if( partEnd == NULL )
             partEnd = dataEnd;
-        if( mpdata->partCount > 0 ) {
-            cpart_appendData(mpdata->parts[mpdata->partCount-1],
-                    data, partEnd - data);
-        }
+        appendToLastPart(mpdata, data, partEnd - data);
+        if( mpdata->isTooLarge )
+            return;
         if( dataEnd - partEnd < delimLen ) {
             data = dataEnd;
             mpdata->delimMatchPart = dataEnd - partEnd;
@@ -116,6 +142,11 @@ void mpdata_appendData(MultipartData *mpdata, const char *data, unsigned len)
     }
 }
 
+bool mpdata_isTooLarge(const MultipartData *mpdata)
+{
+    return mpdata->isTooLarge;
+}
+
 const ContentPart *mpdata_getPart(MultipartData *mpdata, unsigned partNum)
 {
     return partNum < mpdata->partCount ? mpdata->parts[partNum] : NULL;
@@ -144,7 +175,6 @@ void mpdata_free(MultipartData *mpdata)
 
     if( mpdata != NULL ) {
         mb_free(mpdata->boundaryDelimiter);
-        free(mpdata->destDir);
         for(i = 0; i < mpdata->partCount; ++i)
             cpart_free(mpdata->parts[i]);
         free(mpdata->parts);
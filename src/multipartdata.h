@@ -10,17 +10,26 @@ typedef struct MultipartData MultipartData;
 /* Creates new MultipartData object.
  * Parameters:
  *   boundaryDelimiter  - "boundary" value from Content-Type header
- *   destDir            - output files location for content parts having
- *                        "filename" parameter in Content-Disposition header.
+ *   destDirFd          - descriptor of output files location for content
+ *                        parts having "filename" parameter in
+ *                        Content-Disposition header; -1 to discard them.
+ *                        The descriptor is not closed by MultipartData.
  */
-MultipartData *mpdata_new(const char *boundaryDelimiter, const char *destDir);
+MultipartData *mpdata_new(const char *boundaryDelimiter, int destDirFd);
 
 
 /* MIME build helper. Adds the data arrived as the part of multipart content.
+ * When the content exceeds "maxformsize" or "maxformparts" limit, the
+ * rest of data is ignored.
  */
 void mpdata_appendData(MultipartData*, const char *data, unsigned len);
 
 
+/* Returns true when the content exceeds the configured limits.
+ */
+bool mpdata_isTooLarge(const MultipartData*);
+
+
 /* Returns the given part of multipart content.
  * Returns NULL when the partNum exceeds number of content parts.
  */
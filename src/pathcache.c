@@ -0,0 +1,111 @@
+#include <stdbool.h>
+#include "pathcache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+typedef struct {
+    char *urlPath;          /* NULL when the entry is unused */
+    struct timespec expiry;
+    int sysErrNo;
+    char *cgiExe;
+    char *cgiUrl;
+    char *cgiSubPath;
+} PathCacheEnt;
+
+/* Cache size; must be a power of two.
+ */
+enum { PATH_CACHE_SIZE = 1024 };
+
+/* Time to live of cache entries
+ */
+enum { PATH_CACHE_TTL_SECS = 2 };
+
+static PathCacheEnt gPathCache[PATH_CACHE_SIZE];
+
+
+static PathCacheEnt *getPathCacheEnt(const char *urlPath)
+{
+    unsigned hash = 2166136261u;
+
+    while( *urlPath )
+        hash = (hash ^ (unsigned char)*urlPath++) * 16777619u;
+    return gPathCache + (hash & (PATH_CACHE_SIZE - 1));
+}
+
+static char *dupOrNull(const char *s)
+{
+    return s ? strdup(s) : NULL;
+}
+
+static void clearEnt(PathCacheEnt *ent)
+{
+    free(ent->urlPath);
+    free(ent->cgiExe);
+    free(ent->cgiUrl);
+    free(ent->cgiSubPath);
+    memset(ent, 0, sizeof(PathCacheEnt));
+}
+
+bool pathcache_get(const char *urlPath, int *sysErrNo, char **cgiExe,
+        char **cgiUrl, char **cgiSubPath)
+{
+    PathCacheEnt *ent = getPathCacheEnt(urlPath);
+    struct timespec now;
+
+    if( ent->urlPath == NULL || strcmp(ent->urlPath, urlPath) )
+        return false;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if( now.tv_sec > ent->expiry.tv_sec || (now.tv_sec == ent->expiry.tv_sec
+                && now.tv_nsec >= ent->expiry.tv_nsec) )
+    {
+        clearEnt(ent);
+        return false;
+    }
+    *sysErrNo = ent->sysErrNo;
+    if( ent->sysErrNo == 0 ) {
+        *cgiExe = strdup(ent->cgiExe);
+        *cgiUrl = dupOrNull(ent->cgiUrl);
+        *cgiSubPath = dupOrNull(ent->cgiSubPath);
+    }
+    return true;
+}
+
+static PathCacheEnt *newEnt(const char *urlPath)
+{
+    PathCacheEnt *ent = getPathCacheEnt(urlPath);
+
+    clearEnt(ent);
+    ent->urlPath = strdup(urlPath);
+    clock_gettime(CLOCK_MONOTONIC, &ent->expiry);
+    ent->expiry.tv_sec += PATH_CACHE_TTL_SECS;
+    return ent;
+}
+
+void pathcache_putError(const char *urlPath, int sysErrNo)
+{
+    PathCacheEnt *ent = newEnt(urlPath);
+
+    ent->sysErrNo = sysErrNo;
+}
+
+void pathcache_putCGI(const char *urlPath, const char *cgiExe,
+        const char *cgiUrl, const char *cgiSubPath)
+{
+    PathCacheEnt *ent = newEnt(urlPath);
+
+    ent->cgiExe = strdup(cgiExe);
+    ent->cgiUrl = dupOrNull(cgiUrl);
+    ent->cgiSubPath = dupOrNull(cgiSubPath);
+}
+
+void pathcache_clear(void)
+{
+    unsigned i;
+
+    for(i = 0; i < PATH_CACHE_SIZE; ++i) {
+        if( gPathCache[i].urlPath != NULL )
+            clearEnt(gPathCache + i);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+
+/* Short-lived cache of URL path resolution results.
+ * Keeps URL paths which failed to resolve (along with the errno value) and
+ * URL paths resolved to CGI script (along with the script location and path
+ * info). Entries expire after a couple of seconds, so file system changes
+ * made outside of the server become visible shortly.
+ */
+
+
+/* Looks up the URL path in cache. Returns false when not found.
+ * When found, stores the errno value in sysErrNo. For CGI script sysErrNo
+ * is set to 0 and cgiExe, cgiUrl, cgiSubPath receive the values like those
+ * returned by config_findCGI(); the cgiUrl and cgiSubPath are NULL when the
+ * URL path refers directly to the script. The returned strings should be
+ * freed by caller.
+ */
+bool pathcache_get(const char *urlPath, int *sysErrNo, char **cgiExe,
+        char **cgiUrl, char **cgiSubPath);
+
+
+/* Remembers that the URL path failed to resolve with sysErrNo error.
+ */
+void pathcache_putError(const char *urlPath, int sysErrNo);
+
+
+/* Remembers that the URL path refers to CGI script. The cgiUrl and
+ * cgiSubPath may be NULL.
+ */
+void pathcache_putCGI(const char *urlPath, const char *cgiExe,
+        const char *cgiUrl, const char *cgiSubPath);
+
+
+/* Drops all cache entries. Should be invoked when the shared file system
+ * contents or the configuration is changed.
+ */
+void pathcache_clear(void);
+
+
+#endif /* PATHCACHE_H */
@@ -1,13 +1,22 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdbool.h>
 #include "reqhandler.h"
 #include "respbuf.h"
 #include "responsesender.h"
 #include "fmlog.h"
 #include "auth.h"
+#include "session.h"
 #include "filemanager.h"
 #include "cgiexecutor.h"
+#include "fcgiclient.h"
+#include "luahandler.h"
 #include "membuf.h"
 #include "contenttype.h"
+#include "fmassets.h"
+#include "pathcache.h"
+#include "fmconfig.h"
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -18,13 +27,64 @@
 
 
 struct RequestHandler {
+    ConfigSnapshot *config;     /* configuration at request start */
     char *peerAddr;
     FileManager *filemgr;
     CgiExecutor *cgiexe;
+    FcgiRequest *fcgireq;
+    LuaRequest *luareq;
+    char *setCookie;            /* session cookie to set; may be NULL */
+    bool isHeaderRejected;      /* request header exceeds limits */
     ResponseSender *response;
 };
 
 
+static const RespTmplSeg tmplMovedAddSlash[] = {
+    RESP_TMPL_TEXT("<!DOCTYPE html><html><head><title>"),
+    RESP_TMPL_HOLE(RTS_STR),        /* URL path */
+    RESP_TMPL_TEXT(" on "),
+    RESP_TMPL_HOLE(RTS_HOST),
+    RESP_TMPL_TEXT("</title></head><body>\n<h3>Moved to <a href=\""),
+    RESP_TMPL_HOLE(RTS_STR),        /* URL path */
+    RESP_TMPL_TEXT("/\">"),
+    RESP_TMPL_HOLE(RTS_STR),        /* URL path */
+    RESP_TMPL_TEXT("/</a></h3>\n</body></html>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplMesgPageHead[] = {
+    RESP_TMPL_TEXT("<!DOCTYPE html><html><head><title>"),
+    RESP_TMPL_HOLE(RTS_STR),        /* URL path */
+    RESP_TMPL_TEXT(" on "),
+    RESP_TMPL_HOLE(RTS_HOST),
+    RESP_TMPL_TEXT("</title></head><body>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplMesgPageLogin[] = {
+    RESP_TMPL_TEXT("<div style='text-align: right'>"),
+    RESP_TMPL_HOLE(RTS_RAW),        /* login form */
+    RESP_TMPL_TEXT("</div>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplMesgPageStatus[] = {
+    RESP_TMPL_TEXT("<div style=\"text-align: center; margin: 150px 0px\">\n"
+            "<span style=\"font-size: x-large; border: 1px solid #FFF0B0; "
+            "background-color: #FFFCF0; padding: 50px 100px\">\n"),
+    RESP_TMPL_HOLE(RTS_RAW),        /* status */
+    RESP_TMPL_TEXT("</span></div>\n"),
+    RESP_TMPL_END
+};
+
+static const RespTmplSeg tmplMesgPageMesg[] = {
+    RESP_TMPL_TEXT("<p>"),
+    RESP_TMPL_HOLE(RTS_STR),
+    RESP_TMPL_TEXT("</p>"),
+    RESP_TMPL_END
+};
+
+
 static RespBuf *printMovedAddSlash(const char *urlPath, bool onlyHead)
 {
     char *newPath;
@@ -40,10 +100,7 @@ static RespBuf *printMovedAddSlash(const char *urlPath, bool onlyHead)
     free(newPath);
     resp_appendHeader(resp, "Content-Type", "text/html; charset=utf-8");
     if( ! onlyHead ) {
-        resp_appendFmt(resp,
-                "<!DOCTYPE html><html><head><title>%S on %H</title></head>"
-                "<body>\n<h3>Moved to <a href=\"%S/\">%S/</a></h3>\n</body>"
-                "</html>\n", urlPath, urlPath, urlPath);
+        resp_appendTmpl(resp, tmplMovedAddSlash, urlPath, urlPath, urlPath);
     }
     return resp;
 }
@@ -56,18 +113,12 @@ static RespBuf *printMesgPage(const char *status, const char *mesg,
     resp = resp_new(status, onlyHead);
     resp_appendHeader(resp, "Content-Type", "text/html; charset=utf-8");
     if( ! onlyHead ) {
-        resp_appendFmt(resp, "<!DOCTYPE html>"
-                "<html><head><title>%S on %H</title></head><body>\n", path);
+        resp_appendTmpl(resp, tmplMesgPageHead, path);
         if( showLoginButton )
-            resp_appendFmt(resp, "<div style='text-align: right'>%R</div>\n",
-                    filemgr_getLoginForm());
-        resp_appendFmt(resp,
-            "<div style=\"text-align: center; margin: 150px 0px\">\n"
-            "<span style=\"font-size: x-large; border: 1px solid #FFF0B0; "
-            "background-color: #FFFCF0; padding: 50px 100px\">\n"
-            "%R</span></div>\n", status);
+            resp_appendTmpl(resp, tmplMesgPageLogin, filemgr_getLoginForm());
+        resp_appendTmpl(resp, tmplMesgPageStatus, status);
         if( mesg != NULL )
-            resp_appendFmt(resp, "<p>%S</p>", mesg);
+            resp_appendTmpl(resp, tmplMesgPageMesg, mesg);
         resp_appendStr(resp, "</body></html>\n");
     }
     return resp;
@@ -100,13 +151,15 @@ static RespBuf *printErrorPage(int sysErrno, const char *path,
             showLoginButton);
 }
 
-static RespBuf *printUnauthorized(const char *urlPath, bool onlyHead)
+static RespBuf *printUnauthorized(const RequestHeader *rhdr, bool onlyHead)
 {
     char *authHeader;
     RespBuf *resp;
 
-    resp = printMesgPage("401 Unauthorized", NULL, urlPath, onlyHead, false);
-    authHeader = auth_getAuthResponseHeader();
+    resp = printMesgPage("401 Unauthorized", NULL, reqhdr_getPath(rhdr),
+            onlyHead, false);
+    authHeader = auth_getAuthResponseHeader(
+            reqhdr_getLoginState(rhdr) == LS_NONCE_STALE);
     resp_appendHeader(resp, "WWW-Authenticate", authHeader);
     free(authHeader);
     resp_appendHeader(resp, "Content-Type", "text/html; charset=utf-8");
@@ -114,29 +167,27 @@ static RespBuf *printUnauthorized(const char *urlPath, bool onlyHead)
 }
 
 static RespBuf *processFileReq(const char *urlPath, const char *sysPath,
-        bool onlyHead)
+        int fd, const struct stat *st, bool onlyHead)
 {
-    int fd;
     RespBuf *resp;
 
-    if( (fd = open(sysPath, O_RDONLY)) >= 0 ) {
-        log_debug("opened %s", sysPath);
-        resp = resp_new(resp_cmnStatus(HTTP_200_OK), onlyHead);
-        resp_appendHeader(resp, "Content-Type",
-                cttype_getContentTypeByFileExt(sysPath));
-        if( onlyHead ) {
-            close(fd);
-        }else{
-            // TODO: escape filename
-            MemBuf *header = mb_new();
-            mb_appendStrL(header, "inline; filename=\"", 
-                    strrchr(urlPath, '/')+1, "\"", NULL);
-            resp_appendHeader(resp, "Content-Disposition", mb_data(header));
-            mb_free(header);
-            resp_enqFile(resp, fd);
-        }
+    log_debug("opened %s", sysPath);
+    resp = resp_new(resp_cmnStatus(HTTP_200_OK), onlyHead);
+    resp_appendHeader(resp, "Content-Type",
+            cttype_getContentTypeByFileExt(sysPath));
+    if( onlyHead ) {
+        close(fd);
     }else{
-        resp = printErrorPage(errno, urlPath, onlyHead, false);
+        // TODO: escape filename
+        MemBuf *header = mb_new();
+        mb_appendStrL(header, "inline; filename=\"", 
+                strrchr(urlPath, '/')+1, "\"", NULL);
+        resp_appendHeader(resp, "Content-Disposition", mb_data(header));
+        mb_free(header);
+        if( S_ISREG(st->st_mode) )
+            resp_enqFileOfSize(resp, fd, st->st_size);
+        else
+            resp_enqFile(resp, fd);
     }
     return resp;
 }
@@ -152,7 +203,7 @@ static RespBuf *processFolderReq(const RequestHeader *rhdr,
     if( !strcmp(reqhdr_getMethod(rhdr), "POST") && filemgr_processPost(
                 filemgr, rhdr) == PR_REQUIRE_AUTH)
     {
-        resp = printUnauthorized(queryFile, isHeadReq);
+        resp = printUnauthorized(rhdr, isHeadReq);
     }else{
         if( reqhdr_isActionAllowed(rhdr, PA_LIST_FOLDER) ) {
             resp = filemgr_printFolderContents(filemgr, rhdr, &sysErrNo);
@@ -167,40 +218,118 @@ static RespBuf *processFolderReq(const RequestHeader *rhdr,
     return resp;
 }
 
+/* Returns "Set-Cookie" header value for response to the request: a new
+ * session token after login or when the session is renewed, removal of
+ * the token at logout. Returns NULL when the cookie shouldn't be set.
+ */
+static char *getSessionCookie(const RequestHeader *rhdr)
+{
+    enum PrivilegedAction pa;
+    unsigned privileges = 0;
+
+    if( config_getSessionLifetime() == 0 )
+        return NULL;
+    switch( session_getEndpoint(reqhdr_getPath(rhdr)) ) {
+    case SE_LOGOUT:
+        return strdup(session_getLogoutCookie());
+    case SE_RENEW:
+        break;
+    default:
+        if( reqhdr_isSessionLogin(rhdr) )
+            return NULL;
+        break;
+    }
+    if( reqhdr_getLoginState(rhdr) != LS_LOGGED_IN )
+        return NULL;
+    for(pa = PA_SERVE_PAGE; pa <= PA_MODIFY; ++pa) {
+        if( config_isActionAllowed(pa, true) )
+            privileges |= 1u << pa;
+    }
+    return session_newCookie(reqhdr_getUserName(rhdr),
+            privileges & reqhdr_getPrivileges(rhdr));
+}
+
+static ResponseSender *finishResponse(RequestHandler *hdlr, RespBuf *resp)
+{
+    if( hdlr->setCookie != NULL )
+        resp_appendHeader(resp, "Set-Cookie", hdlr->setCookie);
+    return resp_finish(resp);
+}
+
 static RespBuf *doProcessRequest(RequestHandler *hdlr,
         const RequestHeader *rhdr)
 {
     unsigned queryFileLen, isHeadReq;
+    enum SessionEndpoint sessionEndpoint;
     const char *queryFile;
+    const char *fcgiAddr, *luaScriptPath;
+    char *fcgiScript, *fcgiPathInfo, *fcgiFileName;
     RespBuf *resp = NULL;
 
     isHeadReq = !strcmp(reqhdr_getMethod(rhdr), "HEAD");
     queryFile = reqhdr_getPath(rhdr);
     queryFileLen = strlen(queryFile);
     if( reqhdr_getLoginState(rhdr) == LS_LOGIN_FAIL ||
+            reqhdr_getLoginState(rhdr) == LS_NONCE_STALE ||
             ! reqhdr_isActionAllowed(rhdr, PA_SERVE_PAGE) )
     {
         if( reqhdr_getLoginState(rhdr) == LS_LOGIN_FAIL ) {
             log_debug("authorization fail: sleep 2");
             sleep(2); /*make a possible dictionary attack harder to overcome*/
         }
-        resp = printUnauthorized(reqhdr_getPath(rhdr), isHeadReq);
+        resp = printUnauthorized(rhdr, isHeadReq);
     }else if( queryFileLen >= 3 && (strstr(queryFile, "/../") != NULL ||
             !strcmp(queryFile+queryFileLen-3, "/.."))) 
     {
         resp = printMesgPage(resp_cmnStatus(HTTP_403_FORBIDDEN), NULL,
                 queryFile, isHeadReq, false);
+    }else if( (sessionEndpoint = session_getEndpoint(queryFile)) != SE_NONE ) {
+        if( sessionEndpoint == SE_LOGOUT &&
+                reqhdr_getLoginState(rhdr) == LS_LOGGED_IN )
+            session_endUserSessions(reqhdr_getUserName(rhdr));
+        /* logout responds with 401 to make browser forget the password */
+        if( sessionEndpoint == SE_RENEW &&
+                reqhdr_getLoginState(rhdr) == LS_LOGGED_IN )
+            resp = resp_new("204 No Content", true);
+        else
+            resp = printUnauthorized(rhdr, isHeadReq);
+    }else if( (resp = assets_getResponse(rhdr)) != NULL ) {
+        /* built-in listing script or style sheet */
+    }else if( config_findFastCGI(queryFile, &fcgiAddr, &fcgiScript,
+                &fcgiPathInfo) )
+    {
+        fcgiFileName = config_getSysPathForUrlPath(fcgiScript);
+        hdlr->fcgireq = fcgi_new(rhdr, fcgiAddr, hdlr->peerAddr, fcgiScript,
+                fcgiPathInfo, fcgiFileName);
+        free(fcgiScript);
+        free(fcgiPathInfo);
+        free(fcgiFileName);
+    }else if( config_findLuaHandler(queryFile, &luaScriptPath, &fcgiScript,
+                &fcgiPathInfo) )
+    {
+        hdlr->luareq = luahdlr_new(rhdr, luaScriptPath, hdlr->peerAddr,
+                fcgiScript, fcgiPathInfo);
+        free(fcgiScript);
+        free(fcgiPathInfo);
     }else{
-        int sysErrNo = 0;
+        int sysErrNo = 0, fd = -1;
         struct stat st;
-        char *sysPath, *indexFile;
+        char *sysPath = NULL, *indexFile;
         char *cgiUrl = NULL, *cgiSubPath = NULL;
-        Folder *folder = NULL;
-        bool isFolder = false, isCGI = false;
+        bool isFolder = false, isCGI = false, isPathOnly = false;
 
-        sysPath = config_getSysPathForUrlPath(queryFile);
-        if( sysPath != NULL ) {
-            if( stat(sysPath, &st) == 0 ) {
+        if( pathcache_get(queryFile, &sysErrNo, &sysPath, &cgiUrl,
+                    &cgiSubPath) )
+        {
+            isCGI = sysErrNo == 0;
+        }else if( (sysPath = config_getSysPathForUrlPath(queryFile)) != NULL ) {
+            /* not readable file still may be an executable CGI script or
+             * a searchable folder */
+            fd = config_openUrlPath(queryFile, O_RDONLY);
+            if( fd < 0 && errno == EACCES && (fd = config_openUrlPath(
+                            queryFile, O_PATH)) >= 0 )
+                isPathOnly = true;
+            if( fd >= 0 && fstat(fd, &st) == 0 ) {
                 isFolder = S_ISDIR(st.st_mode);
                 isCGI = S_ISREG(st.st_mode) && config_isCGI(queryFile);
             }else{
@@ -215,38 +344,67 @@ static RespBuf *doProcessRequest(RequestHandler *hdlr,
                     sysPath = cgiExe;
                 }
             }
+            if( isCGI )
+                pathcache_putCGI(queryFile, sysPath, cgiUrl, cgiSubPath);
+            else if( sysErrNo != 0 )
+                pathcache_putError(queryFile, sysErrNo);
         }else{
-            if( (folder = config_getSubSharesForPath(queryFile)) == NULL )
-                sysErrNo = ENOENT;
-            else
+            if( config_hasSubShares(queryFile) )
                 isFolder = true;
+            else
+                sysErrNo = ENOENT;
         }
 
         if( sysErrNo == 0 && isFolder && queryFile[strlen(queryFile)-1] != '/')
         {
             resp = printMovedAddSlash(queryFile, isHeadReq);
         }else{
-            if( sysErrNo == 0 && isFolder && folder == NULL &&
-                (indexFile = config_getIndexFile(sysPath, &sysErrNo)) != NULL )
+            if( sysErrNo == 0 && isFolder && sysPath != NULL &&
+                (indexFile = config_getIndexFile(sysPath, fd, &st,
+                                                 &sysErrNo)) != NULL )
             {
+                MemBuf *indexPath = mb_newWithStr(queryFile);
+
+                mb_appendStr(indexPath, indexFile);
+                close(fd);
+                if( (fd = config_openUrlPath(mb_data(indexPath), O_RDONLY)) < 0
+                        || fstat(fd, &st) != 0 )
+                    sysErrNo = errno;
+                isPathOnly = false;
+                mb_setStrEnd(indexPath, 0, sysPath);
+                mb_ensureEndsWithSlash(indexPath);
+                mb_appendStr(indexPath, indexFile);
                 free(sysPath);
-                sysPath = indexFile;
+                sysPath = mb_unbox_free(indexPath);
+                free(indexFile);
                 isFolder = false;
             }
             if( sysErrNo == 0 ) {
                 if( isFolder ) {
-                    hdlr->filemgr = filemgr_new(sysPath, rhdr);
+                    hdlr->filemgr = filemgr_new(sysPath, fd, &st, rhdr);
+                    fd = -1;
                 }else if( isCGI ) {
-                    hdlr->cgiexe = cgiexe_new(rhdr, sysPath, hdlr->peerAddr,
-                            cgiUrl == NULL ? queryFile : cgiUrl, cgiSubPath);
+                    const char *scriptName = cgiUrl ? cgiUrl : queryFile;
+                    CgiCacheFill *cacheFill;
+
+                    resp = cgicache_getResponse(rhdr, scriptName, &cacheFill);
+                    if( resp == NULL )
+                        hdlr->cgiexe = cgiexe_new(rhdr, sysPath,
+                                hdlr->peerAddr, scriptName, cgiSubPath,
+                                cacheFill);
+                }else if( isPathOnly ) {
+                    resp = printErrorPage(EACCES, queryFile, isHeadReq, false);
                 }else{
-                    resp = processFileReq(queryFile, sysPath, isHeadReq);
+                    resp = processFileReq(queryFile, sysPath, fd, &st,
+                            isHeadReq);
+                    fd = -1;
                 }
             }else{
                 resp = printErrorPage(sysErrNo, queryFile, isHeadReq, false);
             }
         }
-        folder_free(folder);
+        if( fd >= 0 )
+            close(fd);
         free(sysPath);
         free(cgiUrl);
         free(cgiSubPath);
@@ -261,16 +419,27 @@ RequestHandler *reqhdlr_new(const RequestHeader *rhdr, const char *peerAddr)
     RespBuf *resp = NULL;
     bool isHeadReq = ! strcmp(meth, "HEAD");
 
+    handler->config = config_acquire();
     handler->peerAddr = peerAddr ? strdup(peerAddr) : NULL;
     handler->filemgr = NULL;
     handler->cgiexe = NULL;
-    if( strcmp(meth, "GET") && strcmp(meth, "POST") && ! isHeadReq ) {
+    handler->fcgireq = NULL;
+    handler->luareq = NULL;
+    handler->setCookie = getSessionCookie(rhdr);
+    handler->isHeaderRejected = reqhdr_getError(rhdr) != RHE_NONE;
+    if( handler->isHeaderRejected ) {
+        resp = printMesgPage(
+                reqhdr_getError(rhdr) == RHE_REQUEST_LINE_TOO_LONG ?
+                "414 URI Too Long" : "431 Request Header Fields Too Large",
+                NULL, reqhdr_getPath(rhdr), isHeadReq, false);
+        resp_appendHeader(resp, "Connection", "close");
+    }else if( strcmp(meth, "GET") && strcmp(meth, "POST") && ! isHeadReq ) {
         resp = resp_new("405 Method Not Allowed", isHeadReq);
         resp_appendHeader(resp, "Allow", "GET, HEAD, POST");
     }else{
         resp = doProcessRequest(handler, rhdr);
     }
-    handler->response = resp == NULL ? NULL : resp_finish(resp);
+    handler->response = resp == NULL ? NULL : finishResponse(handler, resp);
     return handler;
 }
 
@@ -279,14 +448,26 @@ unsigned reqhdlr_processData(RequestHandler *hdlr, const char *data,
 {
     unsigned processed = len;
 
+    config_use(hdlr->config);
     if( hdlr->filemgr != NULL ) {
         filemgr_consumeBodyBytes(hdlr->filemgr, data, len);
     }else if( hdlr->cgiexe != NULL ) {
         processed = cgiexe_processData(hdlr->cgiexe, data, len, dpr);
+    }else if( hdlr->fcgireq != NULL ) {
+        processed = fcgi_processData(hdlr->fcgireq, data, len, dpr);
+    }else if( hdlr->luareq != NULL ) {
+        luahdlr_processData(hdlr->luareq, data, len);
     }
+    config_use(NULL);
     return processed;
 }
 
+bool reqhdlr_isRequestRejected(const RequestHandler *hdlr)
+{
+    return hdlr->isHeaderRejected ||
+        (hdlr->filemgr != NULL && filemgr_isBodyTooLarge(hdlr->filemgr));
+}
+
 void reqhdlr_requestReadCompleted(RequestHandler *hdlr,
         const RequestHeader *rhdr)
 {
@@ -294,17 +475,27 @@ void reqhdlr_requestReadCompleted(RequestHandler *hdlr,
     int isHeadReq = ! strcmp(meth, "HEAD");
     RespBuf *resp = NULL;
 
+    config_use(hdlr->config);
     if( hdlr->cgiexe != NULL ) {
         cgiexe_requestReadCompleted(hdlr->cgiexe);
+    }else if( hdlr->fcgireq != NULL ) {
+        fcgi_requestReadCompleted(hdlr->fcgireq);
+    }else if( hdlr->luareq != NULL ) {
+        luahdlr_requestReadCompleted(hdlr->luareq);
     }else if( hdlr->response == NULL ) {
-        if( hdlr->filemgr != NULL ) {
+        if( hdlr->filemgr != NULL && filemgr_isBodyTooLarge(hdlr->filemgr) ) {
+            resp = printMesgPage("413 Payload Too Large", NULL,
+                    reqhdr_getPath(rhdr), isHeadReq, false);
+            resp_appendHeader(resp, "Connection", "close");
+        }else if( hdlr->filemgr != NULL ) {
             resp = processFolderReq(rhdr, hdlr->filemgr);
         }else
             resp = printMesgPage(resp_cmnStatus(HTTP_500),
                     "reqhandler: unspecified handler",
                     reqhdr_getPath(rhdr), isHeadReq, false);
-        hdlr->response = resp_finish(resp);
+        hdlr->response = finishResponse(hdlr, resp);
     }
+    config_use(NULL);
 }
 
 bool reqhdlr_progressResponse(RequestHandler *hdlr, int socketFd,
@@ -312,14 +503,24 @@ bool reqhdlr_progressResponse(RequestHandler *hdlr, int socketFd,
 {
     bool isFinished = false;
 
+    config_use(hdlr->config);
     if( hdlr->response == NULL && hdlr->cgiexe != NULL ) {
         RespBuf *resp = cgiexe_getResponse(hdlr->cgiexe, dpr);
         if( resp != NULL )
-            hdlr->response = resp_finish(resp);
+            hdlr->response = finishResponse(hdlr, resp);
+    }else if( hdlr->response == NULL && hdlr->fcgireq != NULL ) {
+        RespBuf *resp = fcgi_getResponse(hdlr->fcgireq, dpr);
+        if( resp != NULL )
+            hdlr->response = finishResponse(hdlr, resp);
+    }else if( hdlr->response == NULL && hdlr->luareq != NULL ) {
+        RespBuf *resp = luahdlr_getResponse(hdlr->luareq);
+        if( resp != NULL )
+            hdlr->response = finishResponse(hdlr, resp);
     }
     if( hdlr->response != NULL ) {
         isFinished = rsndr_send(hdlr->response, socketFd, dpr);
     }
+    config_use(NULL);
     return isFinished;
 }
 
@@ -327,9 +528,14 @@ void reqhdlr_free(RequestHandler *hdlr)
 {
     if( hdlr != NULL ) {
         free(hdlr->peerAddr);
+        free(hdlr->setCookie);
         filemgr_free(hdlr->filemgr);
         cgiexe_free(hdlr->cgiexe);
+        /* response body is produced by the FastCGI or Lua request */
         rsndr_free(hdlr->response);
+        fcgi_free(hdlr->fcgireq);
+        luahdlr_free(hdlr->luareq);
+        config_release(hdlr->config);
         free(hdlr);
     }
 }
@@ -20,6 +20,14 @@ unsigned reqhdlr_processData(RequestHandler*, const char *data,
         unsigned len, DataProcessingResult*);
 
 
+/* Returns true when the request exceeds configured limits: the header,
+ * or the form data in body. The rest of request shall not be read then;
+ * the handler responds with error once signaled that the request is read
+ * and the connection shall be closed after the response.
+ */
+bool reqhdlr_isRequestRejected(const RequestHandler*);
+
+
 /* Signals the handler that request is completely read.
  */
 void reqhdlr_requestReadCompleted(RequestHandler*, const RequestHeader*);
@@ -2,6 +2,7 @@
 #include "requestheader.h"
 #include "membuf.h"
 #include "auth.h"
+#include "session.h"
 #include "fmlog.h"
 #include <stdlib.h>
 #include <string.h>
@@ -16,7 +17,15 @@ struct RequestHeader {
                          * is incomplete.
                          * Value -1 means the request line is incomplete.
                          */
+    unsigned fieldsSize;    /* total size of header field lines read,
+                             * including line terminators */
+    enum RequestHeaderError error;
+    bool isComplete;        /* the header is complete; further lines belong
+                             * to the chunked body trailer */
     enum LoginState loginState;
+    char *userName;         /* the logged in user; NULL if not logged in */
+    unsigned privileges;    /* PrivilegedAction bits available after login */
+    bool isSessionLogin;    /* whether logged in using session token */
 };
 
 RequestHeader *reqhdr_new(void)
@@ -28,10 +37,21 @@ RequestHeader *reqhdr_new(void)
     req->version = "";
     req->headers = NULL;
     req->headerCount = -1;
+    req->fieldsSize = 0;
+    req->error = RHE_NONE;
+    req->isComplete = false;
     req->loginState = LS_LOGGED_OUT;
+    req->userName = NULL;
+    req->privileges = 0;
+    req->isSessionLogin = false;
     return req;
 }
 
+enum RequestHeaderError reqhdr_getError(const RequestHeader *req)
+{
+    return req->error;
+}
+
 const char *reqhdr_getMethod(const RequestHeader *req)
 {
     return req->request;
@@ -109,9 +129,25 @@ bool reqhdr_isWorthPuttingLogOnButton(const RequestHeader *req)
         config_givesLoginMorePrivileges();
 }
 
+const char *reqhdr_getUserName(const RequestHeader *req)
+{
+    return req->userName;
+}
+
+bool reqhdr_isSessionLogin(const RequestHeader *req)
+{
+    return req->isSessionLogin;
+}
+
+unsigned reqhdr_getPrivileges(const RequestHeader *req)
+{
+    return req->privileges;
+}
+
 bool reqhdr_isActionAllowed(const RequestHeader *req, enum PrivilegedAction pa)
 {
-    return config_isActionAllowed(pa, req->loginState == LS_LOGGED_IN);
+    return config_isActionAllowed(pa, req->loginState == LS_LOGGED_IN &&
+            (req->privileges & 1u << pa));
 }
 
 static void decodeRequestStartLine(RequestHeader *req)
@@ -156,24 +192,69 @@ static void decodeRequestStartLine(RequestHeader *req)
     }
 }
 
-static void checkAuthorization(RequestHeader *req)
+/* Sets the login state, checking session cookie first, then the
+ * "Authorization" header. Invoked when the header is complete.
+ */
+static void checkLogin(RequestHeader *req)
 {
-    static const char authHeaderName[] = "Authorization";
-    const char *auth = req->headers[req->headerCount];
+    const char *auth, *cookie;
+    bool isStale;
 
-    if(req->loginState == LS_LOGGED_OUT && !strcasecmp(auth, authHeaderName)) {
-        auth += sizeof(authHeaderName);
-        req->loginState = auth_isClientAuthorized(auth, reqhdr_getMethod(req)) ?
-            LS_LOGGED_IN : LS_LOGIN_FAIL;
+    if( config_getSessionLifetime() != 0 &&
+            (cookie = reqhdr_getHeaderVal(req, "Cookie")) != NULL &&
+            session_checkCookie(cookie, &req->userName, &req->privileges) )
+    {
+        req->loginState = LS_LOGGED_IN;
+        req->isSessionLogin = true;
+    }else if( (auth = reqhdr_getHeaderVal(req, "Authorization")) != NULL ) {
+        if( auth_isClientAuthorized(auth, reqhdr_getMethod(req), &isStale,
+                    &req->userName) )
+        {
+            req->loginState = LS_LOGGED_IN;
+            req->privileges = ~0u;
+        }else
+            req->loginState = isStale ? LS_NONCE_STALE : LS_LOGIN_FAIL;
         log_debug("Authorization: %s", auth);
     }
 }
 
+/* Returns length of line consisting of cur and add parts, not counting
+ * the trailing CR.
+ */
+static unsigned getLineLen(const char *cur, unsigned curLen,
+        const char *add, unsigned addLen)
+{
+    unsigned len = curLen + addLen;
+
+    if( addLen > 0 ? add[addLen-1] == '\r' :
+            curLen > 0 && cur[curLen-1] == '\r' )
+        --len;
+    return len;
+}
+
+/* Marks the header as erroneous. The incomplete or excess line is dropped;
+ * when the request line is not complete, only the method is kept.
+ */
+static void setError(RequestHeader *req, enum RequestHeaderError error)
+{
+    log_debug("request header exceeds limits (%s)",
+            error == RHE_REQUEST_LINE_TOO_LONG ? "request line" : "fields");
+    req->error = error;
+    if( req->headerCount == -1 ) {
+        req->request[strcspn(req->request, " ")] = '\0';
+        decodeRequestStartLine(req);
+        req->headerCount = 0;
+        req->headers = malloc(sizeof(char*));
+        req->headers[0] = strdup("");
+    }else
+        req->headers[req->headerCount][0] = '\0';
+}
+
 int reqhdr_appendData(RequestHeader *req, const char *data, unsigned len)
 {
     const char *bol, *eol;
     char **curLoc, *colon;
-    unsigned curLen, addLen;
+    unsigned curLen, addLen, maxSize;
     bool isFinish = false;
 
     bol = data;
@@ -183,6 +264,27 @@ int reqhdr_appendData(RequestHeader *req, const char *data, unsigned len)
         curLen = strlen(*curLoc);
         eol = memchr(bol, '\n', data + len - bol);
         addLen = (eol==NULL ? data+len : eol) - bol;
+        if( req->headerCount == -1 ) {
+            maxSize = config_getMaxRequestLine();
+            if( maxSize != 0 &&
+                    getLineLen(*curLoc, curLen, bol, addLen) > maxSize )
+            {
+                setError(req, RHE_REQUEST_LINE_TOO_LONG);
+                isFinish = true;
+                break;
+            }
+        }else{
+            maxSize = config_getMaxHeaderSize();
+            /* line terminators are counted too */
+            if( maxSize != 0 &&
+                    req->fieldsSize + addLen + (eol != NULL) > maxSize )
+            {
+                setError(req, RHE_FIELDS_TOO_LARGE);
+                isFinish = true;
+                break;
+            }
+            req->fieldsSize += addLen + (eol != NULL);
+        }
         *curLoc = realloc(*curLoc, curLen + addLen + 1);
         memcpy(*curLoc + curLen, bol, addLen);
         curLen += addLen;
@@ -191,14 +293,21 @@ int reqhdr_appendData(RequestHeader *req, const char *data, unsigned len)
             if( curLen > 0 && (*curLoc)[curLen-1] == '\r' )
                 (*curLoc)[--curLen] = '\0';
             if( **curLoc == '\0' ) {    /* empty line */
-                isFinish = req->headerCount >= 0;
+                if( (isFinish = req->headerCount >= 0) && ! req->isComplete )
+                    checkLogin(req);
             }else{
                 if( req->headerCount >= 0 ) {
+                    if( (maxSize = config_getMaxHeaderCount()) != 0 &&
+                            (unsigned)req->headerCount >= maxSize )
+                    {
+                        setError(req, RHE_FIELDS_TOO_LARGE);
+                        isFinish = true;
+                        break;
+                    }
                     /* replace colon with '\0' */
                     colon = strchr(req->headers[req->headerCount], ':');
                     if( colon != NULL ) {
                         *colon = '\0';
-                        checkAuthorization(req);
                     }else{
                         log_debug("No colon in header line (line ignored): %s",
                                 req->headers[req->headerCount]);
@@ -218,6 +327,10 @@ int reqhdr_appendData(RequestHeader *req, const char *data, unsigned len)
             bol = data + len;
         }
     }
+    if( req->error != RHE_NONE )
+        bol = data + len;   /* the rest of data is dropped */
+    if( isFinish )
+        req->isComplete = true;
     return isFinish ? bol - data : -1;
 }
 
@@ -230,6 +343,7 @@ void reqhdr_free(RequestHeader *req)
         for(i = 0; i <= req->headerCount; ++i)
             free(req->headers[i]);
         free(req->headers);
+        free(req->userName);
         free(req);
     }
 }
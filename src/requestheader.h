@@ -12,7 +12,17 @@ typedef struct RequestHeader RequestHeader;
 enum LoginState {
     LS_LOGGED_OUT,      /* request does not contain "Authorization" header */
     LS_LOGGED_IN,       /* request contains valid "Authorization" header */
-    LS_LOGIN_FAIL       /* request contains invalid "Authorization" header */
+    LS_LOGIN_FAIL,      /* request contains invalid "Authorization" header */
+    LS_NONCE_STALE      /* "Authorization" header has correct credentials
+                         * but expired or reused nonce */
+};
+
+
+enum RequestHeaderError {
+    RHE_NONE,
+    RHE_REQUEST_LINE_TOO_LONG,  /* request line exceeds "maxrequestline" */
+    RHE_FIELDS_TOO_LARGE        /* header fields exceed "maxheadersize" or
+                                 * "maxheadercount" */
 };
 
 
@@ -25,10 +35,18 @@ RequestHeader *reqhdr_new(void);
  * as a part of request header.
  * Returns -1 when the request header is not complete. Otherwise
  * (value >= 0) - number of bytes consumed from data.
+ * When the header exceeds configured limits, the header is considered
+ * complete at once: the data is consumed entirely, the excess lines are
+ * dropped and reqhdr_getError() reports the error.
  */
 int reqhdr_appendData(RequestHeader*, const char *data, unsigned len);
 
 
+/* Returns the error encountered while the header was built.
+ */
+enum RequestHeaderError reqhdr_getError(const RequestHeader*);
+
+
 /* Returns the request method (GET, POST, etc.)
  */
 const char *reqhdr_getMethod(const RequestHeader*);
@@ -75,6 +93,23 @@ bool reqhdr_isChunkedTransferEncoding(const RequestHeader*);
 enum LoginState reqhdr_getLoginState(const RequestHeader*);
 
 
+/* Returns name of the logged in user; NULL when not logged in.
+ */
+const char *reqhdr_getUserName(const RequestHeader*);
+
+
+/* Returns true when the user is logged in using session token rather than
+ * "Authorization" header.
+ */
+bool reqhdr_isSessionLogin(const RequestHeader*);
+
+
+/* Returns bit mask of PrivilegedAction values which the logged in user
+ * may perform, as far as the configuration allows.
+ */
+unsigned reqhdr_getPrivileges(const RequestHeader*);
+
+
 /* Returns true when client might be interested with log in, i.e.:
  *  1. Is not logged in yet
  *  2. Some additional actions will be possible after login
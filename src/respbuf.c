@@ -10,11 +10,25 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/* Maximum number of holes in response template
+ */
+enum { RESP_TMPL_MAXHOLES = 16 };
 
 struct RespBuf {
     MemBuf *header;
     MemBuf *body;
     int fileDesc;
+    long long fileSize;     /* fileDesc regular file size; -1 if unknown */
+    RespBodyProducer producer;
+    void *producerData;
+    void (*freeProducerData)(void*);
 };
 
 const char *resp_cmnStatus(HttpStatus status)
@@ -46,6 +60,10 @@ RespBuf *resp_new(const char *status, bool onlyHead)
     resp->header = mb_new();
     resp->body = onlyHead ? NULL : mb_new();
     resp->fileDesc = -1;
+    resp->fileSize = -1;
+    resp->producer = NULL;
+    resp->producerData = NULL;
+    resp->freeProducerData = NULL;
     mb_appendStr(resp->header, "HTTP/1.1 ");
     mb_appendStr(resp->header, status);
     mb_appendStr(resp->header, "\r\n");
@@ -62,89 +80,175 @@ void resp_appendHeader(RespBuf *resp, const char *name, const char *value)
 
 void resp_appendData(RespBuf *resp, const char *data, unsigned dataLen)
 {
-    mb_appendData(resp->body, data, dataLen);
+    if( resp->body != NULL )
+        mb_appendData(resp->body, data, dataLen);
 }
 
 void resp_appendStr(RespBuf *resp, const char *str)
 {
-    mb_appendStr(resp->body, str);
+    if( resp->body != NULL )
+        mb_appendStr(resp->body, str);
+}
+
+unsigned resp_bodyLen(const RespBuf *resp)
+{
+    return resp->body ? mb_dataLen(resp->body) : 0;
+}
+
+const char *resp_bodyData(const RespBuf *resp)
+{
+    return resp->body ? mb_data(resp->body) : "";
+}
+
+/* HTML escape sequences of special characters; empty for other characters.
+ */
+static const struct {
+    const char *repl;
+    unsigned len;
+} gEscapeHtml[256] = {
+    ['"']  = { "&quot;", 6 },
+    ['\''] = { "&apos;", 6 },
+    ['&']  = { "&amp;",  5 },
+    ['<']  = { "&lt;",   4 },
+    ['>']  = { "&gt;",   4 }
+};
+
+/* Returns offset of first character in data needing HTML escape; returns
+ * len when there is no such character.
+ */
+static unsigned findEscapeHtml(const char *data, unsigned len)
+{
+    unsigned offset = 0;
+
+#ifdef __AVX2__
+    const __m256i quot32 = _mm256_set1_epi8('"');
+    const __m256i apos32 = _mm256_set1_epi8('\'');
+    const __m256i amp32  = _mm256_set1_epi8('&');
+    const __m256i lt32   = _mm256_set1_epi8('<');
+    const __m256i gt32   = _mm256_set1_epi8('>');
+
+    while( offset + 32 <= len ) {
+        __m256i chars = _mm256_loadu_si256((const __m256i*)(data + offset));
+        __m256i match = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(chars, quot32),
+                    _mm256_cmpeq_epi8(chars, apos32)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(chars, amp32),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(chars, lt32),
+                        _mm256_cmpeq_epi8(chars, gt32))));
+        unsigned mask = _mm256_movemask_epi8(match);
+        if( mask )
+            return offset + __builtin_ctz(mask);
+        offset += 32;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i apos = _mm_set1_epi8('\'');
+    const __m128i amp  = _mm_set1_epi8('&');
+    const __m128i lt   = _mm_set1_epi8('<');
+    const __m128i gt   = _mm_set1_epi8('>');
+
+    while( offset + 16 <= len ) {
+        __m128i chars = _mm_loadu_si128((const __m128i*)(data + offset));
+        __m128i match = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chars, quot),
+                    _mm_cmpeq_epi8(chars, apos)),
+                _mm_or_si128(_mm_cmpeq_epi8(chars, amp),
+                    _mm_or_si128(_mm_cmpeq_epi8(chars, lt),
+                        _mm_cmpeq_epi8(chars, gt))));
+        unsigned mask = _mm_movemask_epi8(match);
+        if( mask )
+            return offset + __builtin_ctz(mask);
+        offset += 16;
+    }
+#endif
+    while( offset < len && gEscapeHtml[(unsigned char)data[offset]].len == 0 )
+        ++offset;
+    return offset;
 }
 
 static void appendDataEscapeHtml(RespBuf *resp, const char *data, unsigned len)
 {
-    const char *repl, *dcur = data;
+    unsigned span, escIdx;
 
+    /* usually nothing needs escape */
+    mb_reserve(resp->body, mb_dataLen(resp->body) + len);
     while( len ) {
-        switch( *dcur ) {
-        case '"':  repl = "&quot;"; break;
-        case '\'': repl = "&apos;"; break;
-        case '&':  repl = "&amp;";  break;
-        case '<':  repl = "&lt;";   break;
-        case '>':  repl = "&gt;";   break;
-        default:   repl = NULL;     break;
-        }
-        if( repl != NULL ) {
-            if( dcur != data )
-                mb_appendData(resp->body, data, dcur-data);
-            mb_appendStr(resp->body, repl);
-            data = dcur + 1;
-        }
-        ++dcur;
-        --len;
+        span = findEscapeHtml(data, len);
+        if( span )
+            memcpy(mb_appendSpace(resp->body, span), data, span);
+        if( span == len )
+            break;
+        escIdx = (unsigned char)data[span];
+        memcpy(mb_appendSpace(resp->body, gEscapeHtml[escIdx].len),
+                gEscapeHtml[escIdx].repl, gEscapeHtml[escIdx].len);
+        data += span + 1;
+        len -= span + 1;
+    }
+}
+
+/* Returns the host name; retrieved once, on first use.
+ */
+static const char *getHostName(void)
+{
+    static char hostname[HOST_NAME_MAX + 1];
+    static bool isRetrieved;
+
+    if( ! isRetrieved ) {
+        if( gethostname(hostname, sizeof(hostname) - 1) != 0 )
+            hostname[0] = '\0';
+        isRetrieved = true;
     }
-    if( dcur != data )
-        mb_appendData(resp->body, data, dcur-data);
+    return hostname;
 }
 
-void resp_appendFmt(RespBuf *resp, const char *fmt, ...)
+void resp_appendTmpl(RespBuf *resp, const RespTmplSeg *tmpl, ...)
 {
     va_list args;
-    const char *fbeg, *fend, *par;
-    const DataChunk *dch;
-    int len;
-    char c, hostname[HOST_NAME_MAX];
-
-    va_start(args, fmt);
-    fbeg = fmt;
-    while( (fend = strchr(fbeg, '%')) != NULL ) {
-        if( fend != fbeg )
-            resp_appendData(resp, fbeg, fend-fbeg);
-        c = *++fend;
-        if( c == 'C' || c == 'D' || c == 'H' || c == 'S' ) {
-            if( c == 'H' ) {
-                if( gethostname(hostname, sizeof(hostname)) != 0 )
-                    hostname[0] = '\0';
-                par = hostname;
-                len = strlen(par);
-            }else if( c == 'C' ) {
-                dch = va_arg(args, DataChunk*);
-                par = dch->data;
-                len = dch->len;
-            }else{
-                par = va_arg(args, const char*);
-                if( c == 'D' )
-                    len = va_arg(args, int);
-                else
-                    len = strlen(par);
-            }
-            appendDataEscapeHtml(resp, par, len);
-        }else{
-            if( c == 'R' ) {
-                par = va_arg(args, const char*);
-                len = strlen(par);
-            }else{
-                if( c != fend[-1] )
-                    --fend;
-                par = fend;
-                len = 1;
-            }
-            resp_appendData(resp, par, len);
+    const RespTmplSeg *seg;
+    DataChunk holes[RESP_TMPL_MAXHOLES];
+    unsigned holeCount = 0, totalLen = 0;
+
+    /* collect parameters and compute expected size of output */
+    va_start(args, tmpl);
+    for(seg = tmpl; seg->type != RTS_END; ++seg) {
+        if( seg->type == RTS_TEXT ) {
+            totalLen += seg->len;
+            continue;
+        }
+        if( holeCount == RESP_TMPL_MAXHOLES )
+            log_fatal("resp_appendTmpl: too many template holes");
+        switch( seg->type ) {
+        case RTS_CHUNK:
+            holes[holeCount] = *va_arg(args, const DataChunk*);
+            break;
+        case RTS_HOST:
+            dch_initWithStr(holes + holeCount, getHostName());
+            break;
+        default:    /* RTS_STR, RTS_RAW */
+            dch_initWithStr(holes + holeCount, va_arg(args, const char*));
+            break;
         }
-        fbeg = fend + 1;
+        totalLen += holes[holeCount++].len;
     }
     va_end(args);
-    if( *fbeg )
-        resp_appendStr(resp, fbeg);
+    mb_reserve(resp->body, mb_dataLen(resp->body) + totalLen);
+    holeCount = 0;
+    for(seg = tmpl; seg->type != RTS_END; ++seg) {
+        switch( seg->type ) {
+        case RTS_TEXT:
+            mb_appendData(resp->body, seg->text, seg->len);
+            break;
+        case RTS_RAW:
+            mb_appendChunk(resp->body, holes + holeCount++);
+            break;
+        default:
+            appendDataEscapeHtml(resp, holes[holeCount].data,
+                    holes[holeCount].len);
+            ++holeCount;
+            break;
+        }
+    }
 }
 
 void resp_enqFile(RespBuf *resp, int fileDesc)
@@ -152,6 +256,49 @@ void resp_enqFile(RespBuf *resp, int fileDesc)
     if( resp->fileDesc != -1 )
         close(resp->fileDesc);
     resp->fileDesc = fileDesc;
+    resp->fileSize = -1;
+}
+
+void resp_enqFileOfSize(RespBuf *resp, int fileDesc,
+        unsigned long long fileSize)
+{
+    resp_enqFile(resp, fileDesc);
+    resp->fileSize = fileSize;
+}
+
+void resp_setBodyProducer(RespBuf *resp, RespBodyProducer producer,
+        void *producerData, void (*freeProducerData)(void*))
+{
+    if( resp->producer != NULL && resp->freeProducerData != NULL )
+        resp->freeProducerData(resp->producerData);
+    resp->producer = producer;
+    resp->producerData = producerData;
+    resp->freeProducerData = freeProducerData;
+}
+
+/* Response sender body producer. Lets the RespBuf body producer append
+ * data directly to the sender buffer.
+ */
+static bool produceBody(void *pvResp, MemBuf *body, int *awaitFd)
+{
+    RespBuf *resp = pvResp;
+    bool res;
+
+    resp->body = body;
+    res = resp->producer(resp, resp->producerData, awaitFd);
+    resp->body = NULL;
+    return res;
+}
+
+static void freeResp(void *pvResp)
+{
+    RespBuf *resp = pvResp;
+
+    if( resp->producer != NULL && resp->freeProducerData != NULL )
+        resp->freeProducerData(resp->producerData);
+    if( resp->fileDesc != -1 )
+        close(resp->fileDesc);
+    free(resp);
 }
 
 ResponseSender *resp_finish(RespBuf *resp)
@@ -159,8 +306,16 @@ ResponseSender *resp_finish(RespBuf *resp)
     ResponseSender * rsndr;
     resp_appendHeader(resp, "Server", "filemanager-httpd");
 
-    rsndr = rsndr_new(resp->header, resp->body, resp->fileDesc);
-    free( resp );
+    if( resp->producer != NULL && resp->body != NULL ) {
+        /* the RespBuf is kept as producer data */
+        rsndr = rsndr_newWithProducer(resp->header, resp->body,
+                produceBody, resp, freeResp);
+        resp->body = NULL;
+    }else{
+        rsndr = rsndr_new(resp->header, resp->body, resp->fileDesc,
+                resp->fileSize);
+        resp->fileDesc = -1;
+        freeResp(resp);
+    }
     return rsndr;
 }
-
@@ -32,7 +32,8 @@ RespBuf *resp_new(const char *status, bool onlyHead);
 void resp_appendHeader(RespBuf*, const char *name, const char *value);
 
 
-/* Appends data to response body
+/* Appends data to response body. Ignored when the response is to HEAD
+ * request.
  */
 void resp_appendData(RespBuf*, const char *data, unsigned dataLen);
 
@@ -47,21 +48,87 @@ void resp_appendData(RespBuf*, const char *data, unsigned dataLen);
 void resp_enqFile(RespBuf*, int fileDescriptor);
 
 
+/* Like resp_enqFile() but for a regular file of known size, which spares
+ * the file status retrieval.
+ */
+void resp_enqFileOfSize(RespBuf*, int fileDescriptor,
+        unsigned long long fileSize);
+
+
 /* Appends string to response body, i.e. strlen(str) bytes.
+ * Ignored when the response is to HEAD request.
  */
 void resp_appendStr(RespBuf*, const char *str);
 
 
-/* Appends formatted string. The following format specifiers are recognized:
- *  %C  - a DataChunk pointer
- *  %D  - two parameters: character array and then their length
- *  %H  - no parameter; host name is inserted
- *  %R  - a "raw" string
- *  %S  - a string
- *  %%  - '%' character
- *  HTML special characters are escaped in all parameters except %R.
+/* Returns current length of response body.
+ */
+unsigned resp_bodyLen(const RespBuf*);
+
+
+/* Returns response body data appended so far, i.e. resp_bodyLen() bytes.
+ */
+const char *resp_bodyData(const RespBuf*);
+
+
+/* Producer of response body. Invoked when the response sender needs more
+ * body data. The producer should append next piece of body using the
+ * resp_append* functions. Returns false when the body is complete.
+ * When returns true, should append some data, unless the data is not
+ * available yet: then should set awaitFd to the file descriptor to wait
+ * for until readable.
+ */
+typedef bool (*RespBodyProducer)(RespBuf*, void *producerData,
+        int *awaitFd);
+
+
+/* Sets producer of the remaining part of response body, i.e. the part
+ * following data set by resp_append* functions. The body is sent using
+ * chunked Transfer-Encoding, so it is generated piece by piece as the
+ * socket accepts data, instead of being kept whole in memory.
+ * The freeProducerData function is invoked with producerData parameter
+ * when the producer is no longer needed.
+ */
+void resp_setBodyProducer(RespBuf*, RespBodyProducer, void *producerData,
+        void (*freeProducerData)(void*));
+
+
+/* Response body template segment types.
+ */
+enum RespTmplSegType {
+    RTS_END,        /* end of template */
+    RTS_TEXT,       /* literal text */
+    RTS_CHUNK,      /* a DataChunk pointer */
+    RTS_STR,        /* a string */
+    RTS_RAW,        /* a "raw" string */
+    RTS_HOST        /* no parameter; host name is inserted */
+};
+
+
+/* Response body template segment. Templates are arrays of segments
+ * terminated with RTS_END, defined statically using the RESP_TMPL_*
+ * macros below. Literal text lengths are computed at compile time.
+ */
+typedef struct {
+    enum RespTmplSegType type;
+    const char *text;           /* RTS_TEXT: the literal text */
+    unsigned len;               /* RTS_TEXT: length of the text */
+} RespTmplSeg;
+
+#define RESP_TMPL_TEXT(str)     { RTS_TEXT, str, sizeof(str) - 1 }
+#define RESP_TMPL_HOLE(type)    { type, NULL, 0 }
+#define RESP_TMPL_END           { RTS_END, NULL, 0 }
+
+
+/* Appends template to response body. Template holes are filled with
+ * parameters, in order of appearance:
+ *  RTS_CHUNK   - a DataChunk pointer
+ *  RTS_STR     - a string
+ *  RTS_RAW     - a "raw" string
+ *  RTS_HOST    - no parameter; host name is inserted
+ *  HTML special characters are escaped in all parameters except RTS_RAW.
  */
-void resp_appendFmt(RespBuf*, const char *fmt, ...);
+void resp_appendTmpl(RespBuf*, const RespTmplSeg *tmpl, ...);
 
 
 /* Finishes response preparation. Free the buffer, return data ready to send.
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -15,11 +16,26 @@ struct ResponseSender {
     int fileDesc;
     unsigned dataSize;
     unsigned dataOffset;    /* index of first unwritten byte in data */
+    unsigned headerOffset;  /* index of first unwritten byte in header */
     long long nbytes;       /* total number of bytes to write; -1 for
                              * "chunked" Transfer-Encoding */
+    RsndrBodyProducer producer;
+    void *producerData;
+    void (*freeProducerData)(void*);
 };
 
-ResponseSender *rsndr_new(MemBuf *header, MemBuf *body, int fileDesc)
+static void freeProducer(ResponseSender *rsndr)
+{
+    if( rsndr->producer != NULL ) {
+        if( rsndr->freeProducerData != NULL )
+            rsndr->freeProducerData(rsndr->producerData);
+        rsndr->producer = NULL;
+    }
+}
+
+static ResponseSender *newSender(MemBuf *header, MemBuf *body, int fileDesc,
+        long long fileSize, RsndrBodyProducer producer, void *producerData,
+        void (*freeProducerData)(void*))
 {
     ResponseSender *rsndr;
     char contentLength[40];
@@ -28,10 +44,20 @@ ResponseSender *rsndr_new(MemBuf *header, MemBuf *body, int fileDesc)
     rsndr->header = header;
     rsndr->body = body;
     rsndr->dataOffset = 0;
+    rsndr->headerOffset = 0;
     rsndr->nbytes = 0;
+    rsndr->producer = producer;
+    rsndr->producerData = producerData;
+    rsndr->freeProducerData = freeProducerData;
+    if( body == NULL )
+        freeProducer(rsndr);
     if( body ) {
         struct stat st;
-        if( fileDesc != -1 ) {
+        if( rsndr->producer != NULL ) {
+            rsndr->nbytes = -1;
+        }else if( fileDesc != -1 && fileSize >= 0 ) {
+            rsndr->nbytes = fileSize;
+        }else if( fileDesc != -1 ) {
             if( fstat(fileDesc, &st) != -1 ) {
                 if( S_ISREG(st.st_mode) )
                     rsndr->nbytes = st.st_size;
@@ -73,9 +99,23 @@ ResponseSender *rsndr_new(MemBuf *header, MemBuf *body, int fileDesc)
     return rsndr;
 }
 
+ResponseSender *rsndr_new(MemBuf *header, MemBuf *body, int fileDesc,
+        long long fileSize)
+{
+    return newSender(header, body, fileDesc, fileSize, NULL, NULL, NULL);
+}
+
+ResponseSender *rsndr_newWithProducer(MemBuf *header, MemBuf *body,
+        RsndrBodyProducer producer, void *producerData,
+        void (*freeProducerData)(void*))
+{
+    return newSender(header, body, -1, -1, producer, producerData,
+            freeProducerData);
+}
+
 static void fillBuffer(ResponseSender *rsndr, DataProcessingResult *dpr)
 {
-    int toFill, rd, filledCount;
+    int toFill, rd, filledCount, awaitFd = rsndr->fileDesc;
     char chunkHeader[12];
 
     if( rsndr->nbytes >= 0 ) {
@@ -107,18 +147,28 @@ static void fillBuffer(ResponseSender *rsndr, DataProcessingResult *dpr)
         rsndr->dataSize = filledCount;
         rsndr->dataOffset = 0;
     }else{
-        toFill = 65546;
-        if( mb_dataLen(rsndr->body) < toFill + 7 )
-            mb_resize(rsndr->body, toFill + 7);
         filledCount = 10;   /* making space for chunk header */
-        while( filledCount < toFill && (rd = mb_readFile(rsndr->body,
+        if( rsndr->producer != NULL ) {
+            mb_resize(rsndr->body, filledCount);
+            if( ! rsndr->producer(rsndr->producerData, rsndr->body,
+                        &awaitFd) )
+                freeProducer(rsndr);
+            filledCount = mb_dataLen(rsndr->body);
+            /* make space for chunk end and possibly the last chunk */
+            mb_resize(rsndr->body, filledCount + 7);
+        }else{
+            toFill = 65546;
+            if( mb_dataLen(rsndr->body) < toFill + 7 )
+                mb_resize(rsndr->body, toFill + 7);
+            while( filledCount < toFill && (rd = mb_readFile(rsndr->body,
                     rsndr->fileDesc, filledCount, toFill - filledCount)) > 0)
-            filledCount += rd;
-        if( filledCount < toFill && (rd == 0 || errno != EWOULDBLOCK) ) {
-            if( rd < 0 )
-                log_error("fillBuffer");
-            close(rsndr->fileDesc);
-            rsndr->fileDesc = -1;
+                filledCount += rd;
+            if( filledCount < toFill && (rd == 0 || errno != EWOULDBLOCK) ) {
+                if( rd < 0 )
+                    log_error("fillBuffer");
+                close(rsndr->fileDesc);
+                rsndr->fileDesc = -1;
+            }
         }
         if( filledCount > 10 ) {
             rd = sprintf(chunkHeader, "%x\r\n", filledCount-10);
@@ -130,14 +180,14 @@ static void fillBuffer(ResponseSender *rsndr, DataProcessingResult *dpr)
             rsndr->dataOffset = 0;
             filledCount = 0;
         }
-        if( rsndr->fileDesc == -1 ) {
+        if( rsndr->fileDesc == -1 && rsndr->producer == NULL ) {
             /* adding last chunk and empty trailer */
             mb_setData(rsndr->body, filledCount, "0\r\n\r\n", 5);
             filledCount += 5;
             rsndr->nbytes = 0;
         }
         if( filledCount == 0 )
-            dpr_setRespState(dpr, DPR_AWAIT_READ, rsndr->fileDesc);
+            dpr_setRespState(dpr, DPR_AWAIT_READ, awaitFd);
         rsndr->dataSize = filledCount;
     }
 }
@@ -147,14 +197,29 @@ bool rsndr_send(ResponseSender *rsndr, int socketFd, DataProcessingResult *dpr)
     int wr;
 
     if( rsndr->header != NULL ) {
-        while( rsndr->dataOffset < mb_dataLen(rsndr->header) &&
-                (wr = write(socketFd,
-                        mb_data(rsndr->header) + rsndr->dataOffset,
-                        mb_dataLen(rsndr->header) - rsndr->dataOffset)) >= 0)
-        {
-            rsndr->dataOffset += wr;
+        unsigned headerLen = mb_dataLen(rsndr->header);
+        struct iovec iov[2];
+
+        /* send the header along with the first portion of body */
+        if( rsndr->body != NULL && rsndr->dataSize == 0 && rsndr->nbytes > 0 )
+            fillBuffer(rsndr, dpr);
+        while( rsndr->headerOffset < headerLen ) {
+            iov[0].iov_base = (char*)mb_data(rsndr->header) +
+                rsndr->headerOffset;
+            iov[0].iov_len = headerLen - rsndr->headerOffset;
+            iov[1].iov_base = rsndr->body ?
+                (char*)mb_data(rsndr->body) + rsndr->dataOffset : NULL;
+            iov[1].iov_len = rsndr->body ?
+                rsndr->dataSize - rsndr->dataOffset : 0;
+            if( (wr = writev(socketFd, iov, iov[1].iov_len ? 2 : 1)) < 0 )
+                break;
+            if( wr >= iov[0].iov_len ) {
+                rsndr->dataOffset += wr - iov[0].iov_len;
+                rsndr->headerOffset = headerLen;
+            }else
+                rsndr->headerOffset += wr;
         }
-        if( rsndr->dataOffset < mb_dataLen(rsndr->header) ) {
+        if( rsndr->headerOffset < headerLen ) {
             if( errno == EWOULDBLOCK ) {
                 dpr_setRespState(dpr, DPR_AWAIT_WRITE, socketFd);
                 return false;
@@ -167,7 +232,6 @@ bool rsndr_send(ResponseSender *rsndr, int socketFd, DataProcessingResult *dpr)
         }else{
             mb_free(rsndr->header);
             rsndr->header = NULL;
-            rsndr->dataOffset = 0;
         }
     }
     if( rsndr->body != NULL ) {
@@ -210,6 +274,7 @@ void rsndr_free(ResponseSender *rsndr)
         mb_free(rsndr->body);
         if( rsndr->fileDesc != -1 )
             close(rsndr->fileDesc);
+        freeProducer(rsndr);
         free(rsndr);
     }
 }
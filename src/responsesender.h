@@ -19,8 +19,32 @@ typedef struct ResponseSender ResponseSender;
  *               file, the Content-Length header is added with total body
  *               length. Otherwise - the body is sent using chunked
  *               Transfer-Encoding.
+ *   fileSize  - size of the regular file referred by fileDesc; -1 when
+ *               unknown, then the file status is retrieved.
  */
-ResponseSender *rsndr_new(MemBuf *header, MemBuf *body, int fileDesc);
+ResponseSender *rsndr_new(MemBuf *header, MemBuf *body, int fileDesc,
+        long long fileSize);
+
+
+/* Producer of response body. Appends next piece of body to the buffer.
+ * Returns false when the body is complete. When returns true, should
+ * append at least one byte, unless the data is not available yet: then
+ * should set awaitFd to the file descriptor to wait for until readable.
+ */
+typedef bool (*RsndrBodyProducer)(void *producerData, MemBuf *body,
+        int *awaitFd);
+
+
+/* Creates a new sender of response with body generated on demand,
+ * as the socket accepts data. The body begins with contents of the body
+ * parameter, which shall not be NULL. Further body contents is obtained
+ * from the producer. The body is sent using chunked Transfer-Encoding.
+ * When the producer is no longer needed, freeProducerData is invoked
+ * with producerData as parameter.
+ */
+ResponseSender *rsndr_newWithProducer(MemBuf *header, MemBuf *body,
+        RsndrBodyProducer, void *producerData,
+        void (*freeProducerData)(void*));
 
 
 /* Sends a piece of response to the socketFd. Returns true when finished
@@ -11,6 +11,10 @@
 #include <arpa/inet.h>
 
 
+enum {
+    CHUNK_HEADER_MAX_LEN = 4096     /* limit of chunk size line length */
+};
+
 enum RequestReadState {
     RRS_IDLE,
     RRS_READ_HEAD,
@@ -21,6 +25,8 @@ enum RequestReadState {
 
 struct ServerConnection {
     int socketFd;
+    char peerAddr[INET_ADDRSTRLEN]; /* empty when unknown */
+    DataProcessingResult awaiting;  /* await state after last processing */
     char readBuffer[65536];
     unsigned readOffset;
     unsigned readSize;
@@ -30,14 +36,19 @@ struct ServerConnection {
     RequestHandler *handler;
     unsigned long long bodyLen;
     unsigned long long bodyReadLen;
+    bool isCloseAfterResponse;  /* request is rejected or malformed */
 };
 
-ServerConnection *conn_new(int socketFd)
+ServerConnection *conn_new(int socketFd, const struct sockaddr_in *peer)
 {
     ServerConnection *conn = malloc(sizeof(ServerConnection));
 
     log_debug("================================= %d open", socketFd);
     conn->socketFd = socketFd;
+    if( peer == NULL || inet_ntop(AF_INET, &peer->sin_addr, conn->peerAddr,
+                sizeof(conn->peerAddr)) == NULL )
+        conn->peerAddr[0] = '\0';
+    dpr_init(&conn->awaiting);
     conn->readOffset = 0;
     conn->readSize = 0;
     /* allow to process at least one request - await the first request header
@@ -48,21 +59,22 @@ ServerConnection *conn_new(int socketFd)
     conn->handler = NULL;
     conn->bodyLen = 0;
     conn->bodyReadLen = 0;
+    conn->isCloseAfterResponse = false;
     return conn;
 }
 
 static void onFinishedHeader(ServerConnection *conn)
 {
-    const char *val = NULL;
-    struct sockaddr_in peer;
-    socklen_t peerAddrLen;
-    char peerAddrStr[INET_ADDRSTRLEN];
+    const char *val;
 
-    peerAddrLen = sizeof(peer);
-    if(getpeername(conn->socketFd, (struct sockaddr*)&peer, &peerAddrLen) == 0)
-        val = inet_ntop(AF_INET, &peer.sin_addr, peerAddrStr, peerAddrLen);
-    conn->handler = reqhdlr_new(conn->header, val);
-    if( reqhdr_isChunkedTransferEncoding(conn->header) ) {
+    conn->handler = reqhdlr_new(conn->header,
+            conn->peerAddr[0] ? conn->peerAddr : NULL);
+    if( reqhdlr_isRequestRejected(conn->handler) ) {
+        /* don't read the body */
+        conn->rrs = RRS_READ_FINISHED;
+        conn->isCloseAfterResponse = true;
+        conn->readOffset = conn->readSize = 0;
+    }else if( reqhdr_isChunkedTransferEncoding(conn->header) ) {
         conn->chunkHdr = mb_newWithStr("\r\n");
         conn->rrs = RRS_READ_BODY;
     }else{
@@ -89,6 +101,13 @@ static void appendBodyData(ServerConnection *conn, DataProcessingResult *dpr)
             processed = reqhdlr_processData(conn->handler, bol, addLen, dpr);
             conn->bodyReadLen += processed;
             bol += processed;
+            if( reqhdlr_isRequestRejected(conn->handler) ) {
+                log_debug("%d request body rejected", conn->socketFd);
+                conn->rrs = RRS_READ_FINISHED;
+                conn->isCloseAfterResponse = true;
+                bol = dataEnd;
+                break;
+            }
             if( processed < addLen )
                 break;
         }
@@ -102,6 +121,14 @@ static void appendBodyData(ServerConnection *conn, DataProcessingResult *dpr)
                 }
                 eol = memchr(bol, '\n', dataEnd - bol);
                 addLen = (eol==NULL ? dataEnd : eol) - bol;
+                if( mb_dataLen(conn->chunkHdr) + addLen >
+                        CHUNK_HEADER_MAX_LEN )
+                {
+                    log_debug("%d chunk size line too long", conn->socketFd);
+                    dpr_setCloseConn(dpr);
+                    bol = dataEnd;
+                    break;
+                }
                 mb_appendData(conn->chunkHdr, bol, addLen);
                 if( eol != NULL ) {
                     addLen = strtoul(mb_data(conn->chunkHdr)+2, NULL, 16);
@@ -169,6 +196,8 @@ static void appendData(ServerConnection *conn, DataProcessingResult *dpr)
                 conn->readSize - conn->readOffset);
         if( offset >= 0 ) {
             conn->rrs = RRS_READ_FINISHED;
+            if( reqhdr_getError(conn->header) != RHE_NONE )
+                conn->isCloseAfterResponse = true;
             conn->readOffset += offset;
             if( conn->readOffset == conn->readSize )
                 conn->readOffset = conn->readSize = 0;
@@ -179,17 +208,35 @@ static void appendData(ServerConnection *conn, DataProcessingResult *dpr)
         reqhdlr_requestReadCompleted(conn->handler, conn->header);
 }
 
-enum ConnProcessingResult conn_processDataReady(ServerConnection *conn,
-        DataReadySelector *drs, bool closeIfIdle)
+/* Returns true when some file descriptor awaited by the connection became
+ * ready, or when the connection does not await anything.
+ */
+static bool isAwaitedDataReady(const ServerConnection *conn,
+        const DataReadySelector *drs)
+{
+    const DataProcessingResult *aw = &conn->awaiting;
+
+    if( aw->reqState == DPR_READY && aw->respState == DPR_READY )
+        return true;
+    if( aw->reqState == DPR_AWAIT_READ ?
+            drs_isReadReady(drs, aw->reqAwaitFd) :
+            aw->reqState == DPR_AWAIT_WRITE &&
+            drs_isWriteReady(drs, aw->reqAwaitFd) )
+        return true;
+    return aw->respState == DPR_AWAIT_READ ?
+        drs_isReadReady(drs, aw->respAwaitFd) :
+        aw->respState == DPR_AWAIT_WRITE &&
+        drs_isWriteReady(drs, aw->respAwaitFd);
+}
+
+static void processData(ServerConnection *conn, DataProcessingResult *dpr,
+        bool *isVeryIdle)
 {
     int rd;
     const char *hdrVal;
-    DataProcessingResult dpr;
-    bool isVeryIdle = conn->rrs == RRS_IDLE;
 
-    dpr_init(&dpr);
     while( true ) {
-        while( ! dpr.closeConn && dpr.reqState == DPR_READY
+        while( ! dpr->closeConn && dpr->reqState == DPR_READY
                 && conn->rrs != RRS_READ_FINISHED )
         { 
             if( conn->readSize == 0 ) {
@@ -197,45 +244,53 @@ enum ConnProcessingResult conn_processDataReady(ServerConnection *conn,
                         sizeof(conn->readBuffer))) > 0 )
                 {
                     conn->readSize = rd;
-                    isVeryIdle = false;
+                    *isVeryIdle = false;
                 }else if( rd < 0 ) {
                     if( errno == EWOULDBLOCK ) {
-                        dpr_setReqState(&dpr, DPR_AWAIT_READ, conn->socketFd);
+                        dpr_setReqState(dpr, DPR_AWAIT_READ, conn->socketFd);
                     }else{
                         if( errno != ECONNRESET )
                             log_error("read");
-                        dpr_setCloseConn(&dpr);
+                        dpr_setCloseConn(dpr);
                     }
                 }else if( rd == 0 ) {/* EOF */
                     if( conn->rrs != RRS_IDLE )
                         log_debug("%d premature EOF", conn->socketFd);
-                    dpr_setCloseConn(&dpr);
+                    dpr_setCloseConn(dpr);
                 }
             }
             if( conn->readSize != 0 )
-                appendData(conn, &dpr);
+                appendData(conn, dpr);
         }
-        if( ! dpr.closeConn && conn->handler != NULL ) {
-            if(reqhdlr_progressResponse(conn->handler, conn->socketFd, &dpr)) {
+        if( ! dpr->closeConn && conn->handler != NULL ) {
+            if(reqhdlr_progressResponse(conn->handler, conn->socketFd, dpr)) {
                 /* response send has been finished */
                 reqhdlr_free(conn->handler);
                 conn->handler = NULL;
+                if( conn->rrs != RRS_READ_FINISHED ) {
+                    /* the rest of request is not awaited anymore */
+                    log_debug("%d response sent before request end",
+                            conn->socketFd);
+                    dpr_setCloseConn(dpr);
+                }
             }
         }
-        if( dpr.closeConn || conn->rrs != RRS_READ_FINISHED ||
+        if( dpr->closeConn || conn->rrs != RRS_READ_FINISHED ||
                 conn->handler != NULL )
             break;
         /* request processing has completed */
         /* sanity check: no await data */
-        if( dpr.reqState != DPR_READY || dpr.respState != DPR_READY )
+        if( dpr->reqState != DPR_READY || dpr->respState != DPR_READY )
             log_fatal("INTERNAL ERROR: conn_processDataReady "
-                    "reqState=%d, respState=%d", dpr.reqState, dpr.respState);
+                    "reqState=%d, respState=%d", dpr->reqState,
+                    dpr->respState);
         /* close HTTP/1.0 connection or when request has "Connection: close" */
-        if( ! strcmp(reqhdr_getVersion(conn->header), "1.0") ||
+        if( conn->isCloseAfterResponse ||
+            ! strcmp(reqhdr_getVersion(conn->header), "1.0") ||
             ((hdrVal = reqhdr_getHeaderVal(conn->header, "Connection"))
                 != NULL && !strcmp(hdrVal, "close")) )
         {
-            dpr_setCloseConn(&dpr);
+            dpr_setCloseConn(dpr);
             break;
         }
         /* re-intialize */
@@ -246,7 +301,26 @@ enum ConnProcessingResult conn_processDataReady(ServerConnection *conn,
         conn->chunkHdr = NULL;
         conn->bodyLen = 0;
         conn->bodyReadLen = 0;
+        /* the next request rarely arrives that fast; rather than attempt
+         * to read it right now, wait until select() reports it */
+        if( conn->readSize == 0 ) {
+            dpr_setReqState(dpr, DPR_AWAIT_READ, conn->socketFd);
+            break;
+        }
     }
+}
+
+enum ConnProcessingResult conn_processDataReady(ServerConnection *conn,
+        DataReadySelector *drs, bool closeIfIdle)
+{
+    DataProcessingResult dpr;
+    bool isVeryIdle = conn->rrs == RRS_IDLE;
+
+    if( isAwaitedDataReady(conn, drs) ) {
+        dpr_init(&dpr);
+        processData(conn, &dpr, &isVeryIdle);
+    }else
+        dpr = conn->awaiting;   /* nothing changed; keep awaiting */
     if( ! dpr.closeConn && closeIfIdle && conn->rrs == RRS_IDLE ) {
         /* closing even when not isVeryIdle -- but a most idle, anyway */
         log_debug("%d closing as most idle", conn->socketFd);
@@ -262,6 +336,7 @@ enum ConnProcessingResult conn_processDataReady(ServerConnection *conn,
         else if( dpr.respState == DPR_AWAIT_WRITE )
             drs_setWriteFd(drs, dpr.respAwaitFd);
     }
+    conn->awaiting = dpr;
     return dpr.closeConn ? CONN_TO_CLOSE : isVeryIdle ? CONN_IDLE : CONN_BUSY;
 }
 
@@ -5,6 +5,7 @@
 #include "fmconfig.h"
 #include "requestheader.h"
 #include "datareadyselector.h"
+#include <netinet/in.h>
 
 enum ConnProcessingResult {
     CONN_IDLE,
@@ -17,9 +18,10 @@ enum ConnProcessingResult {
 typedef struct ServerConnection ServerConnection;
 
 
-/* Creates a new connection.
+/* Creates a new connection. The peer is the client address, as returned
+ * by accept(); may be NULL when unknown.
  */
-ServerConnection *conn_new(int socketFd);
+ServerConnection *conn_new(int socketFd, const struct sockaddr_in *peer);
 
 
 /* Advances request processing progress.
@@ -0,0 +1,317 @@
+#include <stdbool.h>
+#include "session.h"
+#include "sha256calc.h"
+#include "membuf.h"
+#include "datachunk.h"
+#include "fmconfig.h"
+#include "fmlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/random.h>
+
+
+#define SESSION_COOKIE          "fmsession"
+#define SESSION_URL_PREFIX      "/.fm/"
+
+enum {
+    SESSION_MAX_USERNAME_LEN = 256,
+    VERIFIED_TOKEN_CACHE_SIZE = 64
+};
+
+/* The session token format:
+ *      expiry "." privileges "." user "." mac
+ * The expiry (monotonic clock, in seconds) and privileges are hex numbers;
+ * the user name is hex-encoded. The mac is hex-encoded HMAC-SHA256 of:
+ *      expiry "." privileges "." user ":" HA1 ":" generation
+ * The generation (hex number) is the user session generation, incremented
+ * at logout to invalidate the user tokens given so far.
+ */
+
+typedef struct {
+    char *userName;
+    unsigned generation;
+} UserGeneration;
+
+/* A token which mac was verified. While the user HA1 and the session
+ * generation are unchanged, the token is valid without computing the mac
+ * again.
+ */
+typedef struct {
+    char *token;            /* NULL when the entry is unused */
+    unsigned tokenLen;
+    char ha1[40];
+    unsigned generation;
+} VerifiedToken;
+
+static Sha256HmacKey gKey;
+static bool gIsKeySet;
+static UserGeneration *gGenerations;
+static unsigned gGenerationCount;
+static VerifiedToken gVerifiedTokens[VERIFIED_TOKEN_CACHE_SIZE];
+
+
+static const Sha256HmacKey *getKey(void)
+{
+    unsigned char key[32];
+
+    if( ! gIsKeySet ) {
+        if( getrandom(key, sizeof(key), 0) != sizeof(key) )
+            log_fatal("session: unable to generate key");
+        sha256_hmacInitKey(&gKey, key, sizeof(key));
+        memset(key, 0, sizeof(key));
+        gIsKeySet = true;
+    }
+    return &gKey;
+}
+
+/* Returns the session generation entry of the user; creates one when
+ * isCreate is true. Returns NULL when the entry does not exist and is not
+ * created.
+ */
+static UserGeneration *getUserGeneration(const char *userName,
+        bool isCreate)
+{
+    UserGeneration *ug;
+    unsigned i;
+
+    for(i = 0; i < gGenerationCount; ++i) {
+        if( ! strcmp(gGenerations[i].userName, userName) )
+            return gGenerations + i;
+    }
+    if( ! isCreate )
+        return NULL;
+    gGenerations = realloc(gGenerations,
+            (gGenerationCount + 1) * sizeof(UserGeneration));
+    ug = gGenerations + gGenerationCount++;
+    ug->userName = strdup(userName);
+    ug->generation = 0;
+    return ug;
+}
+
+static time_t getTimeSecs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static void appendHex(MemBuf *mb, const unsigned char *data, unsigned len)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *dest = mb_appendSpace(mb, 2 * len);
+    unsigned i;
+
+    for(i = 0; i < len; ++i) {
+        dest[2 * i] = hex[data[i] >> 4];
+        dest[2 * i + 1] = hex[data[i] & 0xf];
+    }
+}
+
+static int hexDigitVal(char c)
+{
+    if( c >= '0' && c <= '9' )
+        return c - '0';
+    if( c >= 'a' && c <= 'f' )
+        return c - 'a' + 10;
+    return -1;
+}
+
+static unsigned getGeneration(const char *userName)
+{
+    const UserGeneration *ug = getUserGeneration(userName, false);
+
+    return ug == NULL ? 0 : ug->generation;
+}
+
+/* Appends to mb the token mac for payload.
+ */
+static void appendMac(MemBuf *mb, const char *payload, unsigned payloadLen,
+        const char *ha1, const char *userName)
+{
+    unsigned char mac[SHA256_DIGEST_LEN];
+    char generation[20];
+    MemBuf *data = mb_new();
+
+    sprintf(generation, "%x", getGeneration(userName));
+    mb_appendData(data, payload, payloadLen);
+    mb_appendStrL(data, ":", ha1, ":", generation, NULL);
+    sha256_hmacWithKey(mac, getKey(), mb_data(data), mb_dataLen(data));
+    mb_free(data);
+    appendHex(mb, mac, sizeof(mac));
+}
+
+enum SessionEndpoint session_getEndpoint(const char *urlPath)
+{
+    if( config_getSessionLifetime() == 0 || strncmp(urlPath,
+                SESSION_URL_PREFIX, sizeof(SESSION_URL_PREFIX) - 1) )
+        return SE_NONE;
+    urlPath += sizeof(SESSION_URL_PREFIX) - 1;
+    if( ! strcmp(urlPath, "logout") )
+        return SE_LOGOUT;
+    if( ! strcmp(urlPath, "renew") )
+        return SE_RENEW;
+    return SE_NONE;
+}
+
+/* Returns the verified token cache entry for the token mac. The mac is
+ * random, so its leading digits spread the tokens evenly.
+ */
+static VerifiedToken *getVerifiedTokenEntry(const char *mac)
+{
+    unsigned i, hash = 0;
+
+    for(i = 0; i < 8; ++i)
+        hash = hash * 31 + (unsigned char)mac[i];
+    return gVerifiedTokens + hash % VERIFIED_TOKEN_CACHE_SIZE;
+}
+
+/* Verifies the token. On success stores the user name in userName buffer
+ * of SESSION_MAX_USERNAME_LEN + 1 bytes.
+ */
+static bool checkToken(const DataChunk *dchToken, char *userName,
+        unsigned *privileges)
+{
+    DataChunk dchRest = *dchToken, dchExpiry, dchPrivileges, dchUser;
+    unsigned long long expiry;
+    unsigned userNameLen, i, generation, diff = 0;
+    char *end, ha1[40], numBuf[20];
+    int hi, lo;
+    VerifiedToken *vt;
+    MemBuf *mac;
+
+    if( ! dch_extractTillChr(&dchRest, &dchExpiry, '.') ||
+            ! dch_extractTillChr(&dchRest, &dchPrivileges, '.') ||
+            ! dch_extractTillChr(&dchRest, &dchUser, '.') ||
+            dchRest.len != 2 * SHA256_DIGEST_LEN ||
+            dchExpiry.len == 0 || dchExpiry.len >= sizeof(numBuf) ||
+            dchUser.len % 2 || dchUser.len > 2 * SESSION_MAX_USERNAME_LEN )
+        return false;
+    memcpy(numBuf, dchExpiry.data, dchExpiry.len);
+    numBuf[dchExpiry.len] = '\0';
+    expiry = strtoull(numBuf, &end, 16);
+    if( *end || expiry <= (unsigned long long)getTimeSecs() ||
+            expiry > getTimeSecs() + config_getSessionLifetime() )
+        return false;
+    if( ! dch_toUInt(&dchPrivileges, 16, privileges) )
+        return false;
+    userNameLen = dchUser.len / 2;
+    for(i = 0; i < userNameLen; ++i) {
+        if( (hi = hexDigitVal(dchUser.data[2 * i])) < 0 ||
+                (lo = hexDigitVal(dchUser.data[2 * i + 1])) < 0 )
+            return false;
+        userName[i] = hi << 4 | lo;
+    }
+    userName[userNameLen] = '\0';
+    if( strlen(userName) != userNameLen ||
+            ! config_getDigestAuthCredential(userName, userNameLen, ha1) )
+        return false;
+    generation = getGeneration(userName);
+    vt = getVerifiedTokenEntry(dchRest.data);
+    if( vt->token != NULL && vt->tokenLen == dchToken->len &&
+            vt->generation == generation && ! strcmp(vt->ha1, ha1) )
+    {
+        /* constant-time comparison */
+        for(i = 0; i < dchToken->len; ++i)
+            diff |= vt->token[i] ^ dchToken->data[i];
+        if( diff == 0 )
+            return true;
+        diff = 0;
+    }
+    mac = mb_new();
+    appendMac(mac, dchToken->data, dchRest.data - dchToken->data - 1, ha1,
+            userName);
+    /* constant-time comparison */
+    for(i = 0; i < 2 * SHA256_DIGEST_LEN; ++i)
+        diff |= mb_data(mac)[i] ^ dchRest.data[i];
+    mb_free(mac);
+    if( diff != 0 )
+        return false;
+    free(vt->token);
+    vt->token = dch_dupToStr(dchToken);
+    vt->tokenLen = dchToken->len;
+    strcpy(vt->ha1, ha1);
+    vt->generation = generation;
+    return true;
+}
+
+bool session_checkCookie(const char *cookieHeader, char **userNameBuf,
+        unsigned *privileges)
+{
+    DataChunk dchLine, dchCookie, dchName;
+    char userName[SESSION_MAX_USERNAME_LEN + 1];
+
+    dch_initWithStr(&dchLine, cookieHeader);
+    while( dchLine.len > 0 ) {
+        dch_extractTillChrStripWS(&dchLine, &dchCookie, ';');
+        if( dch_extractTillChr(&dchCookie, &dchName, '=') &&
+                dch_equalsStr(&dchName, SESSION_COOKIE) )
+        {
+            if( checkToken(&dchCookie, userName, privileges) ) {
+                *userNameBuf = strdup(userName);
+                return true;
+            }
+            log_debug("session: invalid token");
+        }
+    }
+    return false;
+}
+
+char *session_newCookie(const char *userName, unsigned privileges)
+{
+    unsigned lifetime = config_getSessionLifetime();
+    unsigned payloadOffset, payloadLen, userNameLen = strlen(userName);
+    char ha1[40], buf[60];
+    MemBuf *cookie;
+
+    if( userNameLen > SESSION_MAX_USERNAME_LEN ||
+            ! config_getDigestAuthCredential(userName, userNameLen, ha1) )
+        return NULL;
+    cookie = mb_newWithStr(SESSION_COOKIE "=");
+    payloadOffset = mb_dataLen(cookie);
+    sprintf(buf, "%llx.%x.", (unsigned long long)getTimeSecs() + lifetime,
+            privileges);
+    mb_appendStr(cookie, buf);
+    appendHex(cookie, (const unsigned char*)userName, userNameLen);
+    payloadLen = mb_dataLen(cookie) - payloadOffset;
+    mb_appendStr(cookie, ".");
+    appendMac(cookie, mb_data(cookie) + payloadOffset, payloadLen, ha1,
+            userName);
+    sprintf(buf, "; Path=/; Max-Age=%u; HttpOnly; SameSite=Strict", lifetime);
+    mb_appendStrL(cookie, buf, NULL);
+    return mb_unbox_free(cookie);
+}
+
+void session_endUserSessions(const char *userName)
+{
+    ++getUserGeneration(userName, true)->generation;
+}
+
+const char *session_getLogoutCookie(void)
+{
+    return SESSION_COOKIE "=; Path=/; Max-Age=0; HttpOnly; SameSite=Strict";
+}
+
+char *session_stripCookie(const char *cookieHeader)
+{
+    DataChunk dchLine, dchCookie, dchName, dchValue;
+    MemBuf *res = NULL;
+
+    dch_initWithStr(&dchLine, cookieHeader);
+    while( dchLine.len > 0 ) {
+        dch_extractTillChrStripWS(&dchLine, &dchCookie, ';');
+        dchValue = dchCookie;
+        if( dchCookie.len == 0 || (dch_extractTillChr(&dchValue, &dchName,
+                    '=') && dch_equalsStr(&dchName, SESSION_COOKIE)) )
+            continue;
+        if( res == NULL )
+            res = mb_new();
+        else
+            mb_appendStr(res, "; ");
+        mb_appendChunk(res, &dchCookie);
+    }
+    return res == NULL ? NULL : mb_unbox_free(res);
+}
+
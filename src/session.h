@@ -0,0 +1,63 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+
+/* Login sessions, enabled by "sessionlifetime" option. After successful
+ * Digest authorization the server gives client a session cookie: a token
+ * with user name, expiry time and privileges, signed using HMAC-SHA256.
+ * Requests carrying a valid token are logged in without verification of
+ * "Authorization" header.
+ *
+ * The token signature covers also the user HA1 value, hence change of the
+ * user password invalidates the user sessions. Logout invalidates all
+ * sessions of the user. The signing key is generated at server start;
+ * the sessions don't survive server restart.
+ */
+
+
+/* Special URL paths handled by the session module.
+ */
+enum SessionEndpoint {
+    SE_NONE,
+    SE_LOGOUT,      /* ends the session */
+    SE_RENEW        /* gives a new token with renewed expiry time */
+};
+
+
+/* Returns the endpoint the URL path refers to; SE_NONE when sessions are
+ * disabled.
+ */
+enum SessionEndpoint session_getEndpoint(const char *urlPath);
+
+
+/* Checks session cookie in the "Cookie" header field value.
+ * When the cookie contains valid token, stores in userNameBuf the user name
+ * (malloc'ed), in privileges the bit mask of PrivilegedAction values granted
+ * and returns true. Otherwise returns false.
+ */
+bool session_checkCookie(const char *cookieHeader, char **userNameBuf,
+        unsigned *privileges);
+
+
+/* Returns "Set-Cookie" header field value with a new token for the user.
+ */
+char *session_newCookie(const char *userName, unsigned privileges);
+
+
+/* Invalidates the session tokens given to the user so far.
+ */
+void session_endUserSessions(const char *userName);
+
+
+/* Returns "Set-Cookie" header field value removing the session cookie.
+ */
+const char *session_getLogoutCookie(void);
+
+
+/* Returns the "Cookie" header field value with the session cookie removed,
+ * to pass to a CGI script. Returns NULL when no other cookies remain.
+ */
+char *session_stripCookie(const char *cookieHeader);
+
+
+#endif /* SESSION_H */
@@ -0,0 +1,172 @@
+#include <stdint.h>
+#include <string.h>
+#include "sha256calc.h"
+
+
+typedef struct {
+    uint32_t H[8];
+    unsigned char block[64];
+    unsigned blockLen;
+    uint64_t totalLen;
+} Sha256Ctx;
+
+
+#define ROR(x, n)   ((x) >> (n) | (x) << (32 - (n)))
+
+/* One round; instead of shifting the variables, the callers rotate
+ * the argument list.
+ */
+#define ROUND(a, b, c, d, e, f, g, h, i) \
+    t1 = (h) + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + \
+        ((g) ^ ((e) & ((f) ^ (g)))) + K[i] + W[i]; \
+    (d) += t1; \
+    (h) = t1 + (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + \
+        (((a) & (b)) | ((c) & ((a) | (b))))
+
+static void sha256Block(uint32_t *H, const unsigned char *p)
+{
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+        0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+        0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t W[64], a, b, c, d, e, f, g, h, t1;
+    unsigned i;
+
+    for(i = 0; i < 16; ++i, p += 4)
+        W[i] = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    for(; i < 64; ++i) {
+        W[i] = W[i-16] + W[i-7] +
+            (ROR(W[i-15], 7) ^ ROR(W[i-15], 18) ^ W[i-15] >> 3) +
+            (ROR(W[i-2], 17) ^ ROR(W[i-2], 19) ^ W[i-2] >> 10);
+    }
+    a = H[0]; b = H[1]; c = H[2]; d = H[3];
+    e = H[4]; f = H[5]; g = H[6]; h = H[7];
+    for(i = 0; i < 64; i += 8) {
+        ROUND(a, b, c, d, e, f, g, h, i);
+        ROUND(h, a, b, c, d, e, f, g, i + 1);
+        ROUND(g, h, a, b, c, d, e, f, i + 2);
+        ROUND(f, g, h, a, b, c, d, e, i + 3);
+        ROUND(e, f, g, h, a, b, c, d, i + 4);
+        ROUND(d, e, f, g, h, a, b, c, i + 5);
+        ROUND(c, d, e, f, g, h, a, b, i + 6);
+        ROUND(b, c, d, e, f, g, h, a, i + 7);
+    }
+    H[0] += a; H[1] += b; H[2] += c; H[3] += d;
+    H[4] += e; H[5] += f; H[6] += g; H[7] += h;
+}
+
+static void sha256Init(Sha256Ctx *ctx)
+{
+    static const uint32_t H0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->H, H0, sizeof(H0));
+    ctx->blockLen = 0;
+    ctx->totalLen = 0;
+}
+
+static void sha256Update(Sha256Ctx *ctx, const void *data, unsigned count)
+{
+    const unsigned char *bytes = data;
+    unsigned toCopy;
+
+    ctx->totalLen += count;
+    if( ctx->blockLen > 0 ) {
+        toCopy = 64 - ctx->blockLen < count ? 64 - ctx->blockLen : count;
+        memcpy(ctx->block + ctx->blockLen, bytes, toCopy);
+        ctx->blockLen += toCopy;
+        bytes += toCopy;
+        count -= toCopy;
+        if( ctx->blockLen < 64 )
+            return;
+        sha256Block(ctx->H, ctx->block);
+        ctx->blockLen = 0;
+    }
+    for(; count >= 64; bytes += 64, count -= 64)
+        sha256Block(ctx->H, bytes);
+    memcpy(ctx->block, bytes, count);
+    ctx->blockLen = count;
+}
+
+static void sha256Final(Sha256Ctx *ctx, unsigned char *digest)
+{
+    uint64_t bits = 8 * ctx->totalLen;
+    unsigned i;
+
+    ctx->block[ctx->blockLen++] = 0x80;
+    if( ctx->blockLen > 56 ) {
+        memset(ctx->block + ctx->blockLen, 0, 64 - ctx->blockLen);
+        sha256Block(ctx->H, ctx->block);
+        ctx->blockLen = 0;
+    }
+    memset(ctx->block + ctx->blockLen, 0, 56 - ctx->blockLen);
+    for(i = 0; i < 8; ++i)
+        ctx->block[63 - i] = bits >> 8 * i;
+    sha256Block(ctx->H, ctx->block);
+    for(i = 0; i < SHA256_DIGEST_LEN; ++i)
+        digest[i] = ctx->H[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void sha256_calculateRaw(unsigned char *digest, const char *bytes,
+        unsigned count)
+{
+    Sha256Ctx ctx;
+
+    sha256Init(&ctx);
+    sha256Update(&ctx, bytes, count);
+    sha256Final(&ctx, digest);
+}
+
+void sha256_hmacInitKey(Sha256HmacKey *hkey, const unsigned char *key,
+        unsigned keyLen)
+{
+    unsigned char pad[64], keyDigest[SHA256_DIGEST_LEN];
+    Sha256Ctx ctx;
+    unsigned i;
+
+    if( keyLen > 64 ) {
+        sha256_calculateRaw(keyDigest, (const char*)key, keyLen);
+        key = keyDigest;
+        keyLen = SHA256_DIGEST_LEN;
+    }
+    memset(pad, 0x36, 64);
+    for(i = 0; i < keyLen; ++i)
+        pad[i] ^= key[i];
+    sha256Init(&ctx);
+    sha256Block(ctx.H, pad);
+    memcpy(hkey->inner, ctx.H, sizeof(ctx.H));
+    for(i = 0; i < 64; ++i)
+        pad[i] ^= 0x36 ^ 0x5c;
+    sha256Init(&ctx);
+    sha256Block(ctx.H, pad);
+    memcpy(hkey->outer, ctx.H, sizeof(ctx.H));
+}
+
+void sha256_hmacWithKey(unsigned char *digest, const Sha256HmacKey *hkey,
+        const char *bytes, unsigned count)
+{
+    Sha256Ctx ctx;
+
+    memcpy(ctx.H, hkey->inner, sizeof(ctx.H));
+    ctx.blockLen = 0;
+    ctx.totalLen = 64;
+    sha256Update(&ctx, bytes, count);
+    sha256Final(&ctx, digest);
+    memcpy(ctx.H, hkey->outer, sizeof(ctx.H));
+    ctx.blockLen = 0;
+    ctx.totalLen = 64;
+    sha256Update(&ctx, digest, SHA256_DIGEST_LEN);
+    sha256Final(&ctx, digest);
+}
+
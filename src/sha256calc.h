@@ -0,0 +1,41 @@
+#ifndef SHA256CALC_H
+#define SHA256CALC_H
+
+#include <stdint.h>
+
+
+enum {
+    SHA256_DIGEST_LEN = 32
+};
+
+
+/* Calculates SHA-256 sum of bytes. Stores in digest the 32-byte binary
+ * value.
+ */
+void sha256_calculateRaw(unsigned char *digest, const char *bytes,
+        unsigned count);
+
+
+/* HMAC key with the inner and outer hash states precomputed, to save two
+ * block computations per HMAC calculation.
+ */
+typedef struct {
+    uint32_t inner[8];
+    uint32_t outer[8];
+} Sha256HmacKey;
+
+
+/* Prepares the HMAC key.
+ */
+void sha256_hmacInitKey(Sha256HmacKey*, const unsigned char *key,
+        unsigned keyLen);
+
+
+/* Calculates HMAC-SHA256 (RFC 2104) of bytes using the prepared key.
+ * Stores in digest the 32-byte binary value.
+ */
+void sha256_hmacWithKey(unsigned char *digest, const Sha256HmacKey*,
+        const char *bytes, unsigned count);
+
+
+#endif /* SHA256CALC_H */
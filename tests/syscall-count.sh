@@ -0,0 +1,116 @@
+#!/bin/sh
+# Counts system calls made by the server per request, using "strace -c",
+# and checks them against the budget of each request class: a static file,
+# a folder listing and a 404 response. Each request is sent on a new
+# connection, as the counts include accepting and closing it.
+#
+# Usage: syscall-count.sh [server-binary]
+# The binary defaults to $FM_HTTPD, then src/filemanager-httpd.
+# The port may be changed by FM_TEST_PORT environment variable.
+# Exit status: 0 - counts within budget, 1 - some count exceeds the
+# budget, 77 - the test can't run here (no strace or curl, ptrace denied).
+
+BIN=${1:-${FM_HTTPD:-src/filemanager-httpd}}
+PORT=${FM_TEST_PORT:-18123}
+REQUESTS=20
+
+# budgets: system calls per request, as counted on Linux 5.6+ (openat2)
+BUDGET_FILE=12
+BUDGET_LISTING=23
+BUDGET_404=8
+
+for prog in strace curl; do
+    if ! command -v $prog >/dev/null 2>&1; then
+        echo "SKIP: $prog not found"
+        exit 77
+    fi
+done
+if [ ! -x "$BIN" ]; then
+    echo "server binary $BIN not found"
+    exit 1
+fi
+
+TMPDIR=$(mktemp -d) || exit 1
+SERVER_PID=
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill $SERVER_PID 2>/dev/null
+    rm -rf "$TMPDIR"
+}
+trap cleanup EXIT
+
+mkdir "$TMPDIR/share" "$TMPDIR/share/dir"
+echo "static file" > "$TMPDIR/share/file.txt"
+for f in a b c; do
+    echo $f > "$TMPDIR/share/dir/$f.txt"
+done
+cat > "$TMPDIR/test.conf" <<EOF
+port = $PORT
+user =
+mimetypes =
+/ = $TMPDIR/share
+EOF
+
+"$BIN" -c "$TMPDIR/test.conf" >"$TMPDIR/server.log" 2>&1 &
+SERVER_PID=$!
+i=0
+while ! curl -s -o /dev/null "http://127.0.0.1:$PORT/file.txt"; do
+    i=$((i+1))
+    if [ $i -ge 50 ] || ! kill -0 $SERVER_PID 2>/dev/null; then
+        echo "server did not start:"
+        cat "$TMPDIR/server.log"
+        exit 1
+    fi
+    sleep 0.1
+done
+
+# Prints number of system calls per request of the URL path.
+countSyscalls() {
+    # warm up caches
+    curl -s -o /dev/null "http://127.0.0.1:$PORT$1"
+    strace -f -c -q -o "$TMPDIR/strace.out" -p $SERVER_PID 2>/dev/null &
+    strace_pid=$!
+    i=0
+    while [ "$(awk '/^TracerPid:/ { print $2 }' /proc/$SERVER_PID/status)" \
+            = 0 ]
+    do
+        i=$((i+1))
+        if [ $i -ge 50 ] || ! kill -0 $strace_pid 2>/dev/null; then
+            kill $strace_pid 2>/dev/null
+            return 1
+        fi
+        sleep 0.1
+    done
+    i=0
+    while [ $i -lt $REQUESTS ]; do
+        curl -s -o /dev/null "http://127.0.0.1:$PORT$1"
+        i=$((i+1))
+    done
+    # let the server finish with the last connection
+    sleep 0.3
+    kill -INT $strace_pid
+    wait $strace_pid
+    # sum the "calls" column of the syscall lines; the few calls made while
+    # attaching and detaching are dropped by rounding down
+    awk -v n=$REQUESTS '
+        $1 ~ /^[0-9.]+$/ && $NF != "total" { calls += $4 }
+        END { printf "%d\n", calls / n }' "$TMPDIR/strace.out"
+}
+
+status=0
+check() {
+    if ! count=$(countSyscalls "$2"); then
+        echo "SKIP: unable to trace the server"
+        exit 77
+    fi
+    if [ $count -le $3 ]; then
+        echo "$1: $count system calls per request (budget $3)"
+    else
+        echo "FAIL $1: $count system calls per request exceed budget $3"
+        status=1
+    fi
+}
+
+check "static file" /file.txt $BUDGET_FILE
+check "folder listing" /dir/ $BUDGET_LISTING
+check "404" /nonexistent $BUDGET_404
+exit $status